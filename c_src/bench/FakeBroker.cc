@@ -0,0 +1,819 @@
+#include "FakeBroker.h"
+#include "ExceptionUtils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <algorithm>
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// MQTT control packet types (high nibble of the fixed header)
+
+#define MQTT_CONNECT     0x10
+#define MQTT_CONNACK     0x20
+#define MQTT_PUBLISH     0x30
+#define MQTT_PUBACK      0x40
+#define MQTT_PUBREC      0x50
+#define MQTT_PUBREL      0x60
+#define MQTT_PUBCOMP     0x70
+#define MQTT_SUBSCRIBE   0x80
+#define MQTT_SUBACK      0x90
+#define MQTT_UNSUBSCRIBE 0xA0
+#define MQTT_UNSUBACK    0xB0
+#define MQTT_PINGREQ     0xC0
+#define MQTT_PINGRESP    0xD0
+#define MQTT_DISCONNECT  0xE0
+
+// CONNACK return codes
+
+#define CONNACK_ACCEPTED            0
+#define CONNACK_BAD_PROTOCOL        1
+#define CONNACK_SERVER_UNAVAILABLE  3
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.
+ */
+FakeBroker::FakeBroker()
+{
+    listenFd_ = -1;
+    port_     = 0;
+    threadId_ = 0;
+    started_  = false;
+
+    stop_.store(false);
+
+    latencyMs_.store(0);
+    bytesPerSec_.store(0);
+    maxQueuedBytes_.store(0);
+    disconnectEvery_.store(0);
+    refuse_.store(false);
+    disconnectAll_.store(false);
+
+    connects_.store(0);
+    received_.store(0);
+    delivered_.store(0);
+    dropped_.store(0);
+    disconnects_.store(0);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+FakeBroker::~FakeBroker()
+{
+    stop();
+}
+
+/**.......................................................................
+ * Bind the listening socket and start the broker thread
+ */
+void FakeBroker::start(unsigned port)
+{
+    if(started_)
+        ThrowRuntimeError("Fake broker is already running");
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(listenFd_ < 0)
+        ThrowRuntimeError("Unable to create broker socket: " << strerror(errno));
+
+    int on = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    socklen_t len = sizeof(sin);
+
+    if(bind(listenFd_, (struct sockaddr*)&sin, sizeof(sin)) != 0 || listen(listenFd_, 64) != 0 ||
+       getsockname(listenFd_, (struct sockaddr*)&sin, &len) != 0) {
+        int err = errno;
+        close(listenFd_);
+        listenFd_ = -1;
+        ThrowRuntimeError("Unable to listen on 127.0.0.1:" << port << ": " << strerror(err));
+    }
+
+    port_ = ntohs(sin.sin_port);
+    stop_.store(false);
+
+    if(pthread_create(&threadId_, NULL, &runFn, this) != 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+        ThrowRuntimeError("Unable to start the broker thread");
+    }
+
+    started_ = true;
+}
+
+/**.......................................................................
+ * Stop the broker thread and drop every connection
+ */
+void FakeBroker::stop()
+{
+    if(!started_)
+        return;
+
+    stop_.store(true);
+    pthread_join(threadId_, NULL);
+
+    for(unsigned i=0; i < clients_.size(); i++) {
+        close(clients_[i]->fd_);
+        delete clients_[i];
+    }
+
+    clients_.clear();
+    shareNext_.clear();
+
+    close(listenFd_);
+    listenFd_ = -1;
+    started_  = false;
+}
+
+unsigned FakeBroker::port()
+{
+    return port_;
+}
+
+//------------------------------------------------------------
+// Fault scripting
+//------------------------------------------------------------
+
+void FakeBroker::setLatencyMs(unsigned ms)
+{
+    latencyMs_.store(ms);
+}
+
+/**.......................................................................
+ * Deliver to each subscriber at no more than bytesPerSec (0 for no
+ * limit), and drop messages for it while more than maxQueuedBytes are
+ * waiting to be sent (0 for no limit)
+ */
+void FakeBroker::setSlowConsumer(unsigned bytesPerSec, size_t maxQueuedBytes)
+{
+    bytesPerSec_.store(bytesPerSec);
+    maxQueuedBytes_.store(maxQueuedBytes);
+}
+
+void FakeBroker::setDisconnectEvery(unsigned nMessage)
+{
+    disconnectEvery_.store(nMessage);
+}
+
+void FakeBroker::setRefuseConnections(bool refuse)
+{
+    refuse_.store(refuse);
+}
+
+void FakeBroker::disconnectAll()
+{
+    disconnectAll_.store(true);
+}
+
+uint64_t FakeBroker::connects()
+{
+    return connects_.load(std::memory_order_relaxed);
+}
+
+uint64_t FakeBroker::received()
+{
+    return received_.load(std::memory_order_relaxed);
+}
+
+uint64_t FakeBroker::delivered()
+{
+    return delivered_.load(std::memory_order_relaxed);
+}
+
+uint64_t FakeBroker::dropped()
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+uint64_t FakeBroker::disconnects()
+{
+    return disconnects_.load(std::memory_order_relaxed);
+}
+
+//------------------------------------------------------------
+// The broker thread
+//------------------------------------------------------------
+
+void* FakeBroker::runFn(void* arg)
+{
+    FakeBroker* broker = (FakeBroker*)arg;
+
+    try {
+        broker->run();
+    } catch(...) {
+    }
+
+    return 0;
+}
+
+/**.......................................................................
+ * Serve every socket until stopped.  Each pass releases delayed
+ * deliveries that have come due, tops up each subscriber's rate
+ * budget, then polls for at most 10 ms (less if a delivery comes due
+ * sooner)
+ */
+void FakeBroker::run()
+{
+    int64_t last = nowMicros();
+    std::vector<struct pollfd> pfds;
+
+    while(!stop_.load()) {
+
+        int64_t now = nowMicros();
+        double dt   = (now - last) / 1e6;
+        last        = now;
+
+        if(disconnectAll_.exchange(false)) {
+            for(unsigned i=0; i < clients_.size(); i++)
+                clients_[i]->closing_ = true;
+        }
+
+        unsigned rate = bytesPerSec_.load();
+        double burst  = std::max(rate / 10.0, 1500.0);
+        int timeoutMs = 10;
+
+        for(unsigned i=0; i < clients_.size(); i++) {
+
+            Client* client = clients_[i];
+
+            while(!client->delayed_.empty() && client->delayed_.front().first <= now) {
+                client->out_          += client->delayed_.front().second;
+                client->delayedBytes_ -= client->delayed_.front().second.size();
+                client->delayed_.pop_front();
+            }
+
+            if(!client->delayed_.empty()) {
+                int dueMs = (int)((client->delayed_.front().first - now + 999) / 1000);
+                timeoutMs = std::min(timeoutMs, std::max(dueMs, 1));
+            }
+
+            client->budget_ = rate > 0 ? std::min(client->budget_ + rate * dt, burst) : 0;
+        }
+
+        //------------------------------------------------------------
+        // Poll the listening socket and every client
+        //------------------------------------------------------------
+
+        pfds.resize(clients_.size() + 1);
+
+        pfds[0].fd      = listenFd_;
+        pfds[0].events  = POLLIN;
+        pfds[0].revents = 0;
+
+        for(unsigned i=0; i < clients_.size(); i++) {
+
+            Client* client = clients_[i];
+            bool canWrite  = !client->out_.empty() && (rate == 0 || client->budget_ >= 1);
+
+            pfds[i+1].fd      = client->fd_;
+            pfds[i+1].events  = POLLIN | (canWrite ? POLLOUT : 0);
+            pfds[i+1].revents = 0;
+        }
+
+        if(poll(&pfds[0], pfds.size(), timeoutMs) < 0 && errno != EINTR)
+            ThrowRuntimeError("poll() failed: " << strerror(errno));
+
+        // Clients accepted below are polled from the next pass
+
+        unsigned nPolled = clients_.size();
+
+        for(unsigned i=0; i < nPolled; i++) {
+
+            Client* client = clients_[i];
+            short revents  = pfds[i+1].revents;
+
+            if(!client->closing_ && (revents & (POLLIN | POLLHUP | POLLERR)))
+                readClient(client);
+
+            if(!client->closing_ && (revents & POLLOUT))
+                writeClient(client, rate > 0 ? client->budget_ : -1);
+        }
+
+        if(pfds[0].revents & POLLIN)
+            acceptClient();
+
+        //------------------------------------------------------------
+        // Reap closed connections
+        //------------------------------------------------------------
+
+        for(unsigned i=0; i < clients_.size(); ) {
+            if(clients_[i]->closing_) {
+                closeClient(clients_[i]);
+                clients_.erase(clients_.begin() + i);
+            } else {
+                i++;
+            }
+        }
+    }
+}
+
+void FakeBroker::acceptClient()
+{
+    int fd = accept(listenFd_, NULL, NULL);
+
+    if(fd < 0)
+        return;
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    int on = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+#if defined(SO_NOSIGPIPE)
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    Client* client = new Client();
+
+    client->fd_           = fd;
+    client->connected_    = false;
+    client->closing_      = false;
+    client->delayedBytes_ = 0;
+    client->nextId_       = 0;
+    client->delivered_    = 0;
+    client->budget_       = 0;
+
+    clients_.push_back(client);
+}
+
+/**.......................................................................
+ * Read what is available and handle every complete packet in it
+ */
+void FakeBroker::readClient(Client* client)
+{
+    char buf[65536];
+
+    for(;;) {
+
+        ssize_t n = recv(client->fd_, buf, sizeof(buf), 0);
+
+        if(n > 0) {
+            client->in_.append(buf, n);
+            if(n < (ssize_t)sizeof(buf))
+                break;
+        } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+            break;
+        } else {
+            client->closing_ = true;
+            return;
+        }
+    }
+
+    const std::string& in = client->in_;
+    size_t pos = 0;
+
+    while(!client->closing_ && in.size() - pos >= 2) {
+
+        // Remaining length: 1-4 bytes, 7 bits each, least significant
+        // first
+
+        size_t len = 0, iByte = 1;
+        unsigned shift = 0;
+        bool complete = false;
+
+        for(; iByte <= 4 && pos + iByte < in.size(); iByte++) {
+
+            unsigned char c = in[pos + iByte];
+            len   |= (size_t)(c & 0x7f) << shift;
+            shift += 7;
+
+            if(!(c & 0x80)) {
+                complete = true;
+                break;
+            }
+        }
+
+        if(!complete) {
+            if(iByte > 4)
+                client->closing_ = true;
+            break;
+        }
+
+        size_t header = iByte + 1;
+
+        if(in.size() - pos < header + len)
+            break;
+
+        unsigned char type = in[pos];
+        std::string body   = in.substr(pos + header, len);
+        pos += header + len;
+
+        if(!handlePacket(client, type, body))
+            client->closing_ = true;
+    }
+
+    client->in_.erase(0, pos);
+}
+
+/**.......................................................................
+ * Send what is queued, up to budget bytes (< 0 for no limit)
+ */
+void FakeBroker::writeClient(Client* client, double budget)
+{
+    size_t n = client->out_.size();
+
+    if(budget >= 0)
+        n = std::min(n, (size_t)budget);
+
+    if(n == 0)
+        return;
+
+    ssize_t sent = ::send(client->fd_, client->out_.data(), n, MSG_NOSIGNAL);
+
+    if(sent > 0) {
+        client->out_.erase(0, sent);
+        if(budget >= 0)
+            client->budget_ -= sent;
+    } else if(sent < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        client->closing_ = true;
+    }
+}
+
+/**.......................................................................
+ * Handle one packet.  Returns false if the connection should be
+ * dropped
+ */
+bool FakeBroker::handlePacket(Client* client, unsigned char type, const std::string& body)
+{
+    unsigned char kind = type & 0xf0;
+
+    if(!client->connected_ && kind != MQTT_CONNECT)
+        return false;
+
+    switch (kind) {
+    case MQTT_CONNECT:
+        if(client->connected_)
+            return false;
+        handleConnect(client, body);
+        break;
+    case MQTT_PUBLISH:
+        handlePublish(client, type & 0x0f, body);
+        break;
+    case MQTT_PUBREL:
+        send(client, packet(MQTT_PUBCOMP, body.substr(0, 2)));
+        break;
+    case MQTT_SUBSCRIBE:
+        handleSubscribe(client, body, true);
+        break;
+    case MQTT_UNSUBSCRIBE:
+        handleSubscribe(client, body, false);
+        break;
+    case MQTT_PINGREQ:
+        send(client, packet(MQTT_PINGRESP, ""));
+        break;
+    case MQTT_PUBACK:
+        break;
+    case MQTT_DISCONNECT:
+        return false;
+    default:
+        return false;
+    }
+
+    return true;
+}
+
+/**.......................................................................
+ * Accept MQTT 3.1 and 3.1.1 connections, unless we've been told to
+ * refuse them.  Nothing past the protocol level is looked at
+ */
+void FakeBroker::handleConnect(Client* client, const std::string& body)
+{
+    unsigned char code = CONNACK_ACCEPTED;
+
+    if(body.size() < 2) {
+        client->closing_ = true;
+        return;
+    }
+
+    size_t nameLen = ((unsigned char)body[0] << 8) | (unsigned char)body[1];
+
+    if(body.size() < 2 + nameLen + 1) {
+        client->closing_ = true;
+        return;
+    }
+
+    unsigned char level = body[2 + nameLen];
+
+    if(level != 3 && level != 4)
+        code = CONNACK_BAD_PROTOCOL;
+    else if(refuse_.load())
+        code = CONNACK_SERVER_UNAVAILABLE;
+
+    std::string ack;
+    ack += (char)0;
+    ack += (char)code;
+
+    send(client, packet(MQTT_CONNACK, ack));
+
+    if(code == CONNACK_ACCEPTED) {
+        client->connected_ = true;
+        connects_.fetch_add(1, std::memory_order_relaxed);
+    } else {
+        client->closing_ = true;
+    }
+}
+
+/**.......................................................................
+ * Add or remove subscriptions, and acknowledge them
+ */
+void FakeBroker::handleSubscribe(Client* client, const std::string& body, bool subscribe)
+{
+    if(body.size() < 2) {
+        client->closing_ = true;
+        return;
+    }
+
+    std::string ack = body.substr(0, 2);
+    size_t pos = 2;
+
+    while(pos + 2 <= body.size()) {
+
+        size_t len = ((unsigned char)body[pos] << 8) | (unsigned char)body[pos+1];
+        pos += 2;
+
+        if(pos + len + (subscribe ? 1 : 0) > body.size()) {
+            client->closing_ = true;
+            return;
+        }
+
+        Subscription sub;
+        sub.filter_ = body.substr(pos, len);
+        pos += len;
+
+        // $share/<group>/<filter>
+
+        if(sub.filter_.compare(0, 7, "$share/") == 0) {
+            size_t slash = sub.filter_.find('/', 7);
+            if(slash != std::string::npos) {
+                sub.group_  = sub.filter_.substr(7, slash - 7);
+                sub.filter_ = sub.filter_.substr(slash + 1);
+            }
+        }
+
+        std::vector<Subscription>& subs = client->subs_;
+
+        for(unsigned i=0; i < subs.size(); ) {
+            if(subs[i].filter_ == sub.filter_ && subs[i].group_ == sub.group_)
+                subs.erase(subs.begin() + i);
+            else
+                i++;
+        }
+
+        if(subscribe) {
+            sub.qos_ = std::min((int)(body[pos++] & 0x03), 1);
+            subs.push_back(sub);
+            ack += (char)sub.qos_;
+        }
+    }
+
+    send(client, packet(subscribe ? MQTT_SUBACK : MQTT_UNSUBACK, ack));
+}
+
+/**.......................................................................
+ * Acknowledge a publish as its QoS requires, and route it
+ */
+void FakeBroker::handlePublish(Client* client, unsigned char flags, const std::string& body)
+{
+    int qos = (flags >> 1) & 0x03;
+
+    if(body.size() < 2 || qos > 2) {
+        client->closing_ = true;
+        return;
+    }
+
+    size_t len = ((unsigned char)body[0] << 8) | (unsigned char)body[1];
+    size_t pos = 2 + len + (qos > 0 ? 2 : 0);
+
+    if(pos > body.size()) {
+        client->closing_ = true;
+        return;
+    }
+
+    std::string topic = body.substr(2, len);
+
+    if(qos == 1)
+        send(client, packet(MQTT_PUBACK, body.substr(2 + len, 2)));
+    else if(qos == 2)
+        send(client, packet(MQTT_PUBREC, body.substr(2 + len, 2)));
+
+    received_.fetch_add(1, std::memory_order_relaxed);
+
+    route(topic, body.substr(pos), qos);
+}
+
+/**.......................................................................
+ * Deliver a message once to each client with a matching ordinary
+ * subscription, and once to one member of each matching share group
+ */
+void FakeBroker::route(const std::string& topic, const std::string& payload, int qos)
+{
+    std::map<std::string, std::vector<std::pair<Client*, int> > > groups;
+
+    for(unsigned i=0; i < clients_.size(); i++) {
+
+        Client* client = clients_[i];
+
+        if(client->closing_ || !client->connected_)
+            continue;
+
+        int subQos = -1;
+
+        for(unsigned iSub=0; iSub < client->subs_.size(); iSub++) {
+
+            Subscription& sub = client->subs_[iSub];
+
+            if(!matches(sub.filter_, topic))
+                continue;
+
+            if(sub.group_.empty())
+                subQos = std::max(subQos, sub.qos_);
+            else
+                groups[sub.group_].push_back(std::make_pair(client, sub.qos_));
+        }
+
+        if(subQos >= 0)
+            deliver(client, topic, payload, std::min(qos, subQos));
+    }
+
+    for(std::map<std::string, std::vector<std::pair<Client*, int> > >::iterator iter = groups.begin();
+        iter != groups.end(); ++iter) {
+
+        unsigned& next = shareNext_[iter->first];
+        std::pair<Client*, int>& member = iter->second[next++ % iter->second.size()];
+
+        deliver(member.first, topic, payload, std::min(qos, member.second));
+    }
+}
+
+/**.......................................................................
+ * Queue a PUBLISH for a subscriber, after the scripted latency, unless
+ * it already has too much queued.  Drops the connection every
+ * disconnectEvery_ deliveries
+ */
+void FakeBroker::deliver(Client* client, const std::string& topic, const std::string& payload, int qos)
+{
+    size_t maxQueued = maxQueuedBytes_.load();
+
+    if(maxQueued > 0 && client->out_.size() + client->delayedBytes_ > maxQueued) {
+        dropped_.fetch_add(1, std::memory_order_relaxed);
+        return;
+    }
+
+    std::string body;
+    putString(body, topic);
+
+    if(qos > 0) {
+        if(++client->nextId_ == 0)
+            client->nextId_ = 1;
+        putUint16(body, client->nextId_);
+    }
+
+    body += payload;
+
+    std::string publish = packet(MQTT_PUBLISH | (qos << 1), body);
+    unsigned latency    = latencyMs_.load();
+
+    if(latency > 0) {
+        client->delayedBytes_ += publish.size();
+        client->delayed_.push_back(std::make_pair(nowMicros() + latency * 1000LL, publish));
+    } else {
+        client->out_ += publish;
+    }
+
+    delivered_.fetch_add(1, std::memory_order_relaxed);
+
+    unsigned every = disconnectEvery_.load();
+
+    if(every > 0 && ++client->delivered_ % every == 0)
+        client->closing_ = true;
+}
+
+/**.......................................................................
+ * Queue a control packet, ahead of any delayed deliveries
+ */
+void FakeBroker::send(Client* client, const std::string& packet)
+{
+    client->out_ += packet;
+}
+
+/**.......................................................................
+ * Drop a connection as a network failure would: anything still queued
+ * for it is lost
+ */
+void FakeBroker::closeClient(Client* client)
+{
+    if(client->connected_)
+        disconnects_.fetch_add(1, std::memory_order_relaxed);
+
+    close(client->fd_);
+    delete client;
+}
+
+//------------------------------------------------------------
+// Helpers
+//------------------------------------------------------------
+
+/**.......................................................................
+ * MQTT topic matching: '+' matches one level, a trailing '#' matches
+ * any number (including none), and wildcards don't match topics
+ * starting with '$'
+ */
+bool FakeBroker::matches(const std::string& filter, const std::string& topic)
+{
+    if(!topic.empty() && topic[0] == '$' && !filter.empty() && (filter[0] == '+' || filter[0] == '#'))
+        return false;
+
+    size_t f = 0, t = 0;
+
+    for(;;) {
+
+        size_t fEnd = filter.find('/', f);
+        size_t tEnd = topic.find('/', t);
+
+        std::string fLevel = filter.substr(f, fEnd == std::string::npos ? std::string::npos : fEnd - f);
+
+        if(fLevel == "#")
+            return true;
+
+        if(t == std::string::npos)
+            return false;
+
+        std::string tLevel = topic.substr(t, tEnd == std::string::npos ? std::string::npos : tEnd - t);
+
+        if(fLevel != "+" && fLevel != tLevel)
+            return false;
+
+        // Last level of the filter: a match only if it's also the last
+        // of the topic.  "a/#" matches "a" as well
+
+        if(fEnd == std::string::npos)
+            return tEnd == std::string::npos;
+
+        f = fEnd + 1;
+        t = tEnd == std::string::npos ? std::string::npos : tEnd + 1;
+
+        if(t == std::string::npos)
+            return filter.compare(f, std::string::npos, "#") == 0;
+    }
+}
+
+/**.......................................................................
+ * Frame a packet: fixed header byte, remaining length, body
+ */
+std::string FakeBroker::packet(unsigned char header, const std::string& body)
+{
+    std::string out;
+    out += (char)header;
+
+    size_t len = body.size();
+
+    do {
+        unsigned char c = len & 0x7f;
+        len >>= 7;
+        out += (char)(len > 0 ? (c | 0x80) : c);
+    } while(len > 0);
+
+    out += body;
+
+    return out;
+}
+
+void FakeBroker::putUint16(std::string& out, unsigned val)
+{
+    out += (char)((val >> 8) & 0xff);
+    out += (char)(val & 0xff);
+}
+
+void FakeBroker::putString(std::string& out, const std::string& str)
+{
+    putUint16(out, str.size());
+    out += str;
+}
+
+int64_t FakeBroker::nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
@@ -0,0 +1,147 @@
+// $Id: $
+
+#ifndef NIFUTIL_FAKEBROKER_H
+#define NIFUTIL_FAKEBROKER_H
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @file FakeBroker.h
+ *
+ * A minimal in-process MQTT 3.1.1 broker, for benchmarking MosClient
+ * without a real broker, and for injecting faults a real broker
+ * won't produce on demand.
+ *
+ * It speaks enough of the protocol for MosClient: CONNECT,
+ * SUBSCRIBE/UNSUBSCRIBE (including $share/<group>/ filters, balanced
+ * round-robin), PUBLISH at QoS 0, 1 and 2 in, and QoS 0 and 1 out,
+ * PINGREQ and DISCONNECT.  There are no retained messages, wills,
+ * persistent sessions or authentication, and keepalives are not
+ * enforced.  QoS 2 subscriptions are granted at QoS 1.
+ *
+ * Faults can be scripted at any time while running:
+ *
+ *    setLatencyMs()        -- delay every delivery by a fixed time
+ *    setSlowConsumer()     -- cap each subscriber's delivery rate, and
+ *                             drop messages once too much is queued
+ *                             for it, as a broker does
+ *    setDisconnectEvery()  -- drop a subscriber's connection after
+ *                             every N messages delivered to it
+ *    setRefuseConnections()-- answer CONNECT with "server unavailable"
+ *    disconnectAll()       -- drop every connection now
+ *
+ * All sockets are served by one thread, with poll().
+ */
+namespace nifutil {
+
+    class FakeBroker {
+    public:
+
+        /**
+         * Constructor.
+         */
+        FakeBroker();
+
+        /**
+         * Destructor.  Stops the broker if it is running
+         */
+        virtual ~FakeBroker();
+
+        // Listen on 127.0.0.1:port (0 for any free port) and start
+        // serving
+
+        void start(unsigned port=0);
+        void stop();
+        unsigned port();
+
+        void setLatencyMs(unsigned ms);
+        void setSlowConsumer(unsigned bytesPerSec, size_t maxQueuedBytes);
+        void setDisconnectEvery(unsigned nMessage);
+        void setRefuseConnections(bool refuse);
+        void disconnectAll();
+
+        // Counts since start
+
+        uint64_t connects();
+        uint64_t received();
+        uint64_t delivered();
+        uint64_t dropped();
+        uint64_t disconnects();
+
+    private:
+
+        struct Subscription {
+            std::string filter_;
+            std::string group_;   // Share group, if any
+            int qos_;
+        };
+
+        struct Client {
+            int fd_;
+            bool connected_;
+            bool closing_;
+            std::string in_;
+            std::string out_;
+            std::deque<std::pair<int64_t, std::string> > delayed_;
+            size_t delayedBytes_;
+            std::vector<Subscription> subs_;
+            uint16_t nextId_;
+            uint64_t delivered_;
+            double budget_;
+        };
+
+        static void* runFn(void* arg);
+
+        void run();
+        void acceptClient();
+        void readClient(Client* client);
+        void writeClient(Client* client, double budget);
+        bool handlePacket(Client* client, unsigned char type, const std::string& body);
+        void handleConnect(Client* client, const std::string& body);
+        void handleSubscribe(Client* client, const std::string& body, bool subscribe);
+        void handlePublish(Client* client, unsigned char flags, const std::string& body);
+        void route(const std::string& topic, const std::string& payload, int qos);
+        void deliver(Client* client, const std::string& topic, const std::string& payload, int qos);
+        void send(Client* client, const std::string& packet);
+        void closeClient(Client* client);
+
+        static bool matches(const std::string& filter, const std::string& topic);
+        static std::string packet(unsigned char header, const std::string& body);
+        static void putUint16(std::string& out, unsigned val);
+        static void putString(std::string& out, const std::string& str);
+        static int64_t nowMicros();
+
+        int listenFd_;
+        unsigned port_;
+        pthread_t threadId_;
+        bool started_;
+        std::atomic<bool> stop_;
+
+        std::vector<Client*> clients_;
+        std::map<std::string, unsigned> shareNext_;
+
+        std::atomic<unsigned> latencyMs_;
+        std::atomic<unsigned> bytesPerSec_;
+        std::atomic<size_t> maxQueuedBytes_;
+        std::atomic<unsigned> disconnectEvery_;
+        std::atomic<bool> refuse_;
+        std::atomic<bool> disconnectAll_;
+
+        std::atomic<uint64_t> connects_;
+        std::atomic<uint64_t> received_;
+        std::atomic<uint64_t> delivered_;
+        std::atomic<uint64_t> dropped_;
+        std::atomic<uint64_t> disconnects_;
+
+    }; // End class FakeBroker
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_FAKEBROKER_H
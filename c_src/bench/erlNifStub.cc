@@ -0,0 +1,800 @@
+#include "erl_nif.h"
+
+#include <deque>
+#include <map>
+#include <string>
+#include <vector>
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+//-----------------------------------------------------------------------
+// A stand-in for the parts of the erl_nif API that ErlUtil, RowCodec,
+// MosClient and MqttNif use, so that the decode path and the NIF
+// commands can be benchmarked without a running VM (see tErlUtil.cc
+// and tCommand.cc).
+//
+// Terms are pointers to Term structs, allocated from their env.  An
+// env reuses its terms once cleared, so that, like a process heap,
+// making a term in a warmed-up env costs no malloc.  Atoms are
+// interned for the life of the program.
+//
+// This is not an erlang runtime: there is no garbage collection,
+// terms are not immutable once the env is cleared, and enif_send()
+// just discards the message.  So a resource is only freed if no term
+// was ever made for it, there is one process (enif_self()), and
+// enif_schedule_nif() runs the function in place, counting the call
+// (see erlNifStubDirtyCalls()).
+//-----------------------------------------------------------------------
+
+struct Term {
+
+    enum Kind {
+        ATOM,
+        INTEGER,
+        FLOAT,
+        BINARY,
+        NIL,
+        CONS,
+        TUPLE,
+        MAP,
+        PID,
+        RESOURCE
+    };
+
+    Kind kind_;
+    int64_t int_;
+    bool unsigned_;             // int_ holds a uint64 above INT64_MAX
+    double float_;
+    std::string bytes_;         // Atom name or binary data
+    std::vector<ERL_NIF_TERM> elems_; // Tuple elements, [head, tail] or
+                                      // map keys and values, interleaved
+};
+
+struct enif_environment_t {
+    std::deque<Term> terms_;
+    size_t used_;
+};
+
+struct enif_resource_type_t {
+    std::string name_;
+    ErlNifResourceDtor* dtor_;
+};
+
+// Resources are allocated with this header in front of the object
+
+struct ResourceHeader {
+    ErlNifResourceType* type_;
+    unsigned refs_;
+    double align_;
+};
+
+static ResourceHeader* headerOf(void* obj)
+{
+    return (ResourceHeader*)obj - 1;
+}
+
+static unsigned dirtyCalls = 0;
+
+static Term* termOf(ERL_NIF_TERM term)
+{
+    return (Term*)term;
+}
+
+static Term* newTerm(ErlNifEnv* env, Term::Kind kind)
+{
+    if(env->used_ == env->terms_.size())
+        env->terms_.push_back(Term());
+
+    Term* term = &env->terms_[env->used_++];
+
+    term->kind_     = kind;
+    term->int_      = 0;
+    term->unsigned_ = false;
+    term->float_    = 0.0;
+    term->bytes_.clear();
+    term->elems_.clear();
+
+    return term;
+}
+
+// Atoms, and the empty list, live in an env that is never cleared
+
+static pthread_mutex_t atomMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static ErlNifEnv* staticEnv()
+{
+    static ErlNifEnv* env = enif_alloc_env();
+    return env;
+}
+
+static ERL_NIF_TERM nilTerm()
+{
+    static ERL_NIF_TERM nil = (ERL_NIF_TERM)newTerm(staticEnv(), Term::NIL);
+    return nil;
+}
+
+static ERL_NIF_TERM atomFor(const char* name, size_t len)
+{
+    static std::map<std::string, ERL_NIF_TERM> atoms;
+
+    std::string key(name, len);
+
+    pthread_mutex_lock(&atomMutex);
+
+    std::map<std::string, ERL_NIF_TERM>::iterator iter = atoms.find(key);
+    ERL_NIF_TERM atom;
+
+    if(iter == atoms.end()) {
+        Term* term = newTerm(staticEnv(), Term::ATOM);
+        term->bytes_ = key;
+        atom = atoms[key] = (ERL_NIF_TERM)term;
+    } else {
+        atom = iter->second;
+    }
+
+    pthread_mutex_unlock(&atomMutex);
+
+    return atom;
+}
+
+static ERL_NIF_TERM makeList(ErlNifEnv* env, const ERL_NIF_TERM* elems, unsigned n)
+{
+    ERL_NIF_TERM list = nilTerm();
+
+    for(unsigned i=n; i > 0; i--) {
+        Term* cell = newTerm(env, Term::CONS);
+        cell->elems_.push_back(elems[i-1]);
+        cell->elems_.push_back(list);
+        list = (ERL_NIF_TERM)cell;
+    }
+
+    return list;
+}
+
+static bool identical(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+{
+    if(lhs == rhs)
+        return true;
+
+    Term* a = termOf(lhs);
+    Term* b = termOf(rhs);
+
+    if(a->kind_ != b->kind_ || a->int_ != b->int_ || a->unsigned_ != b->unsigned_ ||
+       a->float_ != b->float_ || a->bytes_ != b->bytes_ || a->elems_.size() != b->elems_.size())
+        return false;
+
+    for(unsigned i=0; i < a->elems_.size(); i++) {
+        if(!identical(a->elems_[i], b->elems_[i]))
+            return false;
+    }
+
+    return true;
+}
+
+static ERL_NIF_TERM copyTerm(ErlNifEnv* env, ERL_NIF_TERM src)
+{
+    Term* from = termOf(src);
+
+    if(from->kind_ == Term::ATOM || from->kind_ == Term::NIL)
+        return src;
+
+    Term* to = newTerm(env, from->kind_);
+
+    to->int_      = from->int_;
+    to->unsigned_ = from->unsigned_;
+    to->float_    = from->float_;
+    to->bytes_    = from->bytes_;
+
+    for(unsigned i=0; i < from->elems_.size(); i++)
+        to->elems_.push_back(copyTerm(env, from->elems_[i]));
+
+    return (ERL_NIF_TERM)to;
+}
+
+// Append the bytes of an iolist to out.  Returns false if it isn't one
+
+static bool flattenIolist(ERL_NIF_TERM term, std::string& out)
+{
+    Term* t = termOf(term);
+
+    switch(t->kind_) {
+    case Term::BINARY:
+        out += t->bytes_;
+        return true;
+    case Term::NIL:
+        return true;
+    case Term::INTEGER:
+        if(t->unsigned_ || t->int_ < 0 || t->int_ > 255)
+            return false;
+        out.push_back((char)t->int_);
+        return true;
+    case Term::CONS:
+        return flattenIolist(t->elems_[0], out) && flattenIolist(t->elems_[1], out);
+    default:
+        return false;
+    }
+}
+
+extern "C" {
+
+//-----------------------------------------------------------------------
+// Environments
+//-----------------------------------------------------------------------
+
+ErlNifEnv* enif_alloc_env(void)
+{
+    ErlNifEnv* env = new ErlNifEnv();
+    env->used_ = 0;
+    return env;
+}
+
+void enif_free_env(ErlNifEnv* env)
+{
+    delete env;
+}
+
+void enif_clear_env(ErlNifEnv* env)
+{
+    env->used_ = 0;
+}
+
+int enif_send(ErlNifEnv* env, const ErlNifPid* pid, ErlNifEnv* msgEnv, ERL_NIF_TERM msg)
+{
+    if(msgEnv)
+        enif_clear_env(msgEnv);
+
+    return 1;
+}
+
+ERL_NIF_TERM enif_make_copy(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return copyTerm(env, term);
+}
+
+//-----------------------------------------------------------------------
+// Type tests
+//-----------------------------------------------------------------------
+
+int enif_is_atom(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return termOf(term)->kind_ == Term::ATOM;
+}
+
+int enif_is_binary(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return termOf(term)->kind_ == Term::BINARY;
+}
+
+int enif_is_list(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return termOf(term)->kind_ == Term::CONS || termOf(term)->kind_ == Term::NIL;
+}
+
+int enif_is_tuple(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return termOf(term)->kind_ == Term::TUPLE;
+}
+
+int enif_is_number(ErlNifEnv* env, ERL_NIF_TERM term)
+{
+    return termOf(term)->kind_ == Term::INTEGER || termOf(term)->kind_ == Term::FLOAT;
+}
+
+int enif_is_identical(ERL_NIF_TERM lhs, ERL_NIF_TERM rhs)
+{
+    return identical(lhs, rhs);
+}
+
+//-----------------------------------------------------------------------
+// Getters
+//-----------------------------------------------------------------------
+
+int enif_get_atom(ErlNifEnv* env, ERL_NIF_TERM term, char* buf, unsigned len, ErlNifCharEncoding encoding)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::ATOM || t->bytes_.size() + 1 > len)
+        return 0;
+
+    memcpy(buf, t->bytes_.c_str(), t->bytes_.size() + 1);
+
+    return t->bytes_.size() + 1;
+}
+
+int enif_get_atom_length(ErlNifEnv* env, ERL_NIF_TERM term, unsigned* len, ErlNifCharEncoding encoding)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::ATOM)
+        return 0;
+
+    *len = t->bytes_.size();
+
+    return 1;
+}
+
+int enif_get_string(ErlNifEnv* env, ERL_NIF_TERM term, char* buf, unsigned len, ErlNifCharEncoding encoding)
+{
+    std::string str;
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::CONS && t->kind_ != Term::NIL)
+        return 0;
+
+    for(; t->kind_ == Term::CONS; t = termOf(t->elems_[1])) {
+
+        Term* head = termOf(t->elems_[0]);
+
+        if(head->kind_ != Term::INTEGER || head->unsigned_ || head->int_ < 0 || head->int_ > 255)
+            return 0;
+
+        str.push_back((char)head->int_);
+    }
+
+    if(t->kind_ != Term::NIL || len == 0)
+        return 0;
+
+    if(str.size() + 1 > len) {
+        memcpy(buf, str.data(), len - 1);
+        buf[len-1] = '\0';
+        return -(int)len;
+    }
+
+    memcpy(buf, str.c_str(), str.size() + 1);
+
+    return str.size() + 1;
+}
+
+int enif_get_list_length(ErlNifEnv* env, ERL_NIF_TERM term, unsigned* len)
+{
+    unsigned n = 0;
+    Term* t = termOf(term);
+
+    for(; t->kind_ == Term::CONS; t = termOf(t->elems_[1]))
+        ++n;
+
+    if(t->kind_ != Term::NIL)
+        return 0;
+
+    *len = n;
+
+    return 1;
+}
+
+int enif_get_list_cell(ErlNifEnv* env, ERL_NIF_TERM term, ERL_NIF_TERM* head, ERL_NIF_TERM* tail)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::CONS)
+        return 0;
+
+    *head = t->elems_[0];
+    *tail = t->elems_[1];
+
+    return 1;
+}
+
+int enif_get_tuple(ErlNifEnv* env, ERL_NIF_TERM term, int* arity, const ERL_NIF_TERM** array)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::TUPLE)
+        return 0;
+
+    *arity = t->elems_.size();
+    *array = t->elems_.empty() ? 0 : &t->elems_[0];
+
+    return 1;
+}
+
+int enif_get_int64(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifSInt64* ip)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::INTEGER || t->unsigned_)
+        return 0;
+
+    *ip = t->int_;
+
+    return 1;
+}
+
+int enif_get_uint64(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifUInt64* ip)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::INTEGER || (!t->unsigned_ && t->int_ < 0))
+        return 0;
+
+    *ip = (uint64_t)t->int_;
+
+    return 1;
+}
+
+int enif_get_int(ErlNifEnv* env, ERL_NIF_TERM term, int* ip)
+{
+    ErlNifSInt64 val;
+
+    if(!enif_get_int64(env, term, &val) || val < INT32_MIN || val > INT32_MAX)
+        return 0;
+
+    *ip = val;
+
+    return 1;
+}
+
+int enif_get_uint(ErlNifEnv* env, ERL_NIF_TERM term, unsigned* ip)
+{
+    ErlNifUInt64 val;
+
+    if(!enif_get_uint64(env, term, &val) || val > UINT32_MAX)
+        return 0;
+
+    *ip = val;
+
+    return 1;
+}
+
+int enif_get_double(ErlNifEnv* env, ERL_NIF_TERM term, double* dp)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::FLOAT)
+        return 0;
+
+    *dp = t->float_;
+
+    return 1;
+}
+
+int enif_inspect_binary(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifBinary* bin)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::BINARY)
+        return 0;
+
+    memset(bin, 0, sizeof(*bin));
+    bin->size = t->bytes_.size();
+    bin->data = (unsigned char*)t->bytes_.data();
+
+    return 1;
+}
+
+int enif_inspect_iolist_as_binary(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifBinary* bin)
+{
+    if(termOf(term)->kind_ == Term::BINARY)
+        return enif_inspect_binary(env, term, bin);
+
+    Term* flat = newTerm(env, Term::BINARY);
+
+    if(!flattenIolist(term, flat->bytes_))
+        return 0;
+
+    return enif_inspect_binary(env, (ERL_NIF_TERM)flat, bin);
+}
+
+//-----------------------------------------------------------------------
+// Binaries
+//-----------------------------------------------------------------------
+
+int enif_alloc_binary(size_t size, ErlNifBinary* bin)
+{
+    memset(bin, 0, sizeof(*bin));
+    bin->size = size;
+    bin->data = (unsigned char*)malloc(size ? size : 1);
+
+    return bin->data != 0;
+}
+
+ERL_NIF_TERM enif_make_binary(ErlNifEnv* env, ErlNifBinary* bin)
+{
+    Term* t = newTerm(env, Term::BINARY);
+    t->bytes_.assign((const char*)bin->data, bin->size);
+
+    // The term now owns the binary
+
+    free(bin->data);
+    bin->data = 0;
+
+    return (ERL_NIF_TERM)t;
+}
+
+unsigned char* enif_make_new_binary(ErlNifEnv* env, size_t size, ERL_NIF_TERM* termp)
+{
+    Term* t = newTerm(env, Term::BINARY);
+    t->bytes_.resize(size);
+
+    *termp = (ERL_NIF_TERM)t;
+
+    return (unsigned char*)&t->bytes_[0];
+}
+
+//-----------------------------------------------------------------------
+// Constructors
+//-----------------------------------------------------------------------
+
+ERL_NIF_TERM enif_make_atom(ErlNifEnv* env, const char* name)
+{
+    return atomFor(name, strlen(name));
+}
+
+ERL_NIF_TERM enif_make_string(ErlNifEnv* env, const char* string, ErlNifCharEncoding encoding)
+{
+    return enif_make_string_len(env, string, strlen(string), encoding);
+}
+
+ERL_NIF_TERM enif_make_string_len(ErlNifEnv* env, const char* string, size_t len, ErlNifCharEncoding encoding)
+{
+    std::vector<ERL_NIF_TERM> chars(len);
+
+    for(size_t i=0; i < len; i++)
+        chars[i] = enif_make_int64(env, (unsigned char)string[i]);
+
+    return makeList(env, chars.empty() ? 0 : &chars[0], len);
+}
+
+ERL_NIF_TERM enif_make_int64(ErlNifEnv* env, ErlNifSInt64 val)
+{
+    Term* t = newTerm(env, Term::INTEGER);
+    t->int_ = val;
+    return (ERL_NIF_TERM)t;
+}
+
+ERL_NIF_TERM enif_make_uint64(ErlNifEnv* env, ErlNifUInt64 val)
+{
+    Term* t = newTerm(env, Term::INTEGER);
+    t->int_      = (int64_t)val;
+    t->unsigned_ = val > (ErlNifUInt64)INT64_MAX;
+    return (ERL_NIF_TERM)t;
+}
+
+ERL_NIF_TERM enif_make_int(ErlNifEnv* env, int val)
+{
+    return enif_make_int64(env, val);
+}
+
+ERL_NIF_TERM enif_make_uint(ErlNifEnv* env, unsigned val)
+{
+    return enif_make_uint64(env, val);
+}
+
+ERL_NIF_TERM enif_make_double(ErlNifEnv* env, double val)
+{
+    Term* t = newTerm(env, Term::FLOAT);
+    t->float_ = val;
+    return (ERL_NIF_TERM)t;
+}
+
+ERL_NIF_TERM enif_make_list(ErlNifEnv* env, unsigned cnt, ...)
+{
+    std::vector<ERL_NIF_TERM> elems(cnt);
+
+    va_list args;
+    va_start(args, cnt);
+    for(unsigned i=0; i < cnt; i++)
+        elems[i] = va_arg(args, ERL_NIF_TERM);
+    va_end(args);
+
+    return makeList(env, elems.empty() ? 0 : &elems[0], cnt);
+}
+
+ERL_NIF_TERM enif_make_list_from_array(ErlNifEnv* env, const ERL_NIF_TERM arr[], unsigned cnt)
+{
+    return makeList(env, arr, cnt);
+}
+
+ERL_NIF_TERM enif_make_tuple_from_array(ErlNifEnv* env, const ERL_NIF_TERM arr[], unsigned cnt)
+{
+    Term* t = newTerm(env, Term::TUPLE);
+    t->elems_.assign(arr, arr + cnt);
+    return (ERL_NIF_TERM)t;
+}
+
+ERL_NIF_TERM enif_make_tuple(ErlNifEnv* env, unsigned cnt, ...)
+{
+    Term* t = newTerm(env, Term::TUPLE);
+
+    va_list args;
+    va_start(args, cnt);
+    for(unsigned i=0; i < cnt; i++)
+        t->elems_.push_back(va_arg(args, ERL_NIF_TERM));
+    va_end(args);
+
+    return (ERL_NIF_TERM)t;
+}
+
+// erl_nif.h defines these as macros over enif_make_tuple(), except
+// where it declares them as functions
+
+#ifndef enif_make_tuple1
+ERL_NIF_TERM enif_make_tuple1(ErlNifEnv* env, ERL_NIF_TERM e1)
+{
+    return enif_make_tuple(env, 1, e1);
+}
+#endif
+
+#ifndef enif_make_tuple2
+ERL_NIF_TERM enif_make_tuple2(ErlNifEnv* env, ERL_NIF_TERM e1, ERL_NIF_TERM e2)
+{
+    return enif_make_tuple(env, 2, e1, e2);
+}
+#endif
+
+#ifndef enif_make_tuple3
+ERL_NIF_TERM enif_make_tuple3(ErlNifEnv* env, ERL_NIF_TERM e1, ERL_NIF_TERM e2, ERL_NIF_TERM e3)
+{
+    return enif_make_tuple(env, 3, e1, e2, e3);
+}
+#endif
+
+#ifndef enif_make_tuple4
+ERL_NIF_TERM enif_make_tuple4(ErlNifEnv* env, ERL_NIF_TERM e1, ERL_NIF_TERM e2, ERL_NIF_TERM e3, ERL_NIF_TERM e4)
+{
+    return enif_make_tuple(env, 4, e1, e2, e3, e4);
+}
+#endif
+
+ERL_NIF_TERM enif_make_new_map(ErlNifEnv* env)
+{
+    return (ERL_NIF_TERM)newTerm(env, Term::MAP);
+}
+
+int enif_make_map_put(ErlNifEnv* env, ERL_NIF_TERM mapIn, ERL_NIF_TERM key, ERL_NIF_TERM value, ERL_NIF_TERM* mapOut)
+{
+    Term* in = termOf(mapIn);
+
+    if(in->kind_ != Term::MAP)
+        return 0;
+
+    Term* out = newTerm(env, Term::MAP);
+    out->elems_ = in->elems_;
+
+    for(unsigned i=0; i < out->elems_.size(); i += 2) {
+        if(identical(out->elems_[i], key)) {
+            out->elems_[i+1] = value;
+            *mapOut = (ERL_NIF_TERM)out;
+            return 1;
+        }
+    }
+
+    out->elems_.push_back(key);
+    out->elems_.push_back(value);
+
+    *mapOut = (ERL_NIF_TERM)out;
+
+    return 1;
+}
+
+//-----------------------------------------------------------------------
+// Processes
+//-----------------------------------------------------------------------
+
+ErlNifPid* enif_self(ErlNifEnv* env, ErlNifPid* pid)
+{
+    static ERL_NIF_TERM self = (ERL_NIF_TERM)newTerm(staticEnv(), Term::PID);
+
+    pid->pid = self;
+
+    return pid;
+}
+
+#ifndef enif_make_pid
+ERL_NIF_TERM enif_make_pid(ErlNifEnv* env, const ErlNifPid* pid)
+{
+    return pid->pid;
+}
+#endif
+
+int enif_get_local_pid(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifPid* pid)
+{
+    if(termOf(term)->kind_ != Term::PID)
+        return 0;
+
+    pid->pid = term;
+
+    return 1;
+}
+
+//-----------------------------------------------------------------------
+// Resources
+//-----------------------------------------------------------------------
+
+ErlNifResourceType* enif_open_resource_type(ErlNifEnv* env, const char* moduleStr, const char* name,
+                                            ErlNifResourceDtor* dtor, ErlNifResourceFlags flags,
+                                            ErlNifResourceFlags* tried)
+{
+    ErlNifResourceType* type = new ErlNifResourceType();
+    type->name_ = name;
+    type->dtor_ = dtor;
+
+    if(tried)
+        *tried = flags;
+
+    return type;
+}
+
+void* enif_alloc_resource(ErlNifResourceType* type, size_t size)
+{
+    ResourceHeader* header = (ResourceHeader*)malloc(sizeof(ResourceHeader) + size);
+    header->type_ = type;
+    header->refs_ = 1;
+
+    return header + 1;
+}
+
+void enif_release_resource(void* obj)
+{
+    ResourceHeader* header = headerOf(obj);
+
+    if(--header->refs_ > 0)
+        return;
+
+    if(header->type_->dtor_)
+        header->type_->dtor_(NULL, obj);
+
+    free(header);
+}
+
+// The term holds a reference that, without garbage collection, is
+// never released
+
+ERL_NIF_TERM enif_make_resource(ErlNifEnv* env, void* obj)
+{
+    headerOf(obj)->refs_++;
+
+    Term* t = newTerm(env, Term::RESOURCE);
+    t->int_ = (int64_t)(intptr_t)obj;
+
+    return (ERL_NIF_TERM)t;
+}
+
+int enif_get_resource(ErlNifEnv* env, ERL_NIF_TERM term, ErlNifResourceType* type, void** objp)
+{
+    Term* t = termOf(term);
+
+    if(t->kind_ != Term::RESOURCE || headerOf((void*)(intptr_t)t->int_)->type_ != type)
+        return 0;
+
+    *objp = (void*)(intptr_t)t->int_;
+
+    return 1;
+}
+
+//-----------------------------------------------------------------------
+// Scheduling and system information
+//-----------------------------------------------------------------------
+
+ERL_NIF_TERM enif_schedule_nif(ErlNifEnv* env, const char* name, int flags,
+                               ERL_NIF_TERM (*fp)(ErlNifEnv*, int, const ERL_NIF_TERM[]),
+                               int argc, const ERL_NIF_TERM argv[])
+{
+    if(flags != 0)
+        dirtyCalls++;
+
+    return fp(env, argc, argv);
+}
+
+void enif_system_info(ErlNifSysInfo* info, size_t size)
+{
+    memset(info, 0, size);
+
+    info->nif_major_version       = ERL_NIF_MAJOR_VERSION;
+    info->nif_minor_version       = ERL_NIF_MINOR_VERSION;
+    info->dirty_scheduler_support = 1;
+}
+
+} // End extern "C"
+
+/**.......................................................................
+ * The number of calls enif_schedule_nif() was asked to run on a dirty
+ * scheduler
+ */
+unsigned erlNifStubDirtyCalls()
+{
+    return dirtyCalls;
+}
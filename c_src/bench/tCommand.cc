@@ -0,0 +1,298 @@
+#include <algorithm>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ExceptionUtils.h"
+
+#if WITH_ERL
+#include "erl_nif.h"
+
+// Defined by ERL_NIF_INIT in MqttNif.cc, as the VM would find it
+
+extern "C" ErlNifEntry* nif_init(void);
+
+unsigned erlNifStubDirtyCalls();
+#endif
+
+//-----------------------------------------------------------------------
+// Per-call latency of the NIF's commands, with a client subscribed to
+// many topics.  Commands run on whichever scheduler calls them, unless
+// MqttNif's isLongRunning() sends them to a dirty one; this checks
+// that every command left on a normal scheduler stays well under the
+// 1 ms a NIF should take, and that the slow ones really are moved.
+//
+// Calls go through the NIF's own function table (nif_init()), against
+// the stub erl_nif API in erlNifStub.cc, where enif_schedule_nif()
+// runs the function in place and counts it.  The client is never
+// started, so no broker is needed; start and publish (which needs a
+// running comms loop) aren't covered, and status, which prints every
+// topic, is left out.
+//
+// Each command is timed individually, and reported as the median,
+// 99th percentile and maximum.  Exits non-zero if the 99th percentile
+// of any normal-scheduler command exceeds the limit, if any command
+// ran on the wrong kind of scheduler, or if close/1 doesn't close the
+// client.
+//
+// Usage: tCommand [--topics=N]        (default 10000)
+//                 [--reps=N]          (calls per command, default 1000)
+//                 [--limit_us=micros] (default 1000)
+//-----------------------------------------------------------------------
+
+#if WITH_ERL
+typedef ERL_NIF_TERM (*NIF_FN)(ErlNifEnv*, int, const ERL_NIF_TERM[]);
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static NIF_FN nifFor(ErlNifEntry* entry, std::string name, unsigned arity)
+{
+    for(int i=0; i < entry->num_of_funcs; i++)
+        if(name == entry->funcs[i].name && arity == entry->funcs[i].arity)
+            return entry->funcs[i].fptr;
+
+    ThrowRuntimeError("No NIF " << name << "/" << arity);
+    return 0;
+}
+
+static ERL_NIF_TERM atom(ErlNifEnv* env, const char* name)
+{
+    return enif_make_atom(env, name);
+}
+
+static ERL_NIF_TERM string(ErlNifEnv* env, std::string str)
+{
+    return enif_make_string(env, str.c_str(), ERL_NIF_LATIN1);
+}
+
+static bool isError(ErlNifEnv* env, ERL_NIF_TERM ret)
+{
+    int arity = 0;
+    const ERL_NIF_TERM* array = 0;
+
+    return enif_get_tuple(env, ret, &arity, &array) && arity == 2 && enif_is_identical(array[0], atom(env, "error"));
+}
+
+//-----------------------------------------------------------------------
+// Timings for one command
+//-----------------------------------------------------------------------
+
+struct Timing {
+    std::string name_;
+    bool dirty_;                  // Expected to go to a dirty scheduler
+    std::vector<double> micros_;  // One per call
+    unsigned dirtyCalls_;         // Calls that did
+    unsigned errors_;
+
+    double quantile(double q) {
+        std::sort(micros_.begin(), micros_.end());
+        return micros_[std::min<size_t>(micros_.size()-1, q * micros_.size())];
+    }
+};
+
+// Call command(Client, Cmd) n times, where cmdFn(i) makes the ith
+// command
+
+static Timing timeCommand(ErlNifEnv* env, NIF_FN command, ERL_NIF_TERM client, std::string name,
+                          bool dirty, unsigned n, std::function<ERL_NIF_TERM(unsigned)> cmdFn)
+{
+    Timing t;
+    t.name_       = name;
+    t.dirty_      = dirty;
+    t.dirtyCalls_ = 0;
+    t.errors_     = 0;
+
+    for(unsigned i=0; i < n; i++) {
+
+        ERL_NIF_TERM argv[2] = {client, cmdFn(i)};
+        unsigned before = erlNifStubDirtyCalls();
+
+        double start = nowSeconds();
+        ERL_NIF_TERM ret = command(env, 2, argv);
+        t.micros_.push_back((nowSeconds() - start) * 1e6);
+
+        t.dirtyCalls_ += erlNifStubDirtyCalls() - before;
+
+        if(isError(env, ret))
+            t.errors_++;
+    }
+
+    return t;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#if WITH_ERL
+    unsigned nTopics = 10000, reps = 1000;
+    double limitUs = 1000;
+
+    for(int i=1; i < argc; i++) {
+
+        std::string arg = argv[i];
+
+        if(arg.compare(0, 9, "--topics=") == 0) {
+            nTopics = atoi(arg.substr(9).c_str());
+        } else if(arg.compare(0, 7, "--reps=") == 0) {
+            reps = atoi(arg.substr(7).c_str());
+        } else if(arg.compare(0, 11, "--limit_us=") == 0) {
+            limitUs = atof(arg.substr(11).c_str());
+        } else {
+            COUTRED("Unrecognized option: " << arg);
+            return 1;
+        }
+    }
+
+    ErlNifEnv* env = enif_alloc_env();
+    ErlNifEntry* entry = nif_init();
+    void* priv = 0;
+
+    if(entry->load(env, &priv, 0) != 0) {
+        COUTRED("on_load failed");
+        return 1;
+    }
+
+    NIF_FN command   = nifFor(entry, "command", 2);
+    NIF_FN newClient = nifFor(entry, "new_client", 1);
+
+    ERL_NIF_TERM opts   = enif_make_list(env, 1, enif_make_tuple2(env, atom(env, "logging"), atom(env, "off")));
+    ERL_NIF_TERM client = newClient(env, 1, &opts);
+
+    if(isError(env, client)) {
+        COUTRED("new_client failed");
+        return 1;
+    }
+
+    ERL_NIF_TERM schema = enif_make_list(env, 3, atom(env, "timestamp"), atom(env, "double"), atom(env, "varchar"));
+    std::vector<Timing> timings;
+
+    timings.push_back(timeCommand(env, command, client, "subscribe", false, nTopics, [&](unsigned i) {
+                std::ostringstream topic;
+                topic << "site/" << i / 100 << "/sensor/" << i;
+                return enif_make_tuple(env, 5, atom(env, "subscribe"), string(env, topic.str()), schema,
+                                       atom(env, "csv"), enif_make_int(env, 0));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "subscribe_batch", false, reps / 10, [&](unsigned i) {
+                std::vector<ERL_NIF_TERM> cmds;
+                for(unsigned j=0; j < 10; j++) {
+                    std::ostringstream topic;
+                    topic << "batch/" << i << "/" << j;
+                    cmds.push_back(enif_make_tuple3(env, atom(env, "subscribe"), string(env, topic.str()), schema));
+                }
+                return enif_make_list_from_array(env, &cmds[0], cmds.size());
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "metrics", false, reps, [&](unsigned i) {
+                return enif_make_tuple1(env, atom(env, "metrics"));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "register", false, reps / 10, [&](unsigned i) {
+                ErlNifPid pid;
+                return enif_make_tuple2(env, atom(env, "register"), enif_make_pid(env, enif_self(env, &pid)));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "logging", false, reps, [&](unsigned i) {
+                return enif_make_tuple2(env, atom(env, "logging"), atom(env, "off"));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "log_level", false, reps, [&](unsigned i) {
+                return enif_make_tuple2(env, atom(env, "log_level"), atom(env, "info"));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "log_rate_limit", false, reps, [&](unsigned i) {
+                return enif_make_tuple2(env, atom(env, "log_rate_limit"), enif_make_int(env, 10));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "bridge_rule", false, reps / 10, [&](unsigned i) {
+                std::ostringstream from;
+                from << "site/" << i << "/";
+                return enif_make_tuple3(env, atom(env, "bridge_rule"), string(env, from.str()), string(env, "remote/"));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "bridge_filter", false, reps / 10, [&](unsigned i) {
+                std::ostringstream filter;
+                filter << "site/" << i << "/#";
+                return enif_make_tuple2(env, atom(env, "bridge_filter"), string(env, filter.str()));
+            }));
+
+    timings.push_back(timeCommand(env, command, client, "topic_stats", true, 10, [&](unsigned i) {
+                return enif_make_tuple2(env, atom(env, "topic_stats"), enif_make_int(env, 10));
+            }));
+
+    // close/1 always goes to a dirty scheduler, leaves the handle
+    // unusable, and can be repeated
+
+    NIF_FN closeFn = nifFor(entry, "close", 1);
+    ERL_NIF_TERM metricsArgv[2] = {client, enif_make_tuple1(env, atom(env, "metrics"))};
+
+    unsigned dirtyBefore = erlNifStubDirtyCalls();
+    bool closeOk = enif_is_identical(closeFn(env, 1, &client), atom(env, "ok"));
+
+    closeOk = closeOk && erlNifStubDirtyCalls() == dirtyBefore + 1;
+    closeOk = closeOk && isError(env, command(env, 2, metricsArgv));
+    closeOk = closeOk && enif_is_identical(closeFn(env, 1, &client), atom(env, "ok"));
+
+    //------------------------------------------------------------
+    // Report
+    //------------------------------------------------------------
+
+    std::cout << nTopics << " topics; limit " << limitUs << " us (p99) on a normal scheduler" << std::endl << std::endl
+              << std::left << std::setw(20) << "Command" << std::setw(10) << "Scheduler" << std::right
+              << std::setw(8) << "Calls" << std::setw(12) << "p50 (us)" << std::setw(12) << "p99 (us)"
+              << std::setw(12) << "max (us)" << std::endl
+              << std::string(74, '-') << std::endl;
+
+    bool ok = true;
+
+    for(unsigned i=0; i < timings.size(); i++) {
+
+        Timing& t = timings[i];
+        double p99 = t.quantile(0.99);
+
+        std::cout << std::left << std::setw(20) << t.name_ << std::setw(10) << (t.dirty_ ? "dirty" : "normal") << std::right
+                  << std::setw(8) << t.micros_.size() << std::fixed << std::setprecision(1)
+                  << std::setw(12) << t.quantile(0.5) << std::setw(12) << p99
+                  << std::setw(12) << t.quantile(1.0) << std::endl;
+
+        if(t.errors_ > 0) {
+            COUTRED(t.name_ << ": " << t.errors_ << " calls returned an error");
+            ok = false;
+        }
+
+        if(t.dirtyCalls_ != (t.dirty_ ? t.micros_.size() : 0)) {
+            COUTRED(t.name_ << ": " << t.dirtyCalls_ << " of " << t.micros_.size() << " calls went to a dirty scheduler");
+            ok = false;
+        }
+
+        if(!t.dirty_ && p99 > limitUs) {
+            COUTRED(t.name_ << ": p99 of " << p99 << " us is over the limit");
+            ok = false;
+        }
+    }
+
+    if(!closeOk) {
+        COUTRED("close: didn't run on a dirty scheduler, or didn't close the client");
+        ok = false;
+    }
+
+    enif_free_env(env);
+
+    return ok ? 0 : 1;
+#else
+    COUTRED("tCommand requires compiling with WITH_ERL=1 (see mqtt_bench_make in build_deps.sh)");
+    return 0;
+#endif
+}
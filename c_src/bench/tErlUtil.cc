@@ -0,0 +1,533 @@
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ExceptionUtils.h"
+
+#if WITH_ERL
+#include "ErlUtil.h"
+#include "MosClient.h"
+#include "RowDecoder.h"
+#include "TopicStats.h"
+
+using namespace nifutil;
+#endif
+
+//-----------------------------------------------------------------------
+// Microbenchmarks of the decode path: each STRING_CONV_FN converter
+// in ErlUtil, for typical field values, and the CSV and JSON
+// splitters (MosClient::formatData()), for a range of field counts
+// and payload shapes.  CSV cases run with the schema's specialized
+// decoder (see RowDecoder.h), where it has one, and again through the
+// generic path ("csv_generic").
+//
+// Runs without a VM, against the stub erl_nif API in erlNifStub.cc,
+// so absolute times exclude the VM's own term construction costs;
+// use them to compare changes to our code.
+//
+// Each case is run for growing iteration counts until one run takes
+// at least the minimum time, as Google Benchmark does, and reported
+// as time per op (and bytes/s for payloads).
+//
+// Before timing anything, checks that each specialized decoder gives
+// the same terms, and fails with the same kind of error, as the
+// generic path, on valid and malformed payloads, and exits non-zero
+// if they ever differ.
+//
+// Usage: tErlUtil [--benchmark_filter=substring]
+//                 [--benchmark_min_time=seconds]
+//                 [--benchmark_format=console|json]
+//-----------------------------------------------------------------------
+
+#if WITH_ERL
+struct Case {
+    std::string name_;
+    size_t bytes_;                        // Per op, or 0
+    std::function<void(uint64_t)> run_;   // Run n iterations
+};
+
+// Results are written here, so that nothing is optimized away
+
+static volatile ERL_NIF_TERM sink;
+
+// Terms are made in one env, cleared as a message env would be
+
+static const unsigned CLEAR_EVERY = 1024;
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+//-----------------------------------------------------------------------
+// Converter cases
+//-----------------------------------------------------------------------
+
+static void addConverter(std::vector<Case>& cases, ErlNifEnv* env, std::string fnName,
+                         STRING_CONV_FN_PTR fn, std::string shape, std::string value)
+{
+    Case c;
+    c.name_  = fnName + "/" + shape;
+    c.bytes_ = 0;
+    c.run_   = [env, fn, value](uint64_t n) {
+        for(uint64_t i=0; i < n; i++) {
+            sink = fn(env, value);
+            if(i % CLEAR_EVERY == CLEAR_EVERY-1)
+                enif_clear_env(env);
+        }
+        enif_clear_env(env);
+    };
+
+    cases.push_back(c);
+}
+
+//-----------------------------------------------------------------------
+// Splitter cases.  Shapes are all doubles ("numeric"), a typical
+// sensor mix of every schema type ("mixed"), or 32-character strings
+// ("strings")
+//-----------------------------------------------------------------------
+
+static std::string fieldType(std::string shape, unsigned i)
+{
+    static const char* mixed[] = {"timestamp", "varchar", "double", "sint64", "boolean"};
+
+    if(shape == "numeric")
+        return "double";
+    else if(shape == "strings")
+        return "varchar";
+
+    return mixed[i % 5];
+}
+
+static std::string fieldValue(std::string type, unsigned i)
+{
+    std::ostringstream os;
+
+    if(type == "timestamp")
+        os << 1700000000000ULL + i;
+    else if(type == "sint64")
+        os << -12345 - (int)i;
+    else if(type == "double")
+        os << 20.0 + i * 0.125;
+    else if(type == "boolean")
+        os << (i % 2 ? "true" : "false");
+    else
+        os << "sensor-" << std::setw(25) << std::setfill('x') << i;
+
+    return os.str();
+}
+
+static void addSplitter(std::vector<Case>& cases, ErlNifEnv* env, MosClient* client,
+                        std::string format, std::string shape, unsigned nField, bool specialize=true)
+{
+    std::shared_ptr<MosClient::Topic> topic(new MosClient::Topic());
+    std::ostringstream schema, payload;
+
+    schema << "[";
+    payload << (format == "json" ? "{" : "");
+
+    for(unsigned i=0; i < nField; i++) {
+
+        std::string type  = fieldType(shape, i);
+        std::string value = fieldValue(type, i);
+
+        schema << (i > 0 ? "," : "") << type;
+        topic->convFnVec_.push_back(ErlUtil::getStringConvFn(type));
+
+        if(format == "json") {
+            bool quote = type == "varchar";
+            payload << (i > 0 ? "," : "") << "\"f" << i << "\":" << (quote ? "\"" : "") << value << (quote ? "\"" : "");
+        } else {
+            payload << (i > 0 ? "," : "") << value;
+        }
+    }
+
+    schema << "]";
+    payload << (format == "json" ? "}" : "");
+
+    topic->name_   = "bench/" + format;
+    topic->schema_ = schema.str();
+    topic->format_ = format == "json" ? MosClient::FORMAT_JSON : MosClient::FORMAT_CSV;
+    topic->qos_    = 0;
+    topic->stats_  = std::make_shared<TopicStats>();
+
+    topic->csvDecoder_ = specialize ? RowDecoder::csvDecoderFor(topic->convFnVec_) : 0;
+
+    std::shared_ptr<std::string> text(new std::string(payload.str()));
+
+    std::ostringstream name;
+    name << "formatData/" << format << (specialize ? "" : "_generic") << "/" << shape << "/" << nField;
+
+    Case c;
+    c.name_  = name.str();
+    c.bytes_ = text->size();
+    c.run_   = [env, client, topic, text](uint64_t n) {
+
+        struct mosquitto_message message;
+        memset(&message, 0, sizeof(message));
+        message.topic      = (char*)topic->name_.c_str();
+        message.payload    = (void*)text->c_str();
+        message.payloadlen = text->size();
+
+        for(uint64_t i=0; i < n; i++) {
+            sink = client->formatData(env, &message, *topic);
+            if(i % CLEAR_EVERY == CLEAR_EVERY-1)
+                enif_clear_env(env);
+        }
+        enif_clear_env(env);
+    };
+
+    cases.push_back(c);
+}
+
+//-----------------------------------------------------------------------
+// Decoder checks.  Each payload is decoded with the schema's
+// specialized decoder and through the generic path, and the results
+// compared: the same terms, or the same kind of error, as counted in
+// the topic's TopicStats
+//-----------------------------------------------------------------------
+
+// The tuple decoded, or -1 and the kind of error
+
+static ERL_NIF_TERM decodeWith(ErlNifEnv* env, MosClient* client, MosClient::Topic& topic, const std::string& payload,
+                               int& errorKind)
+{
+    struct mosquitto_message message;
+    memset(&message, 0, sizeof(message));
+    message.topic      = (char*)topic.name_.c_str();
+    message.payload    = (void*)payload.c_str();
+    message.payloadlen = payload.size();
+
+    errorKind = -1;
+
+    try {
+        return client->formatData(env, &message, topic);
+    } catch(...) {
+        for(int kind=0; kind < TopicStats::NERROR; kind++) {
+            if(topic.stats_->errors((TopicStats::Error)kind) > 0)
+                errorKind = kind;
+        }
+
+        // An error that wasn't counted is a mismatch in itself
+
+        if(errorKind < 0)
+            errorKind = TopicStats::NERROR;
+    }
+
+    return 0;
+}
+
+static std::string describe(ErlNifEnv* env, ERL_NIF_TERM term, int errorKind)
+{
+    if(errorKind < 0)
+        return ErlUtil::formatTerm(env, term);
+
+    if(errorKind == TopicStats::NERROR)
+        return "uncounted error";
+
+    return "error (" + TopicStats::errorName((TopicStats::Error)errorKind) + ")";
+}
+
+// Decode each payload both ways.  Returns the number that differ
+
+static unsigned checkDecoder(ErlNifEnv* env, MosClient* client, std::vector<std::string> types,
+                             std::vector<std::string> payloads)
+{
+    MosClient::Topic topic;
+    std::ostringstream schema;
+
+    for(unsigned i=0; i < types.size(); i++) {
+        schema << (i > 0 ? "," : "[") << types[i];
+        topic.convFnVec_.push_back(ErlUtil::getStringConvFn(types[i]));
+    }
+
+    schema << "]";
+
+    topic.name_   = "check/csv";
+    topic.schema_ = schema.str();
+    topic.format_ = MosClient::FORMAT_CSV;
+    topic.qos_    = 0;
+
+    RowDecoder::CSV_FN decoder = RowDecoder::csvDecoderFor(topic.convFnVec_);
+
+    if(!decoder) {
+        COUTRED("No specialized decoder for " << topic.schema_);
+        return 1;
+    }
+
+    unsigned nDiff = 0;
+
+    for(unsigned i=0; i < payloads.size(); i++) {
+
+        int specializedKind, genericKind;
+
+        topic.stats_       = std::make_shared<TopicStats>();
+        topic.csvDecoder_  = decoder;
+        ERL_NIF_TERM specialized = decodeWith(env, client, topic, payloads[i], specializedKind);
+
+        topic.stats_       = std::make_shared<TopicStats>();
+        topic.csvDecoder_  = 0;
+        ERL_NIF_TERM generic = decodeWith(env, client, topic, payloads[i], genericKind);
+
+        bool same = specializedKind == genericKind && (genericKind >= 0 || enif_is_identical(specialized, generic));
+
+        if(!same) {
+            COUTRED(topic.schema_ << " \"" << payloads[i] << "\": specialized gives "
+                    << describe(env, specialized, specializedKind) << ", generic "
+                    << describe(env, generic, genericKind));
+            nDiff++;
+        }
+
+        enif_clear_env(env);
+    }
+
+    return nDiff;
+}
+
+static unsigned checkDecoders(ErlNifEnv* env, MosClient* client)
+{
+    unsigned nDiff = 0;
+
+    std::vector<std::string> mixed = {"timestamp", "double", "varchar"};
+
+    nDiff += checkDecoder(env, client, mixed, {
+            "1700000000123,21.5,sensor-1",
+            "1700000000123,21.5,sensor-1,extra",       // Too many terms
+            "1700000000123,21.5,sensor-1,",            // Trailing comma
+            "1700000000123,21.5",                      // Too few
+            "",
+            ",,",
+            "abc,21.5,sensor-1",                       // Bad fields
+            "1700000000123,21.5x,sensor-1",
+            "1700000000123,,sensor-1",
+            "-1,21.5,sensor-1",
+            "abc,21.5,sensor-1,extra",                 // Bad field and too many
+            "abc,21.5",                                // Bad field and too few
+            " 1700000000123,21.5,sensor-1",            // Padding
+            "1700000000123, 21.5 ,sensor-1",
+            "1700000000123,21.5, sensor-1 ",
+        });
+
+    std::vector<std::string> ints = {"sint64", "boolean", "sint64"};
+
+    nDiff += checkDecoder(env, client, ints, {
+            "-12,true,34",
+            "-12, true,34",                            // Padded booleans
+            "-12,true ,34",
+            "-12,  false  ,34",
+            "-12,TRUE,34",
+            "-12,1,34",
+            "-12,truex,34",
+            "-12,,34",
+            "+12,false,34",
+            "9223372036854775807,false,-9223372036854775808",
+            "9223372036854775808,false,0",             // Overflow
+            "12.5,false,0",
+            "-12,true,34,",                            // Trailing comma
+            "-12,true,34,56",                          // Too many terms
+            "-12,true",                                // Too few
+        });
+
+    std::vector<std::string> booleans(4, "boolean");
+
+    nDiff += checkDecoder(env, client, booleans, {
+            "true,false,true,false",
+            " true,false , true ,  false",
+            "true,false,true,false,",
+            "true,false,true",
+            "true,false,true,false,true",
+            "true,false,yes,false",
+            "true,false,,false",
+        });
+
+    std::vector<std::string> doubles(16, "double");
+    std::string row;
+
+    for(unsigned i=0; i < doubles.size(); i++)
+        row += (i > 0 ? "," : "") + fieldValue("double", i);
+
+    nDiff += checkDecoder(env, client, doubles, {
+            row,
+            row + ",",
+            row + ",1.0",
+            row.substr(0, row.rfind(',')),
+            row.substr(0, row.rfind(',')) + ",abc",
+            "abc" + row.substr(row.find(',')),
+            row.substr(0, row.rfind(',')) + ",1e400",
+            row.substr(0, row.rfind(',')) + ",nan",
+            row.substr(0, row.rfind(',')) + ", 6.5 ",
+        });
+
+    std::vector<std::string> strings(3, "varchar");
+
+    nDiff += checkDecoder(env, client, strings, {
+            "a,b,c",
+            ",,",
+            "a,b,c,",
+            "a,b",
+            " a , b , c ",
+        });
+
+    return nDiff;
+}
+
+//-----------------------------------------------------------------------
+// Time a case, growing the iteration count until a run takes at least
+// minTime.  Returns seconds per op
+//-----------------------------------------------------------------------
+
+static double timeCase(Case& c, double minTime, uint64_t& iterations)
+{
+    uint64_t n = 1;
+
+    for(;;) {
+
+        double start = nowSeconds();
+        c.run_(n);
+        double elapsed = nowSeconds() - start;
+
+        if(elapsed >= minTime || n >= 1000000000ULL) {
+            iterations = n;
+            return elapsed / n;
+        }
+
+        // Aim for 1.4x minTime, growing by at least 2x and at most 10x
+
+        double factor = elapsed > 0 ? 1.4 * minTime / elapsed : 10;
+        factor = factor < 2 ? 2 : (factor > 10 ? 10 : factor);
+
+        n = (uint64_t)(n * factor);
+    }
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#if WITH_ERL
+    std::string filter, format = "console";
+    double minTime = 0.5;
+
+    for(int i=1; i < argc; i++) {
+
+        std::string arg = argv[i];
+
+        if(arg.compare(0, 19, "--benchmark_filter=") == 0) {
+            filter = arg.substr(19);
+        } else if(arg.compare(0, 21, "--benchmark_min_time=") == 0) {
+            minTime = atof(arg.substr(21).c_str());
+        } else if(arg.compare(0, 19, "--benchmark_format=") == 0) {
+            format = arg.substr(19);
+        } else {
+            COUTRED("Unrecognized option: " << arg);
+            return 1;
+        }
+    }
+
+    ErlNifEnv* env = enif_alloc_env();
+    MosClient client;
+    std::vector<Case> cases;
+
+    unsigned nDiff = checkDecoders(env, &client);
+
+    if(nDiff > 0) {
+        COUTRED(nDiff << " payloads decoded differently by the specialized and generic CSV paths");
+        enif_free_env(env);
+        return 1;
+    }
+
+    addConverter(cases, env, "stringToInt64Term",   ErlUtil::stringToInt64Term,   "small",    "7");
+    addConverter(cases, env, "stringToInt64Term",   ErlUtil::stringToInt64Term,   "medium",   "-1234567");
+    addConverter(cases, env, "stringToInt64Term",   ErlUtil::stringToInt64Term,   "max",      "9223372036854775807");
+    addConverter(cases, env, "stringToUint64Term",  ErlUtil::stringToUint64Term,  "ms_epoch", "1700000000123");
+    addConverter(cases, env, "stringToUint64Term",  ErlUtil::stringToUint64Term,  "ns_epoch", "1700000000123456789");
+    addConverter(cases, env, "epochSecondsToTimestampTerm", ErlUtil::epochSecondsToTimestampTerm, "fraction", "1700000000.123");
+    addConverter(cases, env, "epochNanosToTimestampTerm",   ErlUtil::epochNanosToTimestampTerm,   "ns_epoch", "1700000000123456789");
+    addConverter(cases, env, "isoToTimestampTerm",          ErlUtil::isoToTimestampTerm,          "rfc3339",  "2026-10-17T12:00:00.123Z");
+    addConverter(cases, env, "isoToTimestampTerm",          ErlUtil::isoToTimestampTerm,          "offset",   "2026-10-17T12:00:00+02:00");
+    addConverter(cases, env, "stringToDoubleTerm",  ErlUtil::stringToDoubleTerm,  "short",    "3.5");
+    addConverter(cases, env, "stringToDoubleTerm",  ErlUtil::stringToDoubleTerm,  "long",     "-123.4567890123");
+    addConverter(cases, env, "stringToDoubleTerm",  ErlUtil::stringToDoubleTerm,  "exponent", "6.02214076e23");
+    addConverter(cases, env, "stringToBooleanTerm", ErlUtil::stringToBooleanTerm, "bare",     "true");
+    addConverter(cases, env, "stringToBooleanTerm", ErlUtil::stringToBooleanTerm, "padded",   "  false ");
+    addConverter(cases, env, "stringToBinaryTerm",  ErlUtil::stringToBinaryTerm,  "8",        std::string(8, 'x'));
+    addConverter(cases, env, "stringToBinaryTerm",  ErlUtil::stringToBinaryTerm,  "64",       std::string(64, 'x'));
+    addConverter(cases, env, "stringToBinaryTerm",  ErlUtil::stringToBinaryTerm,  "512",      std::string(512, 'x'));
+
+    const char* formats[] = {"csv", "json"};
+    const char* shapes[]  = {"numeric", "mixed", "strings"};
+    unsigned nFields[]    = {1, 3, 4, 16, 64};
+
+    for(unsigned iFormat=0; iFormat < 2; iFormat++)
+        for(unsigned iShape=0; iShape < 3; iShape++)
+            for(unsigned iField=0; iField < 5; iField++)
+                addSplitter(cases, env, &client, formats[iFormat], shapes[iShape], nFields[iField]);
+
+    for(unsigned iShape=0; iShape < 3; iShape++)
+        for(unsigned iField=0; iField < 5; iField++)
+            addSplitter(cases, env, &client, "csv", shapes[iShape], nFields[iField], false);
+
+    //------------------------------------------------------------
+    // Run and report
+    //------------------------------------------------------------
+
+    bool json = format == "json";
+
+    if(json)
+        std::cout << "{\"benchmarks\": [" << std::endl;
+    else
+        std::cout << std::left << std::setw(40) << "Benchmark" << std::right << std::setw(14) << "Time"
+                  << std::setw(14) << "Iterations" << std::setw(16) << "Throughput" << std::endl
+                  << std::string(84, '-') << std::endl;
+
+    bool first = true;
+
+    for(unsigned i=0; i < cases.size(); i++) {
+
+        Case& c = cases[i];
+
+        if(!filter.empty() && c.name_.find(filter) == std::string::npos)
+            continue;
+
+        uint64_t iterations = 0;
+        double perOp = timeCase(c, minTime, iterations);
+        double bytesPerSec = c.bytes_ > 0 ? c.bytes_ / perOp : 0;
+
+        if(json) {
+            std::cout << (first ? "" : ",\n") << "  {\"name\": \"" << c.name_ << "\", \"iterations\": " << iterations
+                      << ", \"real_time_ns\": " << perOp * 1e9;
+            if(c.bytes_ > 0)
+                std::cout << ", \"bytes_per_second\": " << bytesPerSec;
+            std::cout << "}";
+        } else {
+            std::ostringstream time, rate;
+            time << std::fixed << std::setprecision(1) << perOp * 1e9 << " ns";
+            if(c.bytes_ > 0)
+                rate << std::fixed << std::setprecision(1) << bytesPerSec / (1024 * 1024) << " MiB/s";
+
+            std::cout << std::left << std::setw(40) << c.name_ << std::right << std::setw(14) << time.str()
+                      << std::setw(14) << iterations << std::setw(16) << rate.str() << std::endl;
+        }
+
+        first = false;
+    }
+
+    if(json)
+        std::cout << std::endl << "]}" << std::endl;
+
+    enif_free_env(env);
+#else
+    COUTRED("tErlUtil requires compiling with WITH_ERL=1 (see mqtt_bench_make in build_deps.sh)");
+#endif
+
+    return 0;
+}
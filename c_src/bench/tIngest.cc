@@ -0,0 +1,561 @@
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include <mosquitto.h>
+
+#include "ExceptionUtils.h"
+#include "FakeBroker.h"
+#include "Histogram.h"
+#include "MosClient.h"
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// End-to-end ingest benchmark.  Publishes synthetic CSV or JSON
+// messages through a broker to a MosClient, with and without the
+// store, and reports as JSON, per run:
+//
+//   msgs_per_sec            -- receipt throughput
+//   latency_us              -- publish to processed (and stored), from
+//                              a send timestamp in each payload
+//   ingest_cpu_ns_per_msg   -- CPU of the client's comms thread
+//   process_cpu_ns_per_msg  -- CPU of the whole process, publisher
+//                              included
+//
+// Unless --host is given, a broker is started on --port for the
+// duration: by default the in-process FakeBroker (on any free port),
+// which needs nothing installed, or else the executable named by
+// --broker (on port 18830).
+//
+// With the fake broker, faults can be injected while messages are
+// flowing: a fixed delivery latency, a per-subscriber rate limit (and
+// queue limit, past which the broker drops messages), or dropping
+// the client's connection every N messages, so that reconnect and
+// backpressure costs show up in the results.  Each run then also
+// reports the broker's own counts.
+//
+// Usage: tIngest [--messages N] [--rate msgs/s, 0 = flat out]
+//                [--size payload bytes] [--topics N] [--format csv|json]
+//                [--qos 0|1|2] [--store 0|1|both] [--host H] [--port P]
+//                [--broker fake|mosquitto]
+//                [--latency-ms ms] [--slow-bps bytes/s]
+//                [--max-queued bytes] [--disconnect-every N]
+//-----------------------------------------------------------------------
+
+static const std::string CLIENT_NAME = "tIngest";
+static const std::string PROBE_TOPIC = "bench/probe";
+
+struct Options {
+    unsigned messages_;
+    unsigned rate_;
+    unsigned size_;
+    unsigned topics_;
+    std::string format_;
+    int qos_;
+    std::string store_;
+    std::string host_;
+    int port_;
+    std::string broker_;
+    unsigned latencyMs_;
+    unsigned slowBps_;
+    unsigned maxQueued_;
+    unsigned disconnectEvery_;
+    FakeBroker* fake_;
+};
+
+// What the client's comms thread sees of one run
+
+struct Run {
+    unsigned expected_;
+    std::atomic<unsigned> received_;
+    std::atomic<bool> probed_;
+    Histogram latency_;
+    double firstWall_;
+    double lastWall_;
+    double firstCpu_;
+    double lastCpu_;
+};
+
+static double clockSeconds(clockid_t id)
+{
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static uint64_t nowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static double processCpuSeconds()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec/1e6 + ru.ru_stime.tv_sec + ru.ru_stime.tv_usec/1e6;
+}
+
+//-----------------------------------------------------------------------
+// Called on the comms thread for every message.  Payloads start with
+// their send time in ns (after '{"ts":' for JSON).  The thread's CPU
+// clock is read only every 1024 messages, since reading it is a
+// system call
+//-----------------------------------------------------------------------
+
+static void onMessage(const struct mosquitto_message* message, void* arg)
+{
+    Run* run = (Run*)arg;
+
+    if(strncmp(message->topic, "bench/", 6) != 0)
+        return;
+
+    if(PROBE_TOPIC == message->topic) {
+        run->probed_.store(true);
+        return;
+    }
+
+    const char* ptr = (const char*)message->payload;
+    while(*ptr && (*ptr < '0' || *ptr > '9'))
+        ++ptr;
+
+    uint64_t sent = strtoull(ptr, NULL, 10);
+    uint64_t now  = nowNs();
+
+    run->latency_.record(now > sent ? now - sent : 0);
+
+    unsigned n = run->received_.fetch_add(1) + 1;
+
+    if(n == 1) {
+        run->firstWall_ = clockSeconds(CLOCK_MONOTONIC);
+        run->firstCpu_  = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    }
+
+    if(n == run->expected_ || (n & 1023) == 0) {
+        run->lastWall_ = clockSeconds(CLOCK_MONOTONIC);
+        run->lastCpu_  = clockSeconds(CLOCK_THREAD_CPUTIME_ID);
+    }
+}
+
+//-----------------------------------------------------------------------
+// Broker management
+//-----------------------------------------------------------------------
+
+static bool canConnect(int port)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(port);
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    bool ok = connect(fd, (struct sockaddr*)&sin, sizeof(sin)) == 0;
+    close(fd);
+
+    return ok;
+}
+
+static pid_t startBroker(std::string broker, int port)
+{
+    if(canConnect(port))
+        ThrowRuntimeError("Something is already listening on port " << port << ": use --host to benchmark against it");
+
+    pid_t pid = fork();
+
+    if(pid < 0)
+        ThrowRuntimeError("Unable to fork: " << strerror(errno));
+
+    if(pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, 1);
+        dup2(devNull, 2);
+
+        std::ostringstream os;
+        os << port;
+        execlp(broker.c_str(), broker.c_str(), "-p", os.str().c_str(), (char*)NULL);
+        _exit(127);
+    }
+
+    for(unsigned i=0; i < 100; i++) {
+
+        if(canConnect(port))
+            return pid;
+
+        int status;
+        if(waitpid(pid, &status, WNOHANG) == pid)
+            ThrowRuntimeError("Unable to start broker '" << broker << "'");
+
+        usleep(50000);
+    }
+
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    ThrowRuntimeError("Broker '" << broker << "' did not start listening on port " << port);
+
+    return 0;
+}
+
+static void removeDir(std::string dir)
+{
+    DIR* dp = opendir(dir.c_str());
+
+    if(!dp)
+        return;
+
+    while(struct dirent* ent = readdir(dp)) {
+        std::string name = ent->d_name;
+        if(name != "." && name != "..")
+            unlink((dir + "/" + name).c_str());
+    }
+
+    closedir(dp);
+    rmdir(dir.c_str());
+}
+
+// A payload of about opts.size_ bytes, padded with a filler field
+
+static std::string payloadFor(Options& opts, uint64_t sentNs, unsigned seq)
+{
+    std::ostringstream os;
+
+    if(opts.format_ == "json")
+        os << "{\"ts\":" << sentNs << ",\"seq\":" << seq << ",\"value\":" << seq % 1000 / 10.0 << ",\"pad\":\"";
+    else
+        os << sentNs << "," << seq << "," << seq % 1000 / 10.0 << ",";
+
+    std::string payload = os.str();
+    size_t tail = opts.format_ == "json" ? 2 : 0;
+
+    if(payload.size() + tail < opts.size_)
+        payload.append(opts.size_ - payload.size() - tail, 'x');
+
+    if(opts.format_ == "json")
+        payload += "\"}";
+
+    return payload;
+}
+
+//-----------------------------------------------------------------------
+// One run: start a client, subscribe it (via its command topic, as
+// a stand-alone client is), publish, and wait for everything to
+// arrive, or for arrivals to stop for 2 seconds
+//-----------------------------------------------------------------------
+
+static std::string runOnce(Options& opts, bool store)
+{
+    Run* run = new Run();
+    run->expected_ = opts.messages_;
+    run->received_.store(0);
+    run->probed_.store(false);
+    run->firstWall_ = run->lastWall_ = 0;
+    run->firstCpu_  = run->lastCpu_  = 0;
+
+    std::string name = CLIENT_NAME + (store ? "_store" : "");
+    removeDir("/tmp/" + name);
+
+    MosClient* client = new MosClient();
+    client->setOption("name", name);
+    client->setOption("host", opts.host_);
+    client->setOption("port", opts.port_);
+    client->setOption("store", store);
+    client->setMessageHook(onMessage, run);
+    client->startCommsLoop();
+
+    struct mosquitto* pub = mosquitto_new(NULL, true, NULL);
+
+    if(!pub || mosquitto_connect(pub, opts.host_.c_str(), opts.port_, 60) != MOSQ_ERR_SUCCESS)
+        ThrowRuntimeError("Unable to connect the publisher to " << opts.host_ << ":" << opts.port_);
+
+    mosquitto_loop_start(pub);
+
+    // Subscribe, and wait until a probe message makes it through
+
+    std::ostringstream command;
+    command << "{\"command\":\"subscribe\",\"topic\":\"bench/#\",\"qos\":\"" << opts.qos_ << "\"}";
+    std::string commandTopic = name + "/command";
+
+    for(unsigned i=0; !run->probed_.load(); i++) {
+
+        if(i == 100)
+            ThrowRuntimeError("Timed out waiting for the client to subscribe");
+
+        mosquitto_publish(pub, NULL, commandTopic.c_str(), command.str().size(), command.str().data(), 0, false);
+        mosquitto_publish(pub, NULL, PROBE_TOPIC.c_str(), 1, "0", 0, false);
+        usleep(100000);
+    }
+
+    std::vector<std::string> topics(opts.topics_);
+    for(unsigned i=0; i < opts.topics_; i++) {
+        std::ostringstream os;
+        os << "bench/device" << i;
+        topics[i] = os.str();
+    }
+
+    // Faults apply to the messages only, not to subscribing
+
+    uint64_t connects = 0, disconnects = 0, delivered = 0, dropped = 0;
+
+    if(opts.fake_) {
+        opts.fake_->setLatencyMs(opts.latencyMs_);
+        opts.fake_->setSlowConsumer(opts.slowBps_, opts.maxQueued_);
+        opts.fake_->setDisconnectEvery(opts.disconnectEvery_);
+
+        connects    = opts.fake_->connects();
+        disconnects = opts.fake_->disconnects();
+        delivered   = opts.fake_->delivered();
+        dropped     = opts.fake_->dropped();
+    }
+
+    // Publish, paced to the requested rate
+
+    double cpuStart = processCpuSeconds();
+    uint64_t start  = nowNs();
+    uint64_t interval = opts.rate_ > 0 ? 1000000000ULL / opts.rate_ : 0;
+
+    for(unsigned i=0; i < opts.messages_; i++) {
+
+        if(interval > 0) {
+            uint64_t due = start + i * interval;
+            uint64_t now = nowNs();
+
+            if(due > now) {
+                struct timespec delay = {(time_t)((due - now) / 1000000000), (long)((due - now) % 1000000000)};
+                nanosleep(&delay, 0);
+            }
+        }
+
+        std::string payload = payloadFor(opts, nowNs(), i);
+        const std::string& topic = topics[i % topics.size()];
+
+        mosquitto_publish(pub, NULL, topic.c_str(), payload.size(), payload.data(), opts.qos_, false);
+    }
+
+    unsigned lastSeen = 0;
+    double lastChange = clockSeconds(CLOCK_MONOTONIC);
+
+    while(run->received_.load() < opts.messages_) {
+
+        usleep(10000);
+
+        unsigned seen = run->received_.load();
+        double now = clockSeconds(CLOCK_MONOTONIC);
+
+        if(seen != lastSeen) {
+            lastSeen   = seen;
+            lastChange = now;
+        } else if(now - lastChange > 2.0) {
+            break;
+        }
+    }
+
+    double cpu = processCpuSeconds() - cpuStart;
+
+    if(opts.fake_) {
+        opts.fake_->setLatencyMs(0);
+        opts.fake_->setSlowConsumer(0, 0);
+        opts.fake_->setDisconnectEvery(0);
+
+        connects    = opts.fake_->connects()    - connects;
+        disconnects = opts.fake_->disconnects() - disconnects;
+        delivered   = opts.fake_->delivered()   - delivered;
+        dropped     = opts.fake_->dropped()     - dropped;
+    }
+
+    mosquitto_disconnect(pub);
+    mosquitto_loop_stop(pub, false);
+    mosquitto_destroy(pub);
+
+    client->stopCommsLoop();
+    delete client;
+
+    removeDir("/tmp/" + name);
+
+    //------------------------------------------------------------
+    // Report
+    //------------------------------------------------------------
+
+    unsigned received = run->received_.load();
+    double seconds = run->lastWall_ - run->firstWall_;
+    double ingestCpu = run->lastCpu_ - run->firstCpu_;
+
+    std::ostringstream os;
+
+    os << "    {\"store\": " << (store ? "true" : "false")
+       << ", \"format\": \"" << opts.format_ << "\""
+       << ", \"qos\": " << opts.qos_
+       << ", \"topics\": " << opts.topics_
+       << ", \"payload_bytes\": " << opts.size_
+       << ", \"rate\": " << opts.rate_
+       << ", \"sent\": " << opts.messages_
+       << ", \"received\": " << received
+       << ", \"lost\": " << opts.messages_ - received
+       << ", \"seconds\": " << seconds
+       << ", \"msgs_per_sec\": " << (seconds > 0 ? received / seconds : 0)
+       << ", \"latency_us\": {\"p50\": " << run->latency_.quantile(0.50)/1e3
+       << ", \"p99\": "  << run->latency_.quantile(0.99)/1e3
+       << ", \"p999\": " << run->latency_.quantile(0.999)/1e3
+       << ", \"max\": "  << run->latency_.max()/1e3 << "}"
+       << ", \"ingest_cpu_ns_per_msg\": "  << (received > 1 ? ingestCpu * 1e9 / (received - 1) : 0)
+       << ", \"process_cpu_ns_per_msg\": " << (received > 0 ? cpu * 1e9 / received : 0);
+
+    if(opts.fake_)
+        os << ", \"faults\": {\"latency_ms\": " << opts.latencyMs_
+           << ", \"slow_bps\": " << opts.slowBps_
+           << ", \"max_queued\": " << opts.maxQueued_
+           << ", \"disconnect_every\": " << opts.disconnectEvery_ << "}"
+           << ", \"broker\": {\"connects\": " << connects
+           << ", \"disconnects\": " << disconnects
+           << ", \"delivered\": " << delivered
+           << ", \"dropped\": " << dropped << "}";
+
+    os << "}";
+
+    delete run;
+
+    return os.str();
+}
+
+int main(int argc, char** argv)
+{
+    Options opts;
+    opts.messages_ = 200000;
+    opts.rate_     = 0;
+    opts.size_     = 100;
+    opts.topics_   = 10;
+    opts.format_   = "csv";
+    opts.qos_      = 0;
+    opts.store_    = "both";
+    opts.port_     = 0;
+    opts.broker_   = "fake";
+
+    opts.latencyMs_       = 0;
+    opts.slowBps_         = 0;
+    opts.maxQueued_       = 0;
+    opts.disconnectEvery_ = 0;
+    opts.fake_            = 0;
+
+    for(int i=1; i+1 < argc; i += 2) {
+
+        std::string flag = argv[i], val = argv[i+1];
+
+        if(flag == "--messages") {
+            opts.messages_ = atoi(val.c_str());
+        } else if(flag == "--rate") {
+            opts.rate_ = atoi(val.c_str());
+        } else if(flag == "--size") {
+            opts.size_ = atoi(val.c_str());
+        } else if(flag == "--topics") {
+            opts.topics_ = atoi(val.c_str()) > 0 ? atoi(val.c_str()) : 1;
+        } else if(flag == "--format") {
+            opts.format_ = val;
+        } else if(flag == "--qos") {
+            opts.qos_ = atoi(val.c_str());
+        } else if(flag == "--store") {
+            opts.store_ = val;
+        } else if(flag == "--host") {
+            opts.host_ = val;
+        } else if(flag == "--port") {
+            opts.port_ = atoi(val.c_str());
+        } else if(flag == "--broker") {
+            opts.broker_ = val;
+        } else if(flag == "--latency-ms") {
+            opts.latencyMs_ = atoi(val.c_str());
+        } else if(flag == "--slow-bps") {
+            opts.slowBps_ = atoi(val.c_str());
+        } else if(flag == "--max-queued") {
+            opts.maxQueued_ = atoi(val.c_str());
+        } else if(flag == "--disconnect-every") {
+            opts.disconnectEvery_ = atoi(val.c_str());
+        } else {
+            COUTRED("Unrecognized option: " << flag);
+            return 1;
+        }
+    }
+
+    bool faults = opts.latencyMs_ > 0 || opts.slowBps_ > 0 || opts.maxQueued_ > 0 || opts.disconnectEvery_ > 0;
+
+    if(faults && (!opts.host_.empty() || opts.broker_ != "fake")) {
+        COUTRED("Fault options require the fake broker");
+        return 1;
+    }
+
+    pid_t brokerPid = 0;
+    FakeBroker fake;
+
+    try {
+
+        if(opts.host_.empty() && opts.broker_ == "fake") {
+            fake.start(opts.port_);
+            opts.fake_ = &fake;
+            opts.port_ = fake.port();
+            opts.host_ = "127.0.0.1";
+        } else if(opts.host_.empty()) {
+            opts.port_ = opts.port_ > 0 ? opts.port_ : 18830;
+            brokerPid  = startBroker(opts.broker_, opts.port_);
+            opts.host_ = "127.0.0.1";
+        } else if(opts.port_ == 0) {
+            opts.port_ = 1883;
+        }
+
+        mosquitto_lib_init();
+
+        std::vector<bool> stores;
+
+        if(opts.store_ != "1")
+            stores.push_back(false);
+
+#if WITH_LEVELDB
+        if(opts.store_ != "0")
+            stores.push_back(true);
+#else
+        if(opts.store_ == "1")
+            ThrowRuntimeError("--store 1 requires compiling with MQTT_USE_LEVELDB=1");
+#endif
+
+        std::cout << "{\"benchmark\": \"tIngest\", \"broker\": \"" << opts.host_ << ":" << opts.port_ << "\", \"runs\": [" << std::endl;
+
+        for(unsigned i=0; i < stores.size(); i++)
+            std::cout << runOnce(opts, stores[i]) << (i+1 < stores.size() ? "," : "") << std::endl;
+
+        std::cout << "]}" << std::endl;
+
+        mosquitto_lib_cleanup();
+
+    } catch(std::runtime_error& err) {
+        COUTRED(err.what());
+
+        if(brokerPid > 0) {
+            kill(brokerPid, SIGTERM);
+            waitpid(brokerPid, NULL, 0);
+        }
+
+        return 1;
+    }
+
+    if(brokerPid > 0) {
+        kill(brokerPid, SIGTERM);
+        waitpid(brokerPid, NULL, 0);
+    }
+
+    return 0;
+}
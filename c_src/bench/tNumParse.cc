@@ -0,0 +1,500 @@
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ExceptionUtils.h"
+#include "NumParse.h"
+#include "TimeParse.h"
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// Check NumParse against strtoll()/strtoull()/strtod(), then time both
+// on typical field values.
+//
+// The check parses nCheck random values of each kind, and a list of
+// edge cases, and requires the same value (bit for bit, for doubles)
+// and the same number of characters consumed as the libc function,
+// or failure where that reports a range error.  Doubles are printed
+// both with 17 significant digits and in their shortest round-trip
+// form, and random decimal strings of up to 25 digits with exponents
+// spanning the whole double range (and beyond) are parsed as well.
+//
+// TimeParse is checked too: ISO-8601 edge cases (extended and basic
+// formats, offsets, fractions, leap days and seconds, and times before
+// the epoch, which are rejected) and epoch counts in each unit against
+// known values, daysFromCivil() against timegm() for every day from
+// 1600 to 2400, and nCheck random timestamps formatted with gmtime_r()
+// and an offset, and parsed back.
+//
+// Usage: tNumParse [nCheck] [nTime]
+//-----------------------------------------------------------------------
+
+static unsigned nFail = 0;
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static uint64_t nextRandom(uint64_t& state)
+{
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return state;
+}
+
+static void fail(std::string kind, const std::string& str, std::string detail)
+{
+    if(nFail++ < 20)
+        COUTRED(kind << " '" << str << "': " << detail);
+}
+
+//-----------------------------------------------------------------------
+// Checks
+//-----------------------------------------------------------------------
+
+static void checkDouble(const std::string& str)
+{
+    errno = 0;
+    char* eptr = 0;
+    double expected = strtod(str.c_str(), &eptr);
+    size_t expectedLen = eptr - str.c_str();
+
+    // We reject overflow; underflow is fine
+
+    if(std::isinf(expected) || isnan(expected))
+        expectedLen = 0;
+
+    double val = 0;
+    size_t len = NumParse::parseDouble(str.data(), str.size(), val);
+
+    if(len != expectedLen) {
+        std::ostringstream os;
+        os << "consumed " << len << " characters, expected " << expectedLen;
+        fail("double", str, os.str());
+    } else if(len > 0 && memcmp(&val, &expected, sizeof(val)) != 0) {
+        std::ostringstream os;
+        os << std::setprecision(17) << "got " << val << ", expected " << expected;
+        fail("double", str, os.str());
+    }
+}
+
+static void checkInt64(const std::string& str)
+{
+    errno = 0;
+    char* eptr = 0;
+    long long expected = strtoll(str.c_str(), &eptr, 10);
+    size_t expectedLen = errno == ERANGE ? 0 : eptr - str.c_str();
+
+    int64_t val = 0;
+    size_t len = NumParse::parseInt64(str.data(), str.size(), val);
+
+    if(len != expectedLen || (len > 0 && val != expected)) {
+        std::ostringstream os;
+        os << "got " << val << " (" << len << " characters), expected " << expected << " (" << expectedLen << ")";
+        fail("int64", str, os.str());
+    }
+}
+
+static void checkUint64(const std::string& str)
+{
+    errno = 0;
+    char* eptr = 0;
+    unsigned long long expected = strtoull(str.c_str(), &eptr, 10);
+    size_t expectedLen = errno == ERANGE ? 0 : eptr - str.c_str();
+
+    // strtoull() negates negative numbers; we reject them
+
+    size_t first = str.find_first_not_of(" \t\n\r\f\v");
+
+    if(first != std::string::npos && str[first] == '-')
+        expectedLen = 0;
+
+    uint64_t val = 0;
+    size_t len = NumParse::parseUint64(str.data(), str.size(), val);
+
+    if(len != expectedLen || (len > 0 && val != expected)) {
+        std::ostringstream os;
+        os << "got " << val << " (" << len << " characters), expected " << expected << " (" << expectedLen << ")";
+        fail("uint64", str, os.str());
+    }
+}
+
+static std::string shortest(double val)
+{
+    char buf[32];
+
+    for(int precision=1; precision <= 17; precision++) {
+        snprintf(buf, sizeof(buf), "%.*g", precision, val);
+        if(strtod(buf, NULL) == val)
+            break;
+    }
+
+    return buf;
+}
+
+static void check(unsigned nCheck)
+{
+    static const char* edges[] = {
+        "0", "-0", "+0", "0.0", "00012", "1", "-1", ".5", "5.", ".", "-.", "e5", "1e", "1e+", "1e-x",
+        "  3.5", "\t-2.25\r\n", "3.5x", "1,2", "12.5.6", "1E3", "1e-3", "-1.5e+10",
+        "9007199254740992", "9007199254740993", "9007199254740995", "18014398509481985",
+        "2.2250738585072011e-308", "2.2250738585072014e-308", "4.9e-324", "2.4703282292062328e-324",
+        "2.4703282292062327e-324", "1e-400", "1.7976931348623157e308", "1.7976931348623158e308",
+        "1.7976931348623159e308", "1e309", "123456789012345678901234567890",
+        "0.000000000000000000000000000000000000000000001", "7.3177701707893310e+15",
+        "9223372036854775807", "9223372036854775808", "-9223372036854775808", "-9223372036854775809",
+        "18446744073709551615", "18446744073709551616", "99999999999999999999", "00000000000000000000000001",
+        "1700000000123", "1700000000123456789", "+42", "-0042", ""
+    };
+
+    for(unsigned i=0; i < sizeof(edges)/sizeof(edges[0]); i++) {
+        checkDouble(edges[i]);
+        checkInt64(edges[i]);
+        checkUint64(edges[i]);
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    char buf[64];
+
+    for(unsigned i=0; i < nCheck; i++) {
+
+        // Any finite double, as printed by us and by erlang
+
+        uint64_t bits = nextRandom(state);
+        double val;
+        memcpy(&val, &bits, sizeof(val));
+
+        if(!std::isinf(val) && !isnan(val)) {
+            snprintf(buf, sizeof(buf), "%.17g", val);
+            checkDouble(buf);
+            checkDouble(shortest(val));
+        }
+
+        // Random decimal strings
+
+        uint64_t r = nextRandom(state);
+        unsigned nDigit = 1 + r % 25;
+        unsigned point  = (r >> 8) % (nDigit + 1);
+        int exponent    = (int)((r >> 16) % 800) - 400;
+
+        std::string str = (r >> 32) & 1 ? "-" : "";
+
+        for(unsigned iDigit=0; iDigit < nDigit; iDigit++) {
+            if(iDigit == point)
+                str += ".";
+            str += (char)('0' + nextRandom(state) % 10);
+        }
+
+        if((r >> 33) & 1) {
+            std::ostringstream os;
+            os << "e" << exponent;
+            str += os.str();
+        }
+
+        checkDouble(str);
+
+        // Integers of every length, signed and unsigned
+
+        uint64_t ival  = nextRandom(state) >> (nextRandom(state) % 64);
+        bool negative  = nextRandom(state) & 1;
+
+        snprintf(buf, sizeof(buf), "%s%llu", negative ? "-" : "", (unsigned long long)ival);
+        checkInt64(buf);
+        checkUint64(buf);
+    }
+}
+
+//-----------------------------------------------------------------------
+// TimeParse checks
+//-----------------------------------------------------------------------
+
+// A string, and the milliseconds and number of characters it should
+// parse to (0 characters if it should be rejected)
+
+struct TimeCase {
+    const char* str_;
+    uint64_t ms_;
+    size_t len_;
+};
+
+static void checkIso8601(const std::string& str, uint64_t expected, size_t expectedLen)
+{
+    uint64_t ms = 0;
+    size_t len = TimeParse::parseIso8601(str.data(), str.size(), ms);
+
+    if(len != expectedLen || (len > 0 && ms != expected)) {
+        std::ostringstream os;
+        os << "got " << ms << " (" << len << " characters), expected " << expected << " (" << expectedLen << ")";
+        fail("iso8601", str, os.str());
+    }
+}
+
+static void checkEpoch(const std::string& str, TimeParse::Unit unit, uint64_t expected, size_t expectedLen)
+{
+    uint64_t ms = 0;
+    size_t len = TimeParse::parseEpoch(str.data(), str.size(), unit, ms);
+
+    if(len != expectedLen || (len > 0 && ms != expected)) {
+        std::ostringstream os;
+        os << "unit " << unit << ": got " << ms << " (" << len << " characters), expected " << expected
+           << " (" << expectedLen << ")";
+        fail("epoch", str, os.str());
+    }
+}
+
+static void checkTime(unsigned nCheck)
+{
+    static const TimeCase isoCases[] = {
+
+        // Extended and basic formats, and their separators
+
+        {"2026-10-17T12:00:00Z",            1792238400000ULL, 20},
+        {"2026-10-17t12:00:00z",            1792238400000ULL, 20},
+        {"2026-10-17 12:00:00Z",            1792238400000ULL, 20},
+        {"2026-10-17T12:00Z",               1792238400000ULL, 17},
+        {"2026-10-17T12:00:00",             1792238400000ULL, 19},
+        {"20261017T120000Z",                1792238400000ULL, 16},
+        {"20261017T1200Z",                  1792238400000ULL, 14},
+        {"2026-10-17",                      1792195200000ULL, 10},
+        {"20261017",                        1792195200000ULL,  8},
+        {"  2026-10-17T12:00:00Z",          1792238400000ULL, 22},
+        {"2026-10-17T12:00:00Zjunk",        1792238400000ULL, 20},
+        {"2026-10-17 x",                    1792195200000ULL, 10},
+
+        // Fractions, with either separator, truncated to ms
+
+        {"2026-10-17T12:00:00.123Z",        1792238400123ULL, 24},
+        {"2026-10-17T12:00:00,123Z",        1792238400123ULL, 24},
+        {"2026-10-17T12:00:00.1239999Z",    1792238400123ULL, 28},
+        {"2026-10-17T12:00:00.5",           1792238400500ULL, 21},
+        {"2026-10-17T12:00:00.Z",           1792238400000ULL, 19},
+
+        // Offsets
+
+        {"2026-10-17T12:00:00+02:00",       1792231200000ULL, 25},
+        {"2026-10-17T12:00:00+0200",        1792231200000ULL, 24},
+        {"2026-10-17T12:00:00+02",          1792231200000ULL, 22},
+        {"2026-10-17T12:00:00-05:30",       1792258200000ULL, 25},
+        {"20261017T120000.5+0200",          1792231200500ULL, 22},
+        {"2026-10-17T12:00:00+24:00",       0,                 0},
+        {"2026-10-17T12:00:00+02:60",       0,                 0},
+        {"2026-10-17T12:00:00+2",           0,                 0},
+
+        // Leap days and seconds
+
+        {"2024-02-29T00:00:00Z",            1709164800000ULL, 20},
+        {"2000-02-29",                      951782400000ULL,  10},
+        {"2023-02-29",                      0,                 0},
+        {"1900-02-29",                      0,                 0},
+        {"2100-02-29",                      0,                 0},
+        {"2016-12-31T23:59:60Z",            1483228800000ULL, 20},
+        {"2016-12-31T23:59:60.500Z",        1483228800500ULL, 24},
+        {"2016-12-31T23:59:61Z",            0,                 0},
+
+        // The epoch, and times before it
+
+        {"1970-01-01T00:00:00Z",            0,                20},
+        {"1970-01-01T00:00:00.001Z",        1,                24},
+        {"1970-01-01T01:00:00+01:00",       0,                25},
+        {"1970-01-01T00:30:00+01:00",       0,                 0},
+        {"1969-12-31T23:59:59.999Z",        0,                 0},
+        {"1969-12-31",                      0,                 0},
+        {"0001-01-01",                      0,                 0},
+
+        // Malformed
+
+        {"2026-13-01",                      0,                 0},
+        {"2026-00-10",                      0,                 0},
+        {"2026-10-32",                      0,                 0},
+        {"2026-10-00",                      0,                 0},
+        {"2026-1017",                       0,                 0},
+        {"2026-10-17T24:00:00Z",            0,                 0},
+        {"2026-10-17T12:60Z",               0,                 0},
+        {"2026-10-17T12",                   0,                 0},
+        {"2026-10-17T",                     0,                 0},
+        {"26-10-17",                        0,                 0},
+        {"",                                0,                 0},
+    };
+
+    for(unsigned i=0; i < sizeof(isoCases)/sizeof(isoCases[0]); i++)
+        checkIso8601(isoCases[i].str_, isoCases[i].ms_, isoCases[i].len_);
+
+    // Epoch counts, truncated to ms
+
+    checkEpoch("1700000000",                TimeParse::SECONDS,      1700000000000ULL, 10);
+    checkEpoch("1700000000.1239",           TimeParse::SECONDS,      1700000000123ULL, 15);
+    checkEpoch("1700000000.",               TimeParse::SECONDS,      1700000000000ULL, 11);
+    checkEpoch("18446744073709551.615",     TimeParse::SECONDS,      UINT64_MAX,       21);
+    checkEpoch("18446744073709551.616",     TimeParse::SECONDS,      0,                 0);
+    checkEpoch("18446744073709552",         TimeParse::SECONDS,      0,                 0);
+    checkEpoch("1700000000123",             TimeParse::MILLISECONDS, 1700000000123ULL, 13);
+    checkEpoch("1700000000123.9",           TimeParse::MILLISECONDS, 1700000000123ULL, 15);
+    checkEpoch("1700000000123999",          TimeParse::MICROSECONDS, 1700000000123ULL, 16);
+    checkEpoch("999",                       TimeParse::MICROSECONDS, 0,                 3);
+    checkEpoch("1700000000123999999",       TimeParse::NANOSECONDS,  1700000000123ULL, 19);
+    checkEpoch("18446744073709551615",      TimeParse::NANOSECONDS,  18446744073709ULL, 20);
+    checkEpoch(" 42",                       TimeParse::SECONDS,      42000,             3);
+    checkEpoch("-1",                        TimeParse::SECONDS,      0,                 0);
+    checkEpoch("",                          TimeParse::MILLISECONDS, 0,                 0);
+
+    // daysFromCivil() against timegm(), for every day from 1600 to
+    // 2400 (so every kind of century year)
+
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = 1600 - 1900;
+    tm.tm_mday = 1;
+
+    time_t secs = timegm(&tm);
+
+    for(; secs < 13601088000LL; secs += 86400) {
+
+        gmtime_r(&secs, &tm);
+
+        int64_t days = TimeParse::daysFromCivil(tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday);
+
+        if(days * 86400 != secs) {
+            std::ostringstream date, os;
+            date << tm.tm_year + 1900 << "-" << tm.tm_mon + 1 << "-" << tm.tm_mday;
+            os << "daysFromCivil gives " << days << ", timegm " << secs / 86400;
+            fail("date", date.str(), os.str());
+        }
+    }
+
+    // Random timestamps, up to the year 9998, formatted in the local
+    // time of a random offset and parsed back
+
+    uint64_t state = 0x2545F4914F6CDD1DULL;
+    char buf[64];
+
+    for(unsigned i=0; i < nCheck; i++) {
+
+        uint64_t ms  = 86400000ULL + nextRandom(state) % 253370592000000ULL;
+        int offset   = (int)(nextRandom(state) % (24 * 60 * 2 - 1)) - (24 * 60 - 1);
+        bool basic   = nextRandom(state) & 1;
+
+        time_t local = (time_t)(ms / 1000) + offset * 60;
+        gmtime_r(&local, &tm);
+
+        unsigned absOffset = offset < 0 ? -offset : offset;
+
+        snprintf(buf, sizeof(buf), basic ? "%04d%02d%02dT%02d%02d%02d.%03u%c%02u%02u" : "%04d-%02d-%02dT%02d:%02d:%02d.%03u%c%02u:%02u",
+                 tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec,
+                 (unsigned)(ms % 1000), offset < 0 ? '-' : '+', absOffset / 60, absOffset % 60);
+
+        checkIso8601(buf, ms, strlen(buf));
+    }
+}
+
+//-----------------------------------------------------------------------
+// Timing, of the conversions as ErlUtil used to do them (from a
+// std::string copy of the field) and as it now does
+//-----------------------------------------------------------------------
+
+static volatile double dsink;
+static volatile int64_t isink;
+
+static void timeCase(std::string name, std::vector<std::string>& values, unsigned nTime, bool isDouble)
+{
+    double start = nowSeconds();
+
+    for(unsigned i=0; i < nTime; i++) {
+        std::string str = values[i % values.size()];
+        if(isDouble)
+            dsink = strtod(str.c_str(), NULL);
+        else
+            isink = strtoll(str.c_str(), NULL, 10);
+    }
+
+    double libc = (nowSeconds() - start) / nTime;
+
+    start = nowSeconds();
+
+    for(unsigned i=0; i < nTime; i++) {
+        const std::string& str = values[i % values.size()];
+        if(isDouble) {
+            double val;
+            NumParse::parseDouble(str.data(), str.size(), val);
+            dsink = val;
+        } else {
+            int64_t val;
+            NumParse::parseInt64(str.data(), str.size(), val);
+            isink = val;
+        }
+    }
+
+    double ours = (nowSeconds() - start) / nTime;
+
+    std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << libc * 1e9 << " ns" << std::setw(12) << ours * 1e9 << " ns"
+              << std::setw(10) << libc / ours << "x" << std::endl;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned nCheck = argc > 1 ? atoi(argv[1]) : 1000000;
+    unsigned nTime  = argc > 2 ? atoi(argv[2]) : 10000000;
+
+    check(nCheck);
+    checkTime(nCheck);
+
+    if(nFail > 0) {
+        COUTRED(nFail << " mismatches");
+        return 1;
+    }
+
+    std::cout << "Checked " << nCheck << " random values of each kind, and timestamps: OK" << std::endl << std::endl;
+
+    std::cout << std::left << std::setw(20) << "Values" << std::right << std::setw(15) << "libc"
+              << std::setw(15) << "NumParse" << std::setw(11) << "Speedup" << std::endl
+              << std::string(61, '-') << std::endl;
+
+    uint64_t state = 12345;
+    std::vector<std::string> small, msEpoch, nsEpoch, shortDouble, longDouble, expDouble, fullDouble;
+
+    for(unsigned i=0; i < 1024; i++) {
+
+        uint64_t r = nextRandom(state);
+        char buf[64];
+
+        snprintf(buf, sizeof(buf), "%d", (int)(r % 2000) - 1000);
+        small.push_back(buf);
+        snprintf(buf, sizeof(buf), "%llu", 1700000000000ULL + r % 100000000000ULL);
+        msEpoch.push_back(buf);
+        snprintf(buf, sizeof(buf), "%llu", 1700000000000000000ULL + r % 100000000000000000ULL);
+        nsEpoch.push_back(buf);
+        snprintf(buf, sizeof(buf), "%.1f", (r % 10000) / 10.0 - 500);
+        shortDouble.push_back(buf);
+        snprintf(buf, sizeof(buf), "%.10f", (r % 100000000) / 1e5 - 500);
+        longDouble.push_back(buf);
+        snprintf(buf, sizeof(buf), "%.8e", (r % 100000000) * 1e17);
+        expDouble.push_back(buf);
+        snprintf(buf, sizeof(buf), "%.17g", (double)r / 3.0);
+        fullDouble.push_back(buf);
+    }
+
+    timeCase("int64/small",     small,       nTime, false);
+    timeCase("int64/ms_epoch",  msEpoch,     nTime, false);
+    timeCase("int64/ns_epoch",  nsEpoch,     nTime, false);
+    timeCase("double/short",    shortDouble, nTime, true);
+    timeCase("double/long",     longDouble,  nTime, true);
+    timeCase("double/exponent", expDouble,   nTime, true);
+    timeCase("double/17digit",  fullDouble,  nTime, true);
+
+    return 0;
+}
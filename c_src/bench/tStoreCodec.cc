@@ -0,0 +1,171 @@
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ExceptionUtils.h"
+#include "LevelManager.h"
+#include "StoreCodec.h"
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// Ingest and replay JSON sensor payloads through the store with each
+// codec, as MosClient::storeMessage() and dumpToBroker() do, and
+// report ingest time, bytes on disk and replay time.
+//
+// Usage: tStoreCodec [nMessage] [dir]
+//-----------------------------------------------------------------------
+
+#if WITH_LEVELDB
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+// Total size of the (flat) leveldb directory, or remove it
+
+static uint64_t dirBytes(std::string dir, bool remove)
+{
+    uint64_t bytes = 0;
+    DIR* dp = opendir(dir.c_str());
+
+    if(!dp)
+        return 0;
+
+    while(struct dirent* ent = readdir(dp)) {
+
+        std::string name = ent->d_name;
+
+        if(name == "." || name == "..")
+            continue;
+
+        std::string path = dir + "/" + name;
+        struct stat st;
+
+        if(stat(path.c_str(), &st) == 0)
+            bytes += st.st_size;
+
+        if(remove)
+            unlink(path.c_str());
+    }
+
+    closedir(dp);
+
+    if(remove)
+        rmdir(dir.c_str());
+
+    return bytes;
+}
+#endif
+
+int main(int argc, char** argv)
+{
+#if WITH_LEVELDB
+    unsigned nMessage = argc > 1 ? atoi(argv[1]) : 200000;
+    std::string base  = argc > 2 ? argv[2] : "/tmp/tStoreCodec";
+
+    // Payloads like those our sensors send, with pseudo-random values
+
+    std::vector<std::string> payloads(nMessage);
+    unsigned seed = 12345;
+
+    for(unsigned i=0; i < nMessage; i++) {
+        seed = seed * 1103515245 + 12345;
+        std::ostringstream os;
+        os << "{\"device\":\"sensor-" << (seed >> 8) % 500 << "\","
+           << "\"ts\":" << 1700000000000ULL + i*100 << ","
+           << "\"temperature\":" << 15 + (seed >> 12) % 1500 / 100.0 << ","
+           << "\"humidity\":" << 30 + (seed >> 4) % 4000 / 100.0 << ","
+           << "\"battery\":" << 3 + (seed >> 16) % 120 / 100.0 << ","
+           << "\"status\":\"ok\",\"firmware\":\"2.4.1\"}";
+        payloads[i] = os.str();
+    }
+
+    StoreCodec::Codec codecs[] = {StoreCodec::NONE, StoreCodec::SNAPPY};
+
+    for(unsigned iCodec=0; iCodec < 2; iCodec++) {
+
+        StoreCodec::Codec codec = codecs[iCodec];
+        std::string dir = base + "_" + StoreCodec::codecName(codec);
+
+        dirBytes(dir, true);
+
+        //------------------------------------------------------------
+        // Ingest, one put per message, keyed as storeMessage() does
+        //------------------------------------------------------------
+
+        LevelManager db;
+        db.open(dir);
+
+        uint64_t payloadBytes = 0, recordBytes = 0;
+        std::string record;
+
+        double start = nowSeconds();
+        for(unsigned i=0; i < nMessage; i++) {
+            std::ostringstream key;
+            key << "sensors_" << 1000000000 + i;
+
+            StoreCodec::encode(codec, payloads[i].data(), payloads[i].size(), record);
+            db.put(key.str(), record);
+
+            payloadBytes += payloads[i].size();
+            recordBytes  += record.size();
+        }
+        double ingest = nowSeconds() - start;
+
+        db.close();
+
+        // Reopen once, so that the log is converted to a table, and
+        // we measure what would sit on disk
+
+        db.open(dir);
+        db.close();
+
+        uint64_t diskBytes = dirBytes(dir, false);
+
+        //------------------------------------------------------------
+        // Replay, decoding every record as dumpToBroker() does
+        //------------------------------------------------------------
+
+        db.open(dir);
+
+        std::string key, val, payload;
+        unsigned nRead = 0;
+        uint64_t replayBytes = 0;
+
+        start = nowSeconds();
+        for(db.iterStart(); db.iterValid(); db.iterStep()) {
+            db.iterGet(key, val);
+            StoreCodec::decode(val, true, payload);
+            replayBytes += payload.size();
+            ++nRead;
+        }
+        double replay = nowSeconds() - start;
+
+        db.iterClose();
+        db.close();
+
+        if(nRead != nMessage || replayBytes != payloadBytes)
+            COUTRED("Replayed " << nRead << " messages (" << replayBytes << " bytes), expected " << nMessage << " (" << payloadBytes << " bytes)");
+
+        COUTGREEN(StoreCodec::codecName(codec) << ": " << nMessage << " messages, payload " << payloadBytes
+                  << " bytes, records " << recordBytes << " bytes (" << (double)payloadBytes/recordBytes << "x), on disk "
+                  << diskBytes << " bytes");
+        COUTGREEN("    ingest: " << ingest*1e9/nMessage << " ns/msg    replay: " << replay*1e9/nMessage << " ns/msg");
+
+        dirBytes(dir, true);
+    }
+#else
+    COUTRED("tStoreCodec requires compiling with MQTT_USE_LEVELDB=1");
+#endif
+
+    return 0;
+}
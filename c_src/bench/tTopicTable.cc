@@ -0,0 +1,120 @@
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <stdlib.h>
+#include <time.h>
+
+#include "ExceptionUtils.h"
+#include "TopicTable.h"
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// Benchmark topic lookups in TopicTable against the std::map<std::string>
+// it replaced, for a table of per-device topics.
+//
+// Usage: tTopicTable [nTopic] [nLookup]
+//-----------------------------------------------------------------------
+
+struct BenchTopic {
+    uint64_t hash_;
+    std::string name_;
+    unsigned count_;
+};
+
+static double nowSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+int main(int argc, char** argv)
+{
+    unsigned nTopic  = argc > 1 ? atoi(argv[1]) : 10000;
+    unsigned nLookup = argc > 2 ? atoi(argv[2]) : 10000000;
+
+    std::vector<std::string> names(nTopic);
+    for(unsigned i=0; i < nTopic; i++) {
+        std::ostringstream os;
+        os << "devices/sensor-" << i << "/telemetry";
+        names[i] = os.str();
+    }
+
+    // Lookup order: pseudo-random, so we don't just walk the cache
+
+    std::vector<unsigned> order(nLookup);
+    unsigned seed = 12345;
+    for(unsigned i=0; i < nLookup; i++) {
+        seed = seed * 1103515245 + 12345;
+        order[i] = (seed >> 8) % nTopic;
+    }
+
+    //------------------------------------------------------------
+    // Inserts
+    //------------------------------------------------------------
+
+    TopicTable<BenchTopic> table;
+    std::map<std::string, BenchTopic> map;
+
+    double start = nowSeconds();
+    for(unsigned i=0; i < nTopic; i++) {
+        BenchTopic* topic = new BenchTopic();
+        topic->hash_  = hashTopic(names[i].c_str());
+        topic->name_  = names[i];
+        topic->count_ = 0;
+        table.insert(topic);
+    }
+    double tableInsert = nowSeconds() - start;
+
+    start = nowSeconds();
+    for(unsigned i=0; i < nTopic; i++) {
+        BenchTopic& topic = map[names[i]];
+        topic.name_  = names[i];
+        topic.count_ = 0;
+    }
+    double mapInsert = nowSeconds() - start;
+
+    //------------------------------------------------------------
+    // Lookups.  As in MosClient::process(), we start from the C
+    // string we were handed by libmosquitto
+    //------------------------------------------------------------
+
+    unsigned found = 0;
+
+    start = nowSeconds();
+    for(unsigned i=0; i < nLookup; i++) {
+        BenchTopic* topic = table.find(names[order[i]].c_str());
+        if(topic) {
+            topic->count_++;
+            found++;
+        }
+    }
+    double tableLookup = nowSeconds() - start;
+
+    if(found != nLookup)
+        COUTRED("TopicTable found " << found << " of " << nLookup << " topics");
+
+    found = 0;
+
+    start = nowSeconds();
+    for(unsigned i=0; i < nLookup; i++) {
+        std::map<std::string, BenchTopic>::iterator iter = map.find(names[order[i]].c_str());
+        if(iter != map.end()) {
+            iter->second.count_++;
+            found++;
+        }
+    }
+    double mapLookup = nowSeconds() - start;
+
+    if(found != nLookup)
+        COUTRED("std::map found " << found << " of " << nLookup << " topics");
+
+    COUTGREEN("Topics:  " << nTopic << "  Lookups: " << nLookup);
+    COUTGREEN("TopicTable insert: " << tableInsert*1e9/nTopic  << " ns/topic    lookup: " << tableLookup*1e9/nLookup << " ns/msg");
+    COUTGREEN("std::map   insert: " << mapInsert*1e9/nTopic    << " ns/topic    lookup: " << mapLookup*1e9/nLookup   << " ns/msg");
+
+    return 0;
+}
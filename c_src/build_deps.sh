@@ -186,8 +186,8 @@ mqtt_cc_make()
 	MQTT_LIBS="-L$MQTT_LIB_DIR -lmosquitto $ROOTDIR/c_src/leveldb/libleveldb.a -L$ROOTDIR/c_src/system/lib -lsnappy -lpthread"
     fi
     
-    MQTT_DEF_FLAGS="-DWITH_ERL=0 -DWITH_LEVELDB=${MQTT_USE_LEVELDB:-0}"
-    MQTT_INC_FLAGS="-I leveldb/include -I $MQTT_INC_DIR"
+    MQTT_DEF_FLAGS="-DWITH_ERL=0 -DWITH_LEVELDB=${MQTT_USE_LEVELDB:-0} -DWITH_MANUAL_ACK=${MQTT_USE_MANUAL_ACK:-0}"
+    MQTT_INC_FLAGS="-I leveldb/include -I system/include -I $MQTT_INC_DIR"
 
     echo "Def flags = $MQTT_DEF_FLAGS"
 
@@ -202,10 +202,10 @@ mqtt_cc_make()
     # The following is needed or our versions of the leveldb calls
     # won't mangle to the same name
 
-    MQTT_COMP_FLAGS=
+    MQTT_COMP_FLAGS="-std=c++11"
     case "$TARGET_OS" in
 	Darwin)
-	    MQTT_COMP_FLAGS="-mmacosx-version-min=10.8"
+	    MQTT_COMP_FLAGS="$MQTT_COMP_FLAGS -mmacosx-version-min=10.8"
     esac
     
     echo "Building MQTT lib sources"
@@ -227,6 +227,53 @@ mqtt_cc_make()
     \rm *.cc *.h *.o
 }
 
+#------------------------------------------------------------
+# Make the benchmark executables (run after mqtt_cc_make)
+#------------------------------------------------------------
+
+mqtt_bench_make()
+{
+    cp util/*.h .
+    cp mqtt/*.h .
+    cp bench/t*.cc .
+
+    # Helpers shared by the benchmarks (bench/[A-Z]*.cc, e.g. the fake
+    # broker) are linked into each of them
+
+    cp bench/[A-Z]*.cc bench/*.h .
+
+    for src in t*.cc; do
+	exe=`basename $src .cc`
+
+	# tErlUtil benchmarks the erlang decode path, and tCommand the
+	# NIF's commands, so they are built from source with WITH_ERL=1,
+	# against a stub of the erl_nif API (bench/erlNifStub.cc) in place
+	# of the VM
+
+	if [ $exe == tErlUtil ] || [ $exe == tCommand ]; then
+	    continue
+	fi
+
+	echo "Building $exe"
+	g++ $MQTT_COMP_FLAGS -O2 -o ../bin/$exe $src [A-Z]*.cc $MQTT_DEF_FLAGS $MQTT_INC_FLAGS -L $ROOTDIR/priv -lcmqtt $MQTT_LIBS
+    done
+
+    ERTS_INC_DIR=`erl -noshell -eval 'io:format("~s/erts-~s/include", [code:root_dir(), erlang:system_info(version)]), halt().'`
+
+    mkdir erlbench
+    cp util/*.cc mqtt/[A-Z]*.cc enif/*.cc bench/erlNifStub.cc erlbench
+    cp enif/*.h erlbench
+
+    for exe in tErlUtil tCommand; do
+	echo "Building $exe"
+	(cd erlbench; g++ $MQTT_COMP_FLAGS -O2 -o ../../bin/$exe ../$exe.cc *.cc -I.. -I../leveldb/include -I../system/include -I $MQTT_INC_DIR -I $ERTS_INC_DIR \
+	    -DWITH_ERL=1 -DWITH_LEVELDB=${MQTT_USE_LEVELDB:-0} -DWITH_MANUAL_ACK=${MQTT_USE_MANUAL_ACK:-0} $MQTT_LIBS)
+    done
+
+    \rm -rf erlbench
+    \rm *.cc *.h
+}
+
 #------------------------------------------------------------
 # Copy files needed for the erlang bundled lib into c_src
 #------------------------------------------------------------
@@ -299,6 +346,25 @@ case "$1" in
 	mqtt_cc_make;
 	;;
     
+    #------------------------------------------------------------
+    # Stand-alone C++ build, plus benchmarks in c_src/bench
+    #------------------------------------------------------------
+
+    bench)
+
+	if [ ! -d ../priv ]; then
+	    mkdir ../priv
+	fi
+
+	if [ ${MQTT_USE_LEVELDB:-0} == 1 ]; then
+	    leveldb_make;
+	fi
+
+	mqtt_clean;
+	mqtt_cc_make;
+	mqtt_bench_make;
+	;;
+
     #------------------------------------------------------------
     # Erlang-bundle build (aka 'make compile')
     #------------------------------------------------------------
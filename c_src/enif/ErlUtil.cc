@@ -1,5 +1,7 @@
 #include "ErlUtil.h"
+#include "NumParse.h"
 #include "StringBuf.h"
+#include "TimeParse.h"
 
 #include "ExceptionUtils.h"
 
@@ -1237,35 +1239,20 @@ ERL_NIF_TERM ErlUtil::getOption(ErlNifEnv* env, ERL_NIF_TERM term, std::string o
 
 STRING_CONV_FN(ErlUtil::stringToInt64Term)
 {
-    char* sptr = (char*)str.c_str();
-    char* eptr = 0;
+    int64_t val = 0;
 
-    errno = 0;
-    ErlNifSInt64 val = strtol(sptr, &eptr, 10);
-
-    if(errno != 0)
-        ThrowRuntimeError("Unable to convert '" << str << "' to an int64_t: errno = " << errno);
-
-    if (eptr == sptr)
-        ThrowRuntimeError("Unable to convert '" << str << "' to an int64_t: eptr = " << eptr << " sptr = " << sptr);
+    if(NumParse::parseInt64(str.data(), str.size(), val) == 0)
+        ThrowRuntimeError("Unable to convert '" << str << "' to an int64_t");
 
     return enif_make_int64(env, val);
 }
 
 STRING_CONV_FN(ErlUtil::stringToUint64Term)
 {
-    char* sptr = (char*)str.c_str();
-    char* eptr = 0;
-    
-    errno = 0;
-    eptr  = 0;
-    ErlNifUInt64 val = strtoull(sptr, &eptr, 10);
-
-    if(errno != 0)
-        ThrowRuntimeError("Unable to convert '" << str << "' to a uint64_t: errno = " << errno);
+    uint64_t val = 0;
 
-    if(eptr == sptr)
-        ThrowRuntimeError("Unable to convert '" << str << "' to a uint64_t: eptr = " << eptr << " sptr = " << sptr);
+    if(NumParse::parseUint64(str.data(), str.size(), val) == 0)
+        ThrowRuntimeError("Unable to convert '" << str << "' to a uint64_t");
 
     return enif_make_uint64(env, val);
 }
@@ -1289,6 +1276,10 @@ STRING_CONV_FN(ErlUtil::stringToBooleanTerm)
 {
     size_t first = str.find_first_not_of(' ');
     size_t last  = str.find_last_not_of(' ');
+
+    if(first == std::string::npos)
+        ThrowRuntimeError("String '" << str << "' can't be converted to an erlang boolean atom");
+
     std::string stripstr = str.substr(first, (last - first + 1));
     
     if(!(stripstr == "true" || stripstr == "false")) {
@@ -1300,26 +1291,68 @@ STRING_CONV_FN(ErlUtil::stringToBooleanTerm)
 
 STRING_CONV_FN(ErlUtil::stringToDoubleTerm)
 {
-    char* sptr = (char*)str.c_str();
-    char* eptr = 0;
-    
-    errno = 0;
-
-    double val = strtod(sptr, &eptr);
-
-    if(errno != 0) 
-        ThrowRuntimeError("Unable to convert '" << str << "' to a double");
+    double val = 0;
 
-    if(eptr == sptr)
+    if(NumParse::parseDouble(str.data(), str.size(), val) == 0)
         ThrowRuntimeError("Unable to convert '" << str << "' to a double");
 
     return enif_make_double(env, val);
 }
 
+//-----------------------------------------------------------------------
+// Timestamps in other forms, normalized to ms since the epoch, as
+// plain timestamps are.  Unlike numbers, nothing but whitespace may
+// follow them
+//-----------------------------------------------------------------------
+
+static ERL_NIF_TERM timestampTerm(ErlNifEnv* env, const std::string& str, size_t n, uint64_t ms)
+{
+    if(n == 0 || str.find_first_not_of(" \t\r\n", n) != std::string::npos)
+        ThrowRuntimeError("Unable to convert '" << str << "' to a timestamp");
+
+    return enif_make_uint64(env, ms);
+}
+
+STRING_CONV_FN(ErlUtil::epochSecondsToTimestampTerm)
+{
+    uint64_t ms = 0;
+    size_t n = TimeParse::parseEpoch(str.data(), str.size(), TimeParse::SECONDS, ms);
+    return timestampTerm(env, str, n, ms);
+}
+
+STRING_CONV_FN(ErlUtil::epochMicrosToTimestampTerm)
+{
+    uint64_t ms = 0;
+    size_t n = TimeParse::parseEpoch(str.data(), str.size(), TimeParse::MICROSECONDS, ms);
+    return timestampTerm(env, str, n, ms);
+}
+
+STRING_CONV_FN(ErlUtil::epochNanosToTimestampTerm)
+{
+    uint64_t ms = 0;
+    size_t n = TimeParse::parseEpoch(str.data(), str.size(), TimeParse::NANOSECONDS, ms);
+    return timestampTerm(env, str, n, ms);
+}
+
+STRING_CONV_FN(ErlUtil::isoToTimestampTerm)
+{
+    uint64_t ms = 0;
+    size_t n = TimeParse::parseIso8601(str.data(), str.size(), ms);
+    return timestampTerm(env, str, n, ms);
+}
+
 STRING_CONV_FN_PTR ErlUtil::getStringConvFn(std::string type)
 {
-    if(type == "timestamp") {
+    if(type == "timestamp" || type == "timestamp_ms") {
         return stringToUint64Term;
+    } else if(type == "timestamp_s") {
+        return epochSecondsToTimestampTerm;
+    } else if(type == "timestamp_us") {
+        return epochMicrosToTimestampTerm;
+    } else if(type == "timestamp_ns") {
+        return epochNanosToTimestampTerm;
+    } else if(type == "timestamp_iso8601" || type == "timestamp_rfc3339") {
+        return isoToTimestampTerm;
     } else if(type == "sint64") {
         return stringToInt64Term;
     } else if(type == "varchar") {
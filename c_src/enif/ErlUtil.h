@@ -166,6 +166,14 @@ namespace nifutil {
         static STRING_CONV_FN(stringToBooleanTerm);
         static STRING_CONV_FN(stringToDoubleTerm);
 
+        // Timestamps given in other forms (see TimeParse.h), as
+        // timestamp terms (ms since the epoch)
+
+        static STRING_CONV_FN(epochSecondsToTimestampTerm);
+        static STRING_CONV_FN(epochMicrosToTimestampTerm);
+        static STRING_CONV_FN(epochNanosToTimestampTerm);
+        static STRING_CONV_FN(isoToTimestampTerm);
+
         static STRING_CONV_FN_PTR getStringConvFn(std::string type);
         
     private:
@@ -22,10 +22,12 @@
 #include <algorithm>
 #include <deque>
 #include <new>
+#include <pthread.h>
 #include <set>
 #include <sstream>
 #include <stack>
 #include <stdexcept>
+#include <string.h>
 #include <syslog.h>
 #include <utility>
 #include <vector>
@@ -35,14 +37,31 @@
 
 #include "ErlUtil.h"
 #include "LevelManager.h"
+#include "Logger.h"
 #include "MosClient.h"
 
-// This NIF exports only one function.  This makes it easy to add new
-// functionality without writing heaps of extra C++ connective tissue
+// This NIF exports only one command function (plus a constructor and
+// close/1 for client handles, and the publish functions).  This makes it easy to add new functionality
+// without writing heaps of extra C++ connective tissue.
+//
+// command/1 operates on the default client.  command/2 takes a client
+// handle returned by new_client/1 as its first argument.
+//
+// Commands that can run for a long time (see isLongRunning() below)
+// are rescheduled by command() and newClient() onto a dirty I/O
+// scheduler, as is close/1, so that they never block a normal
+// scheduler
 
 static ErlNifFunc nif_funcs[] =
 {
-    {"command",  1, mqtt::command},
+    {"command",    1, mqtt::command},
+    {"command",    2, mqtt::command},
+    {"new_client", 1, mqtt::newClient},
+    {"close",      1, mqtt::closeClient},
+    {"publish",       3, mqtt::publish},
+    {"publish",       4, mqtt::publish},
+    {"publish_batch", 2, mqtt::publishBatch},
+    {"publish_batch", 3, mqtt::publishBatch},
 };
 
 namespace mqtt {
@@ -52,7 +71,53 @@ namespace mqtt {
     ERL_NIF_TERM ATOM_OK;
     ERL_NIF_TERM ATOM_ERROR;
 
-    ERL_NIF_TERM processOptTuple(ErlNifEnv* env, ERL_NIF_TERM tuple);
+    // True if the runtime we were loaded into has dirty schedulers
+
+    bool haveDirtySchedulers = false;
+
+    // Resource type for client handles returned by new_client/1.
+    // Calls on a handle hold lock_ for reading, so that close/1, which
+    // takes it for writing, can't free the client from under them
+
+    ErlNifResourceType* CLIENT_RESOURCE = 0;
+
+    struct ClientHandle {
+        nifutil::MosClient* client_;
+        pthread_rwlock_t lock_;
+    };
+
+    // The client a call operates on: the handle passed as term, read
+    // locked for the lifetime of this object, or the default client
+
+    class ClientRef {
+    public:
+        ClientRef(ErlNifEnv* env, bool haveHandle, ERL_NIF_TERM term);
+        ~ClientRef();
+
+        nifutil::MosClient* client_;
+
+    private:
+        ClientHandle* handle_;
+    };
+
+    ERL_NIF_TERM executeCommand(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM createClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM destroyClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[]);
+    ERL_NIF_TERM processOptTuple(ErlNifEnv* env, ERL_NIF_TERM tuple, nifutil::MosClient* client);
+    bool isLongRunning(ErlNifEnv* env, ERL_NIF_TERM term);
+    void getPublishOpts(ErlNifEnv* env, ERL_NIF_TERM opts, int& qos, bool& retain);
+    ERL_NIF_TERM enqueuePublish(ErlNifEnv* env, nifutil::MosClient* client,
+                                std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> >& messages, ERL_NIF_TERM opts);
+
+    // Target for log messages forwarded to an erlang process (see
+    // {log_to, Pid}).  Only the logging thread uses env_
+
+    struct LogTarget {
+        ErlNifPid pid_;
+        ErlNifEnv* env_;
+    };
+
+    void sendLog(nifutil::Logger::Level level, int64_t micros, const char* text, size_t len, void* arg);
 }
 
 using std::nothrow;
@@ -61,25 +126,82 @@ using namespace nifutil;
 namespace mqtt {
 
     //------------------------------------------------------------
-    // Implement the single command we support
+    // Implement the single command we support.  Long-running
+    // commands are handed off to a dirty I/O scheduler if we have
+    // one, else executed in place
     //------------------------------------------------------------
     
     ERL_NIF_TERM command(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        if(haveDirtySchedulers && isLongRunning(env, argv[argc-1]))
+            return enif_schedule_nif(env, "command", ERL_NIF_DIRTY_JOB_IO_BOUND, commandDirty, argc, argv);
+
+        return executeCommand(env, argc, argv);
+    }
+
+    ERL_NIF_TERM commandDirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        return executeCommand(env, argc, argv);
+    }
+
+    //------------------------------------------------------------
+    // Return true if term is (or is a list containing) a command
+    // that may block for longer than we should hold a normal
+    // scheduler: dump and replay iterate the whole store, start opens
+    // it (and binds the metrics listener and connects the bridge),
+    // status and topic_stats walk the full topic list, and the cunit
+    // tests open and close leveldb.  Everything else should take well
+    // under a millisecond (see bench/tCommand.cc)
+    //------------------------------------------------------------
+
+    bool isLongRunning(ErlNifEnv* env, ERL_NIF_TERM term)
+    {
+        ERL_NIF_TERM head, tail;
+
+        if(enif_get_list_cell(env, term, &head, &tail))
+            return isLongRunning(env, head) || isLongRunning(env, tail);
+
+        int arity=0;
+        const ERL_NIF_TERM* array=0;
+        char buf[16];
+
+        if(!enif_get_tuple(env, term, &arity, &array) || arity < 1)
+            return false;
+
+        if(!enif_get_atom(env, array[0], buf, sizeof(buf), ERL_NIF_LATIN1))
+            return false;
+
+        std::string atom(buf);
+
+        return atom == "dump" || atom == "replay" || atom == "start" ||
+            atom == "status" || atom == "topic_stats" || atom == "cunit";
+    }
+
+    //------------------------------------------------------------
+    // Execute a command or list of commands, on the default client,
+    // or on the client handle passed as the first of two arguments
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM executeCommand(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
     {
         try {
 
-            if(ErlUtil::isList(env, argv[0])) {
-                std::vector<ERL_NIF_TERM> optTuples = ErlUtil::getListCells(env, argv[0]);
+            ClientRef ref(env, argc == 2, argv[0]);
+            MosClient* client = ref.client_;
+            ERL_NIF_TERM cmd  = argv[argc-1];
+
+            if(ErlUtil::isList(env, cmd)) {
+                std::vector<ERL_NIF_TERM> optTuples = ErlUtil::getListCells(env, cmd);
                 std::vector<ERL_NIF_TERM> optRets(optTuples.size());
                 
                 for(unsigned i=0; i < optTuples.size(); i++) {
-                    optRets[i] = processOptTuple(env, optTuples[i]);
+                    optRets[i] = processOptTuple(env, optTuples[i], client);
                 }
 
-                return enif_make_list(env, optRets.size(), &optRets[0]);
+                return enif_make_list_from_array(env, &optRets[0], optRets.size());
                 
             } else {
-                return processOptTuple(env, argv[0]);
+                return processOptTuple(env, cmd, client);
             }
 
             return ATOM_OK;
@@ -94,11 +216,261 @@ namespace mqtt {
         }
     }
 
+    //------------------------------------------------------------
+    // Create a new client handle, configured from a list of option
+    // (or command) tuples, as accepted by command/1.  Like command(),
+    // this moves to a dirty I/O scheduler if the list includes a
+    // long-running command, e.g., {start}
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM newClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        if(haveDirtySchedulers && isLongRunning(env, argv[0]))
+            return enif_schedule_nif(env, "new_client", ERL_NIF_DIRTY_JOB_IO_BOUND, newClientDirty, argc, argv);
+
+        return createClient(env, argc, argv);
+    }
+
+    ERL_NIF_TERM newClientDirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        return createClient(env, argc, argv);
+    }
+
+    ERL_NIF_TERM createClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        ClientHandle* handle = (ClientHandle*)enif_alloc_resource(CLIENT_RESOURCE, sizeof(ClientHandle));
+        handle->client_ = 0;
+        pthread_rwlock_init(&handle->lock_, NULL);
+
+        try {
+
+            handle->client_ = new MosClient();
+
+            std::vector<ERL_NIF_TERM> optTuples = ErlUtil::getListCells(env, argv[0]);
+            for(unsigned i=0; i < optTuples.size(); i++)
+                processOptTuple(env, optTuples[i], handle->client_);
+
+            ERL_NIF_TERM ret = enif_make_resource(env, handle);
+            enif_release_resource(handle);
+
+            return ret;
+            
+        } catch(std::runtime_error& err) {
+            enif_release_resource(handle);
+            ERL_NIF_TERM msg_str  = enif_make_string(env, err.what(), ERL_NIF_LATIN1);
+            return enif_make_tuple2(env, mqtt::ATOM_ERROR, msg_str);
+        } catch(...) {
+            enif_release_resource(handle);
+            ERL_NIF_TERM msg_str  = enif_make_string(env, "Unhandled exception caught", ERL_NIF_LATIN1);
+            return enif_make_tuple2(env, mqtt::ATOM_ERROR, msg_str);
+        }
+    }
+
+    //------------------------------------------------------------
+    // Stop and free the client referenced by a handle.  This waits
+    // for the client's threads to exit and its store to close, so it
+    // always runs on a dirty scheduler, if we have one
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM closeClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        if(haveDirtySchedulers)
+            return enif_schedule_nif(env, "close", ERL_NIF_DIRTY_JOB_IO_BOUND, closeClientDirty, argc, argv);
+
+        return destroyClient(env, argc, argv);
+    }
+
+    ERL_NIF_TERM closeClientDirty(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        return destroyClient(env, argc, argv);
+    }
+
+    ERL_NIF_TERM destroyClient(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        ClientHandle* handle = 0;
+
+        if(!enif_get_resource(env, argv[0], CLIENT_RESOURCE, (void**)&handle)) {
+            std::ostringstream os;
+            os << "Term '" << ErlUtil::formatTerm(env, argv[0]) << "' is not an mqtt client";
+            return enif_make_tuple2(env, mqtt::ATOM_ERROR, enif_make_string(env, os.str().c_str(), ERL_NIF_LATIN1));
+        }
+
+        // Tell the client to stop first, so that a dump or replay
+        // holding the handle gives up, and releases the lock, promptly
+
+        pthread_rwlock_rdlock(&handle->lock_);
+        if(handle->client_)
+            handle->client_->requestStop();
+        pthread_rwlock_unlock(&handle->lock_);
+
+        pthread_rwlock_wrlock(&handle->lock_);
+        MosClient* client = handle->client_;
+        handle->client_ = 0;
+        pthread_rwlock_unlock(&handle->lock_);
+
+        delete client;
+
+        return ATOM_OK;
+    }
+
+    //------------------------------------------------------------
+    // Publish a message: publish(Topic, Payload, Opts), or
+    // publish(Client, Topic, Payload, Opts).  Payload is a binary or
+    // iolist, and is queued without copying.  Returns ok once the
+    // message is queued
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM publish(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        try {
+
+            ClientRef ref(env, argc == 4, argv[0]);
+            MosClient* client = ref.client_;
+
+            std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> > messages;
+            messages.push_back(std::make_pair(argv[argc-3], argv[argc-2]));
+
+            return enqueuePublish(env, client, messages, argv[argc-1]);
+
+        } catch(std::runtime_error& err) {
+            ERL_NIF_TERM msg_str  = enif_make_string(env, err.what(), ERL_NIF_LATIN1);
+            return enif_make_tuple2(env, mqtt::ATOM_ERROR, msg_str);
+        }
+    }
+
+    //------------------------------------------------------------
+    // Publish a list of {Topic, Payload} messages, as one request:
+    // publish_batch(Messages, Opts), or publish_batch(Client,
+    // Messages, Opts)
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM publishBatch(ErlNifEnv* env, int argc, const ERL_NIF_TERM argv[])
+    {
+        try {
+
+            ClientRef ref(env, argc == 3, argv[0]);
+            MosClient* client = ref.client_;
+
+            std::vector<ERL_NIF_TERM> cells = ErlUtil::getListCells(env, argv[argc-2]);
+            std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> > messages(cells.size());
+
+            for(unsigned i=0; i < cells.size(); i++) {
+                std::vector<ERL_NIF_TERM> msg = ErlUtil::getTupleCells(env, cells[i]);
+
+                if(msg.size() != 2)
+                    ThrowRuntimeError("Messages must be {Topic, Payload} tuples");
+
+                messages[i] = std::make_pair(msg[0], msg[1]);
+            }
+
+            return enqueuePublish(env, client, messages, argv[argc-1]);
+
+        } catch(std::runtime_error& err) {
+            ERL_NIF_TERM msg_str  = enif_make_string(env, err.what(), ERL_NIF_LATIN1);
+            return enif_make_tuple2(env, mqtt::ATOM_ERROR, msg_str);
+        }
+    }
+
+    ERL_NIF_TERM enqueuePublish(ErlNifEnv* env, MosClient* client,
+                                std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> >& messages, ERL_NIF_TERM opts)
+    {
+        int qos = 0;
+        bool retain = false;
+
+        getPublishOpts(env, opts, qos, retain);
+        client->publish(env, messages, qos, retain);
+
+        return ATOM_OK;
+    }
+
+    //------------------------------------------------------------
+    // Parse publish options: [{qos, 0|1|2}, {retain, Bool}]
+    //------------------------------------------------------------
+
+    void getPublishOpts(ErlNifEnv* env, ERL_NIF_TERM opts, int& qos, bool& retain)
+    {
+        std::vector<ERL_NIF_TERM> optTuples = ErlUtil::getListCells(env, opts);
+
+        for(unsigned i=0; i < optTuples.size(); i++) {
+
+            std::vector<ERL_NIF_TERM> cells = ErlUtil::getTupleCells(env, optTuples[i]);
+
+            if(cells.size() != 2)
+                ThrowRuntimeError("Publish options must be {Name, Value} tuples");
+
+            std::string name = ErlUtil::formatTerm(env, cells[0]);
+
+            if(name == "qos") {
+                qos = ErlUtil::getValAsInt32(env, cells[1]);
+            } else if(name == "retain") {
+                retain = ErlUtil::getBool(env, cells[1]);
+            } else {
+                ThrowRuntimeError("Unrecognized publish option: " << name);
+            }
+        }
+    }
+
+    //------------------------------------------------------------
+    // Log sink: forward a message to the registered process as
+    // {mqtt_log, Level, Micros, Text}.  Called on the logging thread
+    //------------------------------------------------------------
+
+    void sendLog(Logger::Level level, int64_t micros, const char* text, size_t len, void* arg)
+    {
+        LogTarget* target = (LogTarget*)arg;
+        ErlNifEnv* env = target->env_;
+
+        ERL_NIF_TERM textTerm;
+        memcpy(enif_make_new_binary(env, len, &textTerm), text, len);
+
+        ERL_NIF_TERM msg = enif_make_tuple4(env, enif_make_atom(env, "mqtt_log"),
+                                            enif_make_atom(env, Logger::levelName(level).c_str()),
+                                            enif_make_int64(env, micros), textTerm);
+
+        enif_send(NULL, &target->pid_, env, msg);
+        enif_clear_env(env);
+    }
+
+    //------------------------------------------------------------
+    // Look up (and lock) the client referenced by a handle, or the
+    // default client if the call wasn't passed one
+    //------------------------------------------------------------
+
+    ClientRef::ClientRef(ErlNifEnv* env, bool haveHandle, ERL_NIF_TERM term)
+    {
+        client_ = &MosClient::defaultClient();
+        handle_ = 0;
+
+        if(!haveHandle)
+            return;
+
+        ClientHandle* handle = 0;
+
+        if(!enif_get_resource(env, term, CLIENT_RESOURCE, (void**)&handle))
+            ThrowRuntimeError("Term '" << ErlUtil::formatTerm(env, term) << "' is not an mqtt client");
+
+        pthread_rwlock_rdlock(&handle->lock_);
+
+        if(!handle->client_) {
+            pthread_rwlock_unlock(&handle->lock_);
+            ThrowRuntimeError("Client '" << ErlUtil::formatTerm(env, term) << "' has been closed");
+        }
+
+        client_ = handle->client_;
+        handle_ = handle;
+    }
+
+    ClientRef::~ClientRef()
+    {
+        if(handle_)
+            pthread_rwlock_unlock(&handle_->lock_);
+    }
+
     //------------------------------------------------------------
     // Process a single options tuple that was passed to command
     //------------------------------------------------------------
 
-    ERL_NIF_TERM processOptTuple(ErlNifEnv* env, ERL_NIF_TERM tuple)
+    ERL_NIF_TERM processOptTuple(ErlNifEnv* env, ERL_NIF_TERM tuple, MosClient* client)
     {
         std::vector<ERL_NIF_TERM> cells = ErlUtil::getTupleCells(env, tuple);
         std::string atom  = ErlUtil::formatTerm(env, cells[0]);
@@ -119,12 +491,34 @@ namespace mqtt {
             COUTGREEN("    To register a Pid to be notified on receipt of a message");
             COUTGREEN(std::endl << "\r" << " mqtt:command({status})");
             COUTGREEN("    To print a connection status summary");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({log_level, debug | info | warning | error})");
+            COUTGREEN("    To set the level below which client log messages are discarded (default info)");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({log_rate_limit, PerSecond})");
+            COUTGREEN("    To limit how often any one log message is repeated (default 10/s; 0 for no limit)");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({log_to, Pid | console})");
+            COUTGREEN("    To send log messages to Pid as {mqtt_log, Level, Micros, Text} (see mqtt:spawnLogForwarder/0)");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({metrics})");
+            COUTGREEN("    To return message counters and stage latency histograms as a map");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({topic_stats, TopN, rate | errors})");
+            COUTGREEN("    To return statistics for the TopN topics with the highest message rate (the default) or most parse errors");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({replay})");
+            COUTGREEN("    To send stored messages to the calling process as {Topic, DataTuple}, returning {ok, Count}");
             COUTGREEN(std::endl << "\r" << " mqtt:command({start})");
             COUTGREEN("    To start the background comms loop");
-            COUTGREEN(std::endl << "\r" << " mqtt:command({subscribe, TopicName, SchemaList, FormatAtom})");
-            COUTGREEN("    To subscribe to topic TopicName, with SchemaList (example: [sint64, timestamp, double, varchar]) and FormatAtom (either csv or json)");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({subscribe, TopicName, SchemaList, FormatAtom, QoS})");
+            COUTGREEN("    To subscribe to topic TopicName, with SchemaList (example: [sint64, timestamp, double, varchar]), FormatAtom (either csv or json) and QoS (0, 1 or 2; default 0)");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({bridge_rule, FromPrefix, ToPrefix})");
+            COUTGREEN("    To rewrite topics starting with FromPrefix when bridging to bridge_host");
+            COUTGREEN(std::endl << "\r" << " mqtt:command({bridge_filter, TopicFilter})");
+            COUTGREEN("    To bridge only topics matching TopicFilter (and any other filters)");
 
             COUTGREEN(std::endl << "\r" << "Or a list of any of the above.");
+            COUTGREEN(std::endl << "\r" << " mqtt:new_client(OptList) and mqtt:command(Client, Command)");
+            COUTGREEN("    To create and command additional independent clients");
+            COUTGREEN(std::endl << "\r" << " mqtt:close(Client)");
+            COUTGREEN("    To stop a client created by mqtt:new_client/1, and wait for it to exit");
+            COUTGREEN(std::endl << "\r" << " mqtt:publish(Topic, Payload, [{qos, QoS}, {retain, Bool}])");
+            COUTGREEN("    To publish a binary or iolist Payload (see also publish_batch/2)");
             COUTGREEN("");
             
             return ATOM_OK;
@@ -144,7 +538,7 @@ namespace mqtt {
             if(enif_get_local_pid(env, pidTerm, &localPid)==0)
                 ThrowRuntimeError("Failed to create local PID");
             
-            MosClient::registerPid(localEnv, localPid);
+            client->registerPid(localEnv, localPid);
             return ATOM_OK;
         }
         
@@ -158,7 +552,7 @@ namespace mqtt {
         //------------------------------------------------------------
         
         else if(atom == "start") {
-            MosClient::startCommsLoop();
+            client->startCommsLoop();
             return ATOM_OK;
         }
         
@@ -172,9 +566,16 @@ namespace mqtt {
             
             std::string format = "csv";
             
-            if(cells.size() == 4)
+            if(cells.size() > 3)
                 format = ErlUtil::formatTerm(env, cells[3]);
 
+            // Process optional QoS
+
+            int qos = 0;
+
+            if(cells.size() > 4)
+                qos = ErlUtil::getValAsInt32(env, cells[4]);
+
             // Process optional schema
             
             std::vector<STRING_CONV_FN_PTR> convFnVec;
@@ -193,11 +594,11 @@ namespace mqtt {
             }
 
             if(cells.size() < 2)
-                ThrowRuntimeError("Usage: {subscribe, Topic, Schema, Format}");
+                ThrowRuntimeError("Usage: {subscribe, Topic, Schema, Format, QoS}");
             
             std::string topic = ErlUtil::getString(env, cells[1]);
             
-            MosClient::subscribe(topic, schemaStr, convFnVec, format);
+            client->subscribe(topic, schemaStr, convFnVec, format, qos);
             
             return ATOM_OK;
         }
@@ -210,6 +611,10 @@ namespace mqtt {
 
             std::map<std::string, std::string> entryMap;
             
+            entryMap["compressed"] = "false";
+            if(cells.size() >= 5)
+                entryMap["compressed"] = ErlUtil::getBool(env, cells[4]) ? "true" : "false";
+
             entryMap["delayms"] = "0";
             if(cells.size() >= 4)
                 entryMap["delayms"] = ErlUtil::formatTerm(env, cells[3]);
@@ -222,27 +627,94 @@ namespace mqtt {
             if(cells.size() > 1)
                 entryMap["host"] = ErlUtil::formatTerm(env, cells[1]);
 
-            MosClient::dumpToBroker(entryMap);
+            client->dumpToBroker(entryMap);
             return ATOM_OK;
         }
         
+        //------------------------------------------------------------
+        // Replay the store to the calling process
+        //------------------------------------------------------------
+        
+        else if(atom == "replay") {
+
+            ErlNifPid pid;
+            enif_self(env, &pid);
+
+            unsigned count = client->replay(env, pid);
+            return enif_make_tuple2(env, ATOM_OK, enif_make_uint(env, count));
+        }
+        
+        //------------------------------------------------------------
+        // Bridge topic rewrite rules and filters
+        //------------------------------------------------------------
+
+        else if(atom == "bridge_rule") {
+
+            if(cells.size() != 3)
+                ThrowRuntimeError("Usage: {bridge_rule, FromPrefix, ToPrefix}");
+
+            client->addBridgeRule(ErlUtil::getAsString(env, cells[1]), ErlUtil::getAsString(env, cells[2]));
+            return ATOM_OK;
+        }
+
+        else if(atom == "bridge_filter") {
+
+            if(cells.size() != 2)
+                ThrowRuntimeError("Usage: {bridge_filter, TopicFilter}");
+
+            client->addBridgeFilter(ErlUtil::getAsString(env, cells[1]));
+            return ATOM_OK;
+        }
+
         //------------------------------------------------------------
         // Print status information about the client
         //------------------------------------------------------------
             
         else if(atom == "status") {
-            std::string status = MosClient::getStatusSummary();
+            std::string status = client->getStatusSummary();
             COUT(status);
             return ATOM_OK;
         }
 
+        //------------------------------------------------------------
+        // Return the client's metrics, as a map
+        //------------------------------------------------------------
+            
+        else if(atom == "metrics") {
+            return client->metrics(env);
+        }
+
+        //------------------------------------------------------------
+        // Return per-topic statistics, highest rate (or error count)
+        // first
+        //------------------------------------------------------------
+            
+        else if(atom == "topic_stats") {
+
+            unsigned topN = 10;
+            if(cells.size() > 1)
+                topN = ErlUtil::getValAsInt32(env, cells[1]);
+
+            bool byErrors = false;
+            if(cells.size() > 2) {
+                std::string sortBy = ErlUtil::getAtom(env, cells[2]);
+
+                if(sortBy == "errors")
+                    byErrors = true;
+                else if(sortBy != "rate")
+                    ThrowRuntimeError("Usage: {topic_stats, TopN, rate | errors}");
+            }
+
+            return client->topicStats(env, topN, byErrors);
+        }
+
         //------------------------------------------------------------
         // Toggle logging on/off
         //------------------------------------------------------------
             
         else if(atom == "logging") {
             bool log = (ErlUtil::getAtom(env, cells[1]) == "on");
-            MosClient::toggleLogging(log);
+            client->toggleLogging(log);
             return ATOM_OK;
         }
 
@@ -279,17 +751,91 @@ namespace mqtt {
             return ATOM_OK;
         }
         
+        //------------------------------------------------------------
+        // Logging (process-wide, whichever client is addressed)
+        //------------------------------------------------------------
+
+        else if(atom == "log_level") {
+            Logger::instance().setLevel(Logger::levelFor(ErlUtil::getAtom(env, cells[1])));
+            return ATOM_OK;
+        }
+
+        else if(atom == "log_rate_limit") {
+            Logger::instance().setRateLimit(ErlUtil::getValAsInt32(env, cells[1]));
+            return ATOM_OK;
+        }
+
+        else if(atom == "log_to") {
+
+            ErlNifPid pid;
+
+            if(enif_is_atom(env, cells[1]) && ErlUtil::getAtom(env, cells[1]) == "console") {
+                Logger::instance().setSink(0, 0);
+            } else if(enif_get_local_pid(env, cells[1], &pid)) {
+
+                // Targets are never freed, since the logging thread
+                // may still be using a superseded one
+
+                LogTarget* target = new LogTarget();
+                target->pid_ = pid;
+                target->env_ = enif_alloc_env();
+
+                Logger::instance().setSink(sendLog, target);
+            } else {
+                ThrowRuntimeError("Usage: {log_to, Pid | console}");
+            }
+
+            return ATOM_OK;
+        }
+
         //------------------------------------------------------------
         // Other options
         //------------------------------------------------------------
 
         else {
-            MosClient::setOption(env, atom, cells[1]);
+            client->setOption(env, atom, cells[1]);
             return ATOM_OK;
         }
     }
 }
 
+//------------------------------------------------------------
+// Destructor for client handles, called when the last reference to
+// a handle is garbage collected, on whichever scheduler ran the
+// collection.  Joining the client's threads can take seconds, so
+// this only tells them to stop, and leaves the wait, and freeing the
+// client, to a detached thread
+//------------------------------------------------------------
+
+static void* reapClient(void* arg)
+{
+    delete (MosClient*)arg;
+    return 0;
+}
+
+static void client_dtor(ErlNifEnv* env, void* obj)
+{
+    mqtt::ClientHandle* handle = (mqtt::ClientHandle*)obj;
+
+    if(handle->client_) {
+
+        handle->client_->requestStop();
+
+        pthread_t threadId;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+        if(pthread_create(&threadId, &attr, &reapClient, handle->client_) != 0)
+            delete handle->client_;
+
+        pthread_attr_destroy(&attr);
+        handle->client_ = 0;
+    }
+
+    pthread_rwlock_destroy(&handle->lock_);
+}
+
 static void on_unload(ErlNifEnv *env, void *priv_data) {}
 
 static int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
@@ -299,6 +845,16 @@ static int on_load(ErlNifEnv* env, void** priv_data, ERL_NIF_TERM load_info)
         
         mqtt::ATOM_OK    = enif_make_atom(env, "ok");
         mqtt::ATOM_ERROR = enif_make_atom(env, "error");
+
+        ErlNifResourceFlags flags = (ErlNifResourceFlags)(ERL_NIF_RT_CREATE | ERL_NIF_RT_TAKEOVER);
+        mqtt::CLIENT_RESOURCE = enif_open_resource_type(env, NULL, "mqtt_client", &client_dtor, flags, NULL);
+
+        if(!mqtt::CLIENT_RESOURCE)
+            return -1;
+
+        ErlNifSysInfo sysInfo;
+        enif_system_info(&sysInfo, sizeof(sysInfo));
+        mqtt::haveDirtySchedulers = sysInfo.dirty_scheduler_support;
         
         COUTGREEN(std::endl << "\r" << "For information on supported commands, use mqtt:command({help})");
         COUTGREEN("   ");
@@ -0,0 +1,178 @@
+#include "EventLoop.h"
+#include "ExceptionUtils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
+using namespace std;
+using namespace nifutil;
+
+#define MAX_EVENTS 64
+
+/**.......................................................................
+ * Constructor.
+ */
+EventLoop::EventLoop()
+{
+    epollFd_ = -1;
+    wakeFd_  = -1;
+
+#if defined(__linux__)
+    epollFd_ = epoll_create1(EPOLL_CLOEXEC);
+
+    if(epollFd_ < 0)
+        ThrowRuntimeError("Unable to create epoll instance: " << strerror(errno));
+
+    wakeFd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+    if(wakeFd_ < 0) {
+        close(epollFd_);
+        ThrowRuntimeError("Unable to create eventfd: " << strerror(errno));
+    }
+
+    // The wake fd is registered with a NULL data pointer, which
+    // distinguishes it from session sockets
+
+    struct epoll_event ev;
+    ev.events   = EPOLLIN;
+    ev.data.ptr = 0;
+
+    if(epoll_ctl(epollFd_, EPOLL_CTL_ADD, wakeFd_, &ev) != 0) {
+        close(wakeFd_);
+        close(epollFd_);
+        ThrowRuntimeError("Unable to register eventfd: " << strerror(errno));
+    }
+#else
+    ThrowRuntimeError("The event loop requires epoll, which is not available on this platform");
+#endif
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+EventLoop::~EventLoop()
+{
+    if(wakeFd_ >= 0)
+        close(wakeFd_);
+
+    if(epollFd_ >= 0)
+        close(epollFd_);
+}
+
+/**.......................................................................
+ * Return true if the event loop can be used on this platform
+ */
+bool EventLoop::isSupported()
+{
+#if defined(__linux__)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**.......................................................................
+ * Register an fd for read events, and for write events if requested
+ */
+void EventLoop::add(int fd, void* data, bool writable)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = data;
+
+    if(epoll_ctl(epollFd_, EPOLL_CTL_ADD, fd, &ev) != 0)
+        ThrowRuntimeError("Unable to add fd " << fd << " to epoll: " << strerror(errno));
+#endif
+}
+
+/**.......................................................................
+ * Change the write interest of a registered fd
+ */
+void EventLoop::modify(int fd, void* data, bool writable)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+    ev.events   = EPOLLIN | (writable ? EPOLLOUT : 0);
+    ev.data.ptr = data;
+
+    if(epoll_ctl(epollFd_, EPOLL_CTL_MOD, fd, &ev) != 0)
+        ThrowRuntimeError("Unable to modify fd " << fd << " in epoll: " << strerror(errno));
+#endif
+}
+
+/**.......................................................................
+ * Deregister an fd.  Errors are ignored, since the socket may already
+ * have been closed by the mosquitto library
+ */
+void EventLoop::remove(int fd)
+{
+#if defined(__linux__)
+    struct epoll_event ev;
+    epoll_ctl(epollFd_, EPOLL_CTL_DEL, fd, &ev);
+#endif
+}
+
+/**.......................................................................
+ * Wait up to timeoutMs for events.  Returns the number of events
+ * placed in the events vector.  A wake() returns with no events
+ */
+unsigned EventLoop::wait(std::vector<Event>& events, int timeoutMs)
+{
+    events.clear();
+
+#if defined(__linux__)
+    struct epoll_event evs[MAX_EVENTS];
+
+    int n = epoll_wait(epollFd_, evs, MAX_EVENTS, timeoutMs);
+
+    if(n < 0) {
+        if(errno == EINTR)
+            return 0;
+        ThrowRuntimeError("Error waiting on epoll: " << strerror(errno));
+    }
+
+    for(int i=0; i < n; i++) {
+
+        // Drain the wake fd
+
+        if(evs[i].data.ptr == 0) {
+            uint64_t val;
+            while(read(wakeFd_, &val, sizeof(val)) > 0)
+                ;
+            continue;
+        }
+
+        // Errors and hangups are reported as readable, so that the
+        // subsequent read surfaces the error
+
+        Event event;
+        event.data_     = evs[i].data.ptr;
+        event.readable_ = evs[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP);
+        event.writable_ = evs[i].events & EPOLLOUT;
+
+        events.push_back(event);
+    }
+#endif
+
+    return events.size();
+}
+
+/**.......................................................................
+ * Interrupt a wait() in progress.  Safe to call from any thread
+ */
+void EventLoop::wake()
+{
+#if defined(__linux__)
+    uint64_t val = 1;
+    ssize_t ret = write(wakeFd_, &val, sizeof(val));
+    (void)ret;
+#endif
+}
@@ -0,0 +1,58 @@
+// $Id: $
+
+#ifndef NIFUTIL_EVENTLOOP_H
+#define NIFUTIL_EVENTLOOP_H
+
+#include <vector>
+
+//=======================================================================
+// EventLoop is a thin wrapper around epoll, used to service many
+// mosquitto sessions from a single thread.  Each registered fd
+// carries an opaque data pointer, which is returned with its events.
+//
+// wake() may be called from any thread to interrupt a blocked wait(),
+// e.g., after queueing outgoing packets or to request shutdown.
+//
+// epoll is Linux-only.  On other platforms, the constructor throws.
+//=======================================================================
+
+namespace nifutil {
+
+    class EventLoop {
+    public:
+
+        struct Event {
+            void* data_;
+            bool readable_;
+            bool writable_;
+        };
+
+        /**
+         * Constructor.
+         */
+        EventLoop();
+
+        /**
+         * Destructor.
+         */
+        virtual ~EventLoop();
+
+        static bool isSupported();
+
+        void add(int fd, void* data, bool writable);
+        void modify(int fd, void* data, bool writable);
+        void remove(int fd);
+
+        unsigned wait(std::vector<Event>& events, int timeoutMs);
+        void wake();
+
+    private:
+
+        int epollFd_;
+        int wakeFd_;
+
+    }; // End class EventLoop
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_EVENTLOOP_H
@@ -5,6 +5,8 @@ using namespace std;
 using namespace nifutil;
 
 #if WITH_LEVELDB
+#include "leveldb/write_batch.h"
+
 using namespace leveldb;
 
 #define CHECK_DB {                                                      \
@@ -19,6 +21,10 @@ using namespace leveldb;
  */
 LevelManager::LevelManager()
 {
+#if WITH_LEVELDB
+    dbPtr_ = 0;
+    iter_  = 0;
+#endif
 }
 
 /**.......................................................................
@@ -112,6 +118,147 @@ void LevelManager::write(std::string key, const char* cptr, size_t n)
 #endif
 }
 
+/**.......................................................................
+ * Write a set of key/value pairs atomically.  If sync is true, the
+ * write is flushed to disk before returning
+ */
+void LevelManager::writeBatch(const std::vector<std::pair<std::string, std::string> >& entries, bool sync)
+{
+#if WITH_LEVELDB
+    CHECK_DB;
+
+    WriteOptions opts;
+    opts.sync = sync;
+
+    WriteBatch batch;
+
+    for(unsigned i=0; i < entries.size(); i++)
+        batch.Put(Slice(entries[i].first), Slice(entries[i].second));
+
+    Status status = dbPtr_->Write(opts, &batch);
+
+    if(!status.ok())
+        ThrowRuntimeError("Error writing batch to leveldb dir: " << status.ToString());
+#endif
+}
+
+/**.......................................................................
+ * Delete a set of keys atomically
+ */
+void LevelManager::erase(const std::vector<std::string>& keys)
+{
+#if WITH_LEVELDB
+    CHECK_DB;
+
+    if(keys.empty())
+        return;
+
+    WriteOptions opts;
+    WriteBatch batch;
+
+    for(unsigned i=0; i < keys.size(); i++)
+        batch.Delete(Slice(keys[i]));
+
+    Status status = dbPtr_->Write(opts, &batch);
+
+    if(!status.ok())
+        ThrowRuntimeError("Error deleting from leveldb dir: " << status.ToString());
+#endif
+}
+
+/**.......................................................................
+ * Read up to maxEntries key/value pairs, in key order, with keys in
+ * [start, limit).  Uses its own iterator, so is independent of
+ * iterStart() and friends
+ */
+void LevelManager::scan(std::string start, std::string limit, unsigned maxEntries,
+                        std::vector<std::pair<std::string, std::string> >& entries)
+{
+    entries.clear();
+
+#if WITH_LEVELDB
+    CHECK_DB;
+
+    ReadOptions opts;
+    Iterator* iter = dbPtr_->NewIterator(opts);
+
+    if(!iter)
+        ThrowRuntimeError("Error initializing iterator");
+
+    for(iter->Seek(start); iter->Valid() && entries.size() < maxEntries; iter->Next()) {
+
+        if(iter->key().compare(Slice(limit)) >= 0)
+            break;
+
+        entries.push_back(std::pair<std::string, std::string>(iter->key().ToString(), iter->value().ToString()));
+    }
+
+    delete iter;
+#endif
+}
+
+/**.......................................................................
+ * Find the first and last keys in [start, limit).  Returns false if
+ * there are none
+ */
+bool LevelManager::bounds(std::string start, std::string limit, std::string& first, std::string& last)
+{
+    bool found = false;
+
+#if WITH_LEVELDB
+    CHECK_DB;
+
+    ReadOptions opts;
+    Iterator* iter = dbPtr_->NewIterator(opts);
+
+    if(!iter)
+        ThrowRuntimeError("Error initializing iterator");
+
+    iter->Seek(start);
+
+    if(iter->Valid() && iter->key().compare(Slice(limit)) < 0) {
+
+        first = iter->key().ToString();
+
+        // Step back from the first key at or after limit
+
+        iter->Seek(limit);
+
+        if(iter->Valid())
+            iter->Prev();
+        else
+            iter->SeekToLast();
+
+        last  = iter->key().ToString();
+        found = true;
+    }
+
+    delete iter;
+#endif
+
+    return found;
+}
+
+/**.......................................................................
+ * Return leveldb's estimate of the bytes on disk for all keys.  This
+ * only consults table indexes, so is cheap enough to call often
+ */
+uint64_t LevelManager::approximateSize()
+{
+    uint64_t size = 0;
+
+#if WITH_LEVELDB
+    CHECK_DB;
+
+    std::string limit(8, '\xff');
+    Range range("", limit);
+
+    dbPtr_->GetApproximateSizes(&range, 1, &size);
+#endif
+
+    return size;
+}
+
 /**.......................................................................
  * Put a string into the DB
  */
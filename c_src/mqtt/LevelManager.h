@@ -4,6 +4,9 @@
 #define NIFUTIL_LEVELMANAGER_H
 
 #include <string>
+#include <vector>
+
+#include <stdint.h>
 
 #if WITH_LEVELDB
 #include "leveldb/db.h"
@@ -42,6 +45,12 @@ namespace nifutil {
         void write(std::string key, const char* cptr, size_t n);
         void put(std::string key, std::string value);
         void put(std::string key, const char* cptr, size_t n);
+        void writeBatch(const std::vector<std::pair<std::string, std::string> >& entries, bool sync);
+        void erase(const std::vector<std::string>& keys);
+        void scan(std::string start, std::string limit, unsigned maxEntries,
+                  std::vector<std::pair<std::string, std::string> >& entries);
+        bool bounds(std::string start, std::string limit, std::string& first, std::string& last);
+        uint64_t approximateSize();
         std::string read(std::string key);
         std::string get(std::string key);
         void dumpDbToStdout();
@@ -1,25 +1,68 @@
 #include "MosClient.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/select.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
 
 #include "ExceptionUtils.h"
+#include "Logger.h"
 #include "String.h"
 
 using namespace std;
 
 using namespace nifutil;
 
+// Defined ahead of instance_, so that they are initialized first
+
+Mutex    MosClient::libMutex_;
+unsigned MosClient::libRefCount_ = 0;
+
 MosClient MosClient::instance_;
 
+// Store keys for outbox messages.  Topics starting with '$' are
+// reserved, so these can't collide with stored received messages
+
+static const std::string OUTBOX_PREFIX = "$outbox_";
+static const std::string OUTBOX_LIMIT  = "$outbox`";
+
+// Store keys for the schemas of stored rows (see RowCodec.h)
+
+static const std::string SCHEMA_PREFIX = "$schema_";
+static const std::string SCHEMA_LIMIT  = "$schema`";
+
+// Store key marking a store whose records are tagged with their codec
+// (see StoreCodec.h), written when the store is first used
+
+static const std::string FORMAT_KEY = "$store_format";
+
+// Counts a dump or replay as in flight for as long as it runs.
+// stopCommsLoop() waits for the count to drop to zero before closing
+// the store, and dumps and replays stop early once running_ is
+// cleared
+
+struct InFlight {
+    std::atomic<unsigned>& count_;
+    InFlight(std::atomic<unsigned>& count) : count_(count) {count_.fetch_add(1);}
+    ~InFlight() {count_.fetch_sub(1);}
+};
+
 #define LOG(text) \
     {                                                                   \
         if(log_)                                                        \
-            COUTGREEN(text);                                            \
+            LOGINFO(text);                                              \
     }
 
 /**.......................................................................
@@ -27,11 +70,66 @@ MosClient MosClient::instance_;
  */
 MosClient::MosClient()
 {
-    mosq_        = 0;
-    connected_   = false;
     initialized_ = false;
+    starting_    = false;
+    stop_        = false;
     log_         = false;
-    mosCommsId_  = 0;
+    nSessions_   = 1;
+    eventLoop_   = false;
+    loopThreads_ = 1;
+
+    cleanSession_   = true;
+    subscribeBatch_ = 100;
+    durable_        = false;
+    durableBatch_   = 1;
+    durableFlushMs_ = 10;
+
+    reconnectMinMs_ = 100;
+    reconnectMaxMs_ = 30000;
+
+    connectAttempts_.store(0);
+    connectFailures_.store(0);
+    reconnects_.store(0);
+    sessionsResumed_.store(0);
+    subscribeBatches_.store(0);
+    durableCommits_.store(0);
+    durableFailures_.store(0);
+
+    publishWakePending_.store(false);
+    running_.store(false);
+    published_.store(0);
+    publishFailures_.store(0);
+
+    publishQueueMax_ = 100000;
+    publishInflight_ = 100;
+    publishQueued_.store(0);
+    pendingRequest_  = 0;
+    pendingItem_     = 0;
+
+    bridge_         = 0;
+    bridgePort_     = 1883;
+    bridgeQos_      = -1;
+    bridgeQueueMax_ = 10000;
+    bridged_.store(0);
+    bridgeDropped_.store(0);
+
+    outbox_ = false;
+    outboxHead_.store(0);
+    outboxTail_.store(0);
+    outboxSpilled_.store(0);
+    outboxForwarded_.store(0);
+
+    // Non-blocking pipe used to wake the publishing thread
+
+    if(pipe(publishPipe_) == 0) {
+        for(unsigned i=0; i < 2; i++) {
+            fcntl(publishPipe_[i], F_SETFL, fcntl(publishPipe_[i], F_GETFL) | O_NONBLOCK);
+            fcntl(publishPipe_[i], F_SETFD, FD_CLOEXEC);
+        }
+    } else {
+        publishPipe_[0] = publishPipe_[1] = -1;
+    }
+
     host_        = "localhost";
     port_        = 1883;
     useCerts_    = false;
@@ -39,11 +137,30 @@ MosClient::MosClient()
     store_       = false;
     name_        = "mosclient";
 
+    storeCodec_  = StoreCodec::NONE;
+    storeTagged_ = true;
+    storedBytes_.store(0);
+    storedRecordBytes_.store(0);
+    storeRows_   = false;
+    storedRows_.store(0);
+
+    messageHookFn_  = 0;
+    messageHookArg_ = 0;
+
+    metricsPort_ = 0;
+    metricsAddr_ = "127.0.0.1";
+    replaysInFlight_.store(0);
+
     initMicros_ = getCurrentMicroSeconds();
     counter_    = 0;
+
+    registerMetrics();
     
 #if WITH_ERL
-    msgEnv_      = enif_alloc_env();
+    notifyList_.store(new NotifyList(), std::memory_order_release);
+
+    topicEnv_     = enif_alloc_env();
+    atomTsPutReq_ = enif_make_atom(topicEnv_, "tsputreq");
 #endif
 }
 
@@ -51,6 +168,90 @@ MosClient::MosClient(MosClient& mos)
 {
 }
 
+/**.......................................................................
+ * Register our metrics.  Called only from the constructor, so that
+ * the registry is complete before anything reads it
+ */
+void MosClient::registerMetrics()
+{
+    metrics_.add("messages_received",   received_);
+    metrics_.add("bytes_received",      receivedBytes_);
+    metrics_.add("messages_notified",   notified_);
+    metrics_.add("messages_stored",     stored_);
+    metrics_.add("messages_replayed",   replayed_);
+
+    metrics_.add("connect_attempts",    connectAttempts_,   Metrics::COUNTER);
+    metrics_.add("connect_failures",    connectFailures_,   Metrics::COUNTER);
+    metrics_.add("reconnects",          reconnects_,        Metrics::COUNTER);
+    metrics_.add("sessions_resumed",    sessionsResumed_,   Metrics::COUNTER);
+    metrics_.add("subscribe_batches",   subscribeBatches_,  Metrics::COUNTER);
+    metrics_.add("durable_commits",     durableCommits_,    Metrics::COUNTER);
+    metrics_.add("durable_failures",    durableFailures_,   Metrics::COUNTER);
+    metrics_.add("published",           published_,        Metrics::COUNTER);
+    metrics_.add("publish_failures",    publishFailures_,   Metrics::COUNTER);
+    metrics_.add("publish_queued",      publishQueued_);
+    metrics_.add("outbox_spilled",      outboxSpilled_,     Metrics::COUNTER);
+    metrics_.add("outbox_forwarded",    outboxForwarded_,   Metrics::COUNTER);
+    metrics_.add("bridged",             bridged_,           Metrics::COUNTER);
+    metrics_.add("bridge_dropped",      bridgeDropped_,     Metrics::COUNTER);
+    metrics_.add("stored_bytes",        storedBytes_,       Metrics::COUNTER);
+    metrics_.add("stored_record_bytes", storedRecordBytes_, Metrics::COUNTER);
+    metrics_.add("stored_rows",         storedRows_,        Metrics::COUNTER);
+
+    metrics_.add("connected",           connectedGauge, this);
+    metrics_.add("outbox_depth",        outboxGauge,    this);
+    metrics_.add("store_size_bytes",    storeSizeGauge, this);
+    metrics_.add("replays_in_flight",   replaysInFlight_);
+
+    metrics_.add("decode_ns",           decodeLatency_);
+    metrics_.add("send_ns",             sendLatency_);
+    metrics_.add("store_put_ns",        storeLatency_);
+    metrics_.add("replay_publish_ns",   replayLatency_);
+    metrics_.add("connect_us",          connectLatency_);
+    metrics_.add("subscribe_us",        subscribeLatency_);
+    metrics_.add("durable_commit_us",   durableLatency_);
+}
+
+/**.......................................................................
+ * Render our metrics for the OpenMetrics listener
+ */
+std::string MosClient::renderMetrics(void* arg)
+{
+    MosClient* client = (MosClient*)arg;
+    return client->metrics_.openMetrics("mqtt_");
+}
+
+/**.......................................................................
+ * Gauges computed on demand.  Sessions and the store only change
+ * under mutex_, so these take it, briefly; it is never taken on
+ * receipt of a message
+ */
+uint64_t MosClient::connectedGauge(void* arg)
+{
+    MosClient* client = (MosClient*)arg;
+    ScopedLock lock(client->mutex_);
+    return client->nConnected();
+}
+
+uint64_t MosClient::outboxGauge(void* arg)
+{
+    MosClient* client = (MosClient*)arg;
+    return client->outboxTail_.load() - client->outboxHead_.load();
+}
+
+uint64_t MosClient::storeSizeGauge(void* arg)
+{
+    MosClient* client = (MosClient*)arg;
+    ScopedLock lock(client->mutex_);
+
+    // The store is open only while the comms loop is running
+
+    if(!client->store_ || client->sessions_.empty())
+        return 0;
+
+    return client->db_.approximateSize();
+}
+
 MosClient::MosClient(const MosClient& mos)
 {
 }
@@ -61,118 +262,260 @@ MosClient::MosClient(const MosClient& mos)
 MosClient::~MosClient()
 {
     //------------------------------------------------------------
-    // Kill any spawned process
+    // Stop any spawned threads.  stopCommsLoop() destroys the
+    // mosquitto sessions, closes the store and releases the library
     //------------------------------------------------------------
     
-    (void) pthread_kill(mosCommsId_, SIGKILL);
-
-    //------------------------------------------------------------
-    // Destroy the mosquitto session that was allocated in initAndRun
-    //------------------------------------------------------------
-    
-    if(mosq_) {
-        mosquitto_destroy(mosq_);
-        mosq_ = 0;
+    try {
+        stopCommsLoop();
+    } catch(...) {
     }
 
-    //------------------------------------------------------------
-    // Clean up the library if initialized
-    //------------------------------------------------------------
-    
-    if(initialized_)
-        mosquitto_lib_cleanup();
+    // Discard anything that was never published
+
+    delete pendingRequest_;
+
+    while(PublishRequest* request = publishQueue_.pop())
+        delete request;
+
+    for(unsigned i=0; i < 2; i++) {
+        if(publishPipe_[i] >= 0)
+            close(publishPipe_[i]);
+    }
 
 #if WITH_ERL
     //------------------------------------------------------------
     // Clear any environments that were allocated
     //------------------------------------------------------------
-    
-    for(std::list<std::pair<ErlNifEnv*, ErlNifPid> >::iterator iter=notificationList_.begin();
-        iter != notificationList_.end(); iter++) {
+
+    NotifyList* notifyList = notifyList_.load(std::memory_order_acquire);
+
+    for(NotifyList::iterator iter=notifyList->begin(); iter != notifyList->end(); iter++)
         enif_free_env(iter->first);
-    }
 
-    if(msgEnv_)
-        enif_free_env(msgEnv_);
+    delete notifyList;
+
+    for(std::list<NotifyList*>::iterator iter=retiredNotifyLists_.begin();
+        iter != retiredNotifyLists_.end(); iter++)
+        delete *iter;
+
+    if(topicEnv_)
+        enif_free_env(topicEnv_);
 #endif
 }
 
 /**.......................................................................
- * Private method to initialize and run the client. Called from
- * THREAD_START function
+ * Allocate the mosquitto session for a Session, and install our
+ * callbacks
  */
-void MosClient::initAndRun()
+void MosClient::createSession(Session* session)
 {
-    bool clean_session = true;
+    // A persistent session needs a stable client id.  With no id
+    // given, the library generates a random one
 
-    mosquitto_lib_init();
-    mosq_ = mosquitto_new(NULL, clean_session, this);
+    std::string clientId = sessionClientId(session);
 
-    initialized_ = true;
+    {
+        ScopedLock lock(mutex_);
+        session->mosq_ = mosquitto_new(clientId.empty() ? NULL : clientId.c_str(), cleanSession_, session);
+    }
     
-    if(!mosq_)
-        ThrowRuntimeError("Unable to allocate new mos session");
+    struct mosquitto* mosq = session->mosq_;
 
-    mosquitto_log_callback_set(mosq_, log_callback);
-    mosquitto_connect_callback_set(mosq_, connect_callback);
-    mosquitto_disconnect_callback_set(mosq_, disconnect_callback);
-    mosquitto_message_callback_set(mosq_, message_callback);
-    mosquitto_subscribe_callback_set(mosq_, subscribe_callback);
+    if(!mosq)
+        ThrowRuntimeError("Unable to allocate new mos session");
 
-    //------------------------------------------------------------
-    // Initialize DB if we were compiled with leveldb, and we are
-    // using leveldb
-    //------------------------------------------------------------
+    mosquitto_log_callback_set(mosq, log_callback);
+    mosquitto_connect_with_flags_callback_set(mosq, connect_callback);
+    mosquitto_disconnect_callback_set(mosq, disconnect_callback);
+    mosquitto_message_callback_set(mosq, message_callback);
+    mosquitto_subscribe_callback_set(mosq, subscribe_callback);
+    mosquitto_publish_callback_set(mosq, publish_callback);
 
-#if WITH_LEVELDB
-    if(store_) {
-        dbName_ = "/tmp/" + name_;
-        db_.open(dbName_);
-    }
+#if WITH_MANUAL_ACK
+    if(durable_)
+        mosquitto_manual_ack_set(mosq, true);
 #endif
 
-    commandTopic_ = name_ + "/command";
+    // TLS settings persist across reconnects, so need only be
+    // configured once
 
-    //------------------------------------------------------------
-    // Initialize timeout to 0, which will cause select to exit immediately
-    //------------------------------------------------------------
+    if(useCerts_)
+        certConfig(session);
+}
 
-    struct timeval timeout;
-    struct timeval* timeOutPtr = &timeout;
-    
-    timeout.tv_sec  = 0;
-    timeout.tv_usec = 0;
+/**.......................................................................
+ * Private method to initialize and run one session of the client.
+ * Called from THREAD_START function
+ */
+void MosClient::initAndRun(Session* session)
+{
+    createSession(session);
+
+    unsigned delayMs = 0;
 
     do {
 
-        select(0, NULL, NULL, NULL, timeOutPtr);
+        sleepUnlessStopped(session, delayMs);
+
+        if(stop_)
+            break;
         
         try {
 
-            COUTGREEN("MQTT Attempting to reconnect...");
+            connectAttempt(session);
 
-            if(useCerts_)
-                certConfig();
+            if(stop_)
+                break;
 
-            int retVal=0;
-            retVal = mosquitto_connect(mosq_, host_.c_str(), port_, keepAlive_);
-            
-            if(retVal != MOSQ_ERR_SUCCESS) {
-                COUTRED("MQTT Unable to connect: return was: " << (retVal==MOSQ_ERR_INVAL ? "Invalid parameters" : "system error"));
-                ThrowRuntimeError("Unable to connect");
-            } else {
-                COUTGREEN("MQTT Successfully connected");
+            // Service the connection until it drops, or we are stopped
+
+            int retVal    = MOSQ_ERR_SUCCESS;
+            int timeoutMs = durable_ ? durableFlushMs_ : 1000;
+
+            while(!stop_ && retVal == MOSQ_ERR_SUCCESS) {
+                retVal = serviceSession(session, timeoutMs);
+
+                if(durable_)
+                    flushDurable(session, false);
+
+                if(session->index_ == 0)
+                    drainPublishQueue(session);
             }
-            
-            mosquitto_loop_forever(mosq_, -1, 1);
-            
+
+            if(durable_)
+                abandonDurable(session);
+
+            if(stop_)
+                break;
+
+            session->connected_ = false;
+
+            // If the session had connected, its backoff was reset, and
+            // this retries immediately
+
+            delayMs = session->backoff_.nextDelayMs();
+
+            LOGWARN("MQTT Lost connection to broker (session " << session->index_ << ") -- attempting to reconnect in " << delayMs << " ms");
+
         } catch(...) {
-            COUTRED("MQTT Caught an error talking to broker -- attempting to reconnect in 1 second");
-            timeout.tv_sec  = 1;
-            timeout.tv_usec = 0;
+            delayMs = session->backoff_.nextDelayMs();
+            LOGWARN("MQTT Caught an error talking to broker -- attempting to reconnect in " << delayMs << " ms");
         }
         
-    } while(true);
+    } while(!stop_);
+}
+
+/**.......................................................................
+ * Wait up to timeoutMs for I/O on a session's socket, and service it.
+ * This is mosquitto_loop(), except that the session servicing
+ * publishes also wakes on publishPipe_.  Returns a MOSQ_ERR code
+ */
+int MosClient::serviceSession(Session* session, int timeoutMs)
+{
+    struct mosquitto* mosq = session->mosq_;
+
+    int sock = mosquitto_socket(mosq);
+
+    if(sock < 0)
+        return MOSQ_ERR_NO_CONN;
+
+    int wakeFd = (session->index_ == 0) ? publishPipe_[0] : -1;
+
+    fd_set readFds, writeFds;
+    FD_ZERO(&readFds);
+    FD_ZERO(&writeFds);
+
+    FD_SET(sock, &readFds);
+
+    if(mosquitto_want_write(mosq))
+        FD_SET(sock, &writeFds);
+
+    if(wakeFd >= 0)
+        FD_SET(wakeFd, &readFds);
+
+    struct timeval timeout;
+    timeout.tv_sec  = timeoutMs / 1000;
+    timeout.tv_usec = (timeoutMs % 1000) * 1000;
+
+    int nFd = select((sock > wakeFd ? sock : wakeFd) + 1, &readFds, &writeFds, NULL, &timeout);
+
+    if(nFd < 0)
+        return errno == EINTR ? MOSQ_ERR_SUCCESS : MOSQ_ERR_ERRNO;
+
+    if(wakeFd >= 0 && FD_ISSET(wakeFd, &readFds))
+        drainPipe(wakeFd);
+
+    int retVal = MOSQ_ERR_SUCCESS;
+
+    if(FD_ISSET(sock, &readFds)) {
+        retVal = mosquitto_loop_read(mosq, 1);
+        if(retVal != MOSQ_ERR_SUCCESS)
+            return retVal;
+    }
+
+    if(FD_ISSET(sock, &writeFds) && mosquitto_socket(mosq) >= 0) {
+        retVal = mosquitto_loop_write(mosq, 1);
+        if(retVal != MOSQ_ERR_SUCCESS)
+            return retVal;
+    }
+
+    return mosquitto_loop_misc(mosq);
+}
+
+/**.......................................................................
+ * Make one blocking connection attempt for a session, for the
+ * thread-per-session path; event loops use connectSession().  The
+ * first successful attempt uses mosquitto_connect; after that,
+ * mosquitto_reconnect reuses the stored connection parameters.  Throws
+ * on failure
+ */
+void MosClient::connectAttempt(Session* session)
+{
+    LOGINFO("MQTT " << (session->initialized_ ? "Attempting to reconnect" : "Connecting")
+            << " (session " << session->index_ << ")...");
+
+    connectAttempts_.fetch_add(1, std::memory_order_relaxed);
+    session->connectStartMicros_ = getCurrentMicroSeconds();
+
+    int retVal = session->initialized_ ?
+        mosquitto_reconnect(session->mosq_) :
+        mosquitto_connect(session->mosq_, host_.c_str(), port_, keepAlive_);
+
+    if(retVal != MOSQ_ERR_SUCCESS) {
+        connectFailures_.fetch_add(1, std::memory_order_relaxed);
+        LOGWARN("MQTT Unable to connect: return was: " << (retVal==MOSQ_ERR_INVAL ? "Invalid parameters" : "system error"));
+        ThrowRuntimeError("Unable to connect");
+    }
+
+    session->initialized_ = true;
+
+    LOGINFO("MQTT Successfully connected");
+}
+
+/**.......................................................................
+ * Sleep for the requested interval, returning early if the comms loop
+ * is stopped
+ */
+void MosClient::sleepUnlessStopped(Session* session, unsigned delayMs)
+{
+    while(delayMs > 0 && !stop_) {
+
+        // Keep moving queued messages to the outbox while we wait
+
+        if(session->index_ == 0)
+            drainPublishQueue(session);
+
+        unsigned ms = delayMs < 100 ? delayMs : 100;
+
+        struct timeval timeout;
+        timeout.tv_sec  = 0;
+        timeout.tv_usec = ms * 1000;
+
+        select(0, NULL, NULL, NULL, &timeout);
+
+        delayMs -= ms;
+    }
 }
 
 //=======================================================================
@@ -186,21 +529,34 @@ void MosClient::initAndRun()
 void MosClient::message_callback(struct mosquitto *mosq, void *userdata,
                                  const struct mosquitto_message *message)
 {
-    MosClient* client = (MosClient*)userdata;
+    Session* session = (Session*)userdata;
+    MosClient* client = session->client_;
+    bool deferAck = false;
 
     try {
         
         if(message->payloadlen) {
-            client->process(message);
+            deferAck = client->process(session, message);
         } else {
             // Empty message -- when can this occur?
         }
         
     } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error while parsing message: " << formatMessage(message) << std::endl << "\r  " << err.what());
+        LOGERROR("MQTT Caught an error while parsing message: " << formatMessage(message) << std::endl << "\r  " << err.what());
     } catch(...) {
-        COUTRED("MQTT Caught an unknown error while parsing message: " << formatMessage(message));
+        LOGERROR("MQTT Caught an unknown error while parsing message: " << formatMessage(message));
     }
+
+    // In durable mode, we acknowledge QoS 1/2 messages ourselves.
+    // Messages queued for the store are acknowledged when their batch
+    // is committed; anything else is acknowledged now
+
+#if WITH_MANUAL_ACK
+    if(client->durable_ && message->qos > 0 && !deferAck)
+        mosquitto_manual_ack(mosq, message->mid);
+#else
+    (void)deferAck;
+#endif
 }
 
 //-----------------------------------------------------------------------
@@ -208,23 +564,42 @@ void MosClient::message_callback(struct mosquitto *mosq, void *userdata,
 //-----------------------------------------------------------------------
 
 void MosClient::connect_callback(struct mosquitto *mosq, void *userdata,
-                                 int result)
+                                 int result, int flags)
 {
-    MosClient* client = (MosClient*)userdata;
+    Session* session = (Session*)userdata;
 
     try {
 
         if(!result) {
-            client->addSubscribeList(mosq);
-            client->connected_ = true;
+
+            MosClient* client = session->client_;
+
+            client->connectLatency_.record(client->getCurrentMicroSeconds() - session->connectStartMicros_);
+
+            if(session->everConnected_)
+                client->reconnects_.fetch_add(1, std::memory_order_relaxed);
+
+            session->everConnected_ = true;
+            session->connecting_    = false;
+            session->backoff_.reset();
+
+            // If the broker kept our session, it also kept our
+            // subscriptions
+
+            bool sessionPresent = !client->cleanSession_ && (flags & 0x1);
+
+            if(sessionPresent)
+                client->sessionsResumed_.fetch_add(1, std::memory_order_relaxed);
+
+            client->addSubscribeList(session, sessionPresent);
         } else {
-            COUT("MQTT Connect failed");
+            LOGWARN("MQTT Connect failed");
         }
 
     } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error in connect callback: " << err.what());
+        LOGERROR("MQTT Caught an error in connect callback: " << err.what());
     } catch(...) {
-        COUTRED("MQTT Caught an unknown error in connect callback");
+        LOGERROR("MQTT Caught an unknown error in connect callback");
     }
 }
 
@@ -235,14 +610,14 @@ void MosClient::connect_callback(struct mosquitto *mosq, void *userdata,
 void MosClient::disconnect_callback(struct mosquitto *mosq, void *userdata,
                                  int result)
 {
-    MosClient* client = (MosClient*)userdata;
+    Session* session = (Session*)userdata;
 
     try {
-        client->connected_ = false;
+        session->connected_ = false;
     } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error in disconnect callback: " << err.what());
+        LOGERROR("MQTT Caught an error in disconnect callback: " << err.what());
     } catch(...) {
-        COUTRED("MQTT Caught an unknown error in disconnect callback");
+        LOGERROR("MQTT Caught an unknown error in disconnect callback");
     }
 }
 
@@ -253,21 +628,67 @@ void MosClient::disconnect_callback(struct mosquitto *mosq, void *userdata,
 void MosClient::subscribe_callback(struct mosquitto *mosq, void *userdata,
                                    int mid, int qos_count, const int *granted_qos)
 {
+    Session* session = (Session*)userdata;
+
     try {
 
         std::ostringstream os;
-        os << "MQTT Subscribed (mid: " << mid << ") " << granted_qos[0];
-        
-        for(int i=1; i < qos_count; i++)
-            os << ", " << granted_qos[i];
+        os << "MQTT Subscribed (mid: " << mid << ") ";
+
+        if(qos_count > 8) {
+            os << qos_count << " topics";
+        } else {
+            os << granted_qos[0];
+            for(int i=1; i < qos_count; i++)
+                os << ", " << granted_qos[i];
+        }
         
-        COUTGREEN(os.str());
+        LOGINFO(os.str());
+
+        // If this completes the last outstanding batch sent on
+        // connect, record how long it took to become fully subscribed
+
+        if(session->pendingSubacks_.erase(mid) && session->pendingSubacks_.empty()) {
+            MosClient* client = session->client_;
+            client->subscribeLatency_.record(client->getCurrentMicroSeconds() - session->subscribeStartMicros_);
+        }
 
     } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error in subscribe callback: " << err.what());
+        LOGERROR("MQTT Caught an error in subscribe callback: " << err.what());
     } catch(...) {
-        COUTRED("MQTT Caught an unknown error in subscribe callback");
+        LOGERROR("MQTT Caught an unknown error in subscribe callback");
+    }
+}
+
+//-----------------------------------------------------------------------
+// Callback when a publish completes (for QoS > 0, when it has been
+// acknowledged)
+//-----------------------------------------------------------------------
+
+void MosClient::publish_callback(struct mosquitto *mosq, void *userdata, int mid)
+{
+    Session* session = (Session*)userdata;
+    MosClient* client = session->client_;
+
+    if(session->index_ != 0)
+        return;
+
+    client->inflightMids_.erase(mid);
+
+    // Delete an acknowledged message forwarded from the outbox
+
+    std::map<int, std::string>::iterator iter = client->outboxUnacked_.find(mid);
+
+    if(iter == client->outboxUnacked_.end())
+        return;
+
+    try {
+        client->db_.erase(std::vector<std::string>(1, iter->second));
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Caught an error in publish callback: " << err.what());
     }
+
+    client->outboxUnacked_.erase(iter);
 }
 
 //-----------------------------------------------------------------------
@@ -277,7 +698,7 @@ void MosClient::subscribe_callback(struct mosquitto *mosq, void *userdata,
 void MosClient::log_callback(struct mosquitto *mosq, void *userdata,
                              int level, const char *str)
 {
-//    COUT("MQTT Logged message: " << str);
+    LOGDEBUG("MQTT libmosquitto: " << str);
 }
 
 //=======================================================================
@@ -285,107 +706,514 @@ void MosClient::log_callback(struct mosquitto *mosq, void *userdata,
 //=======================================================================
 
 /**-----------------------------------------------------------------------
- * Top-level call to create background thread talking to the MQTT
- * broker
+ * Return the process-wide client
  */
-void MosClient::startCommsLoop()
+MosClient& MosClient::defaultClient()
 {
-    ScopedLock(instance_.mutex_);
-
-    if(instance_.mosCommsId_ != 0)
-        ThrowRuntimeError("Comms loop is already running");
-
-    if(pthread_create(&instance_.mosCommsId_, NULL, &runMosCommsLoop, &instance_) != 0)
-        ThrowRuntimeError("Unable to create comms thread");
+    return instance_;
 }
 
-#if WITH_ERL
 /**-----------------------------------------------------------------------
- * Register a calling process' erlang pid to be notified on receipt of
- * messages
+ * Reference-counted init and cleanup of the mosquitto library, which
+ * is shared by all clients
  */
-void MosClient::registerPid(ErlNifEnv* env, ErlNifPid pid)
+void MosClient::libInit()
 {
-    ScopedLock(instance_.mutex_);
-    instance_.notificationList_.insert(instance_.notificationList_.end(),
-                                       std::pair<ErlNifEnv*, ErlNifPid>(env, pid));
-}
+    ScopedLock lock(libMutex_);
 
-/**.......................................................................
- * Public method to subscribe to a new topic
- */
-void MosClient::subscribe(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format)
-{
-    ScopedLock(instance_.mutex_);
-    instance_.subscribePrivate(topic, schema, convFnVec, format);
+    if(libRefCount_++ == 0)
+        mosquitto_lib_init();
 }
-#endif
 
-/**.......................................................................
- * Return a status summary 
- */
-std::string MosClient::getStatusSummary()
+void MosClient::libCleanup()
 {
-    ScopedLock(mutex_);
-    return instance_.getStatusSummaryPrivate();
+    ScopedLock lock(libMutex_);
+
+    if(libRefCount_ > 0 && --libRefCount_ == 0)
+        mosquitto_lib_cleanup();
 }
 
-/**.......................................................................
- * Toggle logging
+/**-----------------------------------------------------------------------
+ * Top-level call to create background threads talking to the MQTT
+ * broker, one per session.
+ *
+ * Opening the store can take seconds (leveldb replays its log), so it
+ * is done without mutex_ held, before any session exists to use it.
+ * The NIF runs this on a dirty scheduler
  */
-void MosClient::toggleLogging(bool log)
+void MosClient::startCommsLoop()
 {
-    ScopedLock(instance_.mutex_);
-    instance_.toggleLoggingPrivate(log);
-}
+    bool failed = false;
+    std::string error = "Unable to create comms thread";
 
-void MosClient::toggleLoggingPrivate(bool log)
-{
-    instance_.log_ = log;
-}
+    {
+        ScopedLock lock(mutex_);
 
-#if WITH_ERL
-/**.......................................................................
- * Set options
- */
-void MosClient::setOption(ErlNifEnv* env, std::string name, ERL_NIF_TERM val)
-{
-    if(name == "host"     ||
-       name == "capath"   ||
-       name == "cafile"   ||
-       name == "certfile" ||
-       name == "keyfile"  ||
-       name == "name") {
-        
-        setOption(name, ErlUtil::getString(env, val));
+        if(!sessions_.empty() || starting_)
+            ThrowRuntimeError("Comms loop is already running");
 
-    } else if(name == "port" ||
-              name == "keepalive") {
+        if(durable_ && !store_)
+            ThrowRuntimeError("Durable mode requires a backing store: use {store, true}");
 
-        setOption(name, ErlUtil::getValAsInt32(env, val));
+        if(outbox_ && !store_)
+            ThrowRuntimeError("The outbox requires a backing store: use {store, true}");
 
-    } else if(name == "store") {
-        setOption(name, ErlUtil::getBool(env, val));
-    } else {
-        ThrowRuntimeError("Unrecognized option: " << name);
+        starting_ = true;
     }
-    
-}
+
+    try {
+        openStore();
+    } catch(...) {
+        ScopedLock lock(mutex_);
+        starting_ = false;
+        throw;
+    }
+
+    {
+        ScopedLock lock(mutex_);
+
+        starting_ = false;
+        stop_     = false;
+
+        commandTopic_ = name_ + "/command";
+
+        libInit();
+        initialized_ = true;
+
+        for(unsigned i=0; i < nSessions_; i++) {
+
+            Session* session = new Session();
+
+            session->client_    = this;
+            session->index_     = i;
+            session->mosq_      = 0;
+            session->threadId_  = 0;
+            session->started_   = false;
+            session->connected_ = false;
+            session->loop_        = 0;
+            session->fd_          = -1;
+            session->wantWrite_   = false;
+            session->connecting_  = false;
+            session->retryMicros_ = 0;
+            session->initialized_   = false;
+            session->everConnected_ = false;
+            session->nSubscribed_   = 0;
+            session->subscribeStartMicros_ = 0;
+            session->firstPendingMicros_   = 0;
+            session->receivedNs_           = 0;
+            session->connectStartMicros_ = 0;
+            session->backoff_.configure(reconnectMinMs_, reconnectMaxMs_);
+#if WITH_ERL
+            session->msgEnv_    = enif_alloc_env();
+            session->rowTopic_  = 0;
+            session->haveRow_   = false;
 #endif
+            sessions_.push_back(session);
+        }
 
-/**.......................................................................
- * Set a boolean option
- */
-void MosClient::setOption(std::string name, bool val)
-{
-    ScopedLock(instance_.mutex_);
+        //------------------------------------------------------------
+        // Start the bridge before any messages can arrive for it
+        //------------------------------------------------------------
 
-    if(instance_.mosCommsId_ != 0)
-        ThrowRuntimeError("Connection options can't be changed once the comms loop has been started");
+        if(!bridgeHost_.empty()) {
+            try {
+                startBridge();
+            } catch(std::runtime_error& err) {
+                error  = std::string("Unable to start bridge: ") + err.what();
+                failed = true;
+            }
+        }
 
-    if(name == "store") {
-        instance_.store_ = val;
-    } else {
+        if(!failed && metricsPort_ > 0) {
+            try {
+                metricsServer_.start(metricsAddr_, metricsPort_, renderMetrics, this);
+            } catch(std::runtime_error& err) {
+                error  = err.what();
+                failed = true;
+            }
+        }
+
+        //------------------------------------------------------------
+        // In event-loop mode, distribute the sessions round-robin
+        // over the loop threads.  Else give each session its own
+        // thread
+        //------------------------------------------------------------
+
+        if(eventLoop_) {
+
+            unsigned nLoop = loopThreads_ < nSessions_ ? loopThreads_ : nSessions_;
+
+            try {
+                for(unsigned i=0; i < nLoop; i++) {
+                    Loop* loop = new Loop();
+
+                    loop->client_    = this;
+                    loop->index_     = i;
+                    loop->eventLoop_ = 0;
+                    loop->threadId_  = 0;
+                    loop->started_   = false;
+
+                    loops_.push_back(loop);
+
+                    loop->eventLoop_ = new EventLoop();
+                }
+            } catch(...) {
+                failed = true;
+            }
+
+            for(unsigned i=0; !failed && i < sessions_.size(); i++) {
+                Loop* loop = loops_[i % loops_.size()];
+                sessions_[i]->loop_ = loop;
+                loop->sessions_.push_back(sessions_[i]);
+            }
+
+            for(unsigned i=0; !failed && i < loops_.size(); i++) {
+
+                Loop* loop = loops_[i];
+
+                if(pthread_create(&loop->threadId_, NULL, &runEventLoop, loop) != 0) {
+                    failed = true;
+                    break;
+                }
+
+                loop->started_ = true;
+            }
+
+        } else {
+
+            for(unsigned i=0; !failed && i < sessions_.size(); i++) {
+
+                Session* session = sessions_[i];
+
+                if(pthread_create(&session->threadId_, NULL, &runMosCommsLoop, session) != 0) {
+                    failed = true;
+                    break;
+                }
+
+                session->started_ = true;
+            }
+        }
+    }
+
+    // If we couldn't start all threads, tear down the ones we did
+    // start
+
+    if(failed) {
+        stopCommsLoop();
+        ThrowRuntimeError(error);
+    }
+
+    running_.store(true);
+}
+
+/**.......................................................................
+ * Open the store, if we are using one, check its format, and find
+ * anything left in the outbox.  The store is shared by all sessions
+ */
+void MosClient::openStore()
+{
+#if WITH_LEVELDB
+    if(!store_)
+        return;
+
+    dbName_ = "/tmp/" + name_;
+    db_.open(dbName_);
+
+    try {
+        checkStoreFormat();
+
+        if(outbox_)
+            recoverOutbox();
+
+    } catch(...) {
+        db_.close();
+        throw;
+    }
+#endif
+}
+
+/**.......................................................................
+ * Tell the background threads to stop, without waiting for them.
+ * stopCommsLoop() (or the destructor) must still be called to join
+ * them, but will then not have to wait for a dump or a reconnect
+ * delay to notice
+ */
+void MosClient::requestStop()
+{
+    ScopedLock lock(mutex_);
+    requestStopPrivate();
+}
+
+void MosClient::requestStopPrivate()
+{
+    if(sessions_.empty())
+        return;
+
+    running_.store(false);
+    stop_ = true;
+
+    for(unsigned i=0; i < sessions_.size(); i++) {
+        if(sessions_[i]->mosq_)
+            mosquitto_disconnect(sessions_[i]->mosq_);
+    }
+
+    wakeLoops();
+}
+
+/**-----------------------------------------------------------------------
+ * Stop the background threads, if they are running, and wait for
+ * them to exit.  This can take up to the 1-second reconnect interval
+ * if a session is between connection attempts.  Any dump or replay
+ * in progress is stopped, and waited for, before the store is closed
+ */
+void MosClient::stopCommsLoop()
+{
+    std::vector<Session*> sessions;
+    std::vector<Loop*> loops;
+
+    {
+        ScopedLock lock(mutex_);
+
+        if(sessions_.empty())
+            return;
+
+        requestStopPrivate();
+
+        sessions = sessions_;
+        loops    = loops_;
+    }
+
+    // Scrapes can take mutex_, so stop serving them without it
+
+    metricsServer_.stop();
+
+    for(unsigned i=0; i < sessions.size(); i++) {
+        if(sessions[i]->started_)
+            pthread_join(sessions[i]->threadId_, NULL);
+    }
+
+    for(unsigned i=0; i < loops.size(); i++) {
+        if(loops[i]->started_)
+            pthread_join(loops[i]->threadId_, NULL);
+    }
+
+    // Nothing more will be received, so the bridge can go too
+
+    stopBridge();
+
+    // Anything still queued goes to the outbox, to be forwarded on the
+    // next start
+
+    if(outbox_) {
+        try {
+            while(processPublishQueue(sessions[0], false))
+                ;
+        } catch(std::runtime_error& err) {
+            LOGERROR("MQTT Error saving queued messages to the outbox: " << err.what());
+        }
+    }
+
+    // Dumps and replays read the store without a lock.  They see
+    // running_ cleared, and give up within a chunk, so wait for them
+    // before closing it
+
+    while(replaysInFlight_.load() > 0) {
+        struct timespec delay;
+        delay.tv_sec  = 0;
+        delay.tv_nsec = 10000000;
+        nanosleep(&delay, 0);
+    }
+
+    ScopedLock lock(mutex_);
+
+    for(unsigned i=0; i < loops.size(); i++) {
+        delete loops[i]->eventLoop_;
+        delete loops[i];
+    }
+
+    loops_.clear();
+
+    for(unsigned i=0; i < sessions.size(); i++) {
+#if WITH_ERL
+        enif_free_env(sessions[i]->msgEnv_);
+#endif
+        delete sessions[i];
+    }
+
+    sessions_.clear();
+
+#if WITH_LEVELDB
+    if(store_)
+        db_.close();
+#endif
+
+    if(initialized_) {
+        libCleanup();
+        initialized_ = false;
+    }
+}
+
+#if WITH_ERL
+/**-----------------------------------------------------------------------
+ * Register a calling process' erlang pid to be notified on receipt of
+ * messages
+ */
+void MosClient::registerPid(ErlNifEnv* env, ErlNifPid pid)
+{
+    ScopedLock lock(mutex_);
+
+    NotifyList* prev = notifyList_.load(std::memory_order_acquire);
+    NotifyList* next = new NotifyList(*prev);
+
+    next->push_back(std::pair<ErlNifEnv*, ErlNifPid>(env, pid));
+
+    notifyList_.store(next, std::memory_order_release);
+    retiredNotifyLists_.push_back(prev);
+}
+
+/**.......................................................................
+ * Public method to subscribe to a new topic
+ */
+void MosClient::subscribe(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format, int qos)
+{
+    if(qos < 0 || qos > 2)
+        ThrowRuntimeError("Invalid QoS: " << qos << " (should be 0, 1 or 2)");
+
+    ScopedLock lock(mutex_);
+    subscribePrivate(topic, schema, convFnVec, format, qos);
+}
+#endif
+
+/**.......................................................................
+ * Return a status summary 
+ */
+std::string MosClient::getStatusSummary()
+{
+    ScopedLock lock(mutex_);
+    return getStatusSummaryPrivate();
+}
+
+/**.......................................................................
+ * Toggle logging
+ */
+void MosClient::toggleLogging(bool log)
+{
+    ScopedLock lock(mutex_);
+    toggleLoggingPrivate(log);
+}
+
+void MosClient::toggleLoggingPrivate(bool log)
+{
+    log_ = log;
+}
+
+#if WITH_ERL
+/**.......................................................................
+ * Set options
+ */
+void MosClient::setOption(ErlNifEnv* env, std::string name, ERL_NIF_TERM val)
+{
+    if(name == "host"     ||
+       name == "capath"   ||
+       name == "cafile"   ||
+       name == "certfile" ||
+       name == "keyfile"  ||
+       name == "name"     ||
+       name == "share_group" ||
+       name == "client_id" ||
+       name == "bridge_host" ||
+       name == "metrics_addr") {
+        
+        setOption(name, ErlUtil::getString(env, val));
+
+    } else if(name == "store_codec" ||
+              name == "store_format") {
+
+        setOption(name, ErlUtil::getAsString(env, val));
+
+    } else if(name == "port"      ||
+              name == "keepalive" ||
+              name == "sessions"  ||
+              name == "loop_threads" ||
+              name == "reconnect_min_ms" ||
+              name == "reconnect_max_ms" ||
+              name == "subscribe_batch" ||
+              name == "durable_batch"   ||
+              name == "durable_flush_ms" ||
+              name == "publish_queue_max" ||
+              name == "publish_inflight" ||
+              name == "bridge_port" ||
+              name == "bridge_qos" ||
+              name == "bridge_queue_max" ||
+              name == "metrics_port") {
+
+        setOption(name, ErlUtil::getValAsInt32(env, val));
+
+    } else if(name == "store"      ||
+              name == "event_loop" ||
+              name == "clean_session" ||
+              name == "durable" ||
+              name == "outbox") {
+        setOption(name, ErlUtil::getBool(env, val));
+    } else {
+        ThrowRuntimeError("Unrecognized option: " << name);
+    }
+    
+}
+#endif
+
+/**.......................................................................
+ * Install a hook to be called on each received message
+ */
+void MosClient::setMessageHook(MESSAGE_FN fn, void* arg)
+{
+    ScopedLock lock(mutex_);
+
+    if(!sessions_.empty())
+        ThrowRuntimeError("The message hook can't be changed once the comms loop has been started");
+
+    messageHookFn_  = fn;
+    messageHookArg_ = arg;
+}
+
+/**.......................................................................
+ * Set a boolean option
+ */
+void MosClient::setOption(std::string name, bool val)
+{
+    ScopedLock lock(mutex_);
+
+    if(!sessions_.empty())
+        ThrowRuntimeError("Connection options can't be changed once the comms loop has been started");
+
+    if(name == "store") {
+        store_ = val;
+    } else if(name == "clean_session") {
+        cleanSession_ = val;
+    } else if(name == "durable") {
+
+#if !WITH_LEVELDB || !WITH_MANUAL_ACK
+        if(val)
+            ThrowRuntimeError("Durable mode requires compiling with MQTT_USE_LEVELDB=1 and MQTT_USE_MANUAL_ACK=1");
+#endif
+        durable_ = val;
+
+    } else if(name == "outbox") {
+
+#if !WITH_LEVELDB
+        if(val)
+            ThrowRuntimeError("The outbox requires compiling with MQTT_USE_LEVELDB=1");
+#endif
+        outbox_ = val;
+
+    } else if(name == "event_loop") {
+
+        if(val && !EventLoop::isSupported())
+            ThrowRuntimeError("The event loop is not supported on this platform");
+
+        eventLoop_ = val;
+
+    } else {
         ThrowRuntimeError("Unrecognized option: " << name);
     }
 }
@@ -395,15 +1223,101 @@ void MosClient::setOption(std::string name, bool val)
  */
 void MosClient::setOption(std::string name, int val)
 {
-    ScopedLock(instance_.mutex_);
+    ScopedLock lock(mutex_);
 
-    if(instance_.mosCommsId_ != 0)
+    if(!sessions_.empty())
         ThrowRuntimeError("Connection options can't be changed once the comms loop has been started");
 
     if(name == "port") {
-        instance_.port_ = val;
+        port_ = val;
     } else if(name == "keepalive") {
-        instance_.keepAlive_ =  val;
+        keepAlive_ =  val;
+    } else if(name == "sessions") {
+
+        if(val < 1)
+            ThrowRuntimeError("Number of sessions must be at least 1");
+
+        nSessions_ = val;
+
+    } else if(name == "loop_threads") {
+
+        if(val < 1)
+            ThrowRuntimeError("Number of loop threads must be at least 1");
+
+        loopThreads_ = val;
+
+    } else if(name == "reconnect_min_ms") {
+
+        if(val < 1)
+            ThrowRuntimeError("Minimum reconnect delay must be at least 1 ms");
+
+        reconnectMinMs_ = val;
+
+    } else if(name == "reconnect_max_ms") {
+
+        if(val < 1)
+            ThrowRuntimeError("Maximum reconnect delay must be at least 1 ms");
+
+        reconnectMaxMs_ = val;
+
+    } else if(name == "subscribe_batch") {
+
+        if(val < 1)
+            ThrowRuntimeError("Subscribe batch size must be at least 1");
+
+        subscribeBatch_ = val;
+
+    } else if(name == "durable_batch") {
+
+        if(val < 1)
+            ThrowRuntimeError("Durable batch size must be at least 1");
+
+        durableBatch_ = val;
+
+    } else if(name == "durable_flush_ms") {
+
+        if(val < 1)
+            ThrowRuntimeError("Durable flush interval must be at least 1 ms");
+
+        durableFlushMs_ = val;
+
+    } else if(name == "publish_queue_max") {
+
+        if(val < 1)
+            ThrowRuntimeError("Publish queue size must be at least 1");
+
+        publishQueueMax_ = val;
+
+    } else if(name == "bridge_port") {
+        bridgePort_ = val;
+    } else if(name == "bridge_qos") {
+
+        if(val < -1 || val > 2)
+            ThrowRuntimeError("Invalid bridge QoS: " << val << " (should be 0, 1 or 2, or -1 for the received QoS)");
+
+        bridgeQos_ = val;
+
+    } else if(name == "bridge_queue_max") {
+
+        if(val < 1)
+            ThrowRuntimeError("Bridge queue size must be at least 1");
+
+        bridgeQueueMax_ = val;
+
+    } else if(name == "publish_inflight") {
+
+        if(val < 1)
+            ThrowRuntimeError("Publish in-flight limit must be at least 1");
+
+        publishInflight_ = val;
+
+    } else if(name == "metrics_port") {
+
+        if(val < 0 || val > 65535)
+            ThrowRuntimeError("Invalid metrics port: " << val << " (should be 1-65535, or 0 for none)");
+
+        metricsPort_ = val;
+
     } else {
         ThrowRuntimeError("Unrecognized option: " << name);
     }
@@ -414,57 +1328,502 @@ void MosClient::setOption(std::string name, int val)
  */
 void MosClient::setOption(std::string name, std::string val)
 {
-    ScopedLock(instance_.mutex_);
+    ScopedLock lock(mutex_);
 
-    if(instance_.mosCommsId_ != 0)
+    if(!sessions_.empty())
         ThrowRuntimeError("Connection options can't be changed once the comms loop has been started");
 
     if(name == "name") {
-        instance_.name_     = val;
+        name_     = val;
     } else if(name == "host") {
-        instance_.host_     = val;
+        host_     = val;
     } else if(name == "capath") {
-        instance_.useCerts_ = true;
-        instance_.caPath_   = val;
+        useCerts_ = true;
+        caPath_   = val;
     } else if(name == "cafile") {
-        instance_.useCerts_ = true;
-        instance_.caFile_   = val;
+        useCerts_ = true;
+        caFile_   = val;
     } else if(name == "certfile") {
-        instance_.useCerts_ = true;
-        instance_.certFile_ = val;
+        useCerts_ = true;
+        certFile_ = val;
     } else if(name == "keyfile") {
-        instance_.useCerts_ = true;
-        instance_.keyFile_  = val;
+        useCerts_ = true;
+        keyFile_  = val;
+    } else if(name == "share_group") {
+        shareGroup_ = val;
+    } else if(name == "client_id") {
+        clientId_ = val;
+    } else if(name == "bridge_host") {
+        bridgeHost_ = val;
+    } else if(name == "metrics_addr") {
+        metricsAddr_ = val;
+    } else if(name == "store_codec") {
+        storeCodec_ = StoreCodec::codecFor(val);
+    } else if(name == "store_format") {
+        if(val == "row") {
+#if WITH_ERL
+            storeRows_ = true;
+#else
+            ThrowRuntimeError("The row store format requires compiling with WITH_ERL=1");
+#endif
+        } else if(val == "text") {
+            storeRows_ = false;
+        } else {
+            ThrowRuntimeError("Unrecognized store format: " << val << " (should be text or row)");
+        }
     } else {
         ThrowRuntimeError("Unrecognized option: " << name);
     }
 }
 
-//=======================================================================
-// Utility functions
-//=======================================================================
-
 /**.......................................................................
- * Format a MOSQ error code
+ * Queue a message for publishing.  The payload is copied
  */
-std::string MosClient::formatMosError(int errVal)
+void MosClient::publish(std::string topic, std::string payload, int qos, bool retain)
 {
-    std::string retStr;
-    
-    switch (errVal) {
-    case MOSQ_ERR_INVAL:
-        retStr = "Invalid parameters";
-        break;
-    case MOSQ_ERR_NOMEM:
-        retStr = "Out of memory";
-        break;
-    case MOSQ_ERR_NO_CONN:
-        retStr = "Not connected to broker";
-        break;
-    default:
-        retStr = "success";
-        break;
-    }
+    if(qos < 0 || qos > 2)
+        ThrowRuntimeError("Invalid QoS: " << qos << " (should be 0, 1 or 2)");
+
+    PublishRequest* request = new PublishRequest();
+
+    request->qos_    = qos;
+    request->retain_ = retain;
+
+    request->items_.resize(1);
+    request->items_[0].topic_   = topic;
+    request->items_[0].payload_ = 0;
+    request->items_[0].len_     = payload.size();
+    request->items_[0].data_    = payload;
+
+    enqueuePublish(request);
+}
+
+#if WITH_ERL
+/**.......................................................................
+ * Queue a batch of {Topic, Payload} messages for publishing.
+ * Payloads may be binaries or iolists.  Binaries are not copied:
+ * refc binaries are shared with the request's env, and iolists are
+ * flattened once, into that env
+ */
+void MosClient::publish(ErlNifEnv* env, std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> >& messages, int qos, bool retain)
+{
+    if(qos < 0 || qos > 2)
+        ThrowRuntimeError("Invalid QoS: " << qos << " (should be 0, 1 or 2)");
+
+    if(messages.empty())
+        return;
+
+    PublishRequest* request = new PublishRequest();
+
+    request->qos_    = qos;
+    request->retain_ = retain;
+    request->env_    = enif_alloc_env();
+
+    try {
+
+        request->items_.resize(messages.size());
+
+        for(unsigned i=0; i < messages.size(); i++) {
+
+            PublishItem& item = request->items_[i];
+
+            item.topic_ = ErlUtil::getAsString(env, messages[i].first);
+
+            if(item.topic_.empty())
+                ThrowRuntimeError("Topic can't be empty");
+
+            ERL_NIF_TERM payload = enif_make_copy(request->env_, messages[i].second);
+            ErlNifBinary bin;
+
+            if(!enif_inspect_iolist_as_binary(request->env_, payload, &bin))
+                ThrowRuntimeError("Payload for topic " << item.topic_ << " must be a binary or iolist");
+
+            item.payload_ = bin.data;
+            item.len_     = bin.size;
+        }
+
+    } catch(...) {
+        delete request;
+        throw;
+    }
+
+    enqueuePublish(request);
+}
+#endif
+
+/**.......................................................................
+ * Pass a request to the publishing thread
+ */
+void MosClient::enqueuePublish(PublishRequest* request)
+{
+    if(!running_.load()) {
+        delete request;
+        ThrowRuntimeError("Comms loop is not running");
+    }
+
+    // Push back on the caller, rather than grow without bound.  Room
+    // is reserved before checking, so that concurrent publishers
+    // can't overshoot the cap between the check and the add
+
+    unsigned nItem = request->items_.size();
+
+    if(publishQueued_.fetch_add(nItem) + nItem > publishQueueMax_) {
+        publishQueued_.fetch_sub(nItem);
+        delete request;
+        ThrowRuntimeError("Publish queue is full (" << publishQueueMax_ << " messages)");
+    }
+
+    publishQueue_.push(request);
+    wakePublisher();
+}
+
+/**.......................................................................
+ * Wake the thread servicing session 0, unless a wakeup is already
+ * pending
+ */
+void MosClient::wakePublisher()
+{
+    if(publishPipe_[1] < 0 || publishWakePending_.exchange(true))
+        return;
+
+    char byte = 0;
+    ssize_t ret = write(publishPipe_[1], &byte, 1);
+    (void)ret;
+}
+
+/**.......................................................................
+ * Publish what we can on session 0: first anything backlogged in the
+ * outbox, then queued requests.  The socket is corked while we do so
+ * (where supported), so that many small PUBLISH packets are coalesced
+ * into full segments.  Called on every pass of session 0's loop,
+ * connected or not
+ */
+void MosClient::drainPublishQueue(Session* session)
+{
+    // Clear the flag before popping, so that a request pushed from
+    // here on triggers another wakeup
+
+    publishWakePending_.store(false);
+
+    bool connected = session->connected_;
+    bool more      = false;
+
+    int sock = connected ? mosquitto_socket(session->mosq_) : -1;
+    setCork(sock, true);
+
+    try {
+
+        if(connected && outbox_)
+            more = forwardOutbox(session);
+
+        more = processPublishQueue(session, connected) || more;
+
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Caught an error while publishing: " << err.what());
+    }
+
+    setCork(sock, false);
+
+    // If we stopped early, make sure we come back
+
+    if(more)
+        wakePublisher();
+}
+
+/**.......................................................................
+ * Publish queued requests.  Messages are published directly if we
+ * are connected, nothing is waiting in the outbox, and flow control
+ * allows.  Otherwise they are appended to the outbox if we have one,
+ * or left queued until we can publish them.  Returns true if there
+ * may be more to do right away
+ */
+bool MosClient::processPublishQueue(Session* session, bool connected)
+{
+    static const unsigned MAX_REQUESTS = 1024;
+
+    std::vector<std::pair<std::string, std::string> > spill;
+    unsigned nRequest = 0;
+    bool blocked = false;
+
+    while(!blocked && nRequest < MAX_REQUESTS) {
+
+        if(!pendingRequest_ && !(pendingRequest_ = publishQueue_.pop()))
+            break;
+
+        PublishRequest* request = pendingRequest_;
+
+        for(; pendingItem_ < request->items_.size(); pendingItem_++) {
+
+            PublishItem& item   = request->items_[pendingItem_];
+            const void* payload = item.payload_ ? item.payload_ : item.data_.data();
+            bool backlog        = outboxHead_.load() != outboxTail_.load();
+
+            if(connected && !backlog && canPublish(session, request->qos_)) {
+
+                // Without an outbox, a message that fails to publish
+                // is dropped (and counted)
+
+                if(publishItem(session, item.topic_, item.len_, payload, request->qos_, request->retain_) < 0 && outbox_)
+                    spill.push_back(outboxEntry(item, request->qos_, request->retain_));
+
+            } else if(outbox_) {
+                spill.push_back(outboxEntry(item, request->qos_, request->retain_));
+            } else {
+                blocked = true;
+                break;
+            }
+
+            publishQueued_.fetch_sub(1);
+        }
+
+        if(blocked)
+            break;
+
+        delete request;
+        pendingRequest_ = 0;
+        pendingItem_    = 0;
+        ++nRequest;
+    }
+
+    if(!spill.empty()) {
+        db_.writeBatch(spill, false);
+        outboxSpilled_.fetch_add(spill.size());
+    }
+
+    return nRequest == MAX_REQUESTS;
+}
+
+/**.......................................................................
+ * Return true if flow control allows another message at this QoS:
+ * the socket must not be backed up, and QoS > 0 messages must not
+ * exceed the in-flight limit
+ */
+bool MosClient::canPublish(Session* session, int qos)
+{
+    if(mosquitto_want_write(session->mosq_))
+        return false;
+
+    return qos == 0 || inflightMids_.size() < publishInflight_;
+}
+
+/**.......................................................................
+ * Publish one message on a session.  Returns the message id, or -1
+ * on failure
+ */
+int MosClient::publishItem(Session* session, const std::string& topic, size_t len, const void* payload, int qos, bool retain)
+{
+    int mid = 0;
+    int retVal = mosquitto_publish(session->mosq_, &mid, topic.c_str(), len, payload, qos, retain);
+
+    if(retVal != MOSQ_ERR_SUCCESS) {
+        publishFailures_.fetch_add(1, std::memory_order_relaxed);
+        LOG("MQTT Failed to publish to " << topic << ": " << formatMosError(retVal));
+        return -1;
+    }
+
+    published_.fetch_add(1, std::memory_order_relaxed);
+
+    if(qos > 0)
+        inflightMids_.insert(mid);
+
+    return mid;
+}
+
+//=======================================================================
+// Outbox
+//=======================================================================
+
+/**.......................................................................
+ * Forward messages from the outbox, in order, while flow control
+ * allows.  QoS 0 messages are deleted once handed to the library,
+ * QoS > 0 messages once acknowledged.  Returns true if there may be
+ * more to do right away
+ */
+bool MosClient::forwardOutbox(Session* session)
+{
+    static const unsigned MAX_FORWARD = 256;
+
+    uint64_t head = outboxHead_.load();
+    uint64_t tail = outboxTail_.load();
+
+    if(head == tail)
+        return false;
+
+    std::vector<std::pair<std::string, std::string> > entries;
+    db_.scan(outboxKey(head), outboxKey(tail), MAX_FORWARD, entries);
+
+    // Nothing left (e.g., a spill failed to write) -- catch up
+
+    if(entries.empty()) {
+        outboxHead_.store(tail);
+        return false;
+    }
+
+    std::vector<std::string> done;
+    unsigned i=0;
+
+    for(; i < entries.size(); i++) {
+
+        const std::string& key = entries[i].first;
+        const std::string& val = entries[i].second;
+        uint64_t seq = strtoull(key.c_str() + OUTBOX_PREFIX.size(), NULL, 16);
+
+        std::string topic;
+        int qos=0;
+        bool retain=false;
+        size_t offset=0;
+
+        if(!decodeOutbox(val, topic, qos, retain, offset)) {
+            LOGERROR("MQTT Discarding malformed outbox entry: " << key);
+            done.push_back(key);
+            outboxHead_.store(seq+1);
+            continue;
+        }
+
+        if(!canPublish(session, qos))
+            break;
+
+        int mid = publishItem(session, topic, val.size() - offset, val.data() + offset, qos, retain);
+
+        if(mid < 0)
+            break;
+
+        if(qos > 0)
+            outboxUnacked_[mid] = key;
+        else
+            done.push_back(key);
+
+        outboxHead_.store(seq+1);
+        outboxForwarded_.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    db_.erase(done);
+
+    return i == MAX_FORWARD;
+}
+
+/**.......................................................................
+ * Find messages left in the outbox by a previous run, so that they
+ * are forwarded first.  Called when the store is opened
+ */
+void MosClient::recoverOutbox()
+{
+    std::string first, last;
+
+    outboxUnacked_.clear();
+    inflightMids_.clear();
+
+    if(!db_.bounds(OUTBOX_PREFIX, OUTBOX_LIMIT, first, last)) {
+        outboxHead_.store(0);
+        outboxTail_.store(0);
+        return;
+    }
+
+    outboxHead_.store(strtoull(first.c_str() + OUTBOX_PREFIX.size(), NULL, 16));
+    outboxTail_.store(strtoull(last.c_str()  + OUTBOX_PREFIX.size(), NULL, 16) + 1);
+
+    LOGINFO("MQTT Found up to " << outboxTail_.load() - outboxHead_.load() << " messages in the outbox");
+}
+
+/**.......................................................................
+ * Return the store entry for a message appended to the outbox.  The
+ * value is: QoS (1 byte), retain (1 byte), topic length (2 bytes, big
+ * endian), topic, payload
+ */
+std::pair<std::string, std::string> MosClient::outboxEntry(PublishItem& item, int qos, bool retain)
+{
+    const char* payload = item.payload_ ? (const char*)item.payload_ : item.data_.data();
+
+    std::string val;
+    val.reserve(4 + item.topic_.size() + item.len_);
+
+    val.push_back((char)qos);
+    val.push_back((char)(retain ? 1 : 0));
+    val.push_back((char)((item.topic_.size() >> 8) & 0xFF));
+    val.push_back((char)(item.topic_.size() & 0xFF));
+    val.append(item.topic_);
+    val.append(payload, item.len_);
+
+    return std::pair<std::string, std::string>(outboxKey(outboxTail_.fetch_add(1)), val);
+}
+
+bool MosClient::decodeOutbox(const std::string& val, std::string& topic, int& qos, bool& retain, size_t& offset)
+{
+    if(val.size() < 4)
+        return false;
+
+    qos    = (unsigned char)val[0];
+    retain = val[1] != 0;
+
+    size_t topicLen = ((unsigned char)val[2] << 8) | (unsigned char)val[3];
+
+    if(qos > 2 || val.size() < 4 + topicLen)
+        return false;
+
+    topic  = val.substr(4, topicLen);
+    offset = 4 + topicLen;
+
+    return true;
+}
+
+/**.......................................................................
+ * Keys are zero-padded hex, so that store order is outbox order
+ */
+std::string MosClient::outboxKey(uint64_t seq)
+{
+    char buf[17];
+    snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)seq);
+    return OUTBOX_PREFIX + buf;
+}
+
+/**.......................................................................
+ * Drain a non-blocking wakeup pipe
+ */
+void MosClient::drainPipe(int fd)
+{
+    char buf[64];
+    while(read(fd, buf, sizeof(buf)) > 0)
+        ;
+}
+
+/**.......................................................................
+ * Cork or uncork a TCP socket.  Uncorking flushes anything held
+ */
+void MosClient::setCork(int sock, bool cork)
+{
+#if defined(TCP_CORK)
+    if(sock >= 0) {
+        int val = cork ? 1 : 0;
+        setsockopt(sock, IPPROTO_TCP, TCP_CORK, &val, sizeof(val));
+    }
+#endif
+}
+
+//=======================================================================
+// Utility functions
+//=======================================================================
+
+/**.......................................................................
+ * Format a MOSQ error code
+ */
+std::string MosClient::formatMosError(int errVal)
+{
+    std::string retStr;
+    
+    switch (errVal) {
+    case MOSQ_ERR_INVAL:
+        retStr = "Invalid parameters";
+        break;
+    case MOSQ_ERR_NOMEM:
+        retStr = "Out of memory";
+        break;
+    case MOSQ_ERR_NO_CONN:
+        retStr = "Not connected to broker";
+        break;
+    default:
+        retStr = "success";
+        break;
+    }
 
     return retStr;
 }
@@ -475,364 +1834,1063 @@ std::string MosClient::formatMosError(int errVal)
  * the topic was subscribed to convert the data to a ready-to-ingest
  * message for TS
  */
-ERL_NIF_TERM MosClient::formatForTs(const struct mosquitto_message* message)
+ERL_NIF_TERM MosClient::formatForTs(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc)
 {
     //------------------------------------------------------------
     // First the msg code
     //------------------------------------------------------------
     
     std::vector<ERL_NIF_TERM> termVec;
-    termVec.push_back(enif_make_atom(msgEnv_, "tsputreq"));
+    termVec.push_back(atomTsPutReq_);
     
     //------------------------------------------------------------
     // First the table name
     //------------------------------------------------------------
     
-    std::string topic = message->topic;
-    termVec.push_back(ErlUtil::stringToBinaryTerm(msgEnv_, topic));
+    termVec.push_back(enif_make_copy(env, topicDesc.binTerm_));
 
     //------------------------------------------------------------
     // Empty list
     //------------------------------------------------------------
     
-    termVec.push_back(enif_make_list(msgEnv_, 0));
+    termVec.push_back(enif_make_list(env, 0));
+
+    //------------------------------------------------------------
+    // Next the table data
+    //------------------------------------------------------------
+
+    ERL_NIF_TERM dataTuple = formatData(env, message, topicDesc);
+    termVec.push_back(enif_make_list(env, 1, dataTuple));
+
+    //------------------------------------------------------------
+    // Finally, return a tuple from the array we just constructed
+    //------------------------------------------------------------
+    
+    return enif_make_tuple_from_array(env, &termVec[0], termVec.size());
+}
+
+/**.......................................................................
+ * Uses the schema supplied when the topic was subscribed to convert
+ * the data to an erlang tuple of converted terms.  If dataOut is
+ * given, the data tuple is also returned in it
+ */
+ERL_NIF_TERM MosClient::formatForSchema(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc, ERL_NIF_TERM* dataOut)
+{
+    //------------------------------------------------------------
+    // First the table name
+    //------------------------------------------------------------
+    
+    ERL_NIF_TERM topic   = enif_make_copy(env, topicDesc.nameTerm_);
 
     //------------------------------------------------------------
     // Next the table data
     //------------------------------------------------------------
 
-    ERL_NIF_TERM dataTuple = formatData(message);
-    termVec.push_back(enif_make_list(msgEnv_, 1, dataTuple));
+    ERL_NIF_TERM dataTuple = formatData(env, message, topicDesc);
+
+    if(dataOut)
+        *dataOut = dataTuple;
 
     //------------------------------------------------------------
     // Finally, return a tuple from the array we just constructed
     //------------------------------------------------------------
     
-    return enif_make_tuple_from_array(msgEnv_, &termVec[0], termVec.size());
+    return enif_make_tuple2(env, topic, dataTuple);
+}
+
+/**.......................................................................
+ * Format data encoded as a string
+ */
+ERL_NIF_TERM MosClient::formatData(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc)
+{
+    switch(topicDesc.format_) {
+    case FORMAT_JSON:
+        return formatDataJson(env, message, topicDesc);
+        break;
+    default:
+        return formatDataCsv(env, message, topicDesc);
+        break;
+    }
+}        
+
+/**.......................................................................
+ * Format TS data encoded as CSV string
+ */
+ERL_NIF_TERM MosClient::formatDataCsv(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc)
+{
+    if(topicDesc.csvDecoder_)
+        return decodeCsv(env, message, topicDesc);
+
+    std::vector<STRING_CONV_FN_PTR>& convFnVec = topicDesc.convFnVec_;
+    
+    unsigned nTerm = convFnVec.size();
+    std::vector<ERL_NIF_TERM> dataTerms;
+    std::ostringstream os;
+    const char* str = (const char*)message->payload;
+        
+    if(nTerm > 0) {
+
+        dataTerms.resize(nTerm);
+        
+        unsigned iTerm=0;
+        for(int i=0; i <= message->payloadlen; i++) {
+            
+            if(i == message->payloadlen || str[i] == ',') {
+                if(iTerm < nTerm) {
+                    dataTerms[iTerm] = convertTerm(env, topicDesc, iTerm, os.str());
+                    os.str("");
+                    iTerm++;
+                } else {
+                    topicDesc.stats_->recordError(TopicStats::TOO_MANY_TERMS);
+                    ThrowRuntimeError("Invalid data received for schema " << message->topic << " (too many terms)"
+                                      << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
+                }
+            } else {
+                os << str[i];
+            }
+        }
+        
+        // Did we convert enough terms?
+    
+        if(iTerm != nTerm) {
+            topicDesc.stats_->recordError(TopicStats::TOO_FEW_TERMS);
+            ThrowRuntimeError("Invalid data received for schema " << message->topic << " (not enough terms)"
+                              << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
+        }
+
+        // Else just process the message in toto as a single string
+        
+    } else {
+
+        nTerm = 1;
+        
+        for(int i=0; i < message->payloadlen; i++)
+            os << str[i];
+
+        dataTerms.resize(1);
+        dataTerms[0] = ErlUtil::stringToBinaryTerm(env, os.str());
+    }
+    
+    return enif_make_tuple_from_array(env, &dataTerms[0], nTerm);
+}
+
+/**.......................................................................
+ * Format CSV data with the topic's specialized decoder, with the same
+ * results as the generic path in formatDataCsv()
+ */
+ERL_NIF_TERM MosClient::decodeCsv(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc)
+{
+    static const unsigned MAX_STACK_TERMS = 32;
+
+    unsigned nTerm = topicDesc.convFnVec_.size();
+
+    ERL_NIF_TERM stackTerms[MAX_STACK_TERMS];
+    std::vector<ERL_NIF_TERM> heapTerms;
+    ERL_NIF_TERM* dataTerms = stackTerms;
+
+    if(nTerm > MAX_STACK_TERMS) {
+        heapTerms.resize(nTerm);
+        dataTerms = &heapTerms[0];
+    }
+
+    RowDecoder::Result result;
+
+    try {
+        result = topicDesc.csvDecoder_(env, (const char*)message->payload, message->payloadlen, dataTerms, nTerm);
+    } catch(...) {
+        topicDesc.stats_->recordError(TopicStats::BAD_VALUE);
+        throw;
+    }
+
+    if(result == RowDecoder::TOO_MANY_TERMS) {
+        topicDesc.stats_->recordError(TopicStats::TOO_MANY_TERMS);
+        ThrowRuntimeError("Invalid data received for schema " << message->topic << " (too many terms)"
+                          << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
+    }
+
+    if(result == RowDecoder::TOO_FEW_TERMS) {
+        topicDesc.stats_->recordError(TopicStats::TOO_FEW_TERMS);
+        ThrowRuntimeError("Invalid data received for schema " << message->topic << " (not enough terms)"
+                          << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
+    }
+
+    return enif_make_tuple_from_array(env, dataTerms, nTerm);
+}
+
+/**.......................................................................
+ * Format TS data encoded as JSON string
+ */
+ERL_NIF_TERM MosClient::formatDataJson(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc)
+{
+    std::vector<STRING_CONV_FN_PTR>& convFnVec = topicDesc.convFnVec_;
+    
+    unsigned nTerm = convFnVec.size();
+    std::vector<ERL_NIF_TERM> dataTerms(nTerm);
+
+
+    const char* str = (const char*)message->payload;
+    
+    std::ostringstream os;
+    
+    unsigned iTerm=0;
+
+    bool readTokens = false;
+    for(int i=0; i <= message->payloadlen; i++) {
+
+        // Json tokens are colon-separated.  Do nothing until we
+        // encounter one.  Colons within a value (e.g., an ISO-8601
+        // time) are part of it
+        
+        if(!readTokens) {
+            readTokens = str[i] == ':';
+        } else {
+            
+            // Skip quotation marks
+            
+            if(str[i] == '"')
+                continue;
+            
+            if(i == message->payloadlen || str[i] == ',' || str[i] == '}') {
+
+                readTokens = false;
+                
+                if(iTerm < nTerm) {
+                    dataTerms[iTerm] = convertTerm(env, topicDesc, iTerm, os.str());
+                    os.str("");
+                    iTerm++;
+                } else {
+                    topicDesc.stats_->recordError(TopicStats::TOO_MANY_TERMS);
+                    ThrowRuntimeError("Invalid data received for schema " << message->topic << " (too many terms)"
+                                      << std::endl << "\r" << "  Expected JSON " << topicDesc.schema_);
+                }
+            } else {
+                os << str[i];
+            }
+        }
+        
+    }
+    
+    // Did we convert enough terms?
+    
+    if(iTerm != nTerm) {
+        topicDesc.stats_->recordError(TopicStats::TOO_FEW_TERMS);
+        ThrowRuntimeError("Invalid data received for schema " << message->topic << " (not enough terms)"
+                          << std::endl << "\r" << "  Expected JSON " << topicDesc.schema_);
+    }
+    
+    return enif_make_tuple_from_array(env, &dataTerms[0], nTerm);
+}
+
+/**.......................................................................
+ * Convert a field with the topic's conversion function for it,
+ * counting any failure against the topic
+ */
+ERL_NIF_TERM MosClient::convertTerm(ErlNifEnv* env, Topic& topicDesc, unsigned iTerm, const std::string& str)
+{
+    try {
+        return topicDesc.convFnVec_[iTerm](env, str);
+    } catch(...) {
+        topicDesc.stats_->recordError(TopicStats::BAD_VALUE);
+        throw;
+    }
+}
+#endif
+
+/**.......................................................................
+ * Log received messages to stdout
+ */
+void MosClient::logMessage(const struct mosquitto_message *message)
+{
+    std::ostringstream msg;
+    for(int i=0; i < message->payloadlen; i++)
+        msg << ((unsigned char*)message->payload)[i];
+
+    LOGINFO("MQTT Got a message on topic: " << message->topic << ": " << msg.str());
+}
+
+/**.......................................................................
+ * Configure to use certificates
+ */
+void MosClient::certConfig(Session* session)
+{
+    std::string caFile   = caPath_ + "/" + caFile_;
+    std::string certFile = caPath_ + "/" + certFile_;
+    std::string keyFile  = caPath_ + "/" + keyFile_;
+
+    mosquitto_tls_set(session->mosq_, caFile.c_str(), caPath_.c_str(), certFile.c_str(), keyFile.c_str(), NULL);
+    mosquitto_tls_insecure_set(session->mosq_, true);
+}
+
+//=======================================================================
+// Private methods of MosClient
+//=======================================================================
+
+/**.......................................................................
+ * Thread start-up function to pass to pthread_create
+ */
+THREAD_START(MosClient::runMosCommsLoop)
+{
+    Session* session = (Session*)arg;
+    MosClient* client = session->client_;
+
+    try {
+        client->initAndRun(session);
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Caught an error starting up comms loop: "
+                << std::endl << "\r" << err.what()
+                << std::endl << "\r" << " ... exiting");
+    } catch(...) {
+        LOGERROR("MQTT Caught an unknown error starting up comms loop... exiting");
+    }
+
+    ScopedLock lock(client->mutex_);
+
+    session->connected_ = false;
+
+    if(session->mosq_) {
+        mosquitto_destroy(session->mosq_);
+        session->mosq_ = 0;
+    }
+
+    return 0;
+}
+
+/**.......................................................................
+ * Thread start-up function for an event-loop thread
+ */
+THREAD_START(MosClient::runEventLoop)
+{
+    Loop* loop = (Loop*)arg;
+    MosClient* client = loop->client_;
+
+    try {
+        client->runLoop(loop);
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Caught an error in event loop " << loop->index_ << ": "
+                << std::endl << "\r" << err.what()
+                << std::endl << "\r" << " ... exiting");
+    } catch(...) {
+        LOGERROR("MQTT Caught an unknown error in event loop " << loop->index_ << "... exiting");
+    }
+
+    ScopedLock lock(client->mutex_);
+
+    for(unsigned i=0; i < loop->sessions_.size(); i++) {
+
+        Session* session = loop->sessions_[i];
+
+        session->connected_ = false;
+
+        if(session->mosq_) {
+            mosquitto_destroy(session->mosq_);
+            session->mosq_ = 0;
+        }
+    }
+
+    return 0;
+}
+
+/**.......................................................................
+ * Drive all sessions assigned to this loop from a single epoll loop.
+ *
+ * Sockets are registered for read events, and for write events only
+ * while mosquitto has data pending.  mosquitto_loop_misc is run on
+ * every pass, and at least once a second, to service keepalives.
+ * Sessions that fail are deregistered and retried with backoff
+ */
+void MosClient::runLoop(Loop* loop)
+{
+    for(unsigned i=0; i < loop->sessions_.size(); i++)
+        createSession(loop->sessions_[i]);
+
+    // Session 0 (always on loop 0) publishes, so that loop also
+    // watches for publish wakeups
+
+    if(loop->index_ == 0 && publishPipe_[0] >= 0)
+        loop->eventLoop_->add(publishPipe_[0], (void*)publishPipe_, false);
+
+    std::vector<EventLoop::Event> events;
+
+    while(!stop_) {
+
+        //------------------------------------------------------------
+        // (Re)connect any sessions that are due, and compute how long
+        // we can wait before the next attempt
+        //------------------------------------------------------------
+
+        int64_t now       = getCurrentMicroSeconds();
+        int     timeoutMs = 1000;
+
+        for(unsigned i=0; i < loop->sessions_.size(); i++) {
+
+            Session* session = loop->sessions_[i];
+
+            // Don't sleep past a pending durable flush
+
+            if(durable_ && !session->pendingWrites_.empty() && (int)durableFlushMs_ < timeoutMs)
+                timeoutMs = durableFlushMs_;
+
+            if(session->fd_ >= 0)
+                continue;
+
+            if(now >= session->retryMicros_)
+                connectSession(session);
+
+            if(session->fd_ < 0) {
+                int64_t waitMs = (session->retryMicros_ - now) / 1000;
+                if(waitMs < timeoutMs)
+                    timeoutMs = waitMs < 0 ? 0 : waitMs;
+            }
+        }
+
+        if(stop_)
+            break;
+
+        loop->eventLoop_->wait(events, timeoutMs);
+
+        //------------------------------------------------------------
+        // Service sockets with pending I/O
+        //------------------------------------------------------------
+
+        for(unsigned i=0; i < events.size(); i++) {
+
+            if(events[i].data_ == (void*)publishPipe_) {
+                drainPipe(publishPipe_[0]);
+                continue;
+            }
+
+            Session* session = (Session*)events[i].data_;
+            int retVal = MOSQ_ERR_SUCCESS;
+
+            if(session->fd_ < 0)
+                continue;
+
+            if(events[i].readable_)
+                retVal = mosquitto_loop_read(session->mosq_, 1);
+
+            if(retVal == MOSQ_ERR_SUCCESS && events[i].writable_)
+                retVal = mosquitto_loop_write(session->mosq_, 1);
+
+            if(retVal != MOSQ_ERR_SUCCESS)
+                dropSession(session);
+        }
+
+        //------------------------------------------------------------
+        // Durable flushes, keepalives, and write interest for anything
+        // queued in the meantime (including by other threads)
+        //------------------------------------------------------------
+
+        for(unsigned i=0; i < loop->sessions_.size(); i++) {
+
+            Session* session = loop->sessions_[i];
+
+            if(session->index_ == 0)
+                drainPublishQueue(session);
+
+            if(session->fd_ < 0)
+                continue;
+
+            if(durable_)
+                flushDurable(session, false);
+
+            if(mosquitto_loop_misc(session->mosq_) != MOSQ_ERR_SUCCESS)
+                dropSession(session);
+            else
+                updateInterest(session);
+        }
+    }
+
+    if(loop->index_ == 0 && publishPipe_[0] >= 0)
+        loop->eventLoop_->remove(publishPipe_[0]);
+
+    for(unsigned i=0; i < loop->sessions_.size(); i++) {
+        Session* session = loop->sessions_[i];
+        if(session->fd_ >= 0)
+            loop->eventLoop_->remove(session->fd_);
+        session->fd_         = -1;
+        session->connecting_ = false;
+
+        if(durable_)
+            abandonDurable(session);
+    }
+}
+
+/**.......................................................................
+ * Start connecting a session in event-loop mode, and register its
+ * socket.  The connect is asynchronous, so that one unreachable broker
+ * doesn't stall the other sessions on this loop: the socket is
+ * registered for write events, and the connect completes when the loop
+ * flushes our CONNECT packet and reads the CONNACK.  A connect that
+ * fails, then or now, is retried after the backoff delay.
+ *
+ * Note that libmosquitto still resolves the broker's name
+ * synchronously, so a numeric host avoids blocking on DNS
+ */
+void MosClient::connectSession(Session* session)
+{
+    LOGINFO("MQTT " << (session->initialized_ ? "Attempting to reconnect" : "Connecting")
+            << " (session " << session->index_ << ")...");
+
+    connectAttempts_.fetch_add(1, std::memory_order_relaxed);
+    session->connectStartMicros_ = getCurrentMicroSeconds();
+
+    int retVal = session->initialized_ ?
+        mosquitto_reconnect_async(session->mosq_) :
+        mosquitto_connect_async(session->mosq_, host_.c_str(), port_, keepAlive_);
+
+    if(retVal != MOSQ_ERR_SUCCESS || mosquitto_socket(session->mosq_) < 0) {
+        unsigned delayMs = session->backoff_.nextDelayMs();
+        connectFailures_.fetch_add(1, std::memory_order_relaxed);
+        LOGWARN("MQTT Unable to connect: " << formatMosError(retVal) << " -- attempting to reconnect in " << delayMs << " ms");
+        session->retryMicros_ = getCurrentMicroSeconds() + 1000*(int64_t)delayMs;
+        return;
+    }
+
+    session->initialized_ = true;
+    session->connecting_  = true;
+    session->fd_          = mosquitto_socket(session->mosq_);
+    session->wantWrite_   = true;
+
+    session->loop_->eventLoop_->add(session->fd_, session, session->wantWrite_);
+}
+
+/**.......................................................................
+ * Deregister a session whose connection has failed, or whose
+ * connect never completed, and schedule a reconnect.  The socket
+ * itself is closed by the library on reconnect
+ */
+void MosClient::dropSession(Session* session)
+{
+    unsigned delayMs = session->backoff_.nextDelayMs();
+
+    if(session->connecting_) {
+        connectFailures_.fetch_add(1, std::memory_order_relaxed);
+        LOGWARN("MQTT Unable to connect (session " << session->index_ << ") -- attempting to reconnect in " << delayMs << " ms");
+    } else if(!stop_) {
+        LOGWARN("MQTT Lost connection (session " << session->index_ << ") -- attempting to reconnect in " << delayMs << " ms");
+    }
+
+    session->loop_->eventLoop_->remove(session->fd_);
+
+    if(durable_)
+        abandonDurable(session);
+
+    session->fd_          = -1;
+    session->wantWrite_   = false;
+    session->connecting_  = false;
+    session->connected_   = false;
+    session->retryMicros_ = getCurrentMicroSeconds() + 1000*(int64_t)delayMs;
+}
+
+/**.......................................................................
+ * Register write interest for a session only while mosquitto has
+ * outgoing data queued
+ */
+void MosClient::updateInterest(Session* session)
+{
+    bool wantWrite = mosquitto_want_write(session->mosq_);
+
+    if(wantWrite != session->wantWrite_) {
+        session->loop_->eventLoop_->modify(session->fd_, session, wantWrite);
+        session->wantWrite_ = wantWrite;
+    }
+}
+
+/**.......................................................................
+ * Wake all event-loop threads, e.g., so that they pick up packets
+ * queued by another thread.  Called with mutex_ held
+ */
+void MosClient::wakeLoops()
+{
+    for(unsigned i=0; i < loops_.size(); i++) {
+        if(loops_[i]->eventLoop_)
+            loops_[i]->eventLoop_->wake();
+    }
+}
+
+#if WITH_ERL
+/**.......................................................................
+ * Add the topic to the list of topics we will subscribe to on connect
+ * to the broker, and subscribe, if already connected
+ */
+void MosClient::subscribePrivate(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format, int qos)
+{
+    // Always add it to our subscribe queue (in case of server
+    // disconnect, we need to re-subscribe when it comes back
+    // online)
+    //
+    // Additionally, if we are connected, just subscribe right away
+    
+    Subscription sub;
+    sub.topic_ = topic;
+    sub.qos_   = qos;
+
+    topicList_.insert(topicList_.end(), sub);
+    
+    int retVal = subscribeSessions(topic, qos);
+    
+    // And add a table entry with the schema conversion fns.  The
+    // erlang terms for the topic name are created only the first time
+    // we see this topic, and are reused on resubscribe.  The new
+    // descriptor is fully built before it is published to the table,
+    // since the comms thread reads the table without locking
+    
+    Topic* topicDesc = new Topic();
+    topicDesc->hash_ = hashTopic(topic.c_str());
+    topicDesc->name_ = topic;
+
+    Topic* prevDesc = topicTable_.find(topic.c_str(), topicDesc->hash_);
+
+    if(prevDesc) {
+        topicDesc->nameTerm_ = prevDesc->nameTerm_;
+        topicDesc->binTerm_  = prevDesc->binTerm_;
+        topicDesc->stats_    = prevDesc->stats_;
+    } else {
+        topicDesc->nameTerm_ = enif_make_string(topicEnv_, topic.c_str(), ERL_NIF_LATIN1);
+        topicDesc->binTerm_  = ErlUtil::stringToBinaryTerm(topicEnv_, topic);
+        topicDesc->stats_    = std::make_shared<TopicStats>();
+    }
+
+    topicDesc->convFnVec_ = convFnVec;
+    topicDesc->schema_    = schema;
+    topicDesc->format_    = (format == "csv" ? FORMAT_CSV : FORMAT_JSON);
+    topicDesc->qos_       = qos;
+
+    topicDesc->csvDecoder_ = RowDecoder::csvDecoderFor(convFnVec);
+
+    // Rows are only stored for CSV topics whose fields all round-trip,
+    // since dump relays rows as CSV.  A varchar field in a CSV message
+    // can't contain a comma, so it can be written back as is
+
+    bool rows = topicDesc->format_ == FORMAT_CSV;
+
+    for(unsigned i=0; i < convFnVec.size(); i++)
+        rows = rows && RowCodec::roundTrips(convFnVec[i]);
+
+    for(unsigned i=0; rows && i < convFnVec.size(); i++)
+        topicDesc->rowTypes_.push_back(RowCodec::typeFor(convFnVec[i]));
+
+    topicDesc->schemaId_ = RowCodec::schemaId(topic, topicDesc->rowTypes_);
+    topicDesc->schemaStored_.store(prevDesc && prevDesc->schemaId_ == topicDesc->schemaId_ && prevDesc->schemaStored_.load());
+
+    topicTable_.insert(topicDesc);
+    
+    // If there was an error on subscribe, throw it now
+    
+    if(retVal != MOSQ_ERR_SUCCESS)
+        ThrowRuntimeError(formatMosError(retVal));
+}
+#endif
+
+#if WITH_ERL
+/**.......................................................................
+ * Look up the descriptor for a topic.  Returns NULL if we have no
+ * descriptor for it.  Takes no lock
+ */
+MosClient::Topic* MosClient::findTopic(const char* topic)
+{
+    return topicTable_.find(topic);
 }
+#endif
 
 /**.......................................................................
- * Uses the schema supplied when the topic was subscribed to convert
- * the data to an erlang tuple of converted terms
+ * Process a message received from the broker.  Returns true if
+ * acknowledgement of the message is deferred until it is committed to
+ * the store
  */
-ERL_NIF_TERM MosClient::formatForSchema(const struct mosquitto_message* message)
+bool MosClient::process(Session* session, const struct mosquitto_message *message)
 {
-    //------------------------------------------------------------
-    // First the table name
-    //------------------------------------------------------------
+    // No lock is taken here: topic lookups are lock-free
+
+    session->receivedNs_ = Metrics::nanoSeconds();
+    received_.add();
+    receivedBytes_.add(message->payloadlen);
+
+    // Log to stdout if requested
     
-    ERL_NIF_TERM topic   = enif_make_string(msgEnv_, (const char*)message->topic, ERL_NIF_LATIN1);
+    if(log_)
+        logMessage(message);
 
-    //------------------------------------------------------------
-    // Next the table data
-    //------------------------------------------------------------
+    // If running from within erlang, possibly notify any registered
+    // processes of the message
+    
+#if WITH_ERL
+    notify(session, message, findTopic(message->topic));
+#endif
 
-    ERL_NIF_TERM dataTuple = formatData(message);
+    // Republish to the bridge, if we have one
 
-    //------------------------------------------------------------
-    // Finally, return a tuple from the array we just constructed
-    //------------------------------------------------------------
+    if(bridge_ && commandTopic_ != message->topic)
+        bridgeMessage(message);
+
+    // Finally, process the message
     
-    return enif_make_tuple2(msgEnv_, topic, dataTuple);
+    bool deferAck = processMessage(session, message);
+
+    if(messageHookFn_)
+        messageHookFn_(message, messageHookArg_);
+
+    return deferAck;
 }
 
 /**.......................................................................
- * Format data encoded as a string
+ * Republish a received message to the bridge, if it passes the
+ * filters, with its topic rewritten by the first rule whose prefix
+ * matches.  If the bridge's queue is full, the message is dropped
+ * (and counted), rather than stall the session
  */
-ERL_NIF_TERM MosClient::formatData(const struct mosquitto_message* message)
+void MosClient::bridgeMessage(const struct mosquitto_message *message)
 {
-    Topic& topicDesc = topicMap_[message->topic];
+    std::string topic = message->topic;
 
-    switch(topicDesc.format_) {
-    case FORMAT_JSON:
-        return formatDataJson(message, topicDesc);
-        break;
-    default:
-        return formatDataCsv(message, topicDesc);
-        break;
+    if(!bridgeFilters_.empty()) {
+
+        bool match = false;
+
+        for(unsigned i=0; i < bridgeFilters_.size() && !match; i++) {
+            if(mosquitto_topic_matches_sub(bridgeFilters_[i].c_str(), message->topic, &match) != MOSQ_ERR_SUCCESS)
+                match = false;
+        }
+
+        if(!match)
+            return;
     }
-}        
 
-/**.......................................................................
- * Format TS data encoded as CSV string
- */
-ERL_NIF_TERM MosClient::formatDataCsv(const struct mosquitto_message* message, Topic& topicDesc)
-{
-    std::vector<STRING_CONV_FN_PTR>& convFnVec = topicDesc.convFnVec_;
-    
-    unsigned nTerm = convFnVec.size();
-    std::vector<ERL_NIF_TERM> dataTerms;
-    std::ostringstream os;
-    const char* str = (const char*)message->payload;
-        
-    if(nTerm > 0) {
+    for(unsigned i=0; i < bridgeRules_.size(); i++) {
 
-        dataTerms.resize(nTerm);
-        
-        unsigned iTerm=0;
-        for(int i=0; i <= message->payloadlen; i++) {
-            
-            if(i == message->payloadlen || str[i] == ',') {
-                if(iTerm < nTerm) {
-                    dataTerms[iTerm] = convFnVec[iTerm](msgEnv_, os.str());
-                    os.str("");
-                    iTerm++;
-                } else {
-                    ThrowRuntimeError("Invalid data received for schema " << message->topic << " (too many terms)"
-                                      << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
-                }
-            } else {
-                os << str[i];
-            }
+        const std::string& from = bridgeRules_[i].first;
+
+        if(topic.compare(0, from.size(), from) == 0) {
+            topic = bridgeRules_[i].second + topic.substr(from.size());
+            break;
         }
-        
-        // Did we convert enough terms?
-    
-        if(iTerm != nTerm)
-            ThrowRuntimeError("Invalid data received for schema " << message->topic << " (not enough terms)"
-                              << std::endl << "\r" << "  Expected CSV " << topicDesc.schema_);
+    }
 
-        // Else just process the message in toto as a single string
-        
-    } else {
+    try {
 
-        nTerm = 1;
-        
-        for(int i=0; i < message->payloadlen; i++)
-            os << str[i];
+        bridge_->publish(topic, std::string((const char*)message->payload, message->payloadlen),
+                         bridgeQos_ < 0 ? message->qos : bridgeQos_, message->retain);
 
-        dataTerms.resize(1);
-        dataTerms[0] = ErlUtil::stringToBinaryTerm(msgEnv_, os.str());
+        bridged_.fetch_add(1, std::memory_order_relaxed);
+
+    } catch(std::runtime_error& err) {
+        bridgeDropped_.fetch_add(1, std::memory_order_relaxed);
+        LOG("MQTT Dropped bridged message on " << topic << ": " << err.what());
     }
-    
-    return enif_make_tuple_from_array(msgEnv_, &dataTerms[0], nTerm);
 }
 
 /**.......................................................................
- * Format TS data encoded as JSON string
+ * Create and start the bridge client.  It gets a store (and an
+ * outbox) of its own if we have one
  */
-ERL_NIF_TERM MosClient::formatDataJson(const struct mosquitto_message* message, Topic& topicDesc)
+void MosClient::startBridge()
 {
-    std::vector<STRING_CONV_FN_PTR>& convFnVec = topicDesc.convFnVec_;
-    
-    unsigned nTerm = convFnVec.size();
-    std::vector<ERL_NIF_TERM> dataTerms(nTerm);
+    MosClient* bridge = new MosClient();
 
+    try {
 
-    const char* str = (const char*)message->payload;
-    
-    std::ostringstream os;
-    
-    unsigned iTerm=0;
+        bridge->setOption("name", name_ + "_bridge");
+        bridge->setOption("host", bridgeHost_);
+        bridge->setOption("port", bridgePort_);
+        bridge->setOption("keepalive", keepAlive_);
+        bridge->setOption("publish_queue_max", (int)bridgeQueueMax_);
 
-    bool readTokens = false;
-    for(int i=0; i <= message->payloadlen; i++) {
+        if(store_) {
+            bridge->setOption("store", true);
+            bridge->setOption("outbox", true);
+        }
 
-        // Json tokens are colon-separated.  Do nothing until we
-        // encounter one
-        
-        if(str[i] == ':') {
-            readTokens = true;
-        } else if(readTokens) {
-            
-            // Skip quotation marks
-            
-            if(str[i] == '"')
-                continue;
-            
-            if(i == message->payloadlen || str[i] == ',' || str[i] == '}') {
+        bridge->startCommsLoop();
 
-                readTokens = false;
-                
-                if(iTerm < nTerm) {
-                    dataTerms[iTerm] = convFnVec[iTerm](msgEnv_, os.str());
-                    os.str("");
-                    iTerm++;
-                } else {
-                    ThrowRuntimeError("Invalid data received for schema " << message->topic << " (too many terms)"
-                                      << std::endl << "\r" << "  Expected JSON " << topicDesc.schema_);
-                }
-            } else {
-                os << str[i];
-            }
-        }
-        
+    } catch(...) {
+        delete bridge;
+        throw;
     }
-    
-    // Did we convert enough terms?
-    
-    if(iTerm != nTerm)
-        ThrowRuntimeError("Invalid data received for schema " << message->topic << " (not enough terms)"
-                          << std::endl << "\r" << "  Expected JSON " << topicDesc.schema_);
-    
-    return enif_make_tuple_from_array(msgEnv_, &dataTerms[0], nTerm);
+
+    bridge_ = bridge;
 }
-#endif
 
 /**.......................................................................
- * Log received messages to stdout
+ * Stop the bridge client.  Called once our sessions have stopped
  */
-void MosClient::logMessage(const struct mosquitto_message *message)
+void MosClient::stopBridge()
 {
-    std::ostringstream msg;
-    for(int i=0; i < message->payloadlen; i++)
-        msg << ((unsigned char*)message->payload)[i];
+    if(!bridge_)
+        return;
 
-    COUTGREEN("MQTT Got a message on topic: " << message->topic << ": " << msg.str());
-    COUTGREEN("   ");
+    delete bridge_;
+    bridge_ = 0;
 }
 
 /**.......................................................................
- * Configure to use certificates
+ * Add a topic rewrite rule for the bridge: topics starting with
+ * fromPrefix are republished with it replaced by toPrefix.  Rules are
+ * tried in the order added
  */
-void MosClient::certConfig()
+void MosClient::addBridgeRule(std::string fromPrefix, std::string toPrefix)
 {
-    std::string caFile   = caPath_ + "/" + caFile_;
-    std::string certFile = caPath_ + "/" + certFile_;
-    std::string keyFile  = caPath_ + "/" + keyFile_;
+    ScopedLock lock(mutex_);
 
-    mosquitto_tls_set(mosq_, caFile.c_str(), caPath_.c_str(), certFile.c_str(), keyFile.c_str(), NULL);
-    mosquitto_tls_insecure_set(mosq_, true);
-}
+    if(!sessions_.empty())
+        ThrowRuntimeError("Bridge rules can't be changed once the comms loop has been started");
 
-//=======================================================================
-// Private methods of MosClient
-//=======================================================================
+    bridgeRules_.push_back(std::pair<std::string, std::string>(fromPrefix, toPrefix));
+}
 
 /**.......................................................................
- * Thread start-up function to pass to pthread_create
+ * Add a topic filter (which may contain + and # wildcards) for the
+ * bridge.  If any filters are given, only messages matching one of
+ * them are bridged
  */
-THREAD_START(MosClient::runMosCommsLoop)
+void MosClient::addBridgeFilter(std::string filter)
 {
-    MosClient* client = (MosClient*)arg;
-
-    try {
-        client->initAndRun();
-    } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error starting up comms loop: "
-                << std::endl << "\r" << err.what()
-                << std::endl << "\r" << " ... exiting");
-    } catch(...) {
-        COUTRED("MQTT Caught an unknown error starting up comms loop... exiting");
-    }
+    ScopedLock lock(mutex_);
 
-    client->connected_ = false;
+    if(!sessions_.empty())
+        ThrowRuntimeError("Bridge filters can't be changed once the comms loop has been started");
 
-    mosquitto_destroy(client->mosq_);
-    client->mosq_ = 0;
-        
-    mosquitto_lib_cleanup();
+    bool valid = false;
 
-    client->initialized_ = false;
+    if(mosquitto_topic_matches_sub(filter.c_str(), "x", &valid) == MOSQ_ERR_INVAL)
+        ThrowRuntimeError("Invalid bridge filter: " << filter);
 
-    return 0;
+    bridgeFilters_.push_back(filter);
 }
 
-#if WITH_ERL
 /**.......................................................................
- * Add the topic to the list of topics we will subscribe to on connect
- * to the broker, and subscribe, if already connected
+ * Process a message received from the broker
  */
-void MosClient::subscribePrivate(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format)
+bool MosClient::processMessage(Session* session, const struct mosquitto_message *message)
 {
-    // Always add it to our subscribe queue (in case of server
-    // disconnect, we need to re-subscribe when it comes back
-    // online)
-    //
-    // Additionally, if we are connected, just subscribe right away
-    
-    topicList_.insert(topicList_.end(), topic);
+    // If the message was received on the command topic, process the
+    // command that was sent via the MQTT broker
     
-    int qos    = 0;
-    int retVal = 0;
+    if(commandTopic_ == message->topic) {
+        processCommand(message);
+
+        // Else process a normal message
 
-    if(connected_) {
-        retVal = mosquitto_subscribe(mosq_, NULL, topic.c_str(), qos);
+    } else {
+        if(store_)
+            return storeMessage(session, message);
     }
+
+    return false;
+}
+
+/**.......................................................................
+ * If we are using a leveldb backing store, store the message in it.
+ *
+ * In durable mode, the write is instead queued on the session, and
+ * committed (synced) together with its acknowledgement by
+ * flushDurable().  Returns true in that case
+ */
+bool MosClient::storeMessage(Session* session, const struct mosquitto_message *message)
+{
+#if WITH_LEVELDB
+    // We assume CSV for now.  First field is the key, the topic is the 'bucket'
+
+    std::string content;
+
+    if(!storeTagged_)
+        content.assign((const char*)message->payload, message->payloadlen);
+    else if(!encodeRow(session, content))
+        StoreCodec::encode(storeCodec_, (const char*)message->payload, message->payloadlen, content);
+
+    storedBytes_.fetch_add(message->payloadlen, std::memory_order_relaxed);
+    storedRecordBytes_.fetch_add(content.size(), std::memory_order_relaxed);
+
+    std::string bucket = message->topic;
+
+    // Construct an internal key based on the start time of this
+    // thread and a monotonic counter.  The actual key is irrelevant
+    // -- it is just to ensure uniqueness for each record
     
-    // And add a map entry with the schema conversion fns
-    
-    Topic topicDesc;
-    topicDesc.convFnVec_ = convFnVec;
-    topicDesc.schema_    = schema;
-    topicDesc.format_    = (format == "csv" ? FORMAT_CSV : FORMAT_JSON);
-    
-    topicMap_[topic]     = topicDesc;
-    
-    // If there was an error on subscribe, throw it now
-    
-    if(retVal != MOSQ_ERR_SUCCESS)
-        ThrowRuntimeError(formatMosError(retVal));
+    std::ostringstream key;
+    key << initMicros_ << counter_.fetch_add(1, std::memory_order_relaxed);
+
+    stored_.add();
+
+    if(!durable_) {
+        uint64_t start = Metrics::nanoSeconds();
+        db_.put(bucket + "_" + key.str(), content);
+        storeLatency_.record(Metrics::nanoSeconds() - start);
+        return false;
+    }
+
+    if(session->pendingWrites_.empty())
+        session->firstPendingMicros_ = getCurrentMicroSeconds();
+
+    session->pendingWrites_.push_back(std::pair<std::string, std::string>(bucket + "_" + key.str(), content));
+
+    if(message->qos > 0)
+        session->pendingAcks_.push_back(message->mid);
+
+    if(session->pendingWrites_.size() >= durableBatch_)
+        flushDurable(session, true);
+
+    return message->qos > 0;
+#else
+    return false;
+#endif
 }
+
+/**.......................................................................
+ * Encode the current message as a row record, if it was converted to
+ * a row on receipt.  The row's schema is stored the first time a row
+ * is stored with it.  Returns false if the message should be stored
+ * as text
+ */
+bool MosClient::encodeRow(Session* session, std::string& record)
+{
+#if WITH_ERL && WITH_LEVELDB
+    if(!session->haveRow_)
+        return false;
+
+    Topic* topicDesc = session->rowTopic_;
+
+    if(!topicDesc->schemaStored_.load(std::memory_order_acquire)) {
+        db_.put(schemaKey(topicDesc->schemaId_), topicDesc->name_ + "\n" + RowCodec::formatTypes(topicDesc->rowTypes_));
+        topicDesc->schemaStored_.store(true, std::memory_order_release);
+    }
+
+    StoreCodec::encodeRow(topicDesc->schemaId_, session->row_, record);
+    storedRows_.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+#else
+    return false;
 #endif
+}
 
 /**.......................................................................
- * Process a message received from the broker.
+ * Read the stored row schemas, keyed by schema id
  */
-void MosClient::process(const struct mosquitto_message *message)
+void MosClient::loadSchemas(std::map<uint32_t, std::vector<RowCodec::FieldType> >& schemas)
 {
-    ScopedLock(mutex_);
+    std::vector<std::pair<std::string, std::string> > entries;
+    db_.scan(SCHEMA_PREFIX, SCHEMA_LIMIT, UINT_MAX, entries);
 
-    // Log to stdout if requested
-    
-    if(log_)
-        logMessage(message);
+    for(unsigned i=0; i < entries.size(); i++) {
 
-    // If running from within erlang, possibly notify any registered
-    // processes of the message
-    
-#if WITH_ERL
-    notify(message);
+        uint32_t schemaId = strtoul(entries[i].first.c_str() + SCHEMA_PREFIX.size(), NULL, 16);
+        size_t idx = entries[i].second.find('\n');
+
+        if(idx == std::string::npos) {
+            LOGERROR("MQTT Ignoring malformed schema entry: " << entries[i].first);
+            continue;
+        }
+
+        schemas[schemaId] = RowCodec::parseTypes(entries[i].second.substr(idx+1));
+    }
+}
+
+std::string MosClient::schemaKey(uint32_t schemaId)
+{
+    char buf[9];
+    snprintf(buf, sizeof(buf), "%08x", schemaId);
+    return SCHEMA_PREFIX + buf;
+}
+
+/**.......................................................................
+ * Decide whether records in the store are tagged with their codec.
+ * A store with FORMAT_KEY is, and so is a new one, which we mark.  A
+ * store with messages but no FORMAT_KEY was written before codecs
+ * existed, and its raw payloads may look tagged, so it is read and
+ * written untagged, with no codec.  Called when the store is opened
+ */
+void MosClient::checkStoreFormat()
+{
+#if WITH_LEVELDB
+    std::vector<std::pair<std::string, std::string> > entries;
+
+    db_.scan(FORMAT_KEY, FORMAT_KEY + '\0', 1, entries);
+
+    if(!entries.empty()) {
+        storeTagged_ = true;
+        return;
+    }
+
+    // Message keys are topics, which never start with '$'
+
+    db_.scan("", "$", 1, entries);
+
+    if(entries.empty())
+        db_.scan("%", std::string(1, '\xff'), 1, entries);
+
+    storeTagged_ = entries.empty();
+
+    if(storeTagged_) {
+        db_.put(FORMAT_KEY, "tagged");
+    } else if(storeCodec_ != StoreCodec::NONE || storeRows_) {
+        LOGWARN("MQTT Store " << dbName_ << " predates store codecs: storing messages uncompressed, as text");
+    }
 #endif
-
-    // Finally, process the message
-    
-    processMessage(message);
 }
 
 /**.......................................................................
- * Process a message received from the broker
+ * Commit a session's queued durable writes with a synced batch write,
+ * then acknowledge the messages they came from.  Unless force is true,
+ * this is done only once the oldest queued write is durableFlushMs_
+ * old.
+ *
+ * If the write fails, nothing is acknowledged, and the session is
+ * disconnected, so that the broker redelivers the messages on the
+ * reconnect.  Left connected, their unacknowledged ids would hold the
+ * broker's in-flight window until QoS > 0 delivery stalled
  */
-void MosClient::processMessage(const struct mosquitto_message *message)
+void MosClient::flushDurable(Session* session, bool force)
 {
-    std::string topic = message->topic;
+    if(session->pendingWrites_.empty())
+        return;
 
-    // If the message was received on the command topic, process the
-    // command that was sent via the MQTT broker
-    
-    if(topic == commandTopic_) {
-        processCommand(message);
+    if(!force && getCurrentMicroSeconds() - session->firstPendingMicros_ < 1000*(int64_t)durableFlushMs_)
+        return;
 
-        // Else process a normal message
+    uint64_t start = Metrics::nanoSeconds();
 
-    } else {
-        if(store_)
-            storeMessage(message);
+    try {
+        db_.writeBatch(session->pendingWrites_, true);
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Error committing " << session->pendingWrites_.size() << " message(s) to the store: " << err.what()
+                 << " -- disconnecting (session " << session->index_ << ") for redelivery");
+        durableFailures_.fetch_add(1, std::memory_order_relaxed);
+        session->pendingWrites_.clear();
+        session->pendingAcks_.clear();
+        mosquitto_disconnect(session->mosq_);
+        return;
     }
+
+#if WITH_MANUAL_ACK
+    for(unsigned i=0; i < session->pendingAcks_.size(); i++)
+        mosquitto_manual_ack(session->mosq_, session->pendingAcks_[i]);
+#endif
+
+    storeLatency_.record(Metrics::nanoSeconds() - start);
+    durableCommits_.fetch_add(1, std::memory_order_relaxed);
+    durableLatency_.record(getCurrentMicroSeconds() - session->firstPendingMicros_);
+
+    session->pendingWrites_.clear();
+    session->pendingAcks_.clear();
 }
 
 /**.......................................................................
- * If we are using a leveldb backing store, store the message in it
+ * On loss of connection, commit any queued writes, but discard their
+ * acknowledgements, which are only valid on the connection the
+ * messages arrived on.  The broker will redeliver them
  */
-void MosClient::storeMessage(const struct mosquitto_message *message)
+void MosClient::abandonDurable(Session* session)
 {
-#if WITH_LEVELDB
-    // We assume CSV for now.  First field is the key, the topic is the 'bucket'
-
-    std::string content((const char*)message->payload, message->payloadlen);
+    session->pendingAcks_.clear();
 
-    std::string bucket = message->topic;
-
-    // Construct an internal key based on the start time of this
-    // thread and a monotonic counter.  The actual key is irrelevant
-    // -- it is just to ensure uniqueness for each record
-    
-    std::ostringstream key;
-    key << initMicros_ << counter_;
-    ++counter_;
+    try {
+        if(!session->pendingWrites_.empty())
+            db_.writeBatch(session->pendingWrites_, true);
+    } catch(std::runtime_error& err) {
+        LOGERROR("MQTT Error committing " << session->pendingWrites_.size() << " message(s) to the store: " << err.what());
+    }
 
-    db_.put(bucket + "_" + key.str(), content);
-#endif
+    session->pendingWrites_.clear();
 }
 
 std::string MosClient::formatMessage(const struct mosquitto_message *message)
@@ -859,11 +2917,12 @@ void MosClient::processCommand(const struct mosquitto_message *message)
     
     if(command == "subscribe") {
         
-        if(connected_) {
+        if(nConnected() > 0) {
 
             std::string       topic  = getEntry(entryMap, "topic");
             gcp::util::String schema = getEntry(entryMap, "schema", "[varchar]");
             std::string       format = getEntry(entryMap, "format", "csv");
+            int               qos    = toInt(getEntry(entryMap, "qos", "0"));
 
 #if WITH_ERL
             std::vector<STRING_CONV_FN_PTR> convFnVec;
@@ -877,9 +2936,14 @@ void MosClient::processCommand(const struct mosquitto_message *message)
                 }
             } while(!atom.isEmpty());
 
-            subscribe(topic, schema.str(), convFnVec, format);
+            subscribe(topic, schema.str(), convFnVec, format, qos);
 #else
-            int retVal = mosquitto_subscribe(mosq_, NULL, entryMap["topic"].c_str(), 0);
+            int retVal = 0;
+
+            {
+                ScopedLock lock(mutex_);
+                retVal = subscribeSessions(entryMap["topic"], qos);
+            }
 
             if(retVal != MOSQ_ERR_SUCCESS)
                 ThrowRuntimeError(formatMosError(retVal));
@@ -934,8 +2998,16 @@ std::string MosClient::getEntry(std::map<std::string, std::string>& entryMap, st
  */
 void MosClient::dumpToBroker(std::map<std::string, std::string>& entryMap)
 {
-    ScopedLock(instance_.mutex_);
-    instance_.dumpToBrokerPrivate(entryMap);
+    // No lock is taken here, since a dump can run for minutes, and
+    // only reads the store, through scan(), so that dumps can run
+    // concurrently
+
+    InFlight inFlight(replaysInFlight_);
+
+    if(!running_.load())
+        ThrowRuntimeError("Comms loop is not running");
+
+    dumpToBrokerPrivate(entryMap);
 }
 
 void MosClient::dumpToBrokerPrivate(std::map<std::string, std::string>& entryMap)
@@ -949,8 +3021,22 @@ void MosClient::dumpToBrokerPrivate(std::map<std::string, std::string>& entryMap
     std::string host =       getEntry(entryMap, "host",   "localhost");
     int port         = toInt(getEntry(entryMap, "port",   "1883"));
     unsigned delayms = toInt(getEntry(entryMap, "delayms", "0"));
+    bool compressed  =       getEntry(entryMap, "compressed", "false") == "true";
                              
     int retVal=0;
+
+    // Compressed records are relayed as is, marked with a
+    // content-encoding user property, which needs MQTT v5
+
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+    if(compressed)
+        mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, MQTT_PROTOCOL_V5);
+#else
+    if(compressed) {
+        mosquitto_destroy(mosq);
+        ThrowRuntimeError("Compressed relay requires libmosquitto 1.6 or later");
+    }
+#endif
     
     retVal = mosquitto_connect(mosq, host.c_str(), port, keepAlive_);
 
@@ -961,55 +3047,352 @@ void MosClient::dumpToBrokerPrivate(std::map<std::string, std::string>& entryMap
 
     try {
 
-        db_.iterStart();
+        std::map<uint32_t, std::vector<RowCodec::FieldType> > schemas;
+        loadSchemas(schemas);
 
-        std::string levelKey, levelVal;
+        // Read the store in chunks, each with its own iterator, so
+        // that concurrent dumps (and replays) don't share one
 
-        while(db_.iterValid()) {
-            db_.iterGet(levelKey, levelVal);
-            
-            size_t idx = levelKey.find_first_of('_');
-            if(idx == std::string::npos) {
-                COUTRED("Expected 'bucket_key'  Got: '" << levelKey << "'");
-            } else {
-                
-                std::string bucket  = levelKey.substr(0, idx);
-                std::string key     = levelKey.substr(idx+1, levelKey.size() - (idx+1));
-                
-                // Re-publish on the specified message queue
+        static const unsigned DUMP_CHUNK = 1000;
 
-                int retVal = mosquitto_publish(mosq, NULL, bucket.c_str(), levelVal.size(), &levelVal[0], 0, false);
+        std::vector<std::pair<std::string, std::string> > entries;
+        std::string start, limit(1, '\xff'), payload;
 
-                if(retVal != MOSQ_ERR_SUCCESS)
-                    ThrowRuntimeError(formatMosError(retVal));
+        do {
 
-                LOG("Published Bucket = " << bucket << " Key = '" << key << "' Val = '" << levelVal << "'");
+            db_.scan(start, limit, DUMP_CHUNK, entries);
 
-                // Delay between publishing, if requested
-                
-                if(delayms > 0) {
-                    struct timespec delay;
-                    delay.tv_sec  = delayms/1000;
-                    delay.tv_nsec = (delayms % 1000);
+            for(unsigned i=0; i < entries.size(); i++) {
+
+                // Checked per message, since dumps may be throttled
+
+                if(!running_.load())
+                    ThrowRuntimeError("Comms loop stopped");
+
+                const std::string& levelKey = entries[i].first;
+                const std::string& levelVal = entries[i].second;
+
+                // Topics may contain '_', but our keys never do
+
+                size_t idx = levelKey.rfind('_');
+
+                // Skip messages waiting in the outbox, which are not ours
+                // to dump
+
+                if(levelKey.compare(0, OUTBOX_PREFIX.size(), OUTBOX_PREFIX) == 0 ||
+                   levelKey.compare(0, SCHEMA_PREFIX.size(), SCHEMA_PREFIX) == 0 ||
+                   levelKey == FORMAT_KEY)
+                    continue;
+
+                if(idx == std::string::npos) {
+                    LOGERROR("Expected 'bucket_key'  Got: '" << levelKey << "'");
+                } else {
+                    
+                    std::string bucket  = levelKey.substr(0, idx);
+                    std::string key     = levelKey.substr(idx+1, levelKey.size() - (idx+1));
+                    
+                    // Re-publish on the specified message queue
+
+                    int retVal = MOSQ_ERR_SUCCESS;
+                    uint64_t publishStart = Metrics::nanoSeconds();
+
+                    // Rows are re-published as CSV
+
+                    if(StoreCodec::codecOf(levelVal, storeTagged_) == StoreCodec::ROW) {
+
+                        uint32_t schemaId = 0;
+                        const char* data = 0;
+                        size_t len = 0;
+                        StoreCodec::rowOf(levelVal, schemaId, data, len);
 
-                    nanosleep(&delay, 0);
+                        if(schemas.find(schemaId) == schemas.end())
+                            ThrowRuntimeError("No schema stored for row " << levelKey);
+
+                        payload = RowCodec::toCsv(schemas[schemaId], data, len);
+                        retVal = mosquitto_publish(mosq, NULL, bucket.c_str(), payload.size(), payload.data(), 0, false);
+
+                    } else if(compressed && StoreCodec::codecOf(levelVal, storeTagged_) != StoreCodec::NONE) {
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+                        const char* data = 0;
+                        size_t len = 0;
+                        StoreCodec::body(levelVal, storeTagged_, data, len);
+
+                        mosquitto_property* props = NULL;
+                        mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "content-encoding",
+                                                           StoreCodec::codecName(StoreCodec::codecOf(levelVal, storeTagged_)).c_str());
+
+                        retVal = mosquitto_publish_v5(mosq, NULL, bucket.c_str(), len, data, 0, false, props);
+                        mosquitto_property_free_all(&props);
+#endif
+                    } else {
+                        StoreCodec::decode(levelVal, storeTagged_, payload);
+                        retVal = mosquitto_publish(mosq, NULL, bucket.c_str(), payload.size(), payload.data(), 0, false);
+                    }
+
+                    if(retVal != MOSQ_ERR_SUCCESS)
+                        ThrowRuntimeError(formatMosError(retVal));
+
+                    replayLatency_.record(Metrics::nanoSeconds() - publishStart);
+                    replayed_.add();
+
+                    LOG("Published Bucket = " << bucket << " Key = '" << key << "' (" << levelVal.size() << " bytes stored)");
+
+                    // Delay between publishing, if requested
+                    
+                    if(delayms > 0) {
+                        struct timespec delay;
+                        delay.tv_sec  = delayms/1000;
+                        delay.tv_nsec = (delayms % 1000) * 1000000;
+
+                        nanosleep(&delay, 0);
+                    }
                 }
             }
-            
-            db_.iterStep();
-        }
+
+            if(!entries.empty())
+                start = entries.back().first + '\0';
+
+        } while(entries.size() == DUMP_CHUNK);
         
     } catch(std::runtime_error& err) {
-        COUTRED("MQTT Caught an error while parsing dump message: " << std::endl << "\r  " << err.what());
+        LOGERROR("MQTT Caught an error while parsing dump message: " << std::endl << "\r  " << err.what());
     } catch(...) {
-        COUT("MQTT Caught an unknown error while parsing dump message");
+        LOGERROR("MQTT Caught an unknown error while parsing dump message");
     }
 
-    db_.iterClose();
     mosquitto_destroy(mosq);
 #endif
 }
 
+#if WITH_ERL
+/**.......................................................................
+ * Replay the store to an erlang process, as {Topic, DataTuple}
+ * messages like those sent on receipt.  Rows are decoded straight to
+ * terms; messages stored as text are converted with their topic's
+ * schema if we have one, else sent as {Topic, {Payload}}.  Returns
+ * the number of messages sent.
+ *
+ * Like dumpToBroker(), this takes no lock, and only reads the store
+ */
+unsigned MosClient::replay(ErlNifEnv* env, ErlNifPid pid)
+{
+    unsigned nSent = 0;
+    InFlight inFlight(replaysInFlight_);
+
+    if(!running_.load())
+        ThrowRuntimeError("Comms loop is not running");
+
+#if WITH_LEVELDB
+    static const unsigned REPLAY_CHUNK = 1000;
+
+    if(!store_)
+        ThrowRuntimeError("Replay requires the store option");
+
+    std::map<uint32_t, std::vector<RowCodec::FieldType> > schemas;
+    loadSchemas(schemas);
+
+    ErlNifEnv* msgEnv = enif_alloc_env();
+
+    std::vector<std::pair<std::string, std::string> > entries;
+    std::string start, limit(1, '\xff'), payload;
+
+    try {
+
+        do {
+
+            if(!running_.load())
+                ThrowRuntimeError("Comms loop stopped");
+
+            db_.scan(start, limit, REPLAY_CHUNK, entries);
+
+            for(unsigned i=0; i < entries.size(); i++) {
+
+                const std::string& levelKey = entries[i].first;
+                const std::string& levelVal = entries[i].second;
+
+                if(levelKey.compare(0, OUTBOX_PREFIX.size(), OUTBOX_PREFIX) == 0 ||
+                   levelKey.compare(0, SCHEMA_PREFIX.size(), SCHEMA_PREFIX) == 0 ||
+                   levelKey == FORMAT_KEY)
+                    continue;
+
+                // Topics may contain '_', but our keys never do
+
+                size_t idx = levelKey.rfind('_');
+
+                if(idx == std::string::npos) {
+                    LOGERROR("Expected 'bucket_key'  Got: '" << levelKey << "'");
+                    continue;
+                }
+
+                std::string topic = levelKey.substr(0, idx);
+                ERL_NIF_TERM dataTuple;
+                uint64_t replayStart = Metrics::nanoSeconds();
+
+                try {
+
+                    if(StoreCodec::codecOf(levelVal, storeTagged_) == StoreCodec::ROW) {
+
+                        uint32_t schemaId = 0;
+                        const char* data = 0;
+                        size_t len = 0;
+                        StoreCodec::rowOf(levelVal, schemaId, data, len);
+
+                        if(schemas.find(schemaId) == schemas.end())
+                            ThrowRuntimeError("No schema stored for row");
+
+                        dataTuple = RowCodec::decode(msgEnv, schemas[schemaId], data, len);
+
+                    } else {
+
+                        StoreCodec::decode(levelVal, storeTagged_, payload);
+                        Topic* topicDesc = findTopic(topic.c_str());
+
+                        if(topicDesc) {
+
+                            struct mosquitto_message message;
+                            memset(&message, 0, sizeof(message));
+                            message.topic      = (char*)topic.c_str();
+                            message.payload    = (void*)payload.data();
+                            message.payloadlen = payload.size();
+
+                            dataTuple = formatData(msgEnv, &message, *topicDesc);
+
+                        } else {
+                            dataTuple = enif_make_tuple1(msgEnv, enif_make_string_len(msgEnv, payload.data(), payload.size(), ERL_NIF_LATIN1));
+                        }
+                    }
+
+                } catch(std::runtime_error& err) {
+                    LOGERROR("MQTT Skipping stored message " << levelKey << ": " << err.what());
+                    enif_clear_env(msgEnv);
+                    continue;
+                }
+
+                ERL_NIF_TERM result = enif_make_tuple2(msgEnv, enif_make_string(msgEnv, topic.c_str(), ERL_NIF_LATIN1), dataTuple);
+
+                if(!enif_send(env, &pid, msgEnv, result))
+                    ThrowRuntimeError("Replay target process is not alive");
+
+                replayLatency_.record(Metrics::nanoSeconds() - replayStart);
+                replayed_.add();
+
+                enif_clear_env(msgEnv);
+                ++nSent;
+            }
+
+            if(!entries.empty())
+                start = entries.back().first + '\0';
+
+        } while(entries.size() == REPLAY_CHUNK);
+
+    } catch(...) {
+        enif_free_env(msgEnv);
+        throw;
+    }
+
+    enif_free_env(msgEnv);
+#else
+    ThrowRuntimeError("Replay requires compiling with MQTT_USE_LEVELDB=1");
+#endif
+
+    return nSent;
+}
+
+/**.......................................................................
+ * Return our metrics as an erlang map of name => value, where the
+ * value of a histogram is itself a map of its count and quantiles.
+ * Takes no lock, except briefly for the computed gauges
+ */
+ERL_NIF_TERM MosClient::metrics(ErlNifEnv* env)
+{
+    ERL_NIF_TERM map = enif_make_new_map(env);
+    std::vector<Metrics::Entry>& entries = metrics_.entries();
+
+    for(unsigned i=0; i < entries.size(); i++) {
+
+        Metrics::Entry& entry = entries[i];
+        ERL_NIF_TERM val;
+
+        if(entry.kind_ == Metrics::HISTOGRAM) {
+
+            Histogram* hist = entry.histogram_;
+            val = enif_make_new_map(env);
+
+            enif_make_map_put(env, val, enif_make_atom(env, "count"), enif_make_uint64(env, hist->count()),        &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "min"),   enif_make_uint64(env, hist->min()),          &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "mean"),  enif_make_double(env, hist->mean()),         &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "p50"),   enif_make_uint64(env, hist->quantile(0.50)), &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "p90"),   enif_make_uint64(env, hist->quantile(0.90)), &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "p99"),   enif_make_uint64(env, hist->quantile(0.99)), &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "p999"),  enif_make_uint64(env, hist->quantile(0.999)), &val);
+            enif_make_map_put(env, val, enif_make_atom(env, "max"),   enif_make_uint64(env, hist->max()),          &val);
+
+        } else {
+            val = enif_make_uint64(env, entry.value());
+        }
+
+        enif_make_map_put(env, map, enif_make_atom(env, entry.name_.c_str()), val, &map);
+    }
+
+    return map;
+}
+
+/**.......................................................................
+ * Return statistics for the topN subscribed topics with the highest
+ * message rate (or, if byErrors is true, the most parse errors), as a
+ * list of maps, highest first.  topN = 0 returns all topics.  Takes
+ * no lock
+ */
+ERL_NIF_TERM MosClient::topicStats(ErlNifEnv* env, unsigned topN, bool byErrors)
+{
+    std::vector<Topic*> topics = topicTable_.entries();
+    int64_t now = getCurrentMicroSeconds();
+
+    // Sort on a snapshot of each key, since the stats keep changing
+
+    std::vector<std::pair<double, Topic*> > ranked;
+
+    for(unsigned i=0; i < topics.size(); i++) {
+        TopicStats& stats = *topics[i]->stats_;
+        ranked.push_back(std::pair<double, Topic*>(byErrors ? stats.errors() : stats.rate(now), topics[i]));
+    }
+
+    std::sort(ranked.begin(), ranked.end(), std::greater<std::pair<double, Topic*> >());
+
+    if(topN > 0 && ranked.size() > topN)
+        ranked.resize(topN);
+
+    std::vector<ERL_NIF_TERM> terms;
+
+    for(unsigned i=0; i < ranked.size(); i++) {
+
+        Topic* topicDesc   = ranked[i].second;
+        TopicStats& stats  = *topicDesc->stats_;
+
+        ERL_NIF_TERM errors = enif_make_new_map(env);
+
+        for(unsigned iErr=0; iErr < TopicStats::NERROR; iErr++) {
+            TopicStats::Error kind = (TopicStats::Error)iErr;
+            enif_make_map_put(env, errors, enif_make_atom(env, TopicStats::errorName(kind).c_str()),
+                              enif_make_uint64(env, stats.errors(kind)), &errors);
+        }
+
+        ERL_NIF_TERM map = enif_make_new_map(env);
+
+        enif_make_map_put(env, map, enif_make_atom(env, "topic"),     enif_make_copy(env, topicDesc->binTerm_),         &map);
+        enif_make_map_put(env, map, enif_make_atom(env, "messages"),  enif_make_uint64(env, stats.messages()),          &map);
+        enif_make_map_put(env, map, enif_make_atom(env, "bytes"),     enif_make_uint64(env, stats.bytes()),             &map);
+        enif_make_map_put(env, map, enif_make_atom(env, "errors"),    errors,                                           &map);
+        enif_make_map_put(env, map, enif_make_atom(env, "last_seen"), enif_make_int64(env, stats.lastSeenMicros()/1000), &map);
+        enif_make_map_put(env, map, enif_make_atom(env, "rate"),      enif_make_double(env, stats.rate(now)),           &map);
+
+        terms.push_back(map);
+    }
+
+    return enif_make_list_from_array(env, terms.empty() ? 0 : &terms[0], terms.size());
+}
+#endif
+
 /**.......................................................................
  * Parse a JSON string into tokens
  */
@@ -1100,8 +3483,13 @@ int MosClient::toInt(std::string str)
 //-----------------------------------------------------------------------
 
 #if WITH_ERL
-void MosClient::notify(const struct mosquitto_message *message)
+void MosClient::notify(Session* session, const struct mosquitto_message *message, Topic* topicDesc)
 {
+    session->haveRow_ = false;
+
+    if(topicDesc)
+        topicDesc->stats_->record(message->payloadlen, getCurrentMicroSeconds());
+
     // Don't pass command messages on to listeners -- they are
     // intended only for us
     
@@ -1110,24 +3498,38 @@ void MosClient::notify(const struct mosquitto_message *message)
 
     try {
         
-        // Reuse the allocated msgEnv.  This saves us having to alloc
-        // and delete one for every message received, which is both
-        // operationally intensive and unnecessary
+        // Reuse the session's allocated msgEnv.  This saves us having
+        // to alloc and delete one for every message received, which
+        // is both operationally intensive and unnecessary
         
+        ErlNifEnv* env = session->msgEnv_;
         ERL_NIF_TERM result;
         
         // If the topic isn't in our map, we can't format it for TS
         
-        if(topicMap_.find(message->topic) == topicMap_.end()) {
+        if(!topicDesc) {
 
-            ERL_NIF_TERM topic   = enif_make_string(msgEnv_, (const char*)message->topic, ERL_NIF_LATIN1);
-            ERL_NIF_TERM payload = enif_make_tuple1(msgEnv_, enif_make_string_len(msgEnv_, (const char*)message->payload, message->payloadlen, ERL_NIF_LATIN1));
-            result = enif_make_tuple2(msgEnv_, topic, payload);
+            ERL_NIF_TERM topic   = enif_make_string(env, (const char*)message->topic, ERL_NIF_LATIN1);
+            ERL_NIF_TERM payload = enif_make_tuple1(env, enif_make_string_len(env, (const char*)message->payload, message->payloadlen, ERL_NIF_LATIN1));
+            result = enif_make_tuple2(env, topic, payload);
             
             // Else use the supplied schema to format the return message
             
         } else {
-            result = formatForSchema(message);
+
+            ERL_NIF_TERM dataTuple;
+            result = formatForSchema(env, message, *topicDesc, &dataTuple);
+            decodeLatency_.record(Metrics::nanoSeconds() - session->receivedNs_);
+
+            // If storing rows, encode the row now, since sending
+            // invalidates the terms
+
+            if(store_ && storeRows_ && storeTagged_ && !topicDesc->rowTypes_.empty()) {
+                session->row_.clear();
+                RowCodec::encode(env, dataTuple, topicDesc->rowTypes_, session->row_);
+                session->rowTopic_ = topicDesc;
+                session->haveRow_  = true;
+            }
         }
         
         //------------------------------------------------------------
@@ -1135,16 +3537,22 @@ void MosClient::notify(const struct mosquitto_message *message)
         // subscribers that a message has arrived
         //------------------------------------------------------------
         
-        for(std::list<std::pair<ErlNifEnv*, ErlNifPid> >::iterator iter=notificationList_.begin(); 
-            iter != notificationList_.end(); iter++) {
+        NotifyList* notifyList = notifyList_.load(std::memory_order_acquire);
+        uint64_t sendStart = Metrics::nanoSeconds();
+
+        for(NotifyList::iterator iter=notifyList->begin(); iter != notifyList->end(); iter++) {
             
             ErlNifPid pid = iter->second;
-            enif_send(NULL, &pid, msgEnv_, result);
+            enif_send(NULL, &pid, env, result);
+            notified_.add();
         }
+
+        if(!notifyList->empty())
+            sendLatency_.record(Metrics::nanoSeconds() - sendStart);
         
         // Ready the environment for reuse
         
-        enif_clear_env(msgEnv_);
+        enif_clear_env(env);
         
     } catch(std::runtime_error& err) {
         
@@ -1166,32 +3574,175 @@ void MosClient::notify(const struct mosquitto_message *message)
 #endif
 
 /**.......................................................................
- * Add our subscribe queue to the server
+ * Add our subscribe queue to the server, and mark the session
+ * connected.  If a subscribe can't be sent, the session is
+ * disconnected instead, and retried through the usual reconnect path.
+ *
+ * If the broker resumed a persistent session, it already holds
+ * everything this session subscribed to, and only topics added since
+ * are sent
  */
-void MosClient::addSubscribeList(struct mosquitto *mosq)
+void MosClient::addSubscribeList(Session* session, bool sessionPresent)
 {
-    ScopedLock(mutex_);
+    ScopedLock lock(mutex_);
     
-    // Subscribe to any topics that have been requested
+    if(!sessionPresent)
+        session->nSubscribed_ = 0;
 
+    // Collect any topics that have been requested, by QoS
 
-    if(!topicList_.empty()) {
-        for(std::list<std::string>::iterator iter=topicList_.begin();
-            iter != topicList_.end(); iter++) {
+    std::vector<std::string> topics[3];
 
-            LOG("MQTT Subscribing to topic " << (*iter).c_str());
+    unsigned iTopic = 0;
+    for(std::list<Subscription>::iterator iter=topicList_.begin();
+        iter != topicList_.end(); iter++, iTopic++) {
 
-            int retVal = mosquitto_subscribe(mosq, NULL, (*iter).c_str(), 0);
-            if(retVal != MOSQ_ERR_SUCCESS)
-                ThrowRuntimeError(formatMosError(retVal));
+        if(iTopic < session->nSubscribed_)
+            continue;
+
+        topics[iter->qos_].push_back(sessionTopic(iter->topic_));
+
+        LOG("MQTT Subscribing to topic " << topics[iter->qos_].back().c_str() << " (QoS " << iter->qos_ << ")");
+    }
+
+    // If running standalone, subscribe to name/command topic too.
+    // Commands are not shared: only the first session receives them
+
+    if(session->index_ == 0 && !sessionPresent)
+        topics[0].push_back(commandTopic_);
+
+    // And send them in batches of subscribeBatch_ topics per
+    // SUBSCRIBE packet (a batch has a single QoS).  SUBACKs are
+    // tracked by mid in subscribe_callback.  Libraries older than
+    // 1.6 have no mosquitto_subscribe_multiple, and send one topic per
+    // packet
+
+    session->pendingSubacks_.clear();
+    session->subscribeStartMicros_ = getCurrentMicroSeconds();
+
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+    unsigned batch = subscribeBatch_;
+#else
+    unsigned batch = 1;
+#endif
+
+    for(int qos=0; qos < 3; qos++) {
+        for(unsigned iStart=0; iStart < topics[qos].size(); iStart += batch) {
+
+            unsigned iStop = iStart + batch;
+            if(iStop > topics[qos].size())
+                iStop = topics[qos].size();
+
+            int mid    = 0;
+#if LIBMOSQUITTO_VERSION_NUMBER >= 1006000
+            std::vector<char*> subs;
+            for(unsigned i=iStart; i < iStop; i++)
+                subs.push_back((char*)topics[qos][i].c_str());
+
+            int retVal = mosquitto_subscribe_multiple(session->mosq_, &mid, subs.size(), &subs[0], qos, 0, NULL);
+#else
+            int retVal = mosquitto_subscribe(session->mosq_, &mid, topics[qos][iStart].c_str(), qos);
+#endif
+
+            // If a batch can't be sent, drop the connection rather
+            // than leave it up and partly subscribed.  nSubscribed_
+            // is left as it was, so the reconnect sends these again
+
+            if(retVal != MOSQ_ERR_SUCCESS) {
+                LOGWARN("MQTT Unable to subscribe (session " << session->index_ << "): " << formatMosError(retVal) << " -- disconnecting");
+                mosquitto_disconnect(session->mosq_);
+                return;
+            }
+
+            session->pendingSubacks_.insert(mid);
+            subscribeBatches_.fetch_add(1, std::memory_order_relaxed);
         }
     }
 
-    // If running standalone, subscribe to name/command topic too
+    // Marked connected under the lock, so that a topic added from
+    // another thread is either in the list above, or is subscribed by
+    // subscribeSessions()
 
-    int retVal = mosquitto_subscribe(mosq, NULL, commandTopic_.c_str(), 0);
-    if(retVal != MOSQ_ERR_SUCCESS)
-        ThrowRuntimeError(formatMosError(retVal));
+    session->nSubscribed_ = topicList_.size();
+    session->connected_   = true;
+}
+
+/**.......................................................................
+ * Return the client id for a session.  An explicit client_id is used
+ * as given for a single session, and suffixed with the session index
+ * for multiple sessions.  Persistent sessions with no client_id
+ * default to the client name.  Else returns empty, for a random id
+ */
+std::string MosClient::sessionClientId(Session* session)
+{
+    std::string id = clientId_;
+
+    if(id.empty() && !cleanSession_)
+        id = name_;
+
+    if(id.empty() || nSessions_ < 2)
+        return id;
+
+    std::ostringstream os;
+    os << id << "-" << session->index_;
+    return os.str();
+}
+
+/**.......................................................................
+ * Return the name under which a data topic is subscribed.  With more
+ * than one session, this is the shared subscription
+ * $share/<group>/<topic>, so that the broker delivers each message to
+ * only one of our sessions
+ */
+std::string MosClient::sessionTopic(const std::string& topic)
+{
+    if(nSessions_ < 2)
+        return topic;
+
+    return "$share/" + (shareGroup_.empty() ? name_ : shareGroup_) + "/" + topic;
+}
+
+/**.......................................................................
+ * Subscribe all currently-connected sessions to a data topic.  Sessions
+ * that are not connected will subscribe when they connect.  Called
+ * with mutex_ held
+ */
+int MosClient::subscribeSessions(const std::string& topic, int qos)
+{
+    std::string name = sessionTopic(topic);
+    int retVal = MOSQ_ERR_SUCCESS;
+
+    for(unsigned i=0; i < sessions_.size(); i++) {
+
+        Session* session = sessions_[i];
+
+        if(session->connected_ && session->mosq_) {
+            int ret = mosquitto_subscribe(session->mosq_, NULL, name.c_str(), qos);
+            if(ret != MOSQ_ERR_SUCCESS)
+                retVal = ret;
+            else
+                session->nSubscribed_ = topicList_.size();
+        }
+    }
+
+    wakeLoops();
+
+    return retVal;
+}
+
+/**.......................................................................
+ * Return the number of sessions currently connected to the broker
+ */
+unsigned MosClient::nConnected()
+{
+    unsigned n = 0;
+
+    for(unsigned i=0; i < sessions_.size(); i++) {
+        if(sessions_[i]->connected_)
+            ++n;
+    }
+
+    return n;
 }
 
 /**.......................................................................
@@ -1199,14 +3750,40 @@ void MosClient::addSubscribeList(struct mosquitto *mosq)
  */
 std::string MosClient::getStatusSummaryPrivate()
 {
-    ScopedLock(mutex_);
-    
     std::ostringstream os;
 
-    os << (connected_ ? GREEN : RED) << "MQTT Client is " << (connected_ ? "" : "not ") << "connected to the broker" << GREEN << std::endl << std::endl << "\r";
+    unsigned nConn   = nConnected();
+    bool connected   = nConn > 0;
+
+    os << (connected ? GREEN : RED) << "MQTT Client is " << (connected ? "" : "not ") << "connected to the broker" << GREEN << std::endl << std::endl << "\r";
 
     os << "Host:        " << host_     << std::endl << "\r";
     os << "Port:        " << port_     << std::endl << "\r";
+    os << "Sessions:    " << nConn << " of " << nSessions_ << " connected" << std::endl << "\r";
+
+    if(eventLoop_)
+        os << "Event loop:  " << loops_.size() << " thread(s)" << std::endl << "\r";
+
+    os << "Connects:    " << connectAttempts_.load() << " attempts, "
+       << connectFailures_.load() << " failures, "
+       << reconnects_.load() << " reconnects" << std::endl << "\r";
+
+    os << "Subscribe batches sent: " << subscribeBatches_.load() << " (up to " << subscribeBatch_ << " topics each)" << std::endl << "\r";
+    os << "Time to fully subscribed: " << subscribeLatency_.summary(1000.0, " ms") << std::endl << "\r";
+
+    if(!cleanSession_)
+        os << "Persistent session resumed " << sessionsResumed_.load() << " time(s)" << std::endl << "\r";
+    os << "Connect latency: " << connectLatency_.summary(1000.0, " ms") << std::endl << "\r";
+    os << "Logging: " << Logger::levelName(Logger::instance().level()) << ", " << Logger::instance().logged()
+       << " messages logged, " << Logger::instance().dropped() << " dropped" << std::endl << "\r";
+
+    if(metricsServer_.running())
+        os << "Metrics: serving http://" << metricsAddr_ << ":" << metricsPort_ << "/metrics, "
+           << metricsServer_.scrapes() << " scrapes" << std::endl << "\r";
+
+    if(nSessions_ > 1)
+        os << "Share group: " << (shareGroup_.empty() ? name_ : shareGroup_) << std::endl << "\r";
+
     os << "Using certs: " << (useCerts_ ? "true" : "false") << std::endl << std::endl << "\r";
     os << "capath     = " << caPath_   << std::endl << "\r";
     os << "cafile     = " << caFile_   << std::endl << "\r";
@@ -1215,27 +3792,55 @@ std::string MosClient::getStatusSummaryPrivate()
     
     os << "MQTT Client is currently subscribed to the following topics: " << std::endl << std::endl << "\r";
 
-    for(std::list<std::string>::iterator iter=topicList_.begin();
+    for(std::list<Subscription>::iterator iter=topicList_.begin();
         iter != topicList_.end(); iter++) {
-        std::string topic = *iter;
-        os << "   " << topic;
+        std::string topic = iter->topic_;
+        os << "   " << topic << " (QoS " << iter->qos_ << ")";
 
 #if WITH_ERL
-        os << std::endl << "\r      with schema: " << topicMap_[topic].schema_;
+        Topic* topicDesc = findTopic(topic.c_str());
+        os << std::endl << "\r      with schema: " << (topicDesc ? topicDesc->schema_ : "");
 #endif
 
         os <<  std::endl << "\r";
     }
 
-    if(connected_) {
+    if(connected) {
         os << "   " << commandTopic_ << std::endl << "\r      with schema: {command:cmdname, arg1:val1, arg2:val2, ...}" << std::endl << "\r";
     } else if(topicList_.empty()) {
         os << "   (none)" << std::endl << "\r";
     }
 
+    os << "Published:   " << published_.load() << " messages, " << publishFailures_.load() << " failures, "
+       << publishQueued_.load() << " queued" << std::endl << "\r";
+
+    if(bridge_) {
+        os << "Bridge:      " << bridgeHost_ << ":" << bridgePort_ << " (" << bridge_->nConnected() << " connected), "
+           << bridged_.load() << " bridged, " << bridgeDropped_.load() << " dropped, "
+           << bridge_->publishQueued_.load() << " queued, "
+           << bridge_->outboxTail_.load() - bridge_->outboxHead_.load() << " stored" << std::endl << "\r";
+    }
+
+    if(outbox_) {
+        os << "Outbox:      " << outboxTail_.load() - outboxHead_.load() << " stored, "
+           << outboxSpilled_.load() << " spilled, " << outboxForwarded_.load() << " forwarded" << std::endl << "\r";
+    }
+
 #if WITH_LEVELDB
     if(store_) {
         os << std::endl << "\r" << "Using leveldb backing store: " << dbName_ << std::endl << "\r";
+        os << "Store codec: " << StoreCodec::codecName(storeTagged_ ? storeCodec_ : StoreCodec::NONE)
+           << (storeTagged_ ? "" : " (store predates codecs)") << ", " << storedBytes_.load() << " payload bytes stored in "
+           << storedRecordBytes_.load() << " record bytes" << std::endl << "\r";
+
+        if(storeRows_ && storeTagged_)
+            os << "Store format: row, " << storedRows_.load() << " messages stored as rows" << std::endl << "\r";
+    }
+
+    if(durable_) {
+        os << "Durable mode: " << durableCommits_.load() << " commits of up to " << durableBatch_
+           << " messages, flushed after " << durableFlushMs_ << " ms, " << durableFailures_.load() << " failed" << std::endl << "\r";
+        os << "Receipt to commit: " << durableLatency_.summary(1000.0, " ms") << std::endl << "\r";
     }
 #endif
     
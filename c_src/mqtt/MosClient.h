@@ -5,19 +5,34 @@
 
 #include <mosquitto.h>
 #include <pthread.h>
+#include <stdint.h>
 
+#include <atomic>
 #include <list>
 #include <map>
+#include <memory>
 #include <queue>
+#include <set>
 #include <string>
 
+#include "MpscQueue.h"
 #include "Mutex.h"
 
 #if WITH_ERL
 #include "ErlUtil.h"
 #endif
 
+#include "Backoff.h"
+#include "EventLoop.h"
+#include "Histogram.h"
 #include "LevelManager.h"
+#include "Metrics.h"
+#include "MetricsServer.h"
+#include "RowCodec.h"
+#include "RowDecoder.h"
+#include "StoreCodec.h"
+#include "TopicStats.h"
+#include "TopicTable.h"
 
 //=======================================================================
 // MosClient is a class that can be used in a number of different ways:
@@ -39,6 +54,40 @@
 // embedded=true, then no backing leveldb store will be used (assumed
 // that the messages will be stored elsewhere by the process in which
 // we are embedded).
+//
+// Each MosClient owns its own mosquitto session(s), comms thread(s),
+// topic table and store.  With the sessions option set to N > 1, the
+// client opens N sessions to the broker, each with its own comms
+// thread, and subscribes to data topics through the shared
+// subscription $share/<group>/<topic>, so that the broker balances
+// messages across them.  All sessions feed the same notification and
+// store pipeline.
+//
+// With the event_loop option set, sessions are not given a thread
+// each.  Instead, loop_threads threads (default 1) each run an epoll
+// loop that drives a subset of the sessions through
+// mosquitto_loop_read/write/misc.  Sessions connect asynchronously, so
+// that a broker that is slow to answer doesn't stall the others.
+//
+// Messages can be published from any thread with publish().  Requests
+// are passed through a lock-free queue to the comms thread servicing
+// session 0, which publishes them in batches.  With the outbox option
+// set, messages that can't be published immediately (because session
+// 0 is disconnected, or publishing is backlogged) are appended to the
+// store instead, and forwarded from there in order, under flow
+// control, once the session can take them.
+//
+// With bridge_host set, messages received on subscribed topics are
+// also republished to a second broker, through a second MosClient
+// (the bridge) with its own publish queue.  Topic prefixes can be
+// rewritten, and messages filtered, on the way.  If we have a backing
+// store, the bridge uses an outbox, so that messages spill to the
+// store when the destination is slow or unreachable.
+//
+// mqtt:command/1 operates on a process-wide default client (see
+// defaultClient()); additional clients are created from erlang with
+// mqtt:new_client/1, and are destroyed when the erlang handle is
+// garbage collected.
 //=======================================================================
 
 #define THREAD_START(fn) void* (fn)(void *arg)
@@ -94,70 +143,303 @@ namespace nifutil {
             FORMAT_JSON    = 2
         };
         
+        //------------------------------------------------------------
+        // A batch of messages to publish, queued from any thread to
+        // the thread servicing session 0.  Erlang payloads are not
+        // copied: they point into terms held by env_, which lives as
+        // long as the request
+        //------------------------------------------------------------
+
+        struct PublishItem {
+            std::string topic_;
+            const void* payload_; // NULL to use data_
+            size_t len_;
+            std::string data_;
+        };
+
+        struct PublishRequest {
+
+            PublishRequest() {
+                qos_    = 0;
+                retain_ = false;
+#if WITH_ERL
+                env_    = 0;
+#endif
+            }
+
+            ~PublishRequest() {
+#if WITH_ERL
+                if(env_)
+                    enif_free_env(env_);
+#endif
+            }
+
+            std::atomic<PublishRequest*> next_;
+            std::vector<PublishItem> items_;
+            int qos_;
+            bool retain_;
+#if WITH_ERL
+            ErlNifEnv* env_;
+#endif
+        };
+
 #if WITH_ERL
         struct Topic {
+            uint64_t hash_;
+            std::string name_;
             std::vector<STRING_CONV_FN_PTR> convFnVec_;
             std::string schema_;
             FormatType format_;
+
+            // A CSV decoder specialized for the schema, if it has one
+            // (see RowDecoder.h)
+
+            RowDecoder::CSV_FN csvDecoder_;
+
+            // Erlang representations of the topic name, created once
+            // in topicEnv_ on subscribe, and copied into the message
+            // env for each message received
+
+            ERL_NIF_TERM nameTerm_;
+            ERL_NIF_TERM binTerm_;
+
+            int qos_;
+
+            // The row types of the schema (empty if messages on this
+            // topic are not stored as rows), and its id.  Messages are
+            // stored as rows once the schema itself has been stored
+
+            std::vector<RowCodec::FieldType> rowTypes_;
+            uint32_t schemaId_;
+            std::atomic<bool> schemaStored_;
+
+            // Throughput and error statistics, carried over to the
+            // new descriptor when the topic is resubscribed
+
+            std::shared_ptr<TopicStats> stats_;
         };
 #endif        
         /**
-         * Destructor.
+         * Constructor.
+         */
+        MosClient();
+
+        /**
+         * Destructor.  Stops the comms loop if it is running
          */
         virtual ~MosClient();
 
+        // The process-wide client
+
+        static MosClient& defaultClient();
+
         //------------------------------------------------------------
         // Used from the NIF interface
         //------------------------------------------------------------
         
-        static void startCommsLoop();
+        void startCommsLoop();
+        void stopCommsLoop();
+        void requestStop();
         static void blockForever();
             
-        static std::string getStatusSummary();
-        static void toggleLogging(bool log);
-        static void dumpToBroker(std::map<std::string, std::string>& entryMap);
+        std::string getStatusSummary();
+        void toggleLogging(bool log);
+        void dumpToBroker(std::map<std::string, std::string>& entryMap);
+
+        void publish(std::string topic, std::string payload, int qos=0, bool retain=false);
+
+        // A hook called on the comms thread once each received
+        // message has been processed (and stored, if storing), e.g.,
+        // to time ingest from a stand-alone program.  Must be set
+        // before the comms loop is started
+
+        typedef void (*MESSAGE_FN)(const struct mosquitto_message* message, void* arg);
+        void setMessageHook(MESSAGE_FN fn, void* arg);
+
+        void addBridgeRule(std::string fromPrefix, std::string toPrefix);
+        void addBridgeFilter(std::string filter);
         
 #if WITH_ERL
-        static void subscribe(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format);
-        static void registerPid(ErlNifEnv* env, ErlNifPid pid);
-        static void setOption(ErlNifEnv* env, std::string name, ERL_NIF_TERM val);
+        void subscribe(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format, int qos=0);
+        void registerPid(ErlNifEnv* env, ErlNifPid pid);
+        unsigned replay(ErlNifEnv* env, ErlNifPid pid);
+        void publish(ErlNifEnv* env, std::vector<std::pair<ERL_NIF_TERM, ERL_NIF_TERM> >& messages, int qos, bool retain);
+        void setOption(ErlNifEnv* env, std::string name, ERL_NIF_TERM val);
+        ERL_NIF_TERM metrics(ErlNifEnv* env);
+        ERL_NIF_TERM topicStats(ErlNifEnv* env, unsigned topN, bool byErrors);
+
+        // Split a CSV or JSON payload and convert its fields according
+        // to a topic's schema.  Public so that the decode path can be
+        // benchmarked without a broker (see bench/tErlUtil.cc)
+
+        ERL_NIF_TERM formatData(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc);
 #endif
 
-        static void setOption(std::string name, int val);
-        static void setOption(std::string name, std::string val);
-        static void setOption(std::string name, bool val);
+        void setOption(std::string name, int val);
+        void setOption(std::string name, std::string val);
+        void setOption(std::string name, bool val);
         
     private:
         
         /**
-         * Private constructors
+         * Private copy constructors
          */
-        MosClient();
         MosClient(MosClient& mos);
         MosClient(const MosClient& mos);
 
+        //------------------------------------------------------------
+        // Per-session state.  Each session is a separate connection
+        // to the broker, serviced by its own comms thread
+        //------------------------------------------------------------
+
+        struct Loop;
+
+        struct Session {
+            MosClient* client_;
+            unsigned index_;
+            struct mosquitto* mosq_;
+            pthread_t threadId_;
+            bool started_;
+            volatile bool connected_;
+
+            // Used only in event-loop mode: the loop servicing this
+            // session, the socket registered with it (-1 if none),
+            // whether write interest is registered, whether an async
+            // connect is still awaiting its CONNACK, and the time of
+            // the next connection attempt
+
+            Loop* loop_;
+            int fd_;
+            bool wantWrite_;
+            bool connecting_;
+            int64_t retryMicros_;
+
+            // Reconnect state: whether mosquitto_connect has
+            // succeeded (after which we use mosquitto_reconnect),
+            // whether we have ever had a CONNACK, and the start time
+            // of the current attempt
+
+            bool initialized_;
+            bool everConnected_;
+            int64_t connectStartMicros_;
+            Backoff backoff_;
+
+            // The number of entries of topicList_ this session has
+            // subscribed to.  With a persistent session, only later
+            // entries need be sent on reconnect
+
+            unsigned nSubscribed_;
+
+            // mids of subscribe batches sent on connect that are still
+            // awaiting a SUBACK, and when they were sent.  Touched
+            // only from this session's comms thread
+
+            std::set<int> pendingSubacks_;
+            int64_t subscribeStartMicros_;
+
+            // In durable mode, store writes awaiting commit, the mids
+            // of the QoS > 0 messages they came from (acknowledged on
+            // commit), and when the oldest was queued.  Touched only
+            // from this session's comms thread
+
+            std::vector<std::pair<std::string, std::string> > pendingWrites_;
+            std::vector<int> pendingAcks_;
+            int64_t firstPendingMicros_;
+
+            // When the current message was received (ns), for stage
+            // latencies
+
+            uint64_t receivedNs_;
+#if WITH_ERL
+            // Env in which messages received on this session are
+            // formatted, reused for every message
+
+            ErlNifEnv* msgEnv_;
+
+            // The current message encoded as a row, and the
+            // descriptor it was encoded with, if it had a schema and
+            // we store rows, so that storing it doesn't parse it again
+
+            std::string row_;
+            Topic* rowTopic_;
+            bool haveRow_;
+#endif
+        };
+
+        //------------------------------------------------------------
+        // An event-loop thread, and the sessions it services
+        //------------------------------------------------------------
+
+        struct Loop {
+            MosClient* client_;
+            unsigned index_;
+            EventLoop* eventLoop_;
+            pthread_t threadId_;
+            bool started_;
+            std::vector<Session*> sessions_;
+        };
+
+        static void libInit();
+        static void libCleanup();
+
         static THREAD_START(runMosCommsLoop);
+        static THREAD_START(runEventLoop);
 
         //------------------------------------------------------------
         // Callbacks used by mosquitto client library
         //------------------------------------------------------------
         
         static void message_callback(struct mosquitto *mosq, void *userdata, const struct mosquitto_message *message);
-        static void connect_callback(struct mosquitto *mosq, void *userdata, int result);
+        static void connect_callback(struct mosquitto *mosq, void *userdata, int result, int flags);
         static void disconnect_callback(struct mosquitto *mosq, void *userdata, int result);
         static void subscribe_callback(struct mosquitto *mosq, void *userdata, int mid, int qos_count, const int *granted_qos);
+        static void publish_callback(struct mosquitto *mosq, void *userdata, int mid);
         static void log_callback(struct mosquitto *mosq, void *userdata, int level, const char *str);
 
 
-        void addSubscribeList(struct mosquitto *mosq);
+        void addSubscribeList(Session* session, bool sessionPresent);
+        std::string sessionClientId(Session* session);
         std::string getStatusSummaryPrivate();
-
-        void process(const struct mosquitto_message *message);
+        std::string sessionTopic(const std::string& topic);
+        int subscribeSessions(const std::string& topic, int qos);
+        unsigned nConnected();
+
+        bool process(Session* session, const struct mosquitto_message *message);
+        void bridgeMessage(const struct mosquitto_message *message);
+        void startBridge();
+        void stopBridge();
         void processCommand(const struct mosquitto_message *message);
-        void processMessage(const struct mosquitto_message *message);
-
-        void initAndRun();
-        void certConfig();
+        bool processMessage(Session* session, const struct mosquitto_message *message);
+
+        void createSession(Session* session);
+        void initAndRun(Session* session);
+        int serviceSession(Session* session, int timeoutMs);
+        void connectAttempt(Session* session);
+        void sleepUnlessStopped(Session* session, unsigned delayMs);
+
+        void runLoop(Loop* loop);
+        void connectSession(Session* session);
+        void dropSession(Session* session);
+        void updateInterest(Session* session);
+        void wakeLoops();
+
+        void enqueuePublish(PublishRequest* request);
+        void drainPublishQueue(Session* session);
+        bool processPublishQueue(Session* session, bool connected);
+        bool canPublish(Session* session, int qos);
+        int publishItem(Session* session, const std::string& topic, size_t len, const void* payload, int qos, bool retain);
+        void wakePublisher();
+
+        bool forwardOutbox(Session* session);
+        void openStore();
+        void recoverOutbox();
+        void checkStoreFormat();
+        std::pair<std::string, std::string> outboxEntry(PublishItem& item, int qos, bool retain);
+        static std::string outboxKey(uint64_t seq);
+        static bool decodeOutbox(const std::string& val, std::string& topic, int& qos, bool& retain, size_t& offset);
+        static void drainPipe(int fd);
+        static void setCork(int sock, bool cork);
+        void certConfig(Session* session);
 
         //------------------------------------------------------------
         // The stand-alone interface to this class
@@ -166,13 +448,20 @@ namespace nifutil {
         LevelManager db_;
         std::string dbName_;
 
-        void storeMessage(const struct mosquitto_message *message);
+        void registerMetrics();
+        bool storeMessage(Session* session, const struct mosquitto_message *message);
+        bool encodeRow(Session* session, std::string& record);
+        void loadSchemas(std::map<uint32_t, std::vector<RowCodec::FieldType> >& schemas);
+        static std::string schemaKey(uint32_t schemaId);
+        void flushDurable(Session* session, bool force);
+        void abandonDurable(Session* session);
         std::map<std::string, std::string> decodeJson(const struct mosquitto_message* message);
         int toInt(std::string str);
 
         std::string getEntry(std::map<std::string, std::string>& entryMap, std::string entry);
         std::string getEntry(std::map<std::string, std::string>& entryMap, std::string defVal, std::string entry);
 
+        void requestStopPrivate();
         void toggleLoggingPrivate(bool log);
         void dumpToBrokerPrivate(std::map<std::string, std::string>& entryMap);
 
@@ -181,18 +470,33 @@ namespace nifutil {
         // The private NIF interface to this class
         //------------------------------------------------------------
         
-        void notify(const struct mosquitto_message *message);
-        void subscribePrivate(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format);
-
-        ERL_NIF_TERM formatForTs(const struct mosquitto_message* message);
-        ERL_NIF_TERM formatForSchema(const struct mosquitto_message* message);
-        ERL_NIF_TERM formatData(const struct mosquitto_message* message);
-        ERL_NIF_TERM formatDataCsv(const struct mosquitto_message* message, Topic& topicDesc);
-        ERL_NIF_TERM formatDataJson(const struct mosquitto_message* message, Topic& topicDesc);
-
-        ErlNifEnv* msgEnv_;
-        std::list<std::pair<ErlNifEnv*, ErlNifPid> > notificationList_;
-        std::map<std::string, Topic> topicMap_;
+        void notify(Session* session, const struct mosquitto_message *message, Topic* topicDesc);
+        void subscribePrivate(std::string topic, std::string schema, std::vector<STRING_CONV_FN_PTR> convFnVec, std::string format, int qos);
+
+        Topic* findTopic(const char* topic);
+
+        ERL_NIF_TERM formatForTs(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc);
+        ERL_NIF_TERM formatForSchema(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc, ERL_NIF_TERM* dataOut=0);
+        ERL_NIF_TERM formatDataCsv(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc);
+        ERL_NIF_TERM decodeCsv(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc);
+        ERL_NIF_TERM formatDataJson(ErlNifEnv* env, const struct mosquitto_message* message, Topic& topicDesc);
+        ERL_NIF_TERM convertTerm(ErlNifEnv* env, Topic& topicDesc, unsigned iTerm, const std::string& str);
+
+        // Registered pids.  The list is copied on write, so that the
+        // comms threads can walk it without locking.  Superseded
+        // lists are retired until destruction
+
+        typedef std::vector<std::pair<ErlNifEnv*, ErlNifPid> > NotifyList;
+
+        std::atomic<NotifyList*> notifyList_;
+        std::list<NotifyList*> retiredNotifyLists_;
+
+        // Topic descriptors, keyed by topic hash.  Terms cached in
+        // the descriptors live in topicEnv_, which is never cleared
+
+        TopicTable<Topic> topicTable_;
+        ErlNifEnv* topicEnv_;
+        ERL_NIF_TERM atomTsPutReq_;
 #endif
 
 
@@ -204,14 +508,146 @@ namespace nifutil {
 
         // Private members of this class
         
-        pthread_t mosCommsId_;
-        struct mosquitto* mosq_;
+        std::vector<Session*> sessions_;
+        unsigned nSessions_;
+        std::string shareGroup_;
+
+        std::vector<Loop*> loops_;
+        bool eventLoop_;
+        unsigned loopThreads_;
+
+        bool cleanSession_;
+        unsigned subscribeBatch_;
+
+        // Durable mode: QoS 1/2 messages are acknowledged only once
+        // committed to the store
+
+        bool durable_;
+        unsigned durableBatch_;
+        unsigned durableFlushMs_;
+        std::string clientId_;
+
+        unsigned reconnectMinMs_;
+        unsigned reconnectMaxMs_;
+
+        Histogram connectLatency_;
+        std::atomic<unsigned> connectAttempts_;
+        std::atomic<unsigned> connectFailures_;
+        std::atomic<unsigned> reconnects_;
+        std::atomic<unsigned> sessionsResumed_;
+        std::atomic<unsigned> subscribeBatches_;
+        Histogram subscribeLatency_;
+        std::atomic<unsigned> durableCommits_;
+        std::atomic<unsigned> durableFailures_;
+        Histogram durableLatency_;
+
+        // Message-path metrics, all registered with metrics_ (see
+        // registerMetrics()).  Stage latencies are in ns: receipt to
+        // decoded, decoded to sent to registered pids, store put (or
+        // durable commit), and each message replayed by dump or
+        // replay
+
+        Metrics metrics_;
+        Counter received_;
+        Counter receivedBytes_;
+        Counter notified_;
+        Counter stored_;
+        Counter replayed_;
+        Histogram decodeLatency_;
+        Histogram sendLatency_;
+        Histogram storeLatency_;
+        Histogram replayLatency_;
+
+        // Optional OpenMetrics listener (metricsPort_ = 0 for none),
+        // serving metrics_ plus the gauges below.  Scrapes run on the
+        // server's thread, and only read atomics, or take mutex_
+        // briefly for state that isn't ingest-path
+
+        MESSAGE_FN messageHookFn_;
+        void* messageHookArg_;
+
+        MetricsServer metricsServer_;
+        unsigned metricsPort_;
+        std::string metricsAddr_;
+        std::atomic<unsigned> replaysInFlight_;
+
+        static std::string renderMetrics(void* arg);
+        static uint64_t connectedGauge(void* arg);
+        static uint64_t outboxGauge(void* arg);
+        static uint64_t storeSizeGauge(void* arg);
+
+        // Outgoing messages.  publishPipe_ wakes the thread servicing
+        // session 0; publishWakePending_ suppresses redundant wakes
+
+        MpscQueue<PublishRequest> publishQueue_;
+        int publishPipe_[2];
+        std::atomic<bool> publishWakePending_;
+        std::atomic<bool> running_;
+        std::atomic<uint64_t> published_;
+        std::atomic<uint64_t> publishFailures_;
+
+        // Flow control.  At most publishQueueMax_ messages are held in
+        // memory, and at most publishInflight_ QoS > 0 messages await
+        // acknowledgement.  pendingRequest_ is a request popped but
+        // not yet fully published (from pendingItem_ on).  Except for
+        // the atomics, touched only by the thread servicing session 0
+
+        unsigned publishQueueMax_;
+        unsigned publishInflight_;
+        std::atomic<uint64_t> publishQueued_;
+        PublishRequest* pendingRequest_;
+        unsigned pendingItem_;
+        std::set<int> inflightMids_;
+
+        // Store-and-forward: messages that can't be published are
+        // appended to the store under outboxKey(outboxTail_), and
+        // forwarded from outboxHead_.  Stored QoS > 0 messages are
+        // deleted once acknowledged (outboxUnacked_ maps mid to key)
+
+        bool outbox_;
+        std::atomic<uint64_t> outboxHead_;
+        std::atomic<uint64_t> outboxTail_;
+        std::map<int, std::string> outboxUnacked_;
+        std::atomic<uint64_t> outboxSpilled_;
+        std::atomic<uint64_t> outboxForwarded_;
+
+        // Bridge mode.  Configuration is fixed while the comms loop
+        // runs, so is read without a lock
+
+        MosClient* bridge_;
+        std::string bridgeHost_;
+        int bridgePort_;
+        int bridgeQos_; // -1 to republish at the received QoS
+        unsigned bridgeQueueMax_;
+        std::vector<std::pair<std::string, std::string> > bridgeRules_;
+        std::vector<std::string> bridgeFilters_;
+        std::atomic<uint64_t> bridged_;
+        std::atomic<uint64_t> bridgeDropped_;
+
         static MosClient instance_;
-        bool connected_;
+        static Mutex libMutex_;
+        static unsigned libRefCount_;
         bool initialized_;
+        bool starting_; // Opening the store, in startCommsLoop()
+        volatile bool stop_;
         bool log_;
         int port_;
         bool store_; // Should we store messages internally?
+
+        // Codec for stored payloads, and the bytes stored before and
+        // after encoding.  Codecs (and rows) are only used in stores
+        // whose records are known to be tagged (see StoreCodec.h)
+
+        StoreCodec::Codec storeCodec_;
+        bool storeTagged_;
+        std::atomic<uint64_t> storedBytes_;
+        std::atomic<uint64_t> storedRecordBytes_;
+
+        // Store messages with a schema as typed rows (see
+        // RowCodec.h), and the number so stored
+
+        bool storeRows_;
+        std::atomic<uint64_t> storedRows_;
         std::string name_;
         std::string host_;
         std::string caPath_;
@@ -223,9 +659,16 @@ namespace nifutil {
         bool useCerts_;
         int keepAlive_;
         
-        std::list<std::string> topicList_;
+        // Topics to subscribe to on connect, with their QoS
+
+        struct Subscription {
+            std::string topic_;
+            int qos_;
+        };
+
+        std::list<Subscription> topicList_;
 
-        unsigned counter_;
+        std::atomic<unsigned> counter_;
         unsigned initMicros_;
 
         Mutex mutex_;
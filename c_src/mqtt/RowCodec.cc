@@ -0,0 +1,343 @@
+#include "RowCodec.h"
+#include "ExceptionUtils.h"
+
+#include <sstream>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Return the field type for a schema type name
+ */
+RowCodec::FieldType RowCodec::typeFor(std::string name)
+{
+    if(name == "timestamp") {
+        return TIMESTAMP;
+    } else if(name == "sint64") {
+        return SINT64;
+    } else if(name == "double") {
+        return DOUBLE;
+    } else if(name == "boolean") {
+        return BOOLEAN;
+    } else if(name == "varchar") {
+        return VARCHAR;
+    }
+
+    ThrowRuntimeError("Received unhandled type: " << name);
+
+    return VARCHAR;
+}
+
+std::string RowCodec::typeName(FieldType type)
+{
+    switch(type) {
+    case TIMESTAMP:
+        return "timestamp";
+    case SINT64:
+        return "sint64";
+    case DOUBLE:
+        return "double";
+    case BOOLEAN:
+        return "boolean";
+    default:
+        return "varchar";
+    }
+}
+
+/**.......................................................................
+ * FNV-1a hash of the topic and its field types
+ */
+uint32_t RowCodec::schemaId(const std::string& topic, const std::vector<FieldType>& types)
+{
+    uint32_t hash = 2166136261U;
+
+    for(unsigned i=0; i < topic.size(); i++) {
+        hash ^= (unsigned char)topic[i];
+        hash *= 16777619U;
+    }
+
+    for(unsigned i=0; i < types.size(); i++) {
+        hash ^= 0x100 + types[i];
+        hash *= 16777619U;
+    }
+
+    return hash;
+}
+
+std::string RowCodec::formatTypes(const std::vector<FieldType>& types)
+{
+    std::ostringstream os;
+
+    for(unsigned i=0; i < types.size(); i++)
+        os << (i > 0 ? "," : "") << typeName(types[i]);
+
+    return os.str();
+}
+
+std::vector<RowCodec::FieldType> RowCodec::parseTypes(const std::string& str)
+{
+    std::vector<FieldType> types;
+    size_t start = 0;
+
+    while(start < str.size()) {
+        size_t end = str.find(',', start);
+        if(end == std::string::npos)
+            end = str.size();
+
+        types.push_back(typeFor(str.substr(start, end - start)));
+        start = end + 1;
+    }
+
+    return types;
+}
+
+/**.......................................................................
+ * Format a double with the fewest significant digits (up to 17) that
+ * read back as the same value, so that e.g. 0.1 isn't rendered as
+ * 0.10000000000000001
+ */
+static std::string shortestDouble(double val)
+{
+    char buf[32];
+
+    for(int precision=15; precision <= 17; precision++) {
+        snprintf(buf, sizeof(buf), "%.*g", precision, val);
+        if(strtod(buf, NULL) == val)
+            break;
+    }
+
+    return buf;
+}
+
+/**.......................................................................
+ * Render an encoded row as CSV text, e.g., for relaying to a broker
+ */
+std::string RowCodec::toCsv(const std::vector<FieldType>& types, const char* data, size_t len)
+{
+    const char* ptr = data;
+    const char* end = data + len;
+
+    std::ostringstream os;
+
+    for(unsigned i=0; i < types.size(); i++) {
+
+        if(i > 0)
+            os << ",";
+
+        switch(types[i]) {
+        case TIMESTAMP:
+            os << getVarint(ptr, end);
+            break;
+        case SINT64:
+            {
+                uint64_t zz = getVarint(ptr, end);
+                os << (int64_t)((zz >> 1) ^ -(int64_t)(zz & 1));
+            }
+            break;
+        case DOUBLE:
+            {
+                double val;
+                check(ptr, end, sizeof(val));
+                memcpy(&val, ptr, sizeof(val));
+                ptr += sizeof(val);
+                os << shortestDouble(val);
+            }
+            break;
+        case BOOLEAN:
+            check(ptr, end, 1);
+            os << (*ptr++ ? "true" : "false");
+            break;
+        default:
+            {
+                size_t n = getVarint(ptr, end);
+                check(ptr, end, n);
+                os.write(ptr, n);
+                ptr += n;
+            }
+            break;
+        }
+    }
+
+    return os.str();
+}
+
+#if WITH_ERL
+/**.......................................................................
+ * Return the field type produced by a string conversion function (see
+ * ErlUtil::getStringConvFn())
+ */
+RowCodec::FieldType RowCodec::typeFor(STRING_CONV_FN_PTR convFn)
+{
+    if(convFn == ErlUtil::stringToUint64Term ||
+       convFn == ErlUtil::epochSecondsToTimestampTerm ||
+       convFn == ErlUtil::epochMicrosToTimestampTerm ||
+       convFn == ErlUtil::epochNanosToTimestampTerm ||
+       convFn == ErlUtil::isoToTimestampTerm) {
+        return TIMESTAMP;
+    } else if(convFn == ErlUtil::stringToInt64Term) {
+        return SINT64;
+    } else if(convFn == ErlUtil::stringToDoubleTerm) {
+        return DOUBLE;
+    } else if(convFn == ErlUtil::stringToBooleanTerm) {
+        return BOOLEAN;
+    }
+
+    return VARCHAR;
+}
+
+bool RowCodec::roundTrips(STRING_CONV_FN_PTR convFn)
+{
+    return convFn == ErlUtil::stringToUint64Term ||
+        convFn == ErlUtil::stringToInt64Term ||
+        convFn == ErlUtil::stringToDoubleTerm ||
+        convFn == ErlUtil::stringToBooleanTerm ||
+        convFn == ErlUtil::stringToBinaryTerm;
+}
+
+/**.......................................................................
+ * Encode a tuple of terms converted according to types
+ */
+void RowCodec::encode(ErlNifEnv* env, ERL_NIF_TERM row, const std::vector<FieldType>& types, std::string& out)
+{
+    int arity = 0;
+    const ERL_NIF_TERM* terms = 0;
+
+    if(!enif_get_tuple(env, row, &arity, &terms) || (unsigned)arity != types.size())
+        ThrowRuntimeError("Row does not match its schema (" << formatTypes(types) << ")");
+
+    for(unsigned i=0; i < types.size(); i++) {
+
+        switch(types[i]) {
+        case TIMESTAMP:
+            {
+                ErlNifUInt64 val;
+                if(!enif_get_uint64(env, terms[i], &val))
+                    ThrowRuntimeError("Field " << i << " is not a timestamp");
+                putVarint(out, val);
+            }
+            break;
+        case SINT64:
+            {
+                ErlNifSInt64 val;
+                if(!enif_get_int64(env, terms[i], &val))
+                    ThrowRuntimeError("Field " << i << " is not an sint64");
+                putVarint(out, ((uint64_t)val << 1) ^ (uint64_t)(val >> 63));
+            }
+            break;
+        case DOUBLE:
+            {
+                double val;
+                if(!enif_get_double(env, terms[i], &val))
+                    ThrowRuntimeError("Field " << i << " is not a double");
+                out.append((const char*)&val, sizeof(val));
+            }
+            break;
+        case BOOLEAN:
+            out.push_back(enif_is_identical(terms[i], enif_make_atom(env, "true")) ? 1 : 0);
+            break;
+        default:
+            {
+                ErlNifBinary bin;
+                if(!enif_inspect_binary(env, terms[i], &bin))
+                    ThrowRuntimeError("Field " << i << " is not a varchar");
+                putVarint(out, bin.size);
+                out.append((const char*)bin.data, bin.size);
+            }
+            break;
+        }
+    }
+}
+
+/**.......................................................................
+ * Decode a row to the tuple of terms it was encoded from
+ */
+ERL_NIF_TERM RowCodec::decode(ErlNifEnv* env, const std::vector<FieldType>& types, const char* data, size_t len)
+{
+    const char* ptr = data;
+    const char* end = data + len;
+
+    std::vector<ERL_NIF_TERM> terms(types.size());
+
+    for(unsigned i=0; i < types.size(); i++) {
+
+        switch(types[i]) {
+        case TIMESTAMP:
+            terms[i] = enif_make_uint64(env, getVarint(ptr, end));
+            break;
+        case SINT64:
+            {
+                uint64_t zz = getVarint(ptr, end);
+                terms[i] = enif_make_int64(env, (int64_t)((zz >> 1) ^ -(int64_t)(zz & 1)));
+            }
+            break;
+        case DOUBLE:
+            {
+                double val;
+                check(ptr, end, sizeof(val));
+                memcpy(&val, ptr, sizeof(val));
+                ptr += sizeof(val);
+                terms[i] = enif_make_double(env, val);
+            }
+            break;
+        case BOOLEAN:
+            check(ptr, end, 1);
+            terms[i] = enif_make_atom(env, *ptr++ ? "true" : "false");
+            break;
+        default:
+            {
+                size_t n = getVarint(ptr, end);
+                check(ptr, end, n);
+
+                ERL_NIF_TERM term;
+                unsigned char* buf = enif_make_new_binary(env, n, &term);
+                memcpy(buf, ptr, n);
+                ptr += n;
+
+                terms[i] = term;
+            }
+            break;
+        }
+    }
+
+    return enif_make_tuple_from_array(env, terms.empty() ? 0 : &terms[0], terms.size());
+}
+#endif
+
+void RowCodec::putVarint(std::string& out, uint64_t val)
+{
+    while(val >= 0x80) {
+        out.push_back((char)(val | 0x80));
+        val >>= 7;
+    }
+
+    out.push_back((char)val);
+}
+
+uint64_t RowCodec::getVarint(const char*& ptr, const char* end)
+{
+    uint64_t val = 0;
+
+    for(unsigned shift=0; shift < 64; shift += 7) {
+
+        check(ptr, end, 1);
+
+        unsigned char byte = *ptr++;
+        val |= (uint64_t)(byte & 0x7F) << shift;
+
+        if(!(byte & 0x80))
+            return val;
+    }
+
+    ThrowRuntimeError("Malformed varint in row");
+
+    return 0;
+}
+
+void RowCodec::check(const char* ptr, const char* end, size_t n)
+{
+    if((size_t)(end - ptr) < n)
+        ThrowRuntimeError("Truncated row");
+}
@@ -0,0 +1,89 @@
+// $Id: $
+
+#ifndef NIFUTIL_ROWCODEC_H
+#define NIFUTIL_ROWCODEC_H
+
+#include <string>
+#include <vector>
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if WITH_ERL
+#include "ErlUtil.h"
+#endif
+
+/**
+ * @file RowCodec.h
+ *
+ * A compact binary encoding of a schema-typed row, as converted from
+ * a CSV message, for storing in place of the message text.
+ *
+ * Fields are written in schema order, with no field names or
+ * separators:
+ *
+ *    timestamp -- unsigned LEB128 varint
+ *    sint64    -- zigzag LEB128 varint
+ *    double    -- 8 bytes, little-endian IEEE 754
+ *    boolean   -- 1 byte (0 or 1)
+ *    varchar   -- varint length, then the bytes
+ *
+ * Rows are identified with their schema by schemaId(), a hash of the
+ * topic and its field types, which is stored with the schema so that
+ * rows can be decoded without re-parsing any text.
+ */
+namespace nifutil {
+
+    class RowCodec {
+    public:
+
+        enum FieldType {
+            TIMESTAMP = 0,
+            SINT64    = 1,
+            DOUBLE    = 2,
+            BOOLEAN   = 3,
+            VARCHAR   = 4
+        };
+
+        static FieldType typeFor(std::string name);
+        static std::string typeName(FieldType type);
+
+        // Schema ids, and the string form in which schemas are stored
+        // ("varchar,double,...")
+
+        static uint32_t schemaId(const std::string& topic, const std::vector<FieldType>& types);
+        static std::string formatTypes(const std::vector<FieldType>& types);
+        static std::vector<FieldType> parseTypes(const std::string& str);
+
+        // Render an encoded row as CSV text.  This reproduces the CSV
+        // message the row was converted from only if every field
+        // round-trips (see roundTrips())
+
+        static std::string toCsv(const std::vector<FieldType>& types, const char* data, size_t len);
+
+#if WITH_ERL
+        static FieldType typeFor(STRING_CONV_FN_PTR convFn);
+
+        // True if toCsv() renders a CSV field converted with convFn
+        // as it was received (up to number formatting).  False for
+        // the timestamp_* types, which are normalized on receipt
+
+        static bool roundTrips(STRING_CONV_FN_PTR convFn);
+
+        // Encode a tuple of converted terms, and decode to one
+
+        static void encode(ErlNifEnv* env, ERL_NIF_TERM row, const std::vector<FieldType>& types, std::string& out);
+        static ERL_NIF_TERM decode(ErlNifEnv* env, const std::vector<FieldType>& types, const char* data, size_t len);
+#endif
+
+    private:
+
+        static void putVarint(std::string& out, uint64_t val);
+        static uint64_t getVarint(const char*& ptr, const char* end);
+        static void check(const char* ptr, const char* end, size_t n);
+
+    }; // End class RowCodec
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_ROWCODEC_H
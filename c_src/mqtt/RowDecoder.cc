@@ -0,0 +1,275 @@
+#include "RowDecoder.h"
+
+#if WITH_ERL
+
+#include "ExceptionUtils.h"
+#include "NumParse.h"
+
+#include <string.h>
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// Field converters.  Each parses a field in place, as the matching
+// ErlUtil::stringTo*Term() does from a copy, and throws the same
+// error if it can't
+//-----------------------------------------------------------------------
+
+static void badValue(const char* ptr, size_t len, const char* what)
+{
+    ThrowRuntimeError("Unable to convert '" << std::string(ptr, len) << "' to " << what);
+}
+
+static void badBoolean(const char* ptr, size_t len)
+{
+    ThrowRuntimeError("String '" << std::string(ptr, len) << "' can't be converted to an erlang boolean atom");
+}
+
+struct TimestampField {
+    static inline ERL_NIF_TERM convert(ErlNifEnv* env, const char* ptr, size_t len) {
+        uint64_t val = 0;
+        if(NumParse::parseUint64(ptr, len, val) == 0)
+            badValue(ptr, len, "a uint64_t");
+        return enif_make_uint64(env, val);
+    }
+};
+
+struct Int64Field {
+    static inline ERL_NIF_TERM convert(ErlNifEnv* env, const char* ptr, size_t len) {
+        int64_t val = 0;
+        if(NumParse::parseInt64(ptr, len, val) == 0)
+            badValue(ptr, len, "an int64_t");
+        return enif_make_int64(env, val);
+    }
+};
+
+struct DoubleField {
+    static inline ERL_NIF_TERM convert(ErlNifEnv* env, const char* ptr, size_t len) {
+        double val = 0;
+        if(NumParse::parseDouble(ptr, len, val) == 0)
+            badValue(ptr, len, "a double");
+        return enif_make_double(env, val);
+    }
+};
+
+struct BooleanField {
+    static inline ERL_NIF_TERM convert(ErlNifEnv* env, const char* ptr, size_t len) {
+
+        const char* first = ptr;
+        const char* last  = ptr + len;
+
+        while(first < last && *first == ' ')
+            first++;
+
+        while(last > first && last[-1] == ' ')
+            last--;
+
+        if(last - first == 4 && memcmp(first, "true", 4) == 0)
+            return enif_make_atom(env, "true");
+
+        if(last - first == 5 && memcmp(first, "false", 5) == 0)
+            return enif_make_atom(env, "false");
+
+        badBoolean(ptr, len);
+
+        return 0;
+    }
+};
+
+struct VarcharField {
+    static inline ERL_NIF_TERM convert(ErlNifEnv* env, const char* ptr, size_t len) {
+
+        ErlNifBinary bin;
+
+        if(enif_alloc_binary(len, &bin) == 0)
+            ThrowRuntimeError("Failed to alloc binary");
+
+        if(len > 0)
+            memcpy(bin.data, ptr, len);
+
+        return enif_make_binary(env, &bin);
+    }
+};
+
+//-----------------------------------------------------------------------
+// Splitting.  As in the generic path, fields are separated by every
+// comma, and a comma after the last field means too many terms
+//-----------------------------------------------------------------------
+
+static inline const char* nextComma(const char* ptr, const char* end)
+{
+    return ptr < end ? (const char*)memchr(ptr, ',', end - ptr) : 0;
+}
+
+// Fixed type lists, unrolled by recursing on the first field
+
+template<class... Fields>
+struct CsvFields;
+
+template<>
+struct CsvFields<> {
+    static inline RowDecoder::Result decode(ErlNifEnv*, const char*, const char*, ERL_NIF_TERM*) {
+        return RowDecoder::OK;
+    }
+};
+
+template<class Field, class... Rest>
+struct CsvFields<Field, Rest...> {
+    static inline RowDecoder::Result decode(ErlNifEnv* env, const char* ptr, const char* end, ERL_NIF_TERM* terms) {
+
+        const char* comma = nextComma(ptr, end);
+
+        *terms = Field::convert(env, ptr, (comma ? comma : end) - ptr);
+
+        if(sizeof...(Rest) == 0)
+            return comma ? RowDecoder::TOO_MANY_TERMS : RowDecoder::OK;
+
+        if(!comma)
+            return RowDecoder::TOO_FEW_TERMS;
+
+        return CsvFields<Rest...>::decode(env, comma + 1, end, terms + 1);
+    }
+};
+
+template<class... Fields>
+static RowDecoder::Result decodeFixed(ErlNifEnv* env, const char* ptr, size_t len, ERL_NIF_TERM* terms, unsigned)
+{
+    return CsvFields<Fields...>::decode(env, ptr, ptr + len, terms);
+}
+
+// Rows of any length, all of one type
+
+template<class Field>
+static RowDecoder::Result decodeUniform(ErlNifEnv* env, const char* ptr, size_t len, ERL_NIF_TERM* terms, unsigned nTerm)
+{
+    const char* end = ptr + len;
+
+    for(unsigned i=0; i < nTerm; i++) {
+
+        const char* comma = nextComma(ptr, end);
+
+        terms[i] = Field::convert(env, ptr, (comma ? comma : end) - ptr);
+
+        if(i + 1 == nTerm)
+            return comma ? RowDecoder::TOO_MANY_TERMS : RowDecoder::OK;
+
+        if(!comma)
+            return RowDecoder::TOO_FEW_TERMS;
+
+        ptr = comma + 1;
+    }
+
+    return RowDecoder::OK;
+}
+
+//-----------------------------------------------------------------------
+// Selecting a decoder
+//-----------------------------------------------------------------------
+
+enum FieldKind {
+    KIND_TIMESTAMP,
+    KIND_SINT64,
+    KIND_DOUBLE,
+    KIND_BOOLEAN,
+    KIND_VARCHAR,
+    KIND_OTHER
+};
+
+static FieldKind kindFor(STRING_CONV_FN_PTR convFn)
+{
+    if(convFn == ErlUtil::stringToUint64Term) {
+        return KIND_TIMESTAMP;
+    } else if(convFn == ErlUtil::stringToInt64Term) {
+        return KIND_SINT64;
+    } else if(convFn == ErlUtil::stringToDoubleTerm) {
+        return KIND_DOUBLE;
+    } else if(convFn == ErlUtil::stringToBooleanTerm) {
+        return KIND_BOOLEAN;
+    } else if(convFn == ErlUtil::stringToBinaryTerm) {
+        return KIND_VARCHAR;
+    }
+
+    return KIND_OTHER;
+}
+
+// Walk the kinds, appending the field type for each to Chosen, until
+// there are none left (or we've gone as deep as we instantiate)
+
+template<bool More, class... Chosen>
+struct Select;
+
+template<class... Chosen>
+struct Select<false, Chosen...> {
+    static RowDecoder::CSV_FN forKinds(const FieldKind*, unsigned n) {
+        return n == 0 ? &decodeFixed<Chosen...> : 0;
+    }
+};
+
+template<class... Chosen>
+struct Select<true, Chosen...> {
+    static RowDecoder::CSV_FN forKinds(const FieldKind* kinds, unsigned n) {
+
+        static const bool more = sizeof...(Chosen) + 1 < RowDecoder::MAX_FIXED_FIELDS;
+
+        if(n == 0)
+            return &decodeFixed<Chosen...>;
+
+        switch (kinds[0]) {
+        case KIND_TIMESTAMP:
+            return Select<more, Chosen..., TimestampField>::forKinds(kinds + 1, n - 1);
+        case KIND_SINT64:
+            return Select<more, Chosen..., Int64Field>::forKinds(kinds + 1, n - 1);
+        case KIND_DOUBLE:
+            return Select<more, Chosen..., DoubleField>::forKinds(kinds + 1, n - 1);
+        case KIND_BOOLEAN:
+            return Select<more, Chosen..., BooleanField>::forKinds(kinds + 1, n - 1);
+        case KIND_VARCHAR:
+            return Select<more, Chosen..., VarcharField>::forKinds(kinds + 1, n - 1);
+        default:
+            return 0;
+        }
+    }
+};
+
+/**.......................................................................
+ * Return the decoder for a schema: unrolled for up to MAX_FIXED_FIELDS
+ * fields, else by type if all fields are of one type, else none
+ */
+RowDecoder::CSV_FN RowDecoder::csvDecoderFor(const std::vector<STRING_CONV_FN_PTR>& convFnVec)
+{
+    unsigned nField = convFnVec.size();
+
+    if(nField == 0)
+        return 0;
+
+    std::vector<FieldKind> kinds(nField);
+
+    for(unsigned i=0; i < nField; i++) {
+        kinds[i] = kindFor(convFnVec[i]);
+        if(kinds[i] == KIND_OTHER)
+            return 0;
+    }
+
+    if(nField <= MAX_FIXED_FIELDS)
+        return Select<true>::forKinds(&kinds[0], nField);
+
+    for(unsigned i=1; i < nField; i++) {
+        if(kinds[i] != kinds[0])
+            return 0;
+    }
+
+    switch (kinds[0]) {
+    case KIND_TIMESTAMP:
+        return &decodeUniform<TimestampField>;
+    case KIND_SINT64:
+        return &decodeUniform<Int64Field>;
+    case KIND_DOUBLE:
+        return &decodeUniform<DoubleField>;
+    case KIND_BOOLEAN:
+        return &decodeUniform<BooleanField>;
+    default:
+        return &decodeUniform<VarcharField>;
+    }
+}
+
+#endif
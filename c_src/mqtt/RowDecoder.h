@@ -0,0 +1,63 @@
+// $Id: $
+
+#ifndef NIFUTIL_ROWDECODER_H
+#define NIFUTIL_ROWDECODER_H
+
+#if WITH_ERL
+
+#include <vector>
+
+#include <stddef.h>
+
+#include "ErlUtil.h"
+
+/**
+ * @file RowDecoder.h
+ *
+ * CSV row decoders specialized at compile time for a schema's field
+ * types, used by MosClient::formatDataCsv() in place of its generic
+ * loop, which copies each field into a std::string and converts it
+ * through its STRING_CONV_FN_PTR.
+ *
+ * A specialized decoder splits the payload in place and converts each
+ * field with an inlined, length-bounded parser, with no copies or
+ * indirect calls.  There is one for every combination of the five
+ * plain field types (timestamp, sint64, double, boolean, varchar) up
+ * to MAX_FIXED_FIELDS fields, fully unrolled, and one per type for
+ * rows of any length that are all of that type.  Other schemas,
+ * including any with the timestamp_* types, get no decoder, and use
+ * the generic path.
+ *
+ * Decoders give the same terms, and throw the same errors, as the
+ * generic path does (tErlUtil checks this on malformed payloads
+ * before timing them).
+ */
+namespace nifutil {
+
+    class RowDecoder {
+    public:
+
+        enum Result {
+            OK,
+            TOO_FEW_TERMS,
+            TOO_MANY_TERMS
+        };
+
+        static const unsigned MAX_FIXED_FIELDS = 3;
+
+        // Decode a CSV payload of len bytes into nTerm terms.  A field
+        // that can't be converted throws
+
+        typedef Result (*CSV_FN)(ErlNifEnv* env, const char* ptr, size_t len, ERL_NIF_TERM* terms, unsigned nTerm);
+
+        // The decoder for a schema, or 0 if it has none
+
+        static CSV_FN csvDecoderFor(const std::vector<STRING_CONV_FN_PTR>& convFnVec);
+
+    }; // End class RowDecoder
+
+} // End namespace nifutil
+
+#endif
+
+#endif // End #ifndef NIFUTIL_ROWDECODER_H
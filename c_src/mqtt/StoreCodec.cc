@@ -0,0 +1,148 @@
+#include "StoreCodec.h"
+#include "ExceptionUtils.h"
+
+#if WITH_LEVELDB
+#include "snappy.h"
+#endif
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Return the codec with the given name
+ */
+StoreCodec::Codec StoreCodec::codecFor(std::string name)
+{
+    if(name == "none")
+        return NONE;
+
+    if(name == "snappy") {
+#if WITH_LEVELDB
+        return SNAPPY;
+#else
+        ThrowRuntimeError("The snappy codec requires compiling with MQTT_USE_LEVELDB=1");
+#endif
+    }
+
+    ThrowRuntimeError("Unrecognized codec: " << name << " (should be none or snappy)");
+
+    return NONE;
+}
+
+std::string StoreCodec::codecName(Codec codec)
+{
+    switch(codec) {
+    case SNAPPY:
+        return "snappy";
+    case ROW:
+        return "row";
+    default:
+        return "none";
+    }
+}
+
+/**.......................................................................
+ * Encode a payload as a store record.  If compression doesn't make
+ * the payload smaller, it is stored uncompressed
+ */
+void StoreCodec::encode(Codec codec, const char* data, size_t len, std::string& record)
+{
+    record.clear();
+
+#if WITH_LEVELDB
+    if(codec == SNAPPY) {
+
+        std::string compressed;
+        snappy::Compress(data, len, &compressed);
+
+        if(compressed.size() < len) {
+            record.reserve(2 + compressed.size());
+            record.push_back((char)TAG);
+            record.push_back((char)SNAPPY);
+            record.append(compressed);
+            return;
+        }
+    }
+#endif
+
+    // Raw, tagged only if it would otherwise look tagged (or we were
+    // asked to compress, so that the record says what happened)
+
+    if(codec != NONE || (len > 0 && (unsigned char)data[0] == TAG)) {
+        record.reserve(2 + len);
+        record.push_back((char)TAG);
+        record.push_back((char)NONE);
+    }
+
+    record.append(data, len);
+}
+
+/**.......................................................................
+ * Decode a store record to the original payload
+ */
+void StoreCodec::decode(const std::string& record, bool tagged, std::string& payload)
+{
+    const char* data = 0;
+    size_t len = 0;
+
+    body(record, tagged, data, len);
+
+    switch(codecOf(record, tagged)) {
+#if WITH_LEVELDB
+    case SNAPPY:
+        if(!snappy::Uncompress(data, len, &payload))
+            ThrowRuntimeError("Corrupt snappy record");
+        break;
+#endif
+    case NONE:
+        payload.assign(data, len);
+        break;
+    default:
+        ThrowRuntimeError("Unsupported codec in store record: " << (int)(unsigned char)record[1]);
+        break;
+    }
+}
+
+StoreCodec::Codec StoreCodec::codecOf(const std::string& record, bool tagged)
+{
+    if(!tagged || record.size() < 2 || (unsigned char)record[0] != TAG)
+        return NONE;
+
+    return (Codec)(unsigned char)record[1];
+}
+
+void StoreCodec::body(const std::string& record, bool tagged, const char*& data, size_t& len)
+{
+    if(!tagged || record.size() < 2 || (unsigned char)record[0] != TAG) {
+        data = record.data();
+        len  = record.size();
+    } else {
+        data = record.data() + 2;
+        len  = record.size() - 2;
+    }
+}
+
+void StoreCodec::encodeRow(uint32_t schemaId, const std::string& row, std::string& record)
+{
+    record.clear();
+    record.reserve(6 + row.size());
+    record.push_back((char)TAG);
+    record.push_back((char)ROW);
+
+    for(int shift=24; shift >= 0; shift -= 8)
+        record.push_back((char)((schemaId >> shift) & 0xFF));
+
+    record.append(row);
+}
+
+void StoreCodec::rowOf(const std::string& record, uint32_t& schemaId, const char*& data, size_t& len)
+{
+    if(codecOf(record, true) != ROW || record.size() < 6)
+        ThrowRuntimeError("Not a row record");
+
+    schemaId = 0;
+    for(unsigned i=2; i < 6; i++)
+        schemaId = (schemaId << 8) | (unsigned char)record[i];
+
+    data = record.data() + 6;
+    len  = record.size() - 6;
+}
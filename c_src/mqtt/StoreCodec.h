@@ -0,0 +1,73 @@
+// $Id: $
+
+#ifndef NIFUTIL_STORECODEC_H
+#define NIFUTIL_STORECODEC_H
+
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file StoreCodec.h
+ *
+ * Encoding of message payloads as store records.
+ *
+ * A tagged record is TAG (one byte), then the codec (one byte), then
+ * the body.  TAG (0xC0) can't start a UTF-8 string, so text payloads
+ * are never mistaken for tagged records.  Untagged records are raw
+ * payloads, as written before codecs existed; with codec NONE,
+ * payloads are still written raw unless they happen to start with
+ * TAG.
+ *
+ * Binary payloads written before codecs existed may start with TAG,
+ * though, so tags are only honored in stores known to hold tagged
+ * records (MosClient marks these with a format key when it creates
+ * them).  Readers pass tagged = false for older stores, and every
+ * record is then a raw payload.
+ *
+ * Compression is only available when built with leveldb, which
+ * brings snappy with it.
+ *
+ * ROW records hold a message converted to a typed row (see
+ * RowCodec.h) rather than its text: the body is the 4-byte schema id
+ * (big-endian), then the row.  decode() can't reproduce the original
+ * payload from them; use rowOf() and the stored schema instead.
+ */
+namespace nifutil {
+
+    class StoreCodec {
+    public:
+
+        enum Codec {
+            NONE   = 0,
+            SNAPPY = 1,
+            ROW    = 2
+        };
+
+        static const unsigned char TAG = 0xC0;
+
+        static Codec codecFor(std::string name);
+        static std::string codecName(Codec codec);
+
+        static void encode(Codec codec, const char* data, size_t len, std::string& record);
+        static void decode(const std::string& record, bool tagged, std::string& payload);
+
+        // Return the codec a record was written with, and its body
+        // (the payload, as encoded).  With tagged false, records are
+        // all raw
+
+        static Codec codecOf(const std::string& record, bool tagged);
+        static void body(const std::string& record, bool tagged, const char*& data, size_t& len);
+
+        // Encode an encoded row as a ROW record, and return the
+        // schema id and row of one
+
+        static void encodeRow(uint32_t schemaId, const std::string& row, std::string& record);
+        static void rowOf(const std::string& record, uint32_t& schemaId, const char*& data, size_t& len);
+
+    }; // End class StoreCodec
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_STORECODEC_H
@@ -0,0 +1,132 @@
+#include "TopicStats.h"
+
+#include <math.h>
+
+using namespace nifutil;
+
+const double TopicStats::TAU_SECONDS = 10.0;
+
+/**.......................................................................
+ * Constructor.
+ */
+TopicStats::TopicStats()
+{
+    messages_.store(0);
+    bytes_.store(0);
+
+    for(unsigned i=0; i < NERROR; i++)
+        errors_[i].store(0);
+
+    lastSeenMicros_.store(0);
+    tickMicros_.store(0);
+    tickMessages_.store(0);
+    rate_.store(0.0);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+TopicStats::~TopicStats() {}
+
+/**.......................................................................
+ * Record receipt of a message
+ */
+void TopicStats::record(size_t bytes, int64_t nowMicros)
+{
+    uint64_t messages = messages_.fetch_add(1, std::memory_order_relaxed) + 1;
+    bytes_.fetch_add(bytes, std::memory_order_relaxed);
+    lastSeenMicros_.store(nowMicros, std::memory_order_relaxed);
+
+    int64_t tick = tickMicros_.load(std::memory_order_relaxed);
+
+    // The first message starts the first tick
+
+    if(tick == 0) {
+        tickMicros_.compare_exchange_strong(tick, nowMicros, std::memory_order_relaxed);
+        return;
+    }
+
+    // Else fold the last tick's messages into the rate, if it is due
+    // and no other thread has beaten us to it
+
+    if(nowMicros - tick < TICK_MICROS || !tickMicros_.compare_exchange_strong(tick, nowMicros, std::memory_order_relaxed))
+        return;
+
+    uint64_t prev = tickMessages_.exchange(messages, std::memory_order_relaxed);
+    double rate   = rate_.load(std::memory_order_relaxed);
+
+    rate_.store(ewma(rate, messages - prev, (nowMicros - tick) / 1e6), std::memory_order_relaxed);
+}
+
+void TopicStats::recordError(Error kind)
+{
+    errors_[kind].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t TopicStats::messages()
+{
+    return messages_.load(std::memory_order_relaxed);
+}
+
+uint64_t TopicStats::bytes()
+{
+    return bytes_.load(std::memory_order_relaxed);
+}
+
+uint64_t TopicStats::errors(Error kind)
+{
+    return errors_[kind].load(std::memory_order_relaxed);
+}
+
+uint64_t TopicStats::errors()
+{
+    uint64_t sum = 0;
+
+    for(unsigned i=0; i < NERROR; i++)
+        sum += errors((Error)i);
+
+    return sum;
+}
+
+int64_t TopicStats::lastSeenMicros()
+{
+    return lastSeenMicros_.load(std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * Return the rate (messages/s), as if a tick were taken now
+ */
+double TopicStats::rate(int64_t nowMicros)
+{
+    int64_t tick = tickMicros_.load(std::memory_order_relaxed);
+
+    if(tick == 0 || nowMicros <= tick)
+        return rate_.load(std::memory_order_relaxed);
+
+    uint64_t since    = tickMessages_.load(std::memory_order_relaxed);
+    uint64_t messages = this->messages();
+
+    return ewma(rate_.load(std::memory_order_relaxed), messages > since ? messages - since : 0, (nowMicros - tick) / 1e6);
+}
+
+std::string TopicStats::errorName(Error kind)
+{
+    switch(kind) {
+    case TOO_MANY_TERMS:
+        return "too_many_terms";
+    case TOO_FEW_TERMS:
+        return "too_few_terms";
+    default:
+        return "bad_value";
+    }
+}
+
+/**.......................................................................
+ * Fold messages received over dt seconds into a rate, weighting them
+ * by the fraction of TAU_SECONDS that dt covers
+ */
+double TopicStats::ewma(double rate, uint64_t messages, double dt)
+{
+    double alpha = 1.0 - exp(-dt / TAU_SECONDS);
+    return rate + alpha * (messages / dt - rate);
+}
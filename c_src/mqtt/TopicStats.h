@@ -0,0 +1,82 @@
+// $Id: $
+
+#ifndef NIFUTIL_TOPICSTATS_H
+#define NIFUTIL_TOPICSTATS_H
+
+#include <atomic>
+#include <string>
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file TopicStats.h
+ *
+ * Lock-free throughput and error statistics for a single topic:
+ * messages and bytes received, parse errors by kind, when the topic
+ * was last seen, and an exponentially-weighted moving average of its
+ * message rate.
+ *
+ * The rate is folded in at most once per TICK_MICROS, by whichever
+ * thread records the first message after the tick is due, with a
+ * time constant of TAU_SECONDS.  rate() extrapolates from the last
+ * tick, so that a topic that goes quiet decays towards zero.
+ */
+namespace nifutil {
+
+    class TopicStats {
+    public:
+
+        enum Error {
+            TOO_MANY_TERMS = 0,
+            TOO_FEW_TERMS  = 1,
+            BAD_VALUE      = 2,
+            NERROR         = 3
+        };
+
+        static const int64_t TICK_MICROS = 1000000;
+        static const double TAU_SECONDS;
+
+        /**
+         * Constructor.
+         */
+        TopicStats();
+
+        /**
+         * Destructor.
+         */
+        virtual ~TopicStats();
+
+        void record(size_t bytes, int64_t nowMicros);
+        void recordError(Error kind);
+
+        uint64_t messages();
+        uint64_t bytes();
+        uint64_t errors(Error kind);
+        uint64_t errors();
+        int64_t lastSeenMicros();
+        double rate(int64_t nowMicros);
+
+        static std::string errorName(Error kind);
+
+    private:
+
+        std::atomic<uint64_t> messages_;
+        std::atomic<uint64_t> bytes_;
+        std::atomic<uint64_t> errors_[NERROR];
+        std::atomic<int64_t> lastSeenMicros_;
+
+        // The time of the last rate tick, the message count at that
+        // tick, and the rate (messages/s) as of that tick
+
+        std::atomic<int64_t> tickMicros_;
+        std::atomic<uint64_t> tickMessages_;
+        std::atomic<double> rate_;
+
+        static double ewma(double rate, uint64_t messages, double dt);
+
+    }; // End class TopicStats
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_TOPICSTATS_H
@@ -0,0 +1,234 @@
+// $Id: $
+
+#ifndef NIFUTIL_TOPICTABLE_H
+#define NIFUTIL_TOPICTABLE_H
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Mutex.h"
+
+//=======================================================================
+// TopicTable is an open-addressing (linear probe) hash table of topic
+// descriptors, keyed by a precomputed 64-bit topic hash.
+//
+// It is read-mostly: lookups take no lock, and are safe to call from
+// the comms thread(s) while another thread is subscribing.  Writers
+// are serialized on an internal mutex, and publish changes as
+// follows:
+//
+//   - A new topic is placed in an empty slot of the current snapshot
+//     with a single release store
+//
+//   - A topic that is resubscribed has its slot swapped to point to
+//     the new descriptor
+//
+//   - When the load factor would exceed 1/2, a new snapshot of twice
+//     the size is built off to the side and swapped in
+//
+// Superseded snapshots and descriptors are retired, not freed, since
+// a reader may still hold a pointer to them.  They are reclaimed when
+// the table is destroyed.  Snapshots grow geometrically, so retired
+// snapshots never amount to more than the size of the live one.
+//
+// T must have public members:
+//
+//    uint64_t    hash_;
+//    std::string name_;
+//
+// and the table takes ownership of anything passed to insert().
+//=======================================================================
+
+namespace nifutil {
+
+    /**.......................................................................
+     * Hash a topic name (64-bit FNV-1a)
+     */
+    inline uint64_t hashTopic(const char* topic)
+    {
+        uint64_t hash = 14695981039346656037ULL;
+
+        for(const unsigned char* cptr = (const unsigned char*)topic; *cptr; cptr++) {
+            hash ^= *cptr;
+            hash *= 1099511628211ULL;
+        }
+
+        return hash;
+    }
+
+    template<class T>
+    class TopicTable {
+    public:
+
+        TopicTable() {
+            size_ = 0;
+            current_.store(new Snapshot(MIN_CAPACITY), std::memory_order_release);
+        }
+
+        /**
+         * Destructor.  No readers may be active
+         */
+        virtual ~TopicTable() {
+
+            Snapshot* snap = current_.load(std::memory_order_acquire);
+
+            for(size_t i=0; i < snap->capacity_; i++)
+                delete snap->slots_[i].load(std::memory_order_relaxed);
+
+            delete snap;
+
+            for(typename std::list<T*>::iterator iter=retiredEntries_.begin();
+                iter != retiredEntries_.end(); iter++)
+                delete *iter;
+
+            for(typename std::list<Snapshot*>::iterator iter=retiredSnapshots_.begin();
+                iter != retiredSnapshots_.end(); iter++)
+                delete *iter;
+        }
+
+        /**
+         * Lock-free lookup.  Returns NULL if the topic is not in the
+         * table
+         */
+        T* find(const char* topic) const {
+            return find(topic, hashTopic(topic));
+        }
+
+        T* find(const char* topic, uint64_t hash) const {
+
+            Snapshot* snap = current_.load(std::memory_order_acquire);
+            size_t mask = snap->capacity_ - 1;
+
+            for(size_t i = hash & mask; ; i = (i+1) & mask) {
+                T* entry = snap->slots_[i].load(std::memory_order_acquire);
+
+                if(!entry)
+                    return 0;
+
+                if(entry->hash_ == hash && entry->name_ == topic)
+                    return entry;
+            }
+        }
+
+        /**
+         * Insert a descriptor, replacing any existing descriptor for
+         * the same topic
+         */
+        void insert(T* entry) {
+
+            MutexLock lock(writeMutex_);
+
+            Snapshot* snap = current_.load(std::memory_order_relaxed);
+            size_t mask = snap->capacity_ - 1;
+
+            for(size_t i = entry->hash_ & mask; ; i = (i+1) & mask) {
+                T* curr = snap->slots_[i].load(std::memory_order_relaxed);
+
+                if(!curr)
+                    break;
+
+                if(curr->hash_ == entry->hash_ && curr->name_ == entry->name_) {
+                    snap->slots_[i].store(entry, std::memory_order_release);
+                    retiredEntries_.push_back(curr);
+                    return;
+                }
+            }
+
+            if(2 * (size_ + 1) > snap->capacity_)
+                snap = grow(snap);
+
+            place(snap, entry);
+            ++size_;
+        }
+
+        /**
+         * Return all current entries.  Pointers remain valid for the
+         * lifetime of the table
+         */
+        std::vector<T*> entries() const {
+
+            std::vector<T*> ret;
+            Snapshot* snap = current_.load(std::memory_order_acquire);
+
+            for(size_t i=0; i < snap->capacity_; i++) {
+                T* entry = snap->slots_[i].load(std::memory_order_acquire);
+                if(entry)
+                    ret.push_back(entry);
+            }
+
+            return ret;
+        }
+
+        size_t size() const {
+            return size_;
+        }
+
+    private:
+
+        static const size_t MIN_CAPACITY = 16;
+
+        struct Snapshot {
+
+            Snapshot(size_t capacity) {
+                capacity_ = capacity;
+                slots_    = new std::atomic<T*>[capacity];
+                for(size_t i=0; i < capacity; i++)
+                    slots_[i].store(0, std::memory_order_relaxed);
+            }
+
+            ~Snapshot() {
+                delete [] slots_;
+            }
+
+            size_t capacity_;
+            std::atomic<T*>* slots_;
+        };
+
+        /**
+         * Build a snapshot of twice the capacity off to the side, and
+         * swap it in
+         */
+        Snapshot* grow(Snapshot* snap) {
+
+            Snapshot* next = new Snapshot(snap->capacity_ * 2);
+
+            for(size_t i=0; i < snap->capacity_; i++) {
+                T* entry = snap->slots_[i].load(std::memory_order_relaxed);
+                if(entry)
+                    place(next, entry);
+            }
+
+            current_.store(next, std::memory_order_release);
+            retiredSnapshots_.push_back(snap);
+
+            return next;
+        }
+
+        void place(Snapshot* snap, T* entry) {
+
+            size_t mask = snap->capacity_ - 1;
+
+            for(size_t i = entry->hash_ & mask; ; i = (i+1) & mask) {
+                if(!snap->slots_[i].load(std::memory_order_relaxed)) {
+                    snap->slots_[i].store(entry, std::memory_order_release);
+                    return;
+                }
+            }
+        }
+
+        std::atomic<Snapshot*> current_;
+        size_t size_;
+
+        Mutex writeMutex_;
+        std::list<T*> retiredEntries_;
+        std::list<Snapshot*> retiredSnapshots_;
+
+    }; // End class TopicTable
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_TOPICTABLE_H
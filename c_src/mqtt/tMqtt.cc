@@ -19,8 +19,9 @@ int main(void)
         COUT("Atom = " << atom);
     } while(!atom.isEmpty());
     
-    MosClient::toggleLogging(true);
-    MosClient::startCommsLoop();
+    MosClient client;
+    client.toggleLogging(true);
+    client.startCommsLoop();
     MosClient::blockForever();
     
     return 0;
@@ -0,0 +1,76 @@
+#include "Backoff.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.  Defaults to 100 ms doubling up to 30 s
+ */
+Backoff::Backoff()
+{
+    minMs_    = 100;
+    maxMs_    = 30000;
+    failures_ = 0;
+
+    // Seed from the time and our address, so that clients (and
+    // sessions) started together draw different delays
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+
+    seed_ = (unsigned)(tv.tv_sec ^ tv.tv_usec ^ (uintptr_t)this);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+Backoff::~Backoff() {}
+
+/**.......................................................................
+ * Set the delay range
+ */
+void Backoff::configure(unsigned minMs, unsigned maxMs)
+{
+    minMs_ = minMs > 0 ? minMs : 1;
+    maxMs_ = maxMs > minMs_ ? maxMs : minMs_;
+}
+
+/**.......................................................................
+ * Return the delay before the next attempt
+ */
+unsigned Backoff::nextDelayMs()
+{
+    if(failures_++ == 0)
+        return 0;
+
+    // Double from minMs_ for each failure after the first, stopping
+    // at maxMs_
+
+    unsigned ceiling = minMs_;
+
+    for(unsigned i=1; i < failures_ - 1 && ceiling < maxMs_; i++)
+        ceiling *= 2;
+
+    if(ceiling > maxMs_)
+        ceiling = maxMs_;
+
+    unsigned half = ceiling / 2;
+
+    return half + rand_r(&seed_) % (ceiling - half + 1);
+}
+
+/**.......................................................................
+ * Reset after a successful attempt
+ */
+void Backoff::reset()
+{
+    failures_ = 0;
+}
+
+unsigned Backoff::failures()
+{
+    return failures_;
+}
@@ -0,0 +1,55 @@
+// $Id: $
+
+#ifndef NIFUTIL_BACKOFF_H
+#define NIFUTIL_BACKOFF_H
+
+/**
+ * @file Backoff.h
+ *
+ * Exponential backoff with jitter, for reconnect scheduling.
+ *
+ * The first delay after a success (or reset()) is 0, so that a single
+ * dropped connection is retried immediately.  Each subsequent delay
+ * doubles, starting from minMs and capped at maxMs, and is drawn
+ * uniformly from the upper half of that range ("equal jitter"), so
+ * that clients that fail together do not retry together.
+ */
+namespace nifutil {
+
+    class Backoff {
+    public:
+
+        /**
+         * Constructor.
+         */
+        Backoff();
+
+        /**
+         * Destructor.
+         */
+        virtual ~Backoff();
+
+        void configure(unsigned minMs, unsigned maxMs);
+
+        // Return the delay before the next attempt, and count a failure
+
+        unsigned nextDelayMs();
+
+        // Call on success
+
+        void reset();
+
+        unsigned failures();
+
+    private:
+
+        unsigned minMs_;
+        unsigned maxMs_;
+        unsigned failures_;
+        unsigned seed_;
+
+    }; // End class Backoff
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_BACKOFF_H
@@ -0,0 +1,38 @@
+#include "Counter.h"
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.
+ */
+Counter::Counter()
+{
+    for(unsigned i=0; i < NSLOT; i++)
+        slots_[i].val_.store(0, std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+Counter::~Counter() {}
+
+uint64_t Counter::value()
+{
+    uint64_t sum = 0;
+
+    for(unsigned i=0; i < NSLOT; i++)
+        sum += slots_[i].val_.load(std::memory_order_relaxed);
+
+    return sum;
+}
+
+/**.......................................................................
+ * Return the calling thread's slot, assigned round-robin on first use
+ */
+unsigned Counter::threadSlot()
+{
+    static std::atomic<unsigned> next(0);
+    static thread_local unsigned slot = next.fetch_add(1, std::memory_order_relaxed) % NSLOT;
+
+    return slot;
+}
@@ -0,0 +1,59 @@
+// $Id: $
+
+#ifndef NIFUTIL_COUNTER_H
+#define NIFUTIL_COUNTER_H
+
+#include <atomic>
+
+#include <stdint.h>
+
+/**
+ * @file Counter.h
+ *
+ * A lock-free event counter for hot paths.  Increments are spread
+ * over NSLOT slots, each on its own cache line, with each thread
+ * always using the same slot, so that threads counting the same event
+ * don't contend for a line.  value() sums the slots, so is only
+ * approximate while increments are in progress.
+ */
+namespace nifutil {
+
+    class Counter {
+    public:
+
+        static const unsigned NSLOT = 32;
+        static const unsigned CACHE_LINE = 64;
+
+        /**
+         * Constructor.
+         */
+        Counter();
+
+        /**
+         * Destructor.
+         */
+        virtual ~Counter();
+
+        void add(uint64_t n=1)
+        {
+            slots_[threadSlot()].val_.fetch_add(n, std::memory_order_relaxed);
+        }
+
+        uint64_t value();
+
+    private:
+
+        struct Slot {
+            std::atomic<uint64_t> val_;
+            char pad_[CACHE_LINE - sizeof(std::atomic<uint64_t>)];
+        };
+
+        Slot slots_[NSLOT];
+
+        static unsigned threadSlot();
+
+    }; // End class Counter
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_COUNTER_H
@@ -0,0 +1,181 @@
+#include "Histogram.h"
+
+#include <sstream>
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.
+ */
+Histogram::Histogram()
+{
+    for(unsigned i=0; i < NBUCKET; i++)
+        buckets_[i].store(0, std::memory_order_relaxed);
+
+    min_.store(UINT64_MAX, std::memory_order_relaxed);
+    max_.store(0, std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+Histogram::~Histogram() {}
+
+/**.......................................................................
+ * Record a value
+ */
+void Histogram::record(uint64_t val)
+{
+    buckets_[bucketOf(val)].fetch_add(1, std::memory_order_relaxed);
+    count_.add();
+    sum_.add(val);
+
+    uint64_t curr = min_.load(std::memory_order_relaxed);
+    while(val < curr && !min_.compare_exchange_weak(curr, val, std::memory_order_relaxed))
+        ;
+
+    curr = max_.load(std::memory_order_relaxed);
+    while(val > curr && !max_.compare_exchange_weak(curr, val, std::memory_order_relaxed))
+        ;
+}
+
+uint64_t Histogram::count()
+{
+    return count_.value();
+}
+
+uint64_t Histogram::sum()
+{
+    return sum_.value();
+}
+
+uint64_t Histogram::min()
+{
+    return count() ? min_.load(std::memory_order_relaxed) : 0;
+}
+
+uint64_t Histogram::max()
+{
+    return max_.load(std::memory_order_relaxed);
+}
+
+double Histogram::mean()
+{
+    uint64_t n = count();
+    return n ? (double)sum_.value() / n : 0.0;
+}
+
+/**.......................................................................
+ * Return the value below which a fraction q of recorded values fall
+ */
+uint64_t Histogram::quantile(double q)
+{
+    uint64_t n = count();
+
+    if(n == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)(q * n);
+    if(target >= n)
+        target = n-1;
+
+    uint64_t seen = 0;
+
+    for(unsigned i=0; i < NBUCKET; i++) {
+
+        seen += buckets_[i].load(std::memory_order_relaxed);
+
+        if(seen > target) {
+            uint64_t edge = upperEdge(i);
+            uint64_t mx   = max();
+            return edge < mx ? edge : mx;
+        }
+    }
+
+    return max();
+}
+
+/**.......................................................................
+ * Return cumulative counts at the bucket edges 2^k - 1 (k >= SUB_BITS),
+ * where our buckets line up with powers of two.  Edges are never
+ * dropped once reached, so that scrapers see a stable set of series
+ */
+uint64_t Histogram::cumulative(std::vector<std::pair<uint64_t, uint64_t> >& buckets)
+{
+    buckets.clear();
+
+    uint64_t seen = 0, total = 0;
+    unsigned last = 0;
+
+    for(unsigned i=0; i < NBUCKET; i++) {
+        uint64_t n = buckets_[i].load(std::memory_order_relaxed);
+        if(n > 0)
+            last = i;
+    }
+
+    for(unsigned i=0; i < NBUCKET; i++) {
+
+        seen += buckets_[i].load(std::memory_order_relaxed);
+
+        if((i + 1) % NSUB == 0) {
+            buckets.push_back(std::pair<uint64_t, uint64_t>(upperEdge(i), seen));
+            total = seen;
+
+            if(i >= last)
+                break;
+        }
+    }
+
+    return total;
+}
+
+/**.......................................................................
+ * Return the bucket for a value.  Values below NSUB have a bucket
+ * each; above that, the bucket is given by the position of the top
+ * bit, and the SUB_BITS bits below it
+ */
+unsigned Histogram::bucketOf(uint64_t val)
+{
+    if(val < NSUB)
+        return val;
+
+    unsigned msb   = 63 - __builtin_clzll(val);
+    unsigned shift = msb - SUB_BITS;
+
+    return (shift + 1) * NSUB + ((val >> shift) & (NSUB - 1));
+}
+
+/**.......................................................................
+ * Return the largest value that falls in a bucket
+ */
+uint64_t Histogram::upperEdge(unsigned bucket)
+{
+    if(bucket < NSUB)
+        return bucket;
+
+    unsigned shift = bucket / NSUB - 1;
+    uint64_t lower = (uint64_t)(NSUB + bucket % NSUB) << shift;
+
+    return lower + (((uint64_t)1 << shift) - 1);
+}
+
+/**.......................................................................
+ * Return a one-line summary
+ */
+std::string Histogram::summary(double scale, std::string units)
+{
+    std::ostringstream os;
+
+    os << "n = " << count();
+
+    if(count() > 0) {
+        os << " min = " << min()/scale << units
+           << " mean = " << mean()/scale << units
+           << " p50 = " << quantile(0.50)/scale << units
+           << " p90 = " << quantile(0.90)/scale << units
+           << " p99 = " << quantile(0.99)/scale << units
+           << " max = " << max()/scale << units;
+    }
+
+    return os.str();
+}
@@ -0,0 +1,79 @@
+// $Id: $
+
+#ifndef NIFUTIL_HISTOGRAM_H
+#define NIFUTIL_HISTOGRAM_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Counter.h"
+
+/**
+ * @file Histogram.h
+ *
+ * A lock-free histogram of non-negative integer values (e.g.,
+ * latencies in nanoseconds), with HDR-style log-linear buckets: each
+ * power of two is split into NSUB equal sub-buckets, and values below
+ * NSUB have a bucket each.
+ *
+ * record() may be called concurrently from any number of threads.
+ * Quantiles are resolved to the upper edge of the bucket in which
+ * they fall, so are accurate to within 1/NSUB (12.5%).
+ */
+namespace nifutil {
+
+    class Histogram {
+    public:
+
+        static const unsigned SUB_BITS = 3;
+        static const unsigned NSUB     = 1 << SUB_BITS;
+        static const unsigned NBUCKET  = (64 - SUB_BITS + 1) * NSUB;
+
+        /**
+         * Constructor.
+         */
+        Histogram();
+
+        /**
+         * Destructor.
+         */
+        virtual ~Histogram();
+
+        void record(uint64_t val);
+
+        uint64_t count();
+        uint64_t sum();
+        uint64_t min();
+        uint64_t max();
+        double mean();
+        uint64_t quantile(double q);
+
+        // Cumulative counts at each power-of-two bucket edge, as
+        // (edge, count of values <= edge), up to the highest edge
+        // reached.  Returns the total count, consistent with buckets
+
+        uint64_t cumulative(std::vector<std::pair<uint64_t, uint64_t> >& buckets);
+
+        // Return a one-line summary, with values scaled by 1/scale
+
+        std::string summary(double scale=1.0, std::string units="");
+
+    private:
+
+        static unsigned bucketOf(uint64_t val);
+        static uint64_t upperEdge(unsigned bucket);
+
+        std::atomic<uint64_t> buckets_[NBUCKET];
+        Counter count_;
+        Counter sum_;
+        std::atomic<uint64_t> min_;
+        std::atomic<uint64_t> max_;
+
+    }; // End class Histogram
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_HISTOGRAM_H
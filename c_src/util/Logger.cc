@@ -0,0 +1,306 @@
+#include "Logger.h"
+#include "ExceptionUtils.h"
+
+#include <string.h>
+#include <time.h>
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Return the process-wide logger
+ */
+Logger& Logger::instance()
+{
+    static Logger instance;
+    return instance;
+}
+
+/**.......................................................................
+ * Constructor.  The logging thread is started on first use
+ */
+Logger::Logger()
+{
+    for(unsigned i=0; i < CAPACITY; i++)
+        slots_[i].seq_.store(i, std::memory_order_relaxed);
+
+    head_.store(0, std::memory_order_relaxed);
+    tail_ = 0;
+
+    level_.store(LEVEL_INFO, std::memory_order_relaxed);
+    rateLimit_.store(10, std::memory_order_relaxed);
+    sink_.store(0, std::memory_order_relaxed);
+
+    logged_.store(0, std::memory_order_relaxed);
+    written_.store(0, std::memory_order_relaxed);
+    dropped_.store(0, std::memory_order_relaxed);
+
+    started_.store(false, std::memory_order_relaxed);
+    stop_ = false;
+}
+
+/**.......................................................................
+ * Destructor.  Writes out anything still queued
+ */
+Logger::~Logger()
+{
+    if(started_.load()) {
+        stop_ = true;
+        pthread_join(threadId_, NULL);
+    }
+}
+
+/**.......................................................................
+ * Queue a message.  Producers claim a slot by advancing head_; a slot
+ * is free for position pos when its sequence number is pos, and full
+ * (ready for the logging thread) when it is pos+1
+ */
+bool Logger::log(Level level, const std::string& text)
+{
+    if(!started_.load(std::memory_order_acquire))
+        start();
+
+    uint64_t pos = head_.load(std::memory_order_relaxed);
+    Slot* slot = 0;
+
+    for(;;) {
+
+        slot = &slots_[pos % CAPACITY];
+
+        uint64_t seq = slot->seq_.load(std::memory_order_acquire);
+        int64_t diff = (int64_t)seq - (int64_t)pos;
+
+        if(diff == 0) {
+            if(head_.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed))
+                break;
+        } else if(diff < 0) {
+            dropped_.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        } else {
+            pos = head_.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level_  = level;
+    slot->micros_ = nowMicros();
+    slot->len_    = text.size() < MAX_TEXT ? text.size() : MAX_TEXT;
+    memcpy(slot->text_, text.data(), slot->len_);
+
+    slot->seq_.store(pos+1, std::memory_order_release);
+    logged_.fetch_add(1, std::memory_order_relaxed);
+
+    return true;
+}
+
+void Logger::setLevel(Level level)
+{
+    level_.store(level, std::memory_order_relaxed);
+}
+
+Logger::Level Logger::level()
+{
+    return (Level)level_.load(std::memory_order_relaxed);
+}
+
+Logger::Level Logger::levelFor(std::string name)
+{
+    if(name == "debug") {
+        return LEVEL_DEBUG;
+    } else if(name == "info") {
+        return LEVEL_INFO;
+    } else if(name == "warn" || name == "warning") {
+        return LEVEL_WARN;
+    } else if(name == "error") {
+        return LEVEL_ERROR;
+    }
+
+    ThrowRuntimeError("Unrecognized log level: " << name << " (should be debug, info, warn or error)");
+
+    return LEVEL_INFO;
+}
+
+std::string Logger::levelName(Level level)
+{
+    switch(level) {
+    case LEVEL_DEBUG:
+        return "debug";
+    case LEVEL_INFO:
+        return "info";
+    case LEVEL_WARN:
+        return "warning";
+    default:
+        return "error";
+    }
+}
+
+void Logger::setRateLimit(unsigned perSecond)
+{
+    rateLimit_.store(perSecond, std::memory_order_relaxed);
+}
+
+unsigned Logger::rateLimit()
+{
+    return rateLimit_.load(std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * Install a sink.  Superseded sinks are never freed, since the logging
+ * thread may still be using one; they are set rarely
+ */
+void Logger::setSink(SINK_FN fn, void* arg)
+{
+    Sink* sink = 0;
+
+    if(fn) {
+        sink = new Sink();
+        sink->fn_  = fn;
+        sink->arg_ = arg;
+    }
+
+    sink_.store(sink, std::memory_order_release);
+}
+
+uint64_t Logger::logged()
+{
+    return logged_.load(std::memory_order_relaxed);
+}
+
+uint64_t Logger::dropped()
+{
+    return dropped_.load(std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * Wait for the logging thread to write everything queued so far
+ */
+void Logger::flush()
+{
+    uint64_t target = logged();
+
+    while(started_.load() && written_.load(std::memory_order_acquire) < target) {
+        struct timespec delay = {0, 1000000};
+        nanosleep(&delay, 0);
+    }
+}
+
+int64_t Logger::nowMicros()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec/1000;
+}
+
+/**.......................................................................
+ * Start the logging thread, if not already started
+ */
+void Logger::start()
+{
+    MutexLock lock(startMutex_);
+
+    if(started_.load())
+        return;
+
+    if(pthread_create(&threadId_, NULL, &runFn, this) != 0)
+        ThrowRuntimeError("Unable to start the logging thread");
+
+    started_.store(true, std::memory_order_release);
+}
+
+/**.......................................................................
+ * The logging thread: drain the ring, sleeping briefly whenever it is
+ * empty
+ */
+void* Logger::runFn(void* arg)
+{
+    Logger* logger = (Logger*)arg;
+
+    for(;;) {
+
+        bool drained = false;
+
+        while(logger->drainOne())
+            drained = true;
+
+        if(logger->stop_ && !drained)
+            break;
+
+        if(!drained) {
+            struct timespec delay = {0, 10000000};
+            nanosleep(&delay, 0);
+        }
+    }
+
+    return 0;
+}
+
+/**.......................................................................
+ * Write out the next message, if there is one ready.  Called only
+ * from the logging thread
+ */
+bool Logger::drainOne()
+{
+    Slot& slot = slots_[tail_ % CAPACITY];
+
+    if(slot.seq_.load(std::memory_order_acquire) != tail_ + 1)
+        return false;
+
+    write(slot);
+
+    slot.seq_.store(tail_ + CAPACITY, std::memory_order_release);
+    ++tail_;
+
+    written_.fetch_add(1, std::memory_order_release);
+
+    return true;
+}
+
+void Logger::write(Slot& slot)
+{
+    Sink* sink = sink_.load(std::memory_order_acquire);
+
+    if(sink) {
+        sink->fn_(slot.level_, slot.micros_, slot.text_, slot.len_, sink->arg_);
+        return;
+    }
+
+    std::string text(slot.text_, slot.len_);
+
+    switch(slot.level_) {
+    case LEVEL_WARN:
+    case LEVEL_ERROR:
+        COUTRED(text);
+        break;
+    case LEVEL_INFO:
+        COUTGREEN(text);
+        break;
+    default:
+        COUT(text);
+        break;
+    }
+}
+
+/**.......................................................................
+ * Allow up to Logger::rateLimit() messages per one-second window
+ */
+bool LogLimiter::allow(unsigned& suppressed)
+{
+    unsigned limit = Logger::instance().rateLimit();
+
+    if(limit == 0) {
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    int64_t now   = Logger::nowMicros();
+    int64_t start = windowStart_.load(std::memory_order_relaxed);
+
+    if(now - start >= 1000000 && windowStart_.compare_exchange_strong(start, now, std::memory_order_relaxed))
+        count_.store(0, std::memory_order_relaxed);
+
+    if(count_.fetch_add(1, std::memory_order_relaxed) < limit) {
+        suppressed = suppressed_.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+
+    suppressed_.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
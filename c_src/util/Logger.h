@@ -0,0 +1,171 @@
+// $Id: $
+
+#ifndef NIFUTIL_LOGGER_H
+#define NIFUTIL_LOGGER_H
+
+#include <atomic>
+#include <sstream>
+#include <string>
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "Mutex.h"
+
+/**
+ * @file Logger.h
+ *
+ * An asynchronous logger, for paths (like the comms threads) that
+ * must never block on console I/O.
+ *
+ * Messages are copied into a bounded lock-free ring buffer
+ * (multi-producer, after Vyukov) and written out by a background
+ * thread, either to stdout, in the style of the COUT* macros, or to a
+ * sink installed with setSink() (e.g., one that forwards them to an
+ * erlang process).  If the ring is full, messages are dropped and
+ * counted, rather than wait.  Messages longer than MAX_TEXT are
+ * truncated.
+ *
+ * Use through the LOGDEBUG, LOGINFO, LOGWARN and LOGERROR macros,
+ * which skip formatting entirely below the current level, and limit
+ * each call site to rateLimit() messages per second, noting how many
+ * were suppressed on the next message let through.
+ */
+namespace nifutil {
+
+    class Logger {
+    public:
+
+        enum Level {
+            LEVEL_DEBUG = 0,
+            LEVEL_INFO  = 1,
+            LEVEL_WARN  = 2,
+            LEVEL_ERROR = 3
+        };
+
+        static const unsigned CAPACITY = 4096;
+        static const unsigned MAX_TEXT = 480;
+
+        // A sink for drained messages, called on the logging thread
+
+        typedef void (*SINK_FN)(Level level, int64_t micros, const char* text, size_t len, void* arg);
+
+        static Logger& instance();
+
+        /**
+         * Queue a message.  Never blocks; returns false if it was
+         * dropped
+         */
+        bool log(Level level, const std::string& text);
+
+        static bool enabled(Level level) {
+            return level >= instance().level_.load(std::memory_order_relaxed);
+        }
+
+        void setLevel(Level level);
+        Level level();
+        static Level levelFor(std::string name);
+        static std::string levelName(Level level);
+
+        void setRateLimit(unsigned perSecond);
+        unsigned rateLimit();
+
+        // Install a sink (or NULL to restore stdout)
+
+        void setSink(SINK_FN fn, void* arg);
+
+        uint64_t logged();
+        uint64_t dropped();
+
+        /**
+         * Block until everything queued so far has been written
+         */
+        void flush();
+
+        static int64_t nowMicros();
+
+    private:
+
+        struct Slot {
+            std::atomic<uint64_t> seq_;
+            Level level_;
+            int64_t micros_;
+            unsigned len_;
+            char text_[MAX_TEXT];
+        };
+
+        struct Sink {
+            SINK_FN fn_;
+            void* arg_;
+        };
+
+        Logger();
+        virtual ~Logger();
+
+        void start();
+        bool drainOne();
+        void write(Slot& slot);
+        static void* runFn(void* arg);
+
+        Slot slots_[CAPACITY];
+        std::atomic<uint64_t> head_;
+        uint64_t tail_;
+
+        std::atomic<int> level_;
+        std::atomic<unsigned> rateLimit_;
+        std::atomic<Sink*> sink_;
+
+        std::atomic<uint64_t> logged_;
+        std::atomic<uint64_t> written_;
+        std::atomic<uint64_t> dropped_;
+
+        Mutex startMutex_;
+        std::atomic<bool> started_;
+        volatile bool stop_;
+        pthread_t threadId_;
+
+    }; // End class Logger
+
+    /**
+     * Per-call-site rate limiting for the LOG* macros
+     */
+    class LogLimiter {
+    public:
+
+        constexpr LogLimiter() : windowStart_(0), count_(0), suppressed_(0) {}
+
+        /**
+         * Return true if a message may be logged now, with the number
+         * of messages suppressed since the last one allowed
+         */
+        bool allow(unsigned& suppressed);
+
+    private:
+
+        std::atomic<int64_t> windowStart_;
+        std::atomic<unsigned> count_;
+        std::atomic<unsigned> suppressed_;
+
+    }; // End class LogLimiter
+
+} // End namespace nifutil
+
+#define NIFUTIL_LOG(level, text) {                                      \
+        static nifutil::LogLimiter _macroLimiter;                       \
+        unsigned _macroSuppressed = 0;                                  \
+        if(nifutil::Logger::enabled(level) && _macroLimiter.allow(_macroSuppressed)) { \
+            std::ostringstream _macroOs;                                \
+            _macroOs << text;                                           \
+            if(_macroSuppressed > 0)                                    \
+                _macroOs << " (" << _macroSuppressed << " similar messages suppressed)"; \
+            nifutil::Logger::instance().log(level, _macroOs.str());     \
+        }                                                               \
+    }
+
+#define LOGDEBUG(text) NIFUTIL_LOG(nifutil::Logger::LEVEL_DEBUG, text)
+#define LOGINFO(text)  NIFUTIL_LOG(nifutil::Logger::LEVEL_INFO,  text)
+#define LOGWARN(text)  NIFUTIL_LOG(nifutil::Logger::LEVEL_WARN,  text)
+#define LOGERROR(text) NIFUTIL_LOG(nifutil::Logger::LEVEL_ERROR, text)
+
+#endif // End #ifndef NIFUTIL_LOGGER_H
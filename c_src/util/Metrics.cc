@@ -0,0 +1,137 @@
+#include "Metrics.h"
+
+#include <sstream>
+
+#include <time.h>
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.
+ */
+Metrics::Metrics() {}
+
+/**.......................................................................
+ * Destructor.
+ */
+Metrics::~Metrics() {}
+
+void Metrics::add(std::string name, Counter& counter)
+{
+    newEntry(name, COUNTER).counter_ = &counter;
+}
+
+void Metrics::add(std::string name, std::atomic<uint64_t>& val, Kind kind)
+{
+    newEntry(name, kind).gauge64_ = &val;
+}
+
+void Metrics::add(std::string name, std::atomic<unsigned>& val, Kind kind)
+{
+    newEntry(name, kind).gauge32_ = &val;
+}
+
+void Metrics::add(std::string name, GAUGE_FN fn, void* arg)
+{
+    Entry& entry = newEntry(name, GAUGE);
+    entry.gaugeFn_  = fn;
+    entry.gaugeArg_ = arg;
+}
+
+void Metrics::add(std::string name, Histogram& histogram)
+{
+    newEntry(name, HISTOGRAM).histogram_ = &histogram;
+}
+
+std::vector<Metrics::Entry>& Metrics::entries()
+{
+    return entries_;
+}
+
+Metrics::Entry& Metrics::newEntry(std::string name, Kind kind)
+{
+    Entry entry;
+    entry.name_      = name;
+    entry.kind_      = kind;
+    entry.counter_   = 0;
+    entry.gauge64_   = 0;
+    entry.gauge32_   = 0;
+    entry.gaugeFn_   = 0;
+    entry.gaugeArg_  = 0;
+    entry.histogram_ = 0;
+
+    entries_.push_back(entry);
+
+    return entries_.back();
+}
+
+/**.......................................................................
+ * Return the value of a counter or gauge, or the count of a histogram
+ */
+uint64_t Metrics::Entry::value()
+{
+    if(counter_) {
+        return counter_->value();
+    } else if(gauge64_) {
+        return gauge64_->load(std::memory_order_relaxed);
+    } else if(gauge32_) {
+        return gauge32_->load(std::memory_order_relaxed);
+    } else if(gaugeFn_) {
+        return gaugeFn_(gaugeArg_);
+    }
+
+    return histogram_->count();
+}
+
+/**.......................................................................
+ * Render as OpenMetrics text.  Counters get the _total suffix the
+ * format requires; histograms are rendered with cumulative buckets at
+ * each power of two (see Histogram::cumulative())
+ */
+std::string Metrics::openMetrics(std::string prefix)
+{
+    std::ostringstream os;
+    std::vector<std::pair<uint64_t, uint64_t> > buckets;
+
+    for(unsigned i=0; i < entries_.size(); i++) {
+
+        Entry& entry = entries_[i];
+        std::string name = prefix + entry.name_;
+
+        switch(entry.kind_) {
+        case COUNTER:
+            os << "# TYPE " << name << " counter\n"
+               << name << "_total " << entry.value() << "\n";
+            break;
+        case GAUGE:
+            os << "# TYPE " << name << " gauge\n"
+               << name << " " << entry.value() << "\n";
+            break;
+        default:
+            {
+                uint64_t count = entry.histogram_->cumulative(buckets);
+
+                os << "# TYPE " << name << " histogram\n";
+
+                for(unsigned iBucket=0; iBucket < buckets.size(); iBucket++)
+                    os << name << "_bucket{le=\"" << buckets[iBucket].first << "\"} " << buckets[iBucket].second << "\n";
+
+                os << name << "_bucket{le=\"+Inf\"} " << count << "\n"
+                   << name << "_count " << count << "\n"
+                   << name << "_sum "   << entry.histogram_->sum() << "\n";
+            }
+            break;
+        }
+    }
+
+    os << "# EOF\n";
+
+    return os.str();
+}
+
+uint64_t Metrics::nanoSeconds()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
@@ -0,0 +1,97 @@
+// $Id: $
+
+#ifndef NIFUTIL_METRICS_H
+#define NIFUTIL_METRICS_H
+
+#include <atomic>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+
+#include "Counter.h"
+#include "Histogram.h"
+
+/**
+ * @file Metrics.h
+ *
+ * A registry of named counters, gauges and histograms, so that a
+ * client's metrics can be enumerated and reported together, e.g., as
+ * OpenMetrics text for Prometheus (see openMetrics()).
+ *
+ * The registry only holds pointers to metrics owned elsewhere.  All
+ * metrics must be added before any thread reads the registry (e.g.,
+ * in the owner's constructor); after that, it is never modified, so
+ * entries() can be walked without locking, while the metrics
+ * themselves are updated.
+ */
+namespace nifutil {
+
+    class Metrics {
+    public:
+
+        // A gauge computed on demand, e.g., from state that is not
+        // kept as a single value
+
+        typedef uint64_t (*GAUGE_FN)(void* arg);
+
+        enum Kind {
+            COUNTER,
+            GAUGE,
+            HISTOGRAM
+        };
+
+        struct Entry {
+            std::string name_;
+            Kind kind_;
+            Counter* counter_;
+            std::atomic<uint64_t>* gauge64_;
+            std::atomic<unsigned>* gauge32_;
+            GAUGE_FN gaugeFn_;
+            void* gaugeArg_;
+            Histogram* histogram_;
+
+            uint64_t value();
+        };
+
+        /**
+         * Constructor.
+         */
+        Metrics();
+
+        /**
+         * Destructor.
+         */
+        virtual ~Metrics();
+
+        void add(std::string name, Counter& counter);
+        // Atomics are gauges unless added as kind COUNTER, for values
+        // that only ever increase
+
+        void add(std::string name, std::atomic<uint64_t>& val, Kind kind=GAUGE);
+        void add(std::string name, std::atomic<unsigned>& val, Kind kind=GAUGE);
+        void add(std::string name, GAUGE_FN fn, void* arg);
+        void add(std::string name, Histogram& histogram);
+
+        std::vector<Entry>& entries();
+
+        // Render all metrics as OpenMetrics text, with names prefixed
+        // by prefix
+
+        std::string openMetrics(std::string prefix);
+
+        // A monotonic clock, in nanoseconds, for timing stages
+
+        static uint64_t nanoSeconds();
+
+    private:
+
+        Entry& newEntry(std::string name, Kind kind);
+
+        std::vector<Entry> entries_;
+
+    }; // End class Metrics
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_METRICS_H
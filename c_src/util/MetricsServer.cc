@@ -0,0 +1,218 @@
+#include "MetricsServer.h"
+#include "ExceptionUtils.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+
+#include <sstream>
+
+// Where send() can't be told not to raise SIGPIPE, the socket is
+// marked SO_NOSIGPIPE instead (see serve())
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+using namespace nifutil;
+
+/**.......................................................................
+ * Constructor.
+ */
+MetricsServer::MetricsServer()
+{
+    listenFd_  = -1;
+    threadId_  = 0;
+    started_   = false;
+    renderFn_  = 0;
+    renderArg_ = 0;
+
+    stop_.store(false);
+    scrapes_.store(0);
+}
+
+/**.......................................................................
+ * Destructor.
+ */
+MetricsServer::~MetricsServer()
+{
+    stop();
+}
+
+/**.......................................................................
+ * Bind the listening socket and start the server thread
+ */
+void MetricsServer::start(std::string addr, unsigned port, RENDER_FN fn, void* arg)
+{
+    if(started_)
+        ThrowRuntimeError("Metrics server is already running");
+
+    struct sockaddr_in sin;
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port   = htons(port);
+
+    if(inet_pton(AF_INET, addr.c_str(), &sin.sin_addr) != 1)
+        ThrowRuntimeError("Invalid metrics address: " << addr);
+
+    listenFd_ = socket(AF_INET, SOCK_STREAM, 0);
+
+    if(listenFd_ < 0)
+        ThrowRuntimeError("Unable to create metrics socket: " << strerror(errno));
+
+    int on = 1;
+    setsockopt(listenFd_, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    if(bind(listenFd_, (struct sockaddr*)&sin, sizeof(sin)) != 0 || listen(listenFd_, 8) != 0) {
+        int err = errno;
+        close(listenFd_);
+        listenFd_ = -1;
+        ThrowRuntimeError("Unable to listen for metrics on " << addr << ":" << port << ": " << strerror(err));
+    }
+
+    renderFn_  = fn;
+    renderArg_ = arg;
+    stop_.store(false);
+
+    if(pthread_create(&threadId_, NULL, &runFn, this) != 0) {
+        close(listenFd_);
+        listenFd_ = -1;
+        ThrowRuntimeError("Unable to start the metrics thread");
+    }
+
+    started_ = true;
+}
+
+/**.......................................................................
+ * Stop the server thread, waiting at most one poll interval for it to
+ * notice
+ */
+void MetricsServer::stop()
+{
+    if(!started_)
+        return;
+
+    stop_.store(true);
+    pthread_join(threadId_, NULL);
+
+    close(listenFd_);
+    listenFd_ = -1;
+    started_  = false;
+}
+
+bool MetricsServer::running()
+{
+    return started_;
+}
+
+uint64_t MetricsServer::scrapes()
+{
+    return scrapes_.load(std::memory_order_relaxed);
+}
+
+/**.......................................................................
+ * The server thread: accept and answer one connection at a time
+ */
+void* MetricsServer::runFn(void* arg)
+{
+    MetricsServer* server = (MetricsServer*)arg;
+
+    while(!server->stop_.load()) {
+
+        struct pollfd pfd;
+        pfd.fd      = server->listenFd_;
+        pfd.events  = POLLIN;
+        pfd.revents = 0;
+
+        if(poll(&pfd, 1, 200) <= 0 || !(pfd.revents & POLLIN))
+            continue;
+
+        int fd = accept(server->listenFd_, NULL, NULL);
+
+        if(fd < 0)
+            continue;
+
+        try {
+            server->serve(fd);
+        } catch(...) {
+        }
+
+        close(fd);
+    }
+
+    return 0;
+}
+
+/**.......................................................................
+ * Read a request and answer it.  Only the request line is looked at;
+ * a client that stalls for more than a second is dropped
+ */
+void MetricsServer::serve(int fd)
+{
+    static const unsigned MAX_REQUEST = 8192;
+
+    struct timeval timeout = {1, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+#if defined(SO_NOSIGPIPE)
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+#endif
+
+    std::string request;
+    char buf[1024];
+
+    while(request.find("\r\n\r\n") == std::string::npos && request.size() < MAX_REQUEST) {
+
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+
+        if(n <= 0)
+            return;
+
+        request.append(buf, n);
+    }
+
+    std::istringstream is(request.substr(0, request.find("\r\n")));
+    std::string method, path;
+    is >> method >> path;
+
+    path = path.substr(0, path.find('?'));
+
+    if(method == "GET" && path == "/metrics") {
+        scrapes_.fetch_add(1, std::memory_order_relaxed);
+        reply(fd, "200 OK", "application/openmetrics-text; version=1.0.0; charset=utf-8", renderFn_(renderArg_));
+    } else {
+        reply(fd, "404 Not Found", "text/plain; charset=utf-8", "Try GET /metrics\n");
+    }
+}
+
+void MetricsServer::reply(int fd, std::string status, std::string type, const std::string& body)
+{
+    std::ostringstream os;
+
+    os << "HTTP/1.1 " << status << "\r\n"
+       << "Content-Type: " << type << "\r\n"
+       << "Content-Length: " << body.size() << "\r\n"
+       << "Connection: close\r\n\r\n"
+       << body;
+
+    std::string response = os.str();
+    size_t sent = 0;
+
+    while(sent < response.size()) {
+
+        ssize_t n = send(fd, response.data() + sent, response.size() - sent, MSG_NOSIGNAL);
+
+        if(n <= 0)
+            return;
+
+        sent += n;
+    }
+}
@@ -0,0 +1,70 @@
+// $Id: $
+
+#ifndef NIFUTIL_METRICSSERVER_H
+#define NIFUTIL_METRICSSERVER_H
+
+#include <atomic>
+#include <string>
+
+#include <pthread.h>
+#include <stdint.h>
+
+/**
+ * @file MetricsServer.h
+ *
+ * A minimal HTTP listener for Prometheus scrapes.  GET /metrics is
+ * answered with the text produced by a render function, as
+ * OpenMetrics; anything else gets a 404.
+ *
+ * Requests are served one at a time, on the server's own thread, so
+ * a scrape costs the process one render and nothing else.  The render
+ * function must therefore be safe to call from that thread (e.g.,
+ * Metrics::openMetrics(), which only reads atomics).
+ */
+namespace nifutil {
+
+    class MetricsServer {
+    public:
+
+        typedef std::string (*RENDER_FN)(void* arg);
+
+        /**
+         * Constructor.
+         */
+        MetricsServer();
+
+        /**
+         * Destructor.
+         */
+        virtual ~MetricsServer();
+
+        // Listen on addr:port and start serving.  Throws if the port
+        // can't be bound
+
+        void start(std::string addr, unsigned port, RENDER_FN fn, void* arg);
+        void stop();
+
+        bool running();
+        uint64_t scrapes();
+
+    private:
+
+        static void* runFn(void* arg);
+
+        void serve(int fd);
+        void reply(int fd, std::string status, std::string type, const std::string& body);
+
+        int listenFd_;
+        pthread_t threadId_;
+        bool started_;
+        std::atomic<bool> stop_;
+        std::atomic<uint64_t> scrapes_;
+
+        RENDER_FN renderFn_;
+        void* renderArg_;
+
+    }; // End class MetricsServer
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_METRICSSERVER_H
@@ -0,0 +1,99 @@
+// $Id: $
+
+#ifndef NIFUTIL_MPSCQUEUE_H
+#define NIFUTIL_MPSCQUEUE_H
+
+#include <atomic>
+
+/**
+ * @file MpscQueue.h
+ *
+ * An intrusive, unbounded, lock-free multi-producer/single-consumer
+ * queue (after Vyukov).  push() may be called from any number of
+ * threads; pop() from one thread only.
+ *
+ * T must be default-constructible and have a public member:
+ *
+ *    std::atomic<T*> next_;
+ *
+ * The queue does not own its nodes.  pop() can transiently return
+ * NULL while a push is in progress on another thread; the pushed node
+ * is returned by a later pop().
+ */
+namespace nifutil {
+
+    template<class T>
+    class MpscQueue {
+    public:
+
+        MpscQueue() {
+            stub_.next_.store(0, std::memory_order_relaxed);
+            head_.store(&stub_, std::memory_order_relaxed);
+            tail_ = &stub_;
+        }
+
+        virtual ~MpscQueue() {}
+
+        /**
+         * Add a node to the queue.  Safe to call from any thread
+         */
+        void push(T* node) {
+            node->next_.store(0, std::memory_order_relaxed);
+            T* prev = head_.exchange(node, std::memory_order_acq_rel);
+            prev->next_.store(node, std::memory_order_release);
+        }
+
+        /**
+         * Remove the oldest node, or return NULL if there is none.
+         * Consumer thread only
+         */
+        T* pop() {
+
+            T* tail = tail_;
+            T* next = tail->next_.load(std::memory_order_acquire);
+
+            if(tail == &stub_) {
+
+                if(!next)
+                    return 0;
+
+                tail_ = next;
+                tail  = next;
+                next  = next->next_.load(std::memory_order_acquire);
+            }
+
+            if(next) {
+                tail_ = next;
+                return tail;
+            }
+
+            // tail is the last node.  Unless a producer is part-way
+            // through a push, put the stub back behind it so that
+            // tail can be returned
+
+            if(tail != head_.load(std::memory_order_acquire))
+                return 0;
+
+            push(&stub_);
+
+            next = tail->next_.load(std::memory_order_acquire);
+
+            if(next) {
+                tail_ = next;
+                return tail;
+            }
+
+            return 0;
+        }
+
+    private:
+
+        std::atomic<T*> head_;
+        T* tail_;
+        T stub_;
+
+    }; // End class MpscQueue
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_MPSCQUEUE_H
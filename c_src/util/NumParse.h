@@ -0,0 +1,51 @@
+// $Id: $
+
+#ifndef NIFUTIL_NUMPARSE_H
+#define NIFUTIL_NUMPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file NumParse.h
+ *
+ * Length-bounded, locale-independent number parsing, for converting
+ * message fields without strtol()/strtod().
+ *
+ * Each function parses the number at the start of (ptr, len), after
+ * any leading whitespace, as strtol() and strtod() would, and returns
+ * the number of characters consumed, or 0 if there is no number there
+ * or it is out of range.  Nothing needs to be NUL-terminated, and
+ * errno is not touched.
+ *
+ * Integers are read 8 digits at a time where possible, with exact
+ * overflow detection.  Doubles are parsed as a decimal mantissa and
+ * exponent, then converted with Clinger's exact fast path where it
+ * applies, or else the Eisel-Lemire algorithm (as used by fast_float),
+ * either of which gives the correctly rounded result.  The rare
+ * inputs neither can decide (more than 19 significant digits, or an
+ * ambiguous product) are handed to strtod() in the "C" locale.
+ *
+ * Only decimal notation is accepted: not hex, and not inf or nan,
+ * which erlang can't represent anyway.  Values too large for a double
+ * are out of range; values too small round to zero.
+ */
+namespace nifutil {
+
+    class NumParse {
+    public:
+
+        static size_t parseInt64(const char* ptr, size_t len, int64_t& val);
+        static size_t parseUint64(const char* ptr, size_t len, uint64_t& val);
+        static size_t parseDouble(const char* ptr, size_t len, double& val);
+
+    private:
+
+        static bool eiselLemire(int64_t exp10, uint64_t mantissa, bool negative, double& val);
+        static bool fallback(const char* ptr, size_t len, double& val);
+
+    }; // End class NumParse
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_NUMPARSE_H
@@ -0,0 +1,240 @@
+#include "TimeParse.h"
+#include "NumParse.h"
+
+using namespace nifutil;
+
+//-----------------------------------------------------------------------
+// Helpers
+//-----------------------------------------------------------------------
+
+static inline bool isSpace(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' || c == '\v';
+}
+
+static inline bool isDigit(char c)
+{
+    return (unsigned char)(c - '0') <= 9;
+}
+
+// Read exactly n digits
+
+static inline bool readDigits(const char*& ptr, const char* end, unsigned n, unsigned& val)
+{
+    if(end - ptr < (ptrdiff_t)n)
+        return false;
+
+    val = 0;
+
+    for(unsigned i=0; i < n; i++) {
+        if(!isDigit(ptr[i]))
+            return false;
+        val = val * 10 + (ptr[i] - '0');
+    }
+
+    ptr += n;
+
+    return true;
+}
+
+// Read a fraction (after the point) as milliseconds, truncating
+// digits past the third
+
+static inline const char* readFractionMs(const char* ptr, const char* end, unsigned& ms)
+{
+    unsigned scale = 100;
+    ms = 0;
+
+    for(; ptr < end && isDigit(*ptr); ptr++) {
+        ms   += (*ptr - '0') * scale;
+        scale /= 10;
+    }
+
+    return ptr;
+}
+
+static bool isLeapYear(unsigned year)
+{
+    return (year % 4 == 0 && year % 100 != 0) || year % 400 == 0;
+}
+
+static unsigned daysInMonth(unsigned year, unsigned month)
+{
+    static const unsigned days[] = {31, 28, 31, 30, 31, 30, 31, 31, 30, 31, 30, 31};
+    return month == 2 && isLeapYear(year) ? 29 : days[month - 1];
+}
+
+/**.......................................................................
+ * Days from 1970-01-01, by Howard Hinnant's days_from_civil: count
+ * 400-year eras of 146097 days, from a year starting in March so that
+ * the leap day comes last
+ */
+int64_t TimeParse::daysFromCivil(int year, unsigned month, unsigned day)
+{
+    year -= month <= 2;
+
+    int64_t era  = (year >= 0 ? year : year - 399) / 400;
+    unsigned yoe = (unsigned)(year - era * 400);
+    unsigned doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+    unsigned doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+    return era * 146097 + (int64_t)doe - 719468;
+}
+
+//-----------------------------------------------------------------------
+// Epoch counts
+//-----------------------------------------------------------------------
+
+size_t TimeParse::parseEpoch(const char* ptr, size_t len, Unit unit, uint64_t& ms)
+{
+    const char* end = ptr + len;
+    uint64_t count  = 0;
+
+    size_t n = NumParse::parseUint64(ptr, len, count);
+
+    if(n == 0)
+        return 0;
+
+    const char* cur = ptr + n;
+    unsigned fractionMs = 0;
+
+    if(cur < end && *cur == '.')
+        cur = readFractionMs(cur + 1, end, fractionMs);
+
+    switch (unit) {
+    case SECONDS:
+        if(count > (UINT64_MAX - fractionMs) / 1000)
+            return 0;
+        ms = count * 1000 + fractionMs;
+        break;
+    case MILLISECONDS:
+        ms = count;
+        break;
+    case MICROSECONDS:
+        ms = count / 1000;
+        break;
+    default:
+        ms = count / 1000000;
+        break;
+    }
+
+    return cur - ptr;
+}
+
+//-----------------------------------------------------------------------
+// ISO-8601 and RFC 3339
+//-----------------------------------------------------------------------
+
+size_t TimeParse::parseIso8601(const char* ptr, size_t len, uint64_t& ms)
+{
+    const char* end = ptr + len;
+    const char* cur = ptr;
+
+    while(cur < end && isSpace(*cur))
+        cur++;
+
+    //------------------------------------------------------------
+    // Date
+    //------------------------------------------------------------
+
+    unsigned year, month, day;
+
+    if(!readDigits(cur, end, 4, year))
+        return 0;
+
+    bool extended = cur < end && *cur == '-';
+
+    if(extended)
+        cur++;
+
+    if(!readDigits(cur, end, 2, month) || (extended && (cur == end || *cur++ != '-')) || !readDigits(cur, end, 2, day))
+        return 0;
+
+    if(month < 1 || month > 12 || day < 1 || day > daysInMonth(year, month))
+        return 0;
+
+    //------------------------------------------------------------
+    // Time, if any.  A space only separates date and time if a time
+    // follows it
+    //------------------------------------------------------------
+
+    unsigned hour = 0, minute = 0, second = 0, fractionMs = 0;
+    int64_t offsetSeconds = 0;
+
+    bool hasTime = cur < end && (*cur == 'T' || *cur == 't' || (*cur == ' ' && cur + 1 < end && isDigit(cur[1])));
+
+    if(hasTime) {
+
+        cur++;
+
+        if(!readDigits(cur, end, 2, hour))
+            return 0;
+
+        if(cur < end && *cur == ':')
+            cur++;
+
+        if(!readDigits(cur, end, 2, minute))
+            return 0;
+
+        const char* sec = cur;
+
+        if(sec < end && *sec == ':')
+            sec++;
+
+        if(sec < end && isDigit(*sec)) {
+
+            cur = sec;
+
+            if(!readDigits(cur, end, 2, second))
+                return 0;
+
+            if(cur < end && (*cur == '.' || *cur == ',') && cur + 1 < end && isDigit(cur[1]))
+                cur = readFractionMs(cur + 1, end, fractionMs);
+        }
+
+        if(hour > 23 || minute > 59 || second > 60)
+            return 0;
+
+        //------------------------------------------------------------
+        // Offset from UTC
+        //------------------------------------------------------------
+
+        if(cur < end && (*cur == 'Z' || *cur == 'z')) {
+
+            cur++;
+
+        } else if(cur < end && (*cur == '+' || *cur == '-')) {
+
+            int sign = *cur++ == '-' ? -1 : 1;
+            unsigned offsetHour = 0, offsetMinute = 0;
+
+            if(!readDigits(cur, end, 2, offsetHour))
+                return 0;
+
+            const char* min = cur;
+
+            if(min < end && *min == ':')
+                min++;
+
+            if(min < end && isDigit(*min)) {
+                cur = min;
+                if(!readDigits(cur, end, 2, offsetMinute))
+                    return 0;
+            }
+
+            if(offsetHour > 23 || offsetMinute > 59)
+                return 0;
+
+            offsetSeconds = sign * (int64_t)(offsetHour * 3600 + offsetMinute * 60);
+        }
+    }
+
+    int64_t seconds = daysFromCivil(year, month, day) * 86400 + hour * 3600 + minute * 60 + second - offsetSeconds;
+
+    if(seconds < 0)
+        return 0;
+
+    ms = (uint64_t)seconds * 1000 + fractionMs;
+
+    return cur - ptr;
+}
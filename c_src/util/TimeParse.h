@@ -0,0 +1,57 @@
+// $Id: $
+
+#ifndef NIFUTIL_TIMEPARSE_H
+#define NIFUTIL_TIMEPARSE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @file TimeParse.h
+ *
+ * Timestamp parsing, normalized to milliseconds since the unix epoch,
+ * for the timestamp_* schema types.  Like NumParse, it works on
+ * (ptr, len) views, skips leading whitespace and returns the number
+ * of characters consumed, or 0 on failure.  No strptime(), time zone
+ * database or locale is involved.
+ *
+ * parseEpoch() reads a non-negative integer count of seconds,
+ * milliseconds, microseconds or nanoseconds, with an optional decimal
+ * fraction, and truncates it to milliseconds.
+ *
+ * parseIso8601() reads an ISO-8601 date or date-time, which includes
+ * every RFC 3339 timestamp:
+ *
+ *    YYYY-MM-DD[(T|t| )hh:mm[:ss[(.|,)fff...]]][Z|z|(+|-)hh[[:]mm]]
+ *
+ * Times may also be in the basic format (hhmm[ss], and offsets
+ * (+|-)hhmm), and dates as YYYYMMDD.  A time without an offset is
+ * taken to be UTC, and a date alone to be midnight UTC.  Fractions
+ * are truncated to milliseconds, and leap seconds (ss = 60) count as
+ * the first second of the next minute.  Times before the epoch are
+ * rejected.
+ */
+namespace nifutil {
+
+    class TimeParse {
+    public:
+
+        enum Unit {
+            SECONDS,
+            MILLISECONDS,
+            MICROSECONDS,
+            NANOSECONDS
+        };
+
+        static size_t parseEpoch(const char* ptr, size_t len, Unit unit, uint64_t& ms);
+        static size_t parseIso8601(const char* ptr, size_t len, uint64_t& ms);
+
+        // Days from 1970-01-01 to a proleptic Gregorian date
+
+        static int64_t daysFromCivil(int year, unsigned month, unsigned day);
+
+    }; // End class TimeParse
+
+} // End namespace nifutil
+
+#endif // End #ifndef NIFUTIL_TIMEPARSE_H
@@ -20,6 +20,13 @@
 -module(mqtt).
 
 -export([command/1, 
+	 command/2, 
+	 new_client/1, 
+	 close/1, 
+	 publish/3, 
+	 publish/4, 
+	 publish_batch/2, 
+	 publish_batch/3, 
 	 startCommsLoop/2, 
 
 	 startCommsLoopPrint/0,
@@ -90,11 +97,68 @@
 %%
 %%        Starts up the background MQTT client (should be called only once)
 %%
+%% command/1 operates on the default client.  command/2 operates on a
+%% client handle returned by new_client/1, and accepts the same
+%% commands.
+%%
 %%=======================================================================
 
 command(_Tuple) ->
     erlang:nif_error({error, not_loaded}).
 
+command(_Client, _Tuple) ->
+    erlang:nif_error({error, not_loaded}).
+
+%%=======================================================================
+%% Create a new, independent client.  Opts is a list of option (or
+%% command) tuples as accepted by command/1, e.g.:
+%%
+%%   Client = mqtt:new_client([{name, "ingest2"}, {host, "broker2"}, {start}])
+%%
+%% Each client has its own broker connection, comms thread, topics
+%% and store.  The client is stopped and freed by close/1, or in the
+%% background when the returned handle is garbage collected.
+%%=======================================================================
+
+new_client(_Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
+%%=======================================================================
+%% Stop a client returned by new_client/1, and wait for its threads to
+%% exit and its store to close.  Returns ok; any later command on the
+%% handle returns {error, Reason}.  Closing a handle twice is harmless.
+%%=======================================================================
+
+close(_Client) ->
+    erlang:nif_error({error, not_loaded}).
+
+%%=======================================================================
+%% Publish a message.  Payload is a binary or iolist, and is queued
+%% for the client's comms thread without being copied.  Opts is a list
+%% of {qos, 0|1|2} and {retain, Bool} (defaults 0 and false), e.g.:
+%%
+%%   mqtt:publish(<<"sensors/t1">>, [<<"21.5,">>, Ts], [{qos, 1}])
+%%
+%% Returns ok once the message is queued, or {error, Reason} (e.g., if
+%% the queue is full: see the publish_queue_max and outbox options).
+%% publish/4 takes a client handle as its first argument.
+%%
+%% publish_batch/2,3 take a list of {Topic, Payload} tuples, which are
+%% queued as one request and written to the broker together.
+%%=======================================================================
+
+publish(_Topic, _Payload, _Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
+publish(_Client, _Topic, _Payload, _Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
+publish_batch(_Messages, _Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
+publish_batch(_Client, _Messages, _Opts) ->
+    erlang:nif_error({error, not_loaded}).
+
 %%=======================================================================
 %% Spawn the MQTT client
 %%=======================================================================
@@ -126,6 +190,25 @@ waitForNextMessage(CallbackFn) ->
     end,
     waitForNextMessage(CallbackFn).
 
+%%=======================================================================
+%% Spawn a background erlang process that forwards the client's log
+%% messages (see {log_to, Pid}) to lager, instead of having them
+%% written to the console
+%%=======================================================================
+
+spawnLogForwarder() ->
+    spawn(mqtt, logForwarder, []).
+
+logForwarder() ->
+    mqtt:command({log_to, self()}),
+    waitForNextLog().
+
+waitForNextLog() ->
+    receive {mqtt_log, Level, _Micros, Text} ->
+            lager:log(Level, self(), "~s", [Text])
+    end,
+    waitForNextLog().
+
 %%=======================================================================
 %% Spawn a background erlang process that periodically checks for new
 %% TS tables.  As new tables are found, they are added to the list of